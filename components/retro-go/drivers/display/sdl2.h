@@ -1,19 +1,81 @@
 #include <SDL2/SDL.h>
 
+// Emulates the asynchronous pipeline of the hardware drivers: lcd_send_buffer only queues the buffer
+// and a worker thread "transfers" it, so that rendering overlaps the transfer like it does on device.
+// SDL2_LCD_BANDWIDTH (bytes per second, 0 = unlimited) simulates the bus speed for benchmarking.
+#define SDL2_LCD_BUFFER_COUNT 3
+#ifndef SDL2_LCD_BANDWIDTH
+#define SDL2_LCD_BANDWIDTH 0
+#endif
+
 static SDL_Window *window;
 static SDL_Surface *surface, *canvas;
 static int win_left, win_top, win_width, win_height, cursor;
-static uint16_t lcd_buffer[LCD_BUFFER_LENGTH];
+static struct
+{
+    uint16_t data[LCD_BUFFER_LENGTH];
+    int left, top, width, cursor;
+    size_t length;
+} lcd_buffers[SDL2_LCD_BUFFER_COUNT];
+static SDL_sem *lcd_buffers_free, *lcd_buffers_queued;
+static SDL_Thread *lcd_thread;
+static int lcd_head, lcd_tail;
+static volatile bool lcd_running;
+
+static int lcd_transfer_thread(void *arg)
+{
+    while (1)
+    {
+        SDL_SemWait(lcd_buffers_queued);
+        if (!lcd_running)
+            break;
+
+        typeof(lcd_buffers[0]) *buffer = &lcd_buffers[lcd_tail++ % SDL2_LCD_BUFFER_COUNT];
+        Uint64 deadline = SDL_GetPerformanceCounter();
+#if SDL2_LCD_BANDWIDTH > 0
+        deadline += SDL_GetPerformanceFrequency() * buffer->length * 2 / SDL2_LCD_BANDWIDTH;
+#endif
+
+        int bpp = canvas->format->BytesPerPixel;
+        int pitch = canvas->pitch;
+        void *pixels = canvas->pixels;
+        for (size_t i = 0; i < buffer->length; ++i)
+        {
+            int real_top = buffer->top + ((buffer->cursor + i) / buffer->width);
+            int real_left = buffer->left + ((buffer->cursor + i) % buffer->width);
+            if (real_top >= RG_SCREEN_HEIGHT || real_left >= RG_SCREEN_WIDTH)
+                break;
+            uint16_t *dst = (void *)pixels + (real_top * pitch) + (real_left * bpp);
+            uint16_t pixel = buffer->data[i];
+            *dst = ((pixel & 0xFF) << 8) | ((pixel & 0xFF00) >> 8);
+        }
+
+        while (SDL_GetPerformanceCounter() < deadline)
+            continue;
+
+        SDL_SemPost(lcd_buffers_free);
+    }
+    return 0;
+}
 
 static void lcd_init(void)
 {
     window = SDL_CreateWindow("Retro-Go", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, RG_SCREEN_WIDTH, RG_SCREEN_HEIGHT, 0);
     surface = SDL_GetWindowSurface(window);
     canvas = SDL_CreateRGBSurfaceWithFormat(0, RG_SCREEN_WIDTH, RG_SCREEN_HEIGHT, 16, SDL_PIXELFORMAT_RGB565);
+    lcd_buffers_free = SDL_CreateSemaphore(SDL2_LCD_BUFFER_COUNT);
+    lcd_buffers_queued = SDL_CreateSemaphore(0);
+    lcd_running = true;
+    lcd_thread = SDL_CreateThread(lcd_transfer_thread, "rg_lcd", NULL);
 }
 
 static void lcd_deinit(void)
 {
+    lcd_running = false;
+    SDL_SemPost(lcd_buffers_queued);
+    SDL_WaitThread(lcd_thread, NULL);
+    SDL_DestroySemaphore(lcd_buffers_queued);
+    SDL_DestroySemaphore(lcd_buffers_free);
 }
 
 static void lcd_set_window(int left, int top, int width, int height)
@@ -35,28 +97,29 @@ static void lcd_set_backlight(float percent)
 
 static inline uint16_t *lcd_get_buffer(size_t length)
 {
-    return lcd_buffer;
+    SDL_SemWait(lcd_buffers_free);
+    return lcd_buffers[lcd_head % SDL2_LCD_BUFFER_COUNT].data;
 }
 
 static inline void lcd_send_buffer(uint16_t *buffer, size_t length)
 {
-    int bpp = canvas->format->BytesPerPixel;
-    int pitch = canvas->pitch;
-    void *pixels = canvas->pixels;
-    for (size_t i = 0; i < length; ++i) {
-        int real_top = win_top + (cursor / win_width);
-        int real_left = win_left + (cursor % win_width);
-        if (real_top >= RG_SCREEN_HEIGHT || real_left >= RG_SCREEN_WIDTH)
-            return;
-        uint16_t *dst = (void*)pixels + (real_top * pitch) + (real_left * bpp);
-        uint16_t pixel = buffer[i];
-        *dst = ((pixel & 0xFF) << 8) | ((pixel & 0xFF00) >> 8);;
-        cursor++;
-    }
+    typeof(lcd_buffers[0]) *slot = &lcd_buffers[lcd_head++ % SDL2_LCD_BUFFER_COUNT];
+    slot->left = win_left;
+    slot->top = win_top;
+    slot->width = win_width;
+    slot->cursor = cursor;
+    slot->length = length;
+    cursor += length;
+    SDL_SemPost(lcd_buffers_queued);
 }
 
 static void lcd_sync(void)
 {
+    // Wait for the transfers in flight before presenting the canvas
+    for (int i = 0; i < SDL2_LCD_BUFFER_COUNT; ++i)
+        SDL_SemWait(lcd_buffers_free);
+    for (int i = 0; i < SDL2_LCD_BUFFER_COUNT; ++i)
+        SDL_SemPost(lcd_buffers_free);
     SDL_BlitSurface(canvas, NULL, surface, NULL);
     SDL_UpdateWindowSurface(window);
 }
@@ -11,6 +11,7 @@
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_mipi_dsi.h>
 #include <esp_ldo_regulator.h>
+#include <esp_cache.h>
 #include "rg_system.h"
 
 #ifdef __cplusplus
@@ -42,6 +43,14 @@ extern "C" {
 #define ST7701_MIPI_DSI_PHY_LDO_CHANNEL   3
 #define ST7701_MIPI_DSI_PHY_LDO_VOLTAGE   2500
 
+// Line buffers in flight: rg_display renders block N+1 while block N is DMA'd to the framebuffer
+#define ST7701_LINE_BUFFER_COUNT     3
+
+// The framebuffer is in memory, we take pixels in native order and can copy unscaled surfaces directly
+#define LCD_NATIVE_ENDIAN            1
+#define LCD_HAS_DIRECT_WRITE         1
+#define LCD_DIRECT_FORMAT            RG_PIXEL_565_LE
+
 typedef struct {
     uint8_t type;
     uint8_t delay;
@@ -61,7 +70,14 @@ typedef struct {
     int window_top;
     int window_width;
     int window_height;
-    int current_y;
+    int cursor; // In pixels, relative to the window
+    struct {
+        uint16_t *data;
+        uint32_t ticket; // DMA transfer that must complete before the buffer can be reused
+    } line_buffers[ST7701_LINE_BUFFER_COUNT];
+    int next_line_buffer;
+    rg_dma_memcpy_t dma;
+    bool dma_ready;
 } st7701_context_t;
 
 static st7701_context_t st7701_ctx = {0};
@@ -174,47 +190,94 @@ static void lcd_set_window(int left, int top, int width, int height)
     st7701_ctx.window_top = top;
     st7701_ctx.window_width = width;
     st7701_ctx.window_height = height;
-    st7701_ctx.current_y = 0;
+    st7701_ctx.cursor = 0;
+}
+
+static inline bool st7701_dma_idle(uint32_t ticket)
+{
+    return !st7701_ctx.dma_ready || rg_dma_memcpy_ticket_done(&st7701_ctx.dma, ticket);
+}
+
+// Copy to the framebuffer by DMA when the alignment allows it, otherwise by CPU
+static void st7701_copy(uint16_t *dst, const void *src, size_t size)
+{
+    bool aligned = ((uintptr_t)dst % 32) == 0 && (size % 32) == 0 &&
+                   ((uintptr_t)src % (rg_perf_is_psram(src) ? 32 : 4)) == 0;
+    if (st7701_ctx.dma_ready && aligned)
+    {
+        if (rg_dma_memcpy_async(&st7701_ctx.dma, dst, src, size))
+            return;
+        // The backlog is full, wait for it to drain and try again
+        while (!st7701_dma_idle(st7701_ctx.dma.issued))
+            continue;
+        if (rg_dma_memcpy_async(&st7701_ctx.dma, dst, src, size))
+            return;
+    }
+    memcpy(dst, src, size);
+    esp_cache_msync(dst, size, ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_UNALIGNED);
 }
 
 static void lcd_sync(void)
 {
+    // Transfers are a few microseconds each, by the time we get here most of them are done
+    while (!st7701_dma_idle(st7701_ctx.dma.issued))
+        rg_task_yield();
 }
 
-// NOTE: This buffer is shared and must be used immediately after lcd_get_buffer
-// is called. Do not call lcd_get_buffer again before lcd_send_buffer is called.
-// The buffer size is ST7701_LCD_H_RES * 4 * 2 bytes (typically 320*4*2 = 2560 bytes)
 static inline uint16_t *lcd_get_buffer(size_t length)
 {
-    (void)length;
-    static uint16_t temp_buffer[ST7701_LCD_H_RES * 4];
-    return temp_buffer;
+    int index = st7701_ctx.next_line_buffer++ % ST7701_LINE_BUFFER_COUNT;
+    while (!st7701_dma_idle(st7701_ctx.line_buffers[index].ticket))
+        continue;
+    return st7701_ctx.line_buffers[index].data;
 }
 
 static inline void lcd_send_buffer(uint16_t *buffer, size_t length)
 {
-    if (!buffer || !st7701_ctx.framebuffer || length == 0) return;
-
-    int width = st7701_ctx.window_width;
-    int height = length / width;
-
-    if (width <= 0 || height <= 0) return;
+    if (!buffer || !st7701_ctx.framebuffer || st7701_ctx.window_width <= 0)
+        return;
+
+    const int width = st7701_ctx.window_width;
+    const bool full_width = st7701_ctx.window_left == 0 && width == ST7701_LCD_H_RES;
+
+    for (size_t pos = 0; pos < length;)
+    {
+        int x = st7701_ctx.cursor % width;
+        int y = st7701_ctx.window_top + st7701_ctx.cursor / width;
+        if (y >= ST7701_LCD_V_RES)
+            break;
+        // Full width windows are contiguous in the framebuffer, the whole buffer goes in one transfer
+        size_t count = full_width ? RG_MIN(length - pos, (size_t)(ST7701_LCD_V_RES - y) * width - x)
+                                  : RG_MIN(length - pos, (size_t)(width - x));
+        uint16_t *dst = st7701_ctx.framebuffer + (y * ST7701_LCD_H_RES) + st7701_ctx.window_left + x;
+        st7701_copy(dst, buffer + pos, count * 2);
+        st7701_ctx.cursor += count;
+        pos += count;
+    }
 
-    int dst_y = st7701_ctx.window_top + st7701_ctx.current_y;
+    for (int i = 0; i < ST7701_LINE_BUFFER_COUNT && length > 0; i++)
+    {
+        if (st7701_ctx.line_buffers[i].data == buffer)
+            st7701_ctx.line_buffers[i].ticket = st7701_ctx.dma.issued;
+    }
+}
 
-    for (int y = 0; y < height; y++) {
-        int fb_y = dst_y + y;
-        if (fb_y >= ST7701_LCD_V_RES) break;
+static void lcd_write_direct(int left, int top, int width, int height, const void *src, int stride)
+{
+    if (!st7701_ctx.framebuffer || top + height > ST7701_LCD_V_RES)
+        return;
 
-        uint16_t *src = buffer + (y * width);
-        uint16_t *dst = st7701_ctx.framebuffer + (fb_y * ST7701_LCD_H_RES) + st7701_ctx.window_left;
+    // The surface was written through the cache, the DMA reads memory
+    esp_cache_msync((void *)src, (size_t)height * stride, ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_UNALIGNED);
 
-        for (int x = 0; x < width; x++) {
-            dst[x] = (src[x] >> 8) | (src[x] << 8);
-        }
+    uint16_t *dst = st7701_ctx.framebuffer + (top * ST7701_LCD_H_RES) + left;
+    if (left == 0 && width == ST7701_LCD_H_RES && stride == ST7701_LCD_H_RES * 2)
+    {
+        st7701_copy(dst, src, (size_t)height * stride);
+        return;
     }
-
-    st7701_ctx.current_y += height;
+    for (int y = 0; y < height; y++)
+        st7701_copy(dst + y * ST7701_LCD_H_RES, src + y * stride, width * 2);
 }
 
 static void lcd_init(void)
@@ -337,7 +400,18 @@ static void lcd_init(void)
     st7701_ctx.window_top = 0;
     st7701_ctx.window_width = ST7701_LCD_H_RES;
     st7701_ctx.window_height = ST7701_LCD_V_RES;
-    st7701_ctx.current_y = 0;
+    st7701_ctx.cursor = 0;
+
+    for (int i = 0; i < ST7701_LINE_BUFFER_COUNT; i++) {
+        st7701_ctx.line_buffers[i].data = heap_caps_aligned_calloc(64, 1, LCD_BUFFER_LENGTH * 2, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (!st7701_ctx.line_buffers[i].data) {
+            RG_PANIC("Failed to allocate line buffers");
+        }
+    }
+    st7701_ctx.dma_ready = rg_dma_memcpy_init(&st7701_ctx.dma);
+    if (!st7701_ctx.dma_ready) {
+        RG_LOGW("Async memcpy unavailable, falling back to CPU copies");
+    }
 
     st7701_ctx.initialized = true;
     RG_LOGI("ST7701 initialization completed");
@@ -350,6 +424,16 @@ static void lcd_deinit(void)
     ledc_set_duty(ST7701_LEDC_MODE, ST7701_LEDC_CHANNEL, 0);
     ledc_update_duty(ST7701_LEDC_MODE, ST7701_LEDC_CHANNEL);
 
+    lcd_sync();
+    if (st7701_ctx.dma_ready) {
+        rg_dma_memcpy_deinit(&st7701_ctx.dma);
+        st7701_ctx.dma_ready = false;
+    }
+    for (int i = 0; i < ST7701_LINE_BUFFER_COUNT; i++) {
+        free(st7701_ctx.line_buffers[i].data);
+        st7701_ctx.line_buffers[i].data = NULL;
+    }
+
     if (st7701_ctx.framebuffer) {
         free(st7701_ctx.framebuffer);
         st7701_ctx.framebuffer = NULL;
@@ -39,6 +39,16 @@ static const rg_audio_sink_t sinks[] = {
     })
 #define RELEASE_DEVICE() rg_mutex_give(audio.lock)
 
+#define RING_LENGTH 4096             // In frames, must be a power of two
+#define RING_TARGET 1024             // Dynamic rate control keeps the buffered frames (ring + sink) around here
+#define RING_HIGH (RING_TARGET * 2)  // rg_audio_submit waits above this, that is what paces audio-clocked cores
+#define RING_CHUNK 256               // Frames handed to the driver at once
+#define DRC_MAX_DELTA 0.005f         // Max resampling adjustment, 0.5% is well below audible pitch change
+#define SUBMIT_MAX_WAIT 100000       // If the sink is stuck for that long (in us), frames are dropped instead
+#define MIX_LENGTH 2048              // In frames, how much the sources can get ahead of each other between submits
+#define MIX_BLOCK 256                // Frames resampled and filtered at once, on the stack
+#define MIX_SOURCES 8
+
 static struct
 {
     const rg_audio_sink_t *sink;
@@ -51,6 +61,33 @@ static struct
 } audio;
 static rg_audio_counters_t counters;
 
+// Single producer (rg_audio_submit) / single consumer (audio_task) ring between the emulator and the
+// sink. The producer resamples by DRC_MAX_DELTA at most as it writes, with linear interpolation.
+static struct
+{
+    rg_audio_frame_t *frames;
+    uint32_t head;           // Written by the producer only
+    uint32_t tail;           // Written by audio_task only
+    rg_audio_resampler_t resampler; // Producer only
+    bool waited;             // Producer only, the previous submission had to wait (we're audio-clocked)
+    uint32_t sink_empty_at;  // Written by audio_task only, estimated time (us) at which the sink runs dry
+    rg_task_t *task;
+    rg_task_t *waiter;       // Producer sleeping in rg_audio_submit, if any
+    volatile bool running;
+    volatile bool stopped;
+} ring;
+
+// Sources accumulate into `buffer` from their own `written` offset, rg_audio_mix_submit clips and submits
+// the part they all reached. Only touched by the producer task.
+static struct
+{
+    int32_t *buffer;          // Interleaved stereo accumulators
+    rg_audio_frame_t *output; // Clipped frames handed to rg_audio_submit
+    rg_audio_source_t *sources[MIX_SOURCES]; // Sources that mixed this round or still have pending frames
+    size_t count;
+    uint32_t round;
+} mixer;
+
 static const char *SETTING_DRIVER = "AudioDriver";
 static const char *SETTING_DEVICE = "AudioDevice";
 static const char *SETTING_VOLUME = "Volume";
@@ -63,6 +100,176 @@ static const char *get_last_driver_error(void)
     return "Unspecified Error";
 }
 
+static inline uint32_t ring_used(void)
+{
+    return __atomic_load_n(&ring.head, __ATOMIC_SEQ_CST) - __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST);
+}
+
+// Frames the sink still has queued in its own (DMA) buffers. Drivers don't tell us, but they block
+// when their buffers are full, so counting what we handed over against the clock is accurate enough.
+static inline uint32_t sink_buffered(uint32_t now)
+{
+    int32_t remaining = __atomic_load_n(&ring.sink_empty_at, __ATOMIC_SEQ_CST) - now;
+    return remaining > 0 ? (int64_t)remaining * audio.sampleRate / 1000000 : 0;
+}
+
+// Linear interpolation between in[i - 1] (or the last frame of the previous block) and in[i]. Stops when
+// either the input or out_max is exhausted and leaves rs->position relative to in, see resample_end.
+static size_t resample_run(rg_audio_resampler_t *rs, const int16_t *in, size_t in_count, int16_t *restrict out, size_t out_max)
+{
+    const uint32_t step = rs->step;
+    uint32_t position = rs->position;
+    size_t written = 0;
+
+    if (rs->channels == 2)
+    {
+        for (size_t i; written < out_max && (i = position >> 16) < in_count; position += step, written++)
+        {
+            const int16_t *a = i ? &in[(i - 1) * 2] : rs->last;
+            const int16_t *b = &in[i * 2];
+            const int frac = (position & 0xFFFF) >> 1;
+            out[written * 2 + 0] = a[0] + (((b[0] - a[0]) * frac) >> 15);
+            out[written * 2 + 1] = a[1] + (((b[1] - a[1]) * frac) >> 15);
+        }
+    }
+    else
+    {
+        for (size_t i; written < out_max && (i = position >> 16) < in_count; position += step, written++)
+        {
+            const int a = i ? in[i - 1] : rs->last[0];
+            const int frac = (position & 0xFFFF) >> 1;
+            out[written] = a + (((in[i] - a) * frac) >> 15);
+        }
+    }
+
+    rs->position = position;
+    return written;
+}
+
+// Rebases the resampler onto the next block. Returns true if some input didn't fit and was dropped.
+static bool resample_end(rg_audio_resampler_t *rs, const int16_t *in, size_t in_count)
+{
+    bool dropped = (rs->position >> 16) < in_count;
+    if (in_count == 0)
+        return false;
+    if (dropped)
+        rs->position = in_count << 16;
+    rs->position -= in_count << 16;
+    for (int c = 0; c < rs->channels; ++c)
+        rs->last[c] = in[(in_count - 1) * rs->channels + c];
+    return dropped;
+}
+
+// The kernels below have no loop-carried dependency, so the compiler can vectorize them
+static void mix_stereo(int32_t *restrict acc, const int16_t *restrict in, size_t count, int gain)
+{
+    for (size_t i = 0; i < count * 2; ++i)
+        acc[i] += (in[i] * gain) >> 8;
+}
+
+static void mix_mono(int32_t *restrict acc, const int16_t *restrict in, size_t count, int gain)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        int32_t sample = (in[i] * gain) >> 8;
+        acc[i * 2 + 0] += sample;
+        acc[i * 2 + 1] += sample;
+    }
+}
+
+static void mix_clip(int16_t *restrict out, const int32_t *restrict acc, size_t count)
+{
+    for (size_t i = 0; i < count * 2; ++i)
+        out[i] = RG_MIN(RG_MAX(acc[i], INT16_MIN), INT16_MAX);
+}
+
+// Single-pole low-pass filter (6 dB/octave), same response as S9xMixSamplesLowPass
+static void mix_lowpass(int16_t *buffer, size_t count, int channels, int factor, int32_t *state)
+{
+    const int64_t factor_a = factor;
+    const int64_t factor_b = 0x10000 - factor;
+    for (int c = 0; c < channels; ++c)
+    {
+        int32_t prev = state[c];
+        for (size_t i = c; i < count * channels; i += channels)
+            buffer[i] = prev = (prev * factor_a + buffer[i] * factor_b) >> 16;
+        state[c] = prev;
+    }
+}
+
+static void audio_task(void *arg)
+{
+    bool starved = true;
+
+    while (ring.running)
+    {
+        uint32_t tail = ring.tail;
+        uint32_t available = __atomic_load_n(&ring.head, __ATOMIC_SEQ_CST) - tail;
+
+        if (available == 0)
+        {
+            // The sink itself still has some audio until sink_empty_at, that isn't an underrun yet
+            if (!starved && !sink_buffered(rg_system_timer()))
+            {
+                counters.underruns++;
+                starved = true;
+            }
+            rg_task_wait(starved ? 100 : 10);
+            continue;
+        }
+        starved = false;
+
+        // Hand over a contiguous chunk, the driver blocks until its DMA has room for it
+        size_t offset = tail % RING_LENGTH;
+        size_t count = RG_MIN(RG_MIN(available, RING_CHUNK), RING_LENGTH - offset);
+        if (ACQUIRE_DEVICE(1000))
+        {
+            audio.driver->submit(&ring.frames[offset], count);
+            RELEASE_DEVICE();
+        }
+
+        uint32_t now = rg_system_timer();
+        uint32_t empty_at = (int32_t)(ring.sink_empty_at - now) > 0 ? ring.sink_empty_at : now;
+        __atomic_store_n(&ring.sink_empty_at, empty_at + (uint32_t)((int64_t)count * 1000000 / audio.sampleRate), __ATOMIC_SEQ_CST);
+        __atomic_store_n(&ring.tail, tail + count, __ATOMIC_SEQ_CST);
+        rg_task_t *waiter = __atomic_exchange_n(&ring.waiter, NULL, __ATOMIC_SEQ_CST);
+        if (waiter)
+            rg_task_notify(waiter);
+    }
+
+    ring.stopped = true;
+}
+
+static void ring_start(void)
+{
+    if (!ring.frames && !(ring.frames = malloc(RING_LENGTH * sizeof(rg_audio_frame_t))))
+    {
+        RG_LOGW("Failed to allocate the audio ring, submitting synchronously");
+        return;
+    }
+    ring.head = ring.tail = 0;
+    rg_audio_resampler_init(&ring.resampler, 2, 1, 1);
+    ring.waited = false;
+    ring.sink_empty_at = rg_system_timer();
+    ring.waiter = NULL;
+    ring.running = true;
+    ring.stopped = false;
+    ring.task = rg_task_create("rg_audio", &audio_task, NULL, 3 * 1024, RG_TASK_PRIORITY_7, RG_PERF_CORE_1);
+    if (!ring.task)
+        ring.running = false;
+}
+
+static void ring_stop(void)
+{
+    if (!ring.task)
+        return;
+    ring.running = false;
+    rg_task_notify(ring.task);
+    for (int i = 0; i < 1000 && !ring.stopped; ++i)
+        rg_task_delay(1);
+    ring.task = NULL;
+}
+
 void rg_audio_init(int sampleRate)
 {
     RG_ASSERT(audio.sink == NULL, "Audio sink already initialized!");
@@ -111,6 +318,8 @@ void rg_audio_init(int sampleRate)
     }
 
     RELEASE_DEVICE();
+
+    ring_start();
 }
 
 void rg_audio_deinit(void)
@@ -118,6 +327,8 @@ void rg_audio_deinit(void)
     if (!audio.sink)
         return;
 
+    ring_stop();
+
     // We'll go ahead even if we can't acquire the lock...
     ACQUIRE_DEVICE(1000);
 
@@ -133,6 +344,7 @@ void rg_audio_deinit(void)
 
 void rg_audio_submit(const rg_audio_frame_t *frames, size_t count)
 {
+    RG_PROFILE_SCOPE(RG_PROFILE_AUDIO);
     const int64_t time_start = rg_system_timer();
 
     if (!audio.driver)
@@ -141,18 +353,187 @@ void rg_audio_submit(const rg_audio_frame_t *frames, size_t count)
     if (!frames || !count)
         return;
 
-    if (ACQUIRE_DEVICE(0))
+    if (!ring.task)
     {
-        audio.driver->submit(frames, count);
-        RELEASE_DEVICE();
+        if (ACQUIRE_DEVICE(0))
+        {
+            audio.driver->submit(frames, count);
+            RELEASE_DEVICE();
+        }
+        counters.totalSamples += count;
+        counters.busyTime += rg_system_timer() - time_start;
+        return;
+    }
+
+    const uint32_t head = ring.head;
+    uint32_t tail = __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST);
+    uint32_t buffered = (head - tail) + sink_buffered(time_start);
+
+    // Dynamic rate control: stretch or shrink our output slightly to keep the buffered audio centered.
+    // An audio-clocked core is paced by the wait below instead, shrinking would only make it run fast.
+    float error = ((int)buffered - RING_TARGET) / (float)RING_TARGET;
+    error = RG_MIN(RG_MAX(error, -1.f), ring.waited ? 0.f : 1.f);
+    uint32_t step = 65536 * (1.f + DRC_MAX_DELTA * error);
+    counters.rateAdjust = -DRC_MAX_DELTA * error * 1000000;
+
+    // Sleep until the sink caught up, this is what keeps cores running at the audio clock
+    ring.waited = false;
+    while (buffered > RING_HIGH && rg_system_timer() - time_start < SUBMIT_MAX_WAIT)
+    {
+        rg_task_t *self = rg_task_current();
+        __atomic_store_n(&ring.waiter, self, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST) == tail)
+            rg_task_wait(10);
+        __atomic_compare_exchange_n(&ring.waiter, &self, NULL, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST);
+        buffered = (head - tail) + sink_buffered(rg_system_timer());
+        ring.waited = true;
     }
 
+    // The ring wraps at most once, so the resampler runs over two contiguous spans at most
+    const uint32_t space = RING_LENGTH - (head - tail);
+    const uint32_t offset = head % RING_LENGTH;
+    const int16_t *input = (const int16_t *)frames;
+    ring.resampler.step = step;
+    uint32_t written = resample_run(&ring.resampler, input, count, (int16_t *)&ring.frames[offset], RG_MIN(space, RING_LENGTH - offset));
+    if (written < space)
+        written += resample_run(&ring.resampler, input, count, (int16_t *)ring.frames, space - written);
+    if (resample_end(&ring.resampler, input, count))
+        counters.overruns++;
+
+    __atomic_store_n(&ring.head, head + written, __ATOMIC_SEQ_CST);
+    rg_task_notify(ring.task);
+
     counters.totalSamples += count;
     counters.busyTime += rg_system_timer() - time_start;
 }
 
+void rg_audio_resampler_init(rg_audio_resampler_t *rs, int channels, int in_rate, int out_rate)
+{
+    RG_ASSERT_ARG(rs);
+    RG_ASSERT(channels == 1 || channels == 2, "Only mono and stereo are supported");
+    RG_ASSERT(in_rate > 0 && out_rate > 0, "Invalid sample rate");
+    rs->step = ((uint64_t)in_rate << 16) / out_rate;
+    rs->position = 0;
+    rs->last[0] = rs->last[1] = 0;
+    rs->channels = channels;
+}
+
+size_t rg_audio_resample(rg_audio_resampler_t *rs, const int16_t *in, size_t in_count, int16_t *out, size_t out_max)
+{
+    if (!in || !in_count)
+        return 0;
+    size_t written = resample_run(rs, in, in_count, out, out_max);
+    resample_end(rs, in, in_count);
+    return written;
+}
+
+void rg_audio_source_init(rg_audio_source_t *source, int channels, int sample_rate, int volume)
+{
+    RG_ASSERT_ARG(source);
+    // Forget any frames the source still had pending in the mixer
+    for (size_t i = 0; i < mixer.count; ++i)
+    {
+        if (mixer.sources[i] == source)
+            mixer.sources[i--] = mixer.sources[--mixer.count];
+    }
+    memset(source, 0, sizeof(*source));
+    rg_audio_resampler_init(&source->resampler, channels, sample_rate, audio.sampleRate ?: sample_rate);
+    source->gain = RG_MIN(RG_MAX(volume, 0), 400) * 256 / 100;
+    source->round = mixer.round - 1;
+}
+
+void rg_audio_mix(rg_audio_source_t *source, const int16_t *samples, size_t count)
+{
+    if (!source || !samples || !count)
+        return;
+
+    if (!mixer.buffer)
+    {
+        int32_t *buffer = calloc(MIX_LENGTH * 2, sizeof(int32_t));
+        rg_audio_frame_t *output = malloc(MIX_LENGTH * sizeof(rg_audio_frame_t));
+        if (!buffer || !output)
+        {
+            RG_LOGE("Failed to allocate the mixer buffers");
+            free(buffer);
+            free(output);
+            return;
+        }
+        mixer.buffer = buffer;
+        mixer.output = output;
+    }
+
+    if (source->round != mixer.round && source->written == 0)
+    {
+        if (mixer.count == MIX_SOURCES)
+        {
+            RG_LOGW("Too many audio sources, dropping samples");
+            return;
+        }
+        mixer.sources[mixer.count++] = source;
+    }
+    source->round = mixer.round;
+
+    const int channels = source->resampler.channels;
+    int16_t block[MIX_BLOCK * 2];
+    size_t done;
+
+    while ((done = RG_MIN(MIX_BLOCK, MIX_LENGTH - source->written)) > 0)
+    {
+        done = resample_run(&source->resampler, samples, count, block, done);
+        if (done == 0)
+            break;
+        if (source->lowpass)
+            mix_lowpass(block, done, channels, source->lowpass, source->lowpass_state);
+        if (channels == 2)
+            mix_stereo(&mixer.buffer[source->written * 2], block, done, source->gain);
+        else
+            mix_mono(&mixer.buffer[source->written * 2], block, done, source->gain);
+        source->written += done;
+    }
+
+    if (resample_end(&source->resampler, samples, count))
+        counters.overruns++;
+}
+
+void rg_audio_mix_submit(void)
+{
+    uint32_t common = UINT32_MAX, pending = 0;
+
+    // Sources that didn't mix this round are silent, they don't hold the others back
+    for (size_t i = 0; i < mixer.count; ++i)
+    {
+        if (mixer.sources[i]->round == mixer.round)
+            common = RG_MIN(common, mixer.sources[i]->written);
+        pending = RG_MAX(pending, mixer.sources[i]->written);
+    }
+    if (common == UINT32_MAX)
+        common = pending;
+
+    if (common > 0)
+    {
+        mix_clip((int16_t *)mixer.output, mixer.buffer, common);
+        memmove(mixer.buffer, &mixer.buffer[common * 2], (pending - common) * 2 * sizeof(int32_t));
+        memset(&mixer.buffer[(pending - common) * 2], 0, common * 2 * sizeof(int32_t));
+    }
+
+    for (size_t i = 0; i < mixer.count; ++i)
+    {
+        rg_audio_source_t *source = mixer.sources[i];
+        source->written -= RG_MIN(source->written, common);
+        if (source->written == 0)
+            mixer.sources[i--] = mixer.sources[--mixer.count];
+    }
+    mixer.round++;
+
+    if (common > 0)
+        rg_audio_submit(mixer.output, common);
+}
+
 rg_audio_counters_t rg_audio_get_counters(void)
 {
+    counters.bufferFill = ring.task ? ring_used() : 0;
+    counters.bufferSize = ring.task ? RING_LENGTH : 0;
     return counters;
 }
 
@@ -34,13 +34,50 @@ typedef struct
 {
     int64_t totalSamples;
     int64_t busyTime;
+    int32_t underruns;  // Times the sink found the buffer empty
+    int32_t overruns;   // Times rg_audio_submit had to drop frames because the buffer was full
+    int32_t bufferFill; // Frames currently buffered
+    int32_t bufferSize;
+    int32_t rateAdjust; // Last dynamic rate control adjustment in parts per million, positive stretches
 } rg_audio_counters_t;
 
+// Linear interpolation resampler, rg_audio uses the same one internally for dynamic rate control
+typedef struct
+{
+    uint32_t step;            // Input frames per output frame (16.16)
+    uint32_t position;        // 16.16, 0 is the last frame of the previous block
+    int16_t last[2];          // Last frame of the previous block
+    int channels;             // 1 (mono) or 2 (interleaved stereo)
+} rg_audio_resampler_t;
+
+// A core can emulate its sound chips at their native rates and mix them through sources instead of
+// converting to the sink's rate itself. Samples are int16, mono or interleaved stereo.
+typedef struct
+{
+    rg_audio_resampler_t resampler;
+    int gain;                 // 256 is unity
+    int lowpass;              // Single pole low-pass factor (16.16, like S9xMixSamplesLowPass), 0 disables it
+    int32_t lowpass_state[2];
+    uint32_t written;         // Frames mixed but not yet submitted
+    uint32_t round;
+} rg_audio_source_t;
+
 void rg_audio_init(int sample_rate);
 void rg_audio_deinit(void);
+// Must always be called from the same task. It only blocks to pace the caller to the sink's clock.
 void rg_audio_submit(const rg_audio_frame_t *frames, size_t count);
 rg_audio_counters_t rg_audio_get_counters(void);
 
+void rg_audio_resampler_init(rg_audio_resampler_t *rs, int channels, int in_rate, int out_rate);
+// Returns the number of frames written to out, input that doesn't fit in out_max is dropped
+size_t rg_audio_resample(rg_audio_resampler_t *rs, const int16_t *in, size_t in_count, int16_t *out, size_t out_max);
+
+// volume is in percent, the source is resampled from sample_rate to the current output rate
+void rg_audio_source_init(rg_audio_source_t *source, int channels, int sample_rate, int volume);
+void rg_audio_mix(rg_audio_source_t *source, const int16_t *samples, size_t count);
+// Submits what all the sources mixed since the last call have in common, the rest is kept for next time
+void rg_audio_mix_submit(void);
+
 // const char **rg_audio_get_drivers(void);
 const char *rg_audio_get_driver(void);
 
@@ -5,9 +5,11 @@
 #include <string.h>
 
 #define LCD_BUFFER_LENGTH (RG_SCREEN_WIDTH * 4) // In pixels
+#define FRAME_QUEUE_LENGTH 4                     // Must be a power of two
+#define FRAME_FULL_REDRAW 1                      // Slot tag: the frame follows a dropped one, ignore its dirty_rows
 
 // static rg_display_driver_t driver;
-static rg_task_t *display_task_queue;
+static rg_task_t *display_task_handle;
 static rg_display_counters_t counters;
 static rg_display_config_t config;
 // static rg_surface_t *osd;
@@ -17,6 +19,20 @@ static int16_t map_viewport_to_source_x[RG_SCREEN_WIDTH + 1];
 static int16_t map_viewport_to_source_y[RG_SCREEN_HEIGHT + 1];
 static uint32_t screen_line_checksum[RG_SCREEN_HEIGHT + 1];
 
+// Single producer (the emulator) / single consumer (display_task) frame queue. Slots hold surface
+// pointers tagged with FRAME_FULL_REDRAW. The display task claims a slot by swapping it with 0,
+// which is what lets the producer replace a pending frame without a lock.
+static struct
+{
+    uintptr_t slots[FRAME_QUEUE_LENGTH];
+    uint32_t head;                  // Written by the producer only
+    uint32_t tail;                  // Written by the display task only, once the frame is drawn
+    const rg_surface_t *drawing;    // Frame claimed by the display task, if any
+    rg_task_t *waiter;              // Task sleeping in frame_queue_wait(), if any
+    uintptr_t next_tag;             // Producer only, FRAME_FULL_REDRAW after a dropped frame
+    bool stop;
+} frame_queue;
+
 #define LINE_IS_REPEATED(Y) (map_viewport_to_source_y[(Y)] == map_viewport_to_source_y[(Y) - 1])
 // This is to avoid flooring a number that is approximated to .9999999 and be explicit about it
 #define FLOAT_TO_INT(x) ((int)((x) + 0.1f))
@@ -47,25 +63,55 @@ static inline void lcd_send_buffer(uint16_t *buffer, size_t length);
 #include "drivers/display/dummy.h"
 #endif
 
-static inline unsigned blend_pixels(unsigned a, unsigned b)
+#include "rg_display_scaler.h"
+
+static inline void update_counters(int lines_updated, int draw_height, int64_t time_start)
 {
-    // Fast path (taken 80-90% of the time)
-    if (a == b)
-        return a;
+    if (lines_updated > draw_height * 0.80f)
+        counters.fullFrames++;
+    else
+        counters.partFrames++;
+    counters.busyTime += rg_system_timer() - time_start;
+}
 
-    // Not the original author, but a good explanation is found at:
-    // https://medium.com/@luc.trudeau/fast-averaging-of-high-color-16-bit-pixels-cb4ac7fd1488
-    a = (a << 8) | (a >> 8);
-    b = (b << 8) | (b >> 8);
-    unsigned s = a ^ b;
-    unsigned v = ((s & 0xF7DEU) >> 1) + (a & b) + (s & 0x0821U);
-    return (v << 8) | (v >> 8);
+#ifdef LCD_HAS_DIRECT_WRITE
+// Unscaled frames already in the panel's pixel format are handed to the driver as-is, which copies
+// them straight to the panel (by DMA when possible). There are no line checksums on this path, so
+// rows are either known dirty or redrawn, and drawn rows are marked with checksum 1 (valid).
+static int write_update_direct(const rg_surface_t *update, const void *data, int dirty_base, bool use_dirty_rows,
+                               int left, int top, int width, int height)
+{
+    const bool check_dirty = RG_SCREEN_PARTIAL_UPDATES && use_dirty_rows && update->dirty_rows;
+    int lines_updated = 0;
 
-    // This is my attempt at averaging two 565BE values without swapping bytes (3x the speed of the code above)
-    // return (((a ^ b) & 0b1101111011110110U) >> 1) + (a & b);
+    for (int y = 0; y < height;)
+    {
+        int count = 0;
+        while (y + count < height && (!check_dirty || screen_line_checksum[top + y + count] == 0 ||
+                                      RG_SURFACE_ROW_IS_DIRTY(update, dirty_base + y + count)))
+        {
+            screen_line_checksum[top + y + count] = 1;
+            ++count;
+        }
+
+        if (count > 0)
+        {
+            lcd_write_direct(display.screen.margins.left + left, display.screen.margins.top + top + y, width, count,
+                             data + y * update->stride, update->stride);
+            lines_updated += count;
+            y += count;
+        }
+        else
+        {
+            ++y;
+        }
+    }
+
+    return lines_updated;
 }
+#endif
 
-static inline void write_update(const rg_surface_t *update)
+static inline void write_update(const rg_surface_t *update, bool use_dirty_rows)
 {
     const int64_t time_start = rg_system_timer();
 
@@ -97,9 +143,27 @@ static inline void write_update(const rg_surface_t *update)
     const int stride = update->stride;
     const void *data = update->data + update->offset + (crop_top * stride) + (crop_left * RG_PIXEL_GET_SIZE(format));
     const uint16_t *palette = update->palette;
+    const int dirty_base = (update->offset / stride) + crop_top;
+    line_kernel_t render_line;
+
+    if (format & RG_PIXEL_PALETTE)
+        render_line = filter_x ? render_line_pal8_filtered : render_line_pal8;
+    else if (format == RG_PIXEL_565_LE)
+        render_line = filter_x ? render_line_565le_filtered : render_line_565le;
+    else
+        render_line = filter_x ? render_line_565be_filtered : render_line_565be;
 
     const bool partial_update = RG_SCREEN_PARTIAL_UPDATES;
 
+#ifdef LCD_HAS_DIRECT_WRITE
+    if (format == LCD_DIRECT_FORMAT && display.viewport.step_x == 1.f && display.viewport.step_y == 1.f)
+    {
+        int lines_updated = write_update_direct(update, data, dirty_base, use_dirty_rows, draw_left, draw_top, draw_width, draw_height);
+        update_counters(lines_updated, draw_height, time_start);
+        return;
+    }
+#endif
+
     int lines_per_buffer = LCD_BUFFER_LENGTH / draw_width;
     int lines_remaining = draw_height;
     int lines_updated = 0;
@@ -120,6 +184,21 @@ static inline void write_update(const rg_surface_t *update)
                 --lines_to_copy;
         }
 
+        // When the source tells us which rows changed, unchanged blocks aren't even rendered
+        if (partial_update && use_dirty_rows && update->dirty_rows)
+        {
+            bool dirty = false;
+            for (int i = 0; i < lines_to_copy && !dirty; ++i)
+                dirty = screen_line_checksum[draw_top + y + i] == 0 ||
+                        RG_SURFACE_ROW_IS_DIRTY(update, dirty_base + map_viewport_to_source_y[y + i]);
+            if (!dirty)
+            {
+                lines_remaining -= lines_to_copy;
+                y += lines_to_copy;
+                continue;
+            }
+        }
+
         uint16_t *line_buffer = lcd_get_buffer(LCD_BUFFER_LENGTH);
         uint16_t *line_buffer_ptr = line_buffer;
 
@@ -130,29 +209,15 @@ static inline void write_update(const rg_surface_t *update)
         {
             if (i > 0 && LINE_IS_REPEATED(y))
             {
-                memcpy(line_buffer_ptr, line_buffer_ptr - draw_width, draw_width * 2);
+                // The vertical filter overwrites the last copy of a line, the others must be copied
+                if (!filter_y || i == lines_to_copy - 1 || LINE_IS_REPEATED(y + 1))
+                    memcpy(line_buffer_ptr, line_buffer_ptr - draw_width, draw_width * 2);
                 line_buffer_ptr += draw_width;
             }
             else
             {
-                #define RENDER_LINE(PTR_TYPE, PIXEL) { \
-                    PTR_TYPE *buffer = (PTR_TYPE *)(data + map_viewport_to_source_y[y] * stride);\
-                    for (int xx = 0; xx < draw_width; ++xx) { \
-                        int x = map_viewport_to_source_x[xx]; \
-                        *line_buffer_ptr++ = (PIXEL); \
-                    } \
-                }
-                if (format & RG_PIXEL_PALETTE)
-                    RENDER_LINE(uint8_t, palette[buffer[x]])
-                else if (format == RG_PIXEL_565_LE)
-                    RENDER_LINE(uint16_t, (buffer[x] << 8) | (buffer[x] >> 8))
-                else
-                    RENDER_LINE(uint16_t, buffer[x])
-
-                if (partial_update)
-                {
-                    checksum = rg_hash((void*)(line_buffer_ptr - draw_width), draw_width * 2);
-                }
+                checksum = render_line(line_buffer_ptr, data + map_viewport_to_source_y[y] * stride, palette);
+                line_buffer_ptr += draw_width;
             }
 
             if (screen_line_checksum[draw_top + y] != checksum)
@@ -164,36 +229,19 @@ static inline void write_update(const rg_surface_t *update)
             ++y;
         }
 
-        if (filter_x && need_update)
-        {
-            for (int i = 0; i < lines_to_copy; ++i)
-            {
-                uint16_t *buffer = line_buffer + i * draw_width;
-                for (int x = 1; x < draw_width - 1; ++x)
-                {
-                    if (map_viewport_to_source_x[x] == map_viewport_to_source_x[x - 1])
-                    {
-                        buffer[x] = blend_pixels(buffer[x - 1], buffer[x + 1]);
-                    }
-                }
-            }
-        }
-
+        // The block is still cache-resident, and unchanged blocks are skipped entirely. The last copy
+        // of a line becomes the blend of the rendered lines around it, which are both in the block.
         if (filter_y && need_update)
         {
             int top = y - lines_to_copy;
+            int source = 0;
             for (int i = 1; i < lines_to_copy - 1; ++i)
             {
-                if (LINE_IS_REPEATED(top + i))
-                {
-                    uint16_t *lineA = line_buffer + (i - 1) * draw_width;
-                    uint16_t *lineB = line_buffer + (i + 0) * draw_width;
-                    uint16_t *lineC = line_buffer + (i + 1) * draw_width;
-                    for (size_t x = 0; x < draw_width; ++x)
-                    {
-                        lineB[x] = blend_pixels(lineA[x], lineC[x]);
-                    }
-                }
+                if (!LINE_IS_REPEATED(top + i))
+                    source = i;
+                else if (!LINE_IS_REPEATED(top + i + 1))
+                    blend_lines(line_buffer + i * draw_width, line_buffer + source * draw_width,
+                                line_buffer + (i + 1) * draw_width, draw_width);
             }
         }
 
@@ -216,11 +264,7 @@ static inline void write_update(const rg_surface_t *update)
         lines_remaining -= lines_to_copy;
     }
 
-    if (lines_updated > draw_height * 0.80f)
-        counters.fullFrames++;
-    else
-        counters.partFrames++;
-    counters.busyTime += rg_system_timer() - time_start;
+    update_counters(lines_updated, draw_height, time_start);
 }
 
 static void update_viewport_scaling(void)
@@ -276,9 +320,14 @@ static void update_viewport_scaling(void)
     for (int y = 0; y < screen_height; ++y)
         map_viewport_to_source_y[y] = FLOAT_TO_INT(y * display.viewport.step_y);
 
-    RG_LOGI("%dx%d@%.3f => %dx%d@%.3f left:%d top:%d step_x:%.2f step_y:%.2f", src_width, src_height,
-            (float)src_width / src_height, new_width, new_height, (float)new_width / new_height,
-            display.viewport.left, display.viewport.top, display.viewport.step_x, display.viewport.step_y);
+    // write_update() crops the viewport symmetrically when it's larger than the screen
+    int draw_width = RG_MIN(new_width, new_width + display.viewport.left * 2);
+    build_scale_plan(map_viewport_to_source_x, draw_width);
+
+    RG_LOGI("%dx%d@%.3f => %dx%d@%.3f left:%d top:%d step_x:%.2f step_y:%.2f spans:%d", src_width,
+            src_height, (float)src_width / src_height, new_width, new_height, (float)new_width / new_height,
+            display.viewport.left, display.viewport.top, display.viewport.step_x, display.viewport.step_y,
+            scale_plan.num_spans);
 }
 
 static bool load_border_file(const char *filename)
@@ -304,17 +353,60 @@ static bool load_border_file(const char *filename)
     return false;
 }
 
+static inline uint32_t frame_queue_pending(void)
+{
+    return __atomic_load_n(&frame_queue.head, __ATOMIC_SEQ_CST) - __atomic_load_n(&frame_queue.tail, __ATOMIC_SEQ_CST);
+}
+
+static bool frame_queue_contains(const rg_surface_t *surface)
+{
+    // Slots must be checked before `drawing`, a slot is cleared only after `drawing` was set
+    for (uint32_t i = frame_queue.tail; i != frame_queue.head; ++i)
+    {
+        uintptr_t slot = __atomic_load_n(&frame_queue.slots[i % FRAME_QUEUE_LENGTH], __ATOMIC_SEQ_CST);
+        if ((slot & ~FRAME_FULL_REDRAW) == (uintptr_t)surface)
+            return true;
+    }
+    return __atomic_load_n(&frame_queue.drawing, __ATOMIC_SEQ_CST) == surface;
+}
+
+// Sleep until the display task releases a frame. The timeout only matters in the unlikely
+// event that two tasks wait at the same time, because only the last one registered is woken up.
+static void frame_queue_wait(uint32_t tail)
+{
+    rg_task_t *self = rg_task_current();
+    if (!self)
+    {
+        rg_task_delay(1);
+        return;
+    }
+    __atomic_store_n(&frame_queue.waiter, self, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&frame_queue.tail, __ATOMIC_SEQ_CST) == tail)
+        rg_task_wait(10);
+    __atomic_compare_exchange_n(&frame_queue.waiter, &self, NULL, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
 IRAM_ATTR
 static void display_task(void *arg)
 {
-    rg_task_msg_t msg;
-
-    while (rg_task_peek(&msg))
+    while (1)
     {
+        uint32_t tail = frame_queue.tail;
+
+        while (__atomic_load_n(&frame_queue.head, __ATOMIC_SEQ_CST) == tail && !__atomic_load_n(&frame_queue.stop, __ATOMIC_SEQ_CST))
+            rg_task_wait(-1);
+
         // Received a shutdown request!
-        if (msg.type == RG_TASK_MSG_STOP)
+        if (__atomic_load_n(&frame_queue.stop, __ATOMIC_SEQ_CST))
             break;
 
+        // Claim the slot, the producer may still replace it until the exchange succeeds
+        uintptr_t *slot = &frame_queue.slots[tail % FRAME_QUEUE_LENGTH];
+        uintptr_t value = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+        do
+            __atomic_store_n(&frame_queue.drawing, (const rg_surface_t *)(value & ~FRAME_FULL_REDRAW), __ATOMIC_SEQ_CST);
+        while (!__atomic_compare_exchange_n(slot, &value, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
         if (display.changed)
         {
             update_viewport_scaling();
@@ -329,11 +421,19 @@ static void display_task(void *arg)
             display.changed = false;
         }
 
-        write_update(msg.dataPtr);
-
-        rg_task_receive(&msg);
+        int64_t started = rg_profile_begin();
+        write_update((const rg_surface_t *)(value & ~FRAME_FULL_REDRAW), !(value & FRAME_FULL_REDRAW));
+        rg_profile_end(RG_PROFILE_DISPLAY, started);
 
+        // The driver may still be reading the surface itself (lcd_write_direct), wait before releasing it
         lcd_sync();
+
+        // Release the frame, the surface can be reused by the producer from this point
+        __atomic_store_n(&frame_queue.drawing, NULL, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&frame_queue.tail, tail + 1, __ATOMIC_SEQ_CST);
+        rg_task_t *waiter = __atomic_exchange_n(&frame_queue.waiter, NULL, __ATOMIC_SEQ_CST);
+        if (waiter)
+            rg_task_notify(waiter);
     }
 }
 
@@ -465,18 +565,79 @@ void rg_display_submit(const rg_surface_t *update, uint32_t flags)
         display.source.height = update->height;
         display.changed = true;
     }
+    display.source.surface = update;
 
-    rg_task_send(display_task_queue, &(rg_task_msg_t){.dataPtr = update});
+    uint32_t head = frame_queue.head;
+    uintptr_t value = (uintptr_t)update | frame_queue.next_tag;
+
+    if (flags & (RG_DISPLAY_SUBMIT_NOWAIT | RG_DISPLAY_SUBMIT_REPLACE))
+    {
+        // At most one frame may wait behind the one being drawn, otherwise we'd only add latency
+        if (frame_queue_pending() >= 2)
+        {
+            // The replacement's dirty_rows are relative to the frame it replaces, they can't be trusted
+            uintptr_t *slot = &frame_queue.slots[(head - 1) % FRAME_QUEUE_LENGTH];
+            uintptr_t pending = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+            if ((flags & RG_DISPLAY_SUBMIT_REPLACE) && pending &&
+                __atomic_compare_exchange_n(slot, &pending, value | FRAME_FULL_REDRAW, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            {
+                counters.replacedFrames++;
+            }
+            else
+            {
+                frame_queue.next_tag = FRAME_FULL_REDRAW;
+                counters.droppedFrames++;
+            }
+            counters.blockTime += rg_system_timer() - time_start;
+            counters.totalFrames++;
+            return;
+        }
+    }
+    else
+    {
+        // Without ASYNC the caller expects to reuse the previous surface as soon as we return
+        uint32_t max_pending = (flags & RG_DISPLAY_SUBMIT_ASYNC) ? FRAME_QUEUE_LENGTH - 1 : 0;
+        uint32_t tail;
+        while (head - (tail = __atomic_load_n(&frame_queue.tail, __ATOMIC_SEQ_CST)) > max_pending)
+            frame_queue_wait(tail);
+    }
+
+    __atomic_store_n(&frame_queue.slots[head % FRAME_QUEUE_LENGTH], value, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&frame_queue.head, head + 1, __ATOMIC_SEQ_CST);
+    frame_queue.next_tag = 0;
+    rg_task_notify(display_task_handle);
 
     counters.blockTime += rg_system_timer() - time_start;
     counters.totalFrames++;
 }
 
+rg_surface_t *rg_display_acquire(rg_surface_t *const *surfaces, size_t count)
+{
+    RG_ASSERT_ARG(surfaces && count > 0);
+    const int64_t time_start = rg_system_timer();
+
+    // Returns the first surface that is neither queued nor being drawn
+    while (1)
+    {
+        uint32_t tail = __atomic_load_n(&frame_queue.tail, __ATOMIC_SEQ_CST);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (surfaces[i] && !frame_queue_contains(surfaces[i]))
+            {
+                counters.blockTime += rg_system_timer() - time_start;
+                return surfaces[i];
+            }
+        }
+        frame_queue_wait(tail);
+    }
+}
+
 bool rg_display_sync(bool block)
 {
-    while (block && rg_task_messages_waiting(display_task_queue))
-        continue; // We should probably yield?
-    return !rg_task_messages_waiting(display_task_queue);
+    uint32_t tail;
+    while (block && frame_queue.head != (tail = __atomic_load_n(&frame_queue.tail, __ATOMIC_SEQ_CST)))
+        frame_queue_wait(tail);
+    return frame_queue_pending() == 0;
 }
 
 void rg_display_write_rect(int left, int top, int width, int height, int stride, const uint16_t *buffer, uint32_t flags)
@@ -517,14 +678,21 @@ void rg_display_write_rect(int left, int top, int width, int height, int stride,
         {
             uint16_t *src = (void *)buffer + ((y + line) * stride);
             uint16_t *dst = lcd_buffer + (line * width);
-            if (flags & RG_DISPLAY_WRITE_NOSWAP)
+            if (flags & RG_DISPLAY_WRITE_NOSWAP) // Source is big-endian
             {
-                memcpy(dst, src, width * 2);
+                if (LCD_NATIVE_ENDIAN)
+                    for (size_t i = 0; i < width; ++i)
+                        dst[i] = LCD_PIXEL_FROM_BE(src[i]);
+                else
+                    memcpy(dst, src, width * 2);
             }
             else
             {
-                for (size_t i = 0; i < width; ++i)
-                    dst[i] = (src[i] >> 8) | (src[i] << 8);
+                if (LCD_NATIVE_ENDIAN)
+                    memcpy(dst, src, width * 2);
+                else
+                    for (size_t i = 0; i < width; ++i)
+                        dst[i] = LCD_PIXEL_FROM_LE(src[i]);
             }
         }
 
@@ -537,7 +705,7 @@ void rg_display_write_rect(int left, int top, int width, int height, int stride,
 
 void rg_display_clear_rect(int left, int top, int width, int height, uint16_t color_le)
 {
-    const uint16_t color_be = (color_le << 8) | (color_le >> 8);
+    const uint16_t color = LCD_PIXEL_FROM_LE(color_le);
     int pixels_remaining = width * height;
     if (pixels_remaining > 0)
     {
@@ -547,7 +715,7 @@ void rg_display_clear_rect(int left, int top, int width, int height, uint16_t co
             uint16_t *buffer = lcd_get_buffer(LCD_BUFFER_LENGTH);
             int pixels = RG_MIN(pixels_remaining, LCD_BUFFER_LENGTH);
             for (size_t j = 0; j < pixels; ++j)
-                buffer[j] = color_be;
+                buffer[j] = color;
             lcd_send_buffer(buffer, pixels);
             pixels_remaining -= pixels;
         }
@@ -577,7 +745,9 @@ void rg_display_clear(uint16_t color_le)
 
 void rg_display_deinit(void)
 {
-    rg_task_send(display_task_queue, &(rg_task_msg_t){.type = RG_TASK_MSG_STOP});
+    rg_display_sync(true);
+    __atomic_store_n(&frame_queue.stop, true, __ATOMIC_SEQ_CST);
+    rg_task_notify(display_task_handle);
     // lcd_set_backlight(0);
     lcd_deinit();
     RG_LOGI("Display terminated.\n");
@@ -609,7 +779,7 @@ void rg_display_init(void)
     rg_display_clear(C_BLACK);
     rg_task_delay(80); // Wait for the screen be cleared before turning on the backlight (40ms doesn't seem to be enough...)
     lcd_set_backlight(config.backlight);
-    display_task_queue = rg_task_create("rg_display", &display_task, NULL, 4 * 1024, RG_TASK_PRIORITY_6, 1);
+    display_task_handle = rg_task_create("rg_display", &display_task, NULL, 4 * 1024, RG_TASK_PRIORITY_6, 1);
     if (config.border_file)
         load_border_file(config.border_file);
     RG_LOGI("Display ready.\n");
@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "rg_surface.h"
+
 typedef enum
 {
     RG_DISPLAY_SCALING_OFF = 0, // No scaling, center image on screen
@@ -42,6 +44,14 @@ enum
     RG_DISPLAY_WRITE_NOSWAP = (1 << 1),
 };
 
+enum
+{
+    // Default: wait until every queued frame is drawn, then queue this one (single/double buffering)
+    RG_DISPLAY_SUBMIT_ASYNC = (1 << 0),   // Only wait for a free slot, surfaces must come from rg_display_acquire()
+    RG_DISPLAY_SUBMIT_NOWAIT = (1 << 1),  // Never wait, drop this frame if the queue is full
+    RG_DISPLAY_SUBMIT_REPLACE = (1 << 2), // Never wait, replace the newest pending frame if the queue is full
+};
+
 typedef struct
 {
     display_rotation_t rotation;
@@ -57,6 +67,8 @@ typedef struct
     int32_t totalFrames;
     int32_t fullFrames;
     int32_t partFrames;
+    int32_t droppedFrames;  // Submitted but rejected because the queue was full
+    int32_t replacedFrames; // Queued but superseded by a newer frame before being drawn
     int64_t blockTime;
     int64_t busyTime;
 } rg_display_counters_t;
@@ -93,12 +105,11 @@ typedef struct
     struct
     {
         int width, height;
+        const rg_surface_t *surface; // Last frame submitted
     } source;
     bool changed;
 } rg_display_t;
 
-#include "rg_surface.h"
-
 void rg_display_init(void);
 void rg_display_deinit(void);
 void rg_display_write_rect(int left, int top, int width, int height, int stride, const uint16_t *buffer, uint32_t flags);
@@ -108,6 +119,7 @@ void rg_display_clear(uint16_t color_le);
 bool rg_display_sync(bool block);
 void rg_display_force_redraw(void);
 void rg_display_submit(const rg_surface_t *update, uint32_t flags);
+rg_surface_t *rg_display_acquire(rg_surface_t *const *surfaces, size_t count);
 
 rg_display_counters_t rg_display_get_counters(void);
 const rg_display_t *rg_display_get_info(void);
@@ -0,0 +1,208 @@
+#pragma once
+
+// Scale plans and line kernels used by write_update(), kept apart from the driver code so that
+// they can be built on the host. RG_SCREEN_WIDTH and RG_SCREEN_PARTIAL_UPDATES must be defined.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef enum
+{
+    SCALE_SPAN_COPY = 0, // count source pixels drawn once (1:1)
+    SCALE_SPAN_REPEAT,   // count source pixels drawn `repeat` times each (2:1, 3:1, ...)
+    SCALE_SPAN_3_2,      // count source pixel pairs drawn as A A B (3:2)
+} scale_span_type_t;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t repeat;
+    uint16_t count;
+    int16_t src;
+} scale_span_t;
+
+// The scale plan is a compiled form of map_viewport_to_source_x, rebuilt on every geometry change
+static struct
+{
+    scale_span_t spans[RG_SCREEN_WIDTH];
+    int num_spans;
+    int width;
+} scale_plan;
+
+typedef uint32_t (*line_kernel_t)(uint16_t *dst, const void *line, const uint16_t *palette);
+
+// Most panels are fed big-endian RGB565 (the SPI byte order), drivers that write to a framebuffer in
+// memory can set LCD_NATIVE_ENDIAN to receive native pixels and skip swapping them a second time.
+#ifndef LCD_NATIVE_ENDIAN
+#define LCD_NATIVE_ENDIAN 0
+#endif
+#if LCD_NATIVE_ENDIAN
+#define LCD_PIXEL_FROM_LE(c) ((uint16_t)(c))
+#define LCD_PIXEL_FROM_BE(c) ((uint16_t)(((c) << 8) | ((c) >> 8)))
+#else
+#define LCD_PIXEL_FROM_LE(c) ((uint16_t)(((c) << 8) | ((c) >> 8)))
+#define LCD_PIXEL_FROM_BE(c) ((uint16_t)(c))
+#endif
+
+static inline unsigned blend_pixels(unsigned a, unsigned b)
+{
+    // Fast path (taken 80-90% of the time)
+    if (a == b)
+        return a;
+
+    // Not the original author, but a good explanation is found at:
+    // https://medium.com/@luc.trudeau/fast-averaging-of-high-color-16-bit-pixels-cb4ac7fd1488
+#if LCD_NATIVE_ENDIAN
+    unsigned s = a ^ b;
+    return ((s & 0xF7DEU) >> 1) + (a & b) + (s & 0x0821U);
+#else
+    a = (a << 8) | (a >> 8);
+    b = (b << 8) | (b >> 8);
+    unsigned s = a ^ b;
+    unsigned v = ((s & 0xF7DEU) >> 1) + (a & b) + (s & 0x0821U);
+    return (v << 8) | (v >> 8);
+#endif
+
+    // This is my attempt at averaging two 565BE values without swapping bytes (3x the speed of the code above)
+    // return (((a ^ b) & 0b1101111011110110U) >> 1) + (a & b);
+}
+
+#define PIXEL_PAL8(i) LCD_PIXEL_FROM_BE(palette[buffer[i]])
+#define PIXEL_565LE(i) LCD_PIXEL_FROM_LE(buffer[i])
+#define PIXEL_565BE(i) LCD_PIXEL_FROM_BE(buffer[i])
+// Formats whose source pixels are already in panel order, 1:1 spans are a plain memcpy
+#define RAW_PAL8 0
+#define RAW_565LE LCD_NATIVE_ENDIAN
+#define RAW_565BE (!LCD_NATIVE_ENDIAN)
+
+// FNV-1a over the rendered line, a word (two pixels) per step and four independent chains so that
+// the multiplies don't serialize. It compiles away entirely when partial updates are disabled.
+static inline uint32_t checksum_line(const uint16_t *line, int width)
+{
+    uint32_t h[4] = {0x811C9DC5, 0x050C5D1F, 0x1B873593, 0x85EBCA6B}, w[4];
+    int x = 0;
+    if (!RG_SCREEN_PARTIAL_UPDATES)
+        return 1;
+    for (; x + 8 <= width; x += 8)
+    {
+        memcpy(w, line + x, sizeof(w));
+        h[0] = (h[0] ^ w[0]) * 0x01000193;
+        h[1] = (h[1] ^ w[1]) * 0x01000193;
+        h[2] = (h[2] ^ w[2]) * 0x01000193;
+        h[3] = (h[3] ^ w[3]) * 0x01000193;
+    }
+    for (; x < width; ++x)
+        h[0] = (h[0] ^ line[x]) * 0x01000193;
+    return (((h[0] ^ h[1]) * 0x01000193) ^ ((h[2] ^ h[3]) * 0x01000193)) ?: 1; /* 0 marks a screen line as invalid */
+}
+
+// Render and horizontally filter a line in a single pass, then checksum it. With the filter, only the
+// last copy of a repeated pixel is affected: it becomes the blend of that pixel and the one that follows.
+#define DEFINE_LINE_KERNEL(NAME, PTR_TYPE, PIXEL, RAW, FILTER)                             \
+    static uint32_t NAME(uint16_t *dst, const void *line, const uint16_t *palette)         \
+    {                                                                                      \
+        const scale_span_t *span = scale_plan.spans;                                       \
+        const scale_span_t *end = span + scale_plan.num_spans;                             \
+        uint16_t *out = dst;                                                               \
+        for (; span < end; ++span)                                                         \
+        {                                                                                  \
+            const PTR_TYPE *buffer = (const PTR_TYPE *)line + span->src;                   \
+            const int count = span->count;                                                 \
+            const int repeat = span->repeat;                                               \
+            if (span->type == SCALE_SPAN_COPY)                                             \
+            {                                                                              \
+                if (RAW)                                                                   \
+                    memcpy(dst, buffer, count * 2);                                        \
+                else                                                                       \
+                    for (int x = 0; x < count; ++x)                                        \
+                        dst[x] = PIXEL(x);                                                 \
+                dst += count;                                                              \
+            }                                                                              \
+            else if (span->type == SCALE_SPAN_3_2)                                         \
+            {                                                                              \
+                for (int x = 0; x < count * 2; x += 2)                                     \
+                {                                                                          \
+                    uint16_t a = PIXEL(x), b = PIXEL(x + 1);                               \
+                    dst[0] = a, dst[1] = FILTER ? blend_pixels(a, b) : a, dst[2] = b;      \
+                    dst += 3;                                                              \
+                }                                                                          \
+            }                                                                              \
+            else                                                                           \
+            {                                                                              \
+                /* The last pixel of the line has nothing to blend with */                 \
+                uint16_t next = (span + 1 < end) ? PIXEL(span[1].src - span->src)          \
+                                                 : PIXEL(count - 1);                       \
+                for (int x = 0; x < count; ++x)                                            \
+                {                                                                          \
+                    uint16_t a = PIXEL(x);                                                 \
+                    uint16_t b = a;                                                        \
+                    if (FILTER)                                                            \
+                        b = blend_pixels(a, x + 1 < count ? PIXEL(x + 1) : next);          \
+                    if (repeat == 2)                                                       \
+                        dst[0] = a, dst[1] = b;                                            \
+                    else if (repeat == 3)                                                  \
+                        dst[0] = a, dst[1] = a, dst[2] = b;                                \
+                    else                                                                   \
+                    {                                                                      \
+                        for (int r = 0; r < repeat - 1; ++r)                               \
+                            dst[r] = a;                                                    \
+                        dst[repeat - 1] = b;                                               \
+                    }                                                                      \
+                    dst += repeat;                                                         \
+                }                                                                          \
+            }                                                                              \
+        }                                                                                  \
+        return checksum_line(out, dst - out);                                              \
+    }
+
+DEFINE_LINE_KERNEL(render_line_pal8, uint8_t, PIXEL_PAL8, RAW_PAL8, false)
+DEFINE_LINE_KERNEL(render_line_565le, uint16_t, PIXEL_565LE, RAW_565LE, false)
+DEFINE_LINE_KERNEL(render_line_565be, uint16_t, PIXEL_565BE, RAW_565BE, false)
+DEFINE_LINE_KERNEL(render_line_pal8_filtered, uint8_t, PIXEL_PAL8, RAW_PAL8, true)
+DEFINE_LINE_KERNEL(render_line_565le_filtered, uint16_t, PIXEL_565LE, RAW_565LE, true)
+DEFINE_LINE_KERNEL(render_line_565be_filtered, uint16_t, PIXEL_565BE, RAW_565BE, true)
+
+static inline void blend_lines(uint16_t *dst, const uint16_t *lineA, const uint16_t *lineC, int width)
+{
+    for (int x = 0; x < width; ++x)
+        dst[x] = blend_pixels(lineA[x], lineC[x]);
+}
+
+// Compile a map of output columns to source columns into spans
+static void build_scale_plan(const int16_t *map, int width)
+{
+    scale_span_t *span = NULL;
+
+    scale_plan.num_spans = 0;
+    scale_plan.width = width;
+
+    for (int x = 0; x < width;)
+    {
+        int src = map[x];
+        int repeat = 1;
+        int type, src_pixels, out_pixels;
+
+        while (x + repeat < width && map[x + repeat] == src && repeat < 255)
+            repeat++;
+
+        if (repeat == 2 && x + 2 < width && map[x + 2] == src + 1 && (x + 3 >= width || map[x + 3] == src + 2))
+            type = SCALE_SPAN_3_2, repeat = 0, src_pixels = 2, out_pixels = 3;
+        else if (repeat > 1)
+            type = SCALE_SPAN_REPEAT, src_pixels = 1, out_pixels = repeat;
+        else
+            type = SCALE_SPAN_COPY, repeat = 0, src_pixels = 1, out_pixels = 1;
+
+        if (span && span->type == type && span->repeat == repeat && span->src + span->count * src_pixels == src)
+        {
+            span->count++;
+        }
+        else
+        {
+            span = &scale_plan.spans[scale_plan.num_spans++];
+            *span = (scale_span_t){type, repeat, 1, src};
+        }
+
+        x += out_pixels;
+    }
+}
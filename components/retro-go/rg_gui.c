@@ -651,6 +651,10 @@ void rg_gui_draw_status_bars(void)
         (int)app->frameskip,
         (int)round(stats.busyPercent));
 
+    // Tells how much of the frame the run-ahead snapshots take
+    if (rg_emu_get_runahead() > 0 && stats.runaheadCost > 0)
+        snprintf(header + strlen(header), max_len - strlen(header), " RA:%dus", stats.runaheadCost);
+
     if (app->romPath && strlen(app->romPath) > max_len - 1)
         snprintf(footer, max_len, "...%s", app->romPath + (strlen(app->romPath) - (max_len - 4)));
     else if (app->romPath)
@@ -1589,6 +1593,26 @@ static rg_gui_event_t speedup_update_cb(rg_gui_option_t *option, rg_gui_event_t
     return RG_DIALOG_VOID;
 }
 
+static rg_gui_event_t rewind_cb(rg_gui_option_t *option, rg_gui_event_t event)
+{
+    if (event == RG_DIALOG_PREV || event == RG_DIALOG_NEXT)
+        rg_emu_set_rewind(!rg_emu_get_rewind());
+    strcpy(option->value, rg_emu_get_rewind() ? _("On") : _("Off"));
+    return RG_DIALOG_VOID;
+}
+
+static rg_gui_event_t runahead_cb(rg_gui_option_t *option, rg_gui_event_t event)
+{
+    if (event == RG_DIALOG_PREV || event == RG_DIALOG_NEXT)
+        rg_emu_set_runahead(rg_emu_get_runahead() + (event == RG_DIALOG_NEXT ? 1 : -1));
+    int frames = rg_emu_get_runahead();
+    if (frames == 0)
+        strcpy(option->value, _("Off"));
+    else
+        sprintf(option->value, "%d", frames);
+    return RG_DIALOG_VOID;
+}
+
 static rg_gui_event_t led_indicator_opt_cb(rg_gui_option_t *option, rg_gui_event_t event)
 {
     if (event == RG_DIALOG_PREV || event == RG_DIALOG_NEXT)
@@ -1614,6 +1638,27 @@ static rg_gui_event_t led_indicator_cb(rg_gui_option_t *option, rg_gui_event_t e
     return RG_DIALOG_VOID;
 }
 
+static rg_gui_event_t unzip_cache_cb(rg_gui_option_t *option, rg_gui_event_t event)
+{
+    const int sizes[] = {0, 64, 256, 1024};
+    int size = rg_storage_get_unzip_cache();
+    int sel = 0;
+    for (int i = 0; i < RG_COUNT(sizes); ++i)
+        if (sizes[i] <= size)
+            sel = i;
+    if (event == RG_DIALOG_PREV)
+        sel = (sel > 0) ? sel - 1 : RG_COUNT(sizes) - 1;
+    else if (event == RG_DIALOG_NEXT)
+        sel = (sel < RG_COUNT(sizes) - 1) ? sel + 1 : 0;
+    if (event == RG_DIALOG_PREV || event == RG_DIALOG_NEXT)
+        rg_storage_set_unzip_cache(sizes[sel]);
+    if (sizes[sel] == 0)
+        strcpy(option->value, _("Off"));
+    else
+        sprintf(option->value, "%dMB", sizes[sel]);
+    return RG_DIALOG_VOID;
+}
+
 static rg_gui_event_t show_clock_cb(rg_gui_option_t *option, rg_gui_event_t event)
 {
     if (event == RG_DIALOG_PREV || event == RG_DIALOG_NEXT)
@@ -2020,6 +2065,7 @@ void rg_gui_options_menu(void)
         {0, _("Show clock"),    "-", RG_DIALOG_FLAG_NORMAL, &show_clock_cb},
         {0, _("Timezone"),      "-", RG_DIALOG_FLAG_NORMAL, &timezone_cb},
         {0, _("Language"),      "-", RG_DIALOG_FLAG_NORMAL, &language_cb},
+        {0, _("ROM cache"),     "-", RG_DIALOG_FLAG_NORMAL, &unzip_cache_cb},
         #ifdef RG_GPIO_LED // Only show disk LED option if disk LED GPIO pin is defined
         {0, _("LED options"),   NULL, RG_DIALOG_FLAG_NORMAL, &led_indicator_cb},
         #endif
@@ -2035,6 +2081,8 @@ void rg_gui_options_menu(void)
         {0, _("Filter"),        "-", RG_DIALOG_FLAG_NORMAL, &filter_update_cb},
         {0, _("Border"),        "-", RG_DIALOG_FLAG_NORMAL, &border_update_cb},
         {0, _("Speed"),         "-", RG_DIALOG_FLAG_NORMAL, &speedup_update_cb},
+        {0, _("Rewind"),        "-", rg_system_get_app()->handlers.saveStateMem ? RG_DIALOG_FLAG_NORMAL : RG_DIALOG_FLAG_HIDDEN, &rewind_cb},
+        {0, _("Run-ahead"),     "-", rg_system_get_app()->handlers.saveStateMem ? RG_DIALOG_FLAG_NORMAL : RG_DIALOG_FLAG_HIDDEN, &runahead_cb},
         // {0, _("Misc options"),  NULL, RG_DIALOG_FLAG_NORMAL, &misc_options_cb},
         #if !RG_BUILD_RELEASE
         {0, _("Overclock"),        "-", RG_DIALOG_FLAG_NORMAL, &overclock_cb},
@@ -2202,6 +2250,7 @@ void rg_gui_debug_menu(void)
         break;
     case 0x004:
         rg_system_save_trace(RG_STORAGE_ROOT "/trace.txt", 0);
+        rg_system_save_trace(RG_STORAGE_ROOT "/trace.json", 0);
         break;
     case 0x005:
         break;
@@ -2269,10 +2318,12 @@ void rg_gui_game_menu(void)
 {
     const char *rom_path = rg_system_get_app()->romPath;
     bool have_option_btn = rg_input_key_is_present(RG_KEY_OPTION);
+    bool have_rewind = rg_emu_get_rewind();
     const rg_gui_option_t choices[] = {
         {1000, _("Save & Continue"), NULL, RG_DIALOG_FLAG_NORMAL, NULL},
         {2000, _("Save & Quit"),     NULL, RG_DIALOG_FLAG_NORMAL, NULL},
         {3001, _("Load game"),       NULL, RG_DIALOG_FLAG_NORMAL, NULL},
+        {3004, _("Rewind"),          NULL, have_rewind ? RG_DIALOG_FLAG_NORMAL : RG_DIALOG_FLAG_HIDDEN, NULL},
         {3000, _("Reset"),           NULL, RG_DIALOG_FLAG_NORMAL, NULL},
         #ifdef RG_ENABLE_NETPLAY
         {5000, _("Netplay"),         NULL, RG_DIALOG_FLAG_NORMAL, NULL},
@@ -2305,6 +2356,7 @@ void rg_gui_game_menu(void)
         case 3001: if ((slot = rg_gui_savestate_menu(_("Load"), rom_path)) >= 0) rg_emu_load_state(slot); break;
         case 3002: rg_emu_reset(false); break;
         case 3003: rg_emu_reset(true); break;
+        case 3004: rg_emu_rewind(5 * rg_system_get_app()->tickRate); break;
     #ifdef RG_ENABLE_NETPLAY
         case 5000: rg_netplay_quick_start(); break;
     #endif
@@ -215,6 +215,7 @@ static void input_task(void *arg)
 
     while (input_task_running)
     {
+        int64_t started = rg_profile_begin();
         if (rg_input_read_gamepad_raw(&state))
         {
             for (int i = 0; i < RG_KEY_COUNT; ++i)
@@ -234,6 +235,7 @@ static void input_task(void *arg)
             gamepad_state = local_gamepad_state;
             __sync_synchronize();
         }
+        rg_profile_end(RG_PROFILE_INPUT, started);
 
         if (rg_system_timer() >= next_battery_update)
         {
@@ -75,16 +75,28 @@ static inline size_t rg_perf_get_largest_free_psram(void)
 typedef struct {
     async_memcpy_handle_t handle;
     volatile bool transfer_done;
+    volatile uint32_t issued;    // Transfers queued so far
+    volatile uint32_t completed; // Transfers finished so far, they complete in order
 } rg_dma_memcpy_t;
 
+static IRAM_ATTR bool rg_dma_memcpy_isr_cb(async_memcpy_handle_t handle, async_memcpy_event_t *event, void *arg)
+{
+    rg_dma_memcpy_t *ctx = arg;
+    ctx->completed++;
+    ctx->transfer_done = ctx->completed == ctx->issued;
+    return false;
+}
+
 static inline bool rg_dma_memcpy_init(rg_dma_memcpy_t *ctx)
 {
     async_memcpy_config_t config = {
-        .backlog = 8,
+        .backlog = 16,
         .sram_trans_align = 4,
         .psram_trans_align = 32,
         .flags = 0,
     };
+    ctx->issued = ctx->completed = 0;
+    ctx->transfer_done = true;
     return esp_async_memcpy_install(&config, &ctx->handle) == ESP_OK;
 }
 
@@ -99,7 +111,12 @@ static inline void rg_dma_memcpy_deinit(rg_dma_memcpy_t *ctx)
 static inline bool rg_dma_memcpy_async(rg_dma_memcpy_t *ctx, void *dst, const void *src, size_t size)
 {
     ctx->transfer_done = false;
-    return esp_async_memcpy(ctx->handle, dst, (void *)src, size, NULL, NULL) == ESP_OK;
+    ctx->issued++;
+    if (esp_async_memcpy(ctx->handle, dst, (void *)src, size, rg_dma_memcpy_isr_cb, ctx) == ESP_OK)
+        return true;
+    ctx->issued--;
+    ctx->transfer_done = ctx->completed == ctx->issued;
+    return false;
 }
 
 static inline bool rg_dma_memcpy_is_done(rg_dma_memcpy_t *ctx)
@@ -107,6 +124,12 @@ static inline bool rg_dma_memcpy_is_done(rg_dma_memcpy_t *ctx)
     return ctx->transfer_done;
 }
 
+// Returns true once the transfer numbered `ticket` (the value of `issued` right after queuing it) is done
+static inline bool rg_dma_memcpy_ticket_done(rg_dma_memcpy_t *ctx, uint32_t ticket)
+{
+    return (int32_t)(ctx->completed - ticket) >= 0;
+}
+
 #else
 
 #define RG_PERF_CURRENT_CORE()      0
@@ -125,12 +148,15 @@ static inline bool rg_dma_memcpy_is_done(rg_dma_memcpy_t *ctx)
 typedef struct {
     void *handle;
     volatile bool transfer_done;
+    volatile uint32_t issued;
+    volatile uint32_t completed;
 } rg_dma_memcpy_t;
 
-static inline bool rg_dma_memcpy_init(rg_dma_memcpy_t *ctx) { ctx->handle = NULL; return true; }
+static inline bool rg_dma_memcpy_init(rg_dma_memcpy_t *ctx) { *ctx = (rg_dma_memcpy_t){0}; return true; }
 static inline void rg_dma_memcpy_deinit(rg_dma_memcpy_t *ctx) { }
-static inline bool rg_dma_memcpy_async(rg_dma_memcpy_t *ctx, void *dst, const void *src, size_t size) { memcpy(dst, src, size); return true; }
+static inline bool rg_dma_memcpy_async(rg_dma_memcpy_t *ctx, void *dst, const void *src, size_t size) { memcpy(dst, src, size); ctx->completed = ++ctx->issued; return true; }
 static inline bool rg_dma_memcpy_is_done(rg_dma_memcpy_t *ctx) { return true; }
+static inline bool rg_dma_memcpy_ticket_done(rg_dma_memcpy_t *ctx, uint32_t ticket) { return true; }
 
 #endif
 
@@ -0,0 +1,145 @@
+#include "rg_system.h"
+#include "rg_rewind.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+rg_rewind_t *rg_rewind_alloc(size_t ring_size, size_t state_capacity)
+{
+    rg_rewind_t *rewind = calloc(1, sizeof(rg_rewind_t));
+    if (rewind)
+    {
+        rewind->ring = rg_alloc(ring_size, MEM_SLOW | MEM_NOPANIC);
+        rewind->state = malloc(state_capacity);
+        rewind->keyframe = malloc(state_capacity);
+    }
+    if (!rewind || !rewind->ring || !rewind->state || !rewind->keyframe)
+    {
+        rg_rewind_free(rewind);
+        return NULL;
+    }
+    rewind->ring_size = ring_size;
+    rewind->state_capacity = state_capacity;
+    return rewind;
+}
+
+void rg_rewind_free(rg_rewind_t *rewind)
+{
+    if (!rewind)
+        return;
+    free(rewind->ring);
+    free(rewind->state);
+    free(rewind->keyframe);
+    free(rewind);
+}
+
+static void drop_oldest(rg_rewind_t *rewind)
+{
+    // Deltas are useless without their keyframe, they go along with it
+    do
+    {
+        rewind->first = (rewind->first + 1) % RG_REWIND_MAX_ENTRIES;
+        rewind->count--;
+    } while (rewind->count > 0 && !rewind->entries[rewind->first].keyframe);
+}
+
+bool rg_rewind_capture(rg_rewind_t *rewind, rg_rewind_save_t save, uint32_t tick)
+{
+    RG_ASSERT_ARG(rewind && save);
+
+    size_t size = rewind->state_capacity;
+    if (!save(rewind->state, &size))
+        return false;
+
+    // Worst case of rg_rle_encode, the entry must be contiguous in the ring
+    size_t max_length = size + size / 128 + 1;
+    size_t offset = 0;
+
+    if (rewind->count > 0)
+    {
+        const rg_rewind_entry_t *last = rg_rewind_entry(rewind, rewind->count - 1);
+        offset = last->offset + last->length;
+    }
+
+    if (offset + max_length > rewind->ring_size)
+    {
+        // Wrap around, the entries left past the write position are the oldest ones
+        while (rewind->count > 0 && rewind->entries[rewind->first].offset >= offset)
+            drop_oldest(rewind);
+        offset = 0;
+    }
+
+    while (rewind->count > 0)
+    {
+        const rg_rewind_entry_t *oldest = &rewind->entries[rewind->first];
+        if (rewind->count < RG_REWIND_MAX_ENTRIES && (oldest->offset >= offset + max_length || oldest->offset + oldest->length <= offset))
+            break;
+        drop_oldest(rewind);
+    }
+
+    bool keyframe = rewind->count == 0 || rewind->since_keyframe >= RG_REWIND_KEYFRAME_INTERVAL || size != rewind->keyframe_size;
+    size_t length = rg_rle_encode(rewind->ring + offset, max_length, rewind->state, keyframe ? NULL : rewind->keyframe, size);
+
+    if (keyframe)
+    {
+        memcpy(rewind->keyframe, rewind->state, size);
+        rewind->keyframe_size = size;
+        rewind->since_keyframe = 0;
+    }
+    else
+    {
+        rewind->since_keyframe++;
+    }
+
+    rewind->entries[(rewind->first + rewind->count) % RG_REWIND_MAX_ENTRIES] = (rg_rewind_entry_t){
+        .offset = offset,
+        .length = length,
+        .size = size,
+        .tick = tick,
+        .keyframe = keyframe,
+    };
+    rewind->count++;
+    return true;
+}
+
+bool rg_rewind_decode(rg_rewind_t *rewind, int index)
+{
+    RG_ASSERT_ARG(rewind);
+
+    if (index < 0 || index >= rewind->count)
+        return false;
+
+    // The keyframe, then the delta on top of it. The oldest entry is always a keyframe.
+    int key = index;
+    while (key > 0 && !rg_rewind_entry(rewind, key)->keyframe)
+        key--;
+
+    const rg_rewind_entry_t *entry = rg_rewind_entry(rewind, index);
+    const rg_rewind_entry_t *keyframe = rg_rewind_entry(rewind, key);
+    bool success = rg_rle_decode(rewind->state, keyframe->size, rewind->ring + keyframe->offset, keyframe->length, false);
+    if (success && entry != keyframe)
+        success = rg_rle_decode(rewind->state, entry->size, rewind->ring + entry->offset, entry->length, true);
+    return success;
+}
+
+bool rg_rewind_restore(rg_rewind_t *rewind, uint32_t tick, rg_rewind_load_t load)
+{
+    RG_ASSERT_ARG(rewind && load);
+
+    if (rewind->count == 0)
+        return false;
+
+    // Go to the newest snapshot taken at or before `tick`, or the oldest one we have
+    while (rewind->count > 1 && (int32_t)(tick - rg_rewind_entry(rewind, rewind->count - 1)->tick) < 0)
+        rewind->count--;
+
+    int index = rewind->count - 1;
+    size_t size = rg_rewind_entry(rewind, index)->size;
+    bool success = rg_rewind_decode(rewind, index);
+
+    // The snapshot is consumed, the next one starts a new chain
+    rewind->count--;
+    rewind->since_keyframe = RG_REWIND_KEYFRAME_INTERVAL;
+
+    return success && load(rewind->state, size);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The rewind ring: a keyframe every RG_REWIND_KEYFRAME_INTERVAL snapshots and the ones in between as
+// XOR deltas against it, everything RLE compressed. Deltas of consecutive snapshots are mostly zeroes,
+// so they compress very well. The snapshots themselves come from the caller, see rg_system.c.
+#define RG_REWIND_MAX_ENTRIES       512
+#define RG_REWIND_KEYFRAME_INTERVAL 30
+
+// Same as the saveStateMem/loadStateMem handlers of rg_app_t
+typedef bool (*rg_rewind_save_t)(void *data, size_t *size);
+typedef bool (*rg_rewind_load_t)(const void *data, size_t size);
+
+typedef struct
+{
+    uint32_t offset; // In the ring
+    uint32_t length; // Encoded size
+    uint32_t size;   // Decoded size
+    uint32_t tick;   // Caller's clock when captured
+    bool keyframe;
+} rg_rewind_entry_t;
+
+typedef struct
+{
+    uint8_t *ring;
+    size_t ring_size;
+    uint8_t *state;    // Latest snapshot, decoding buffer
+    uint8_t *keyframe; // Decoded keyframe the deltas are taken against
+    size_t state_capacity;
+    size_t keyframe_size;
+    rg_rewind_entry_t entries[RG_REWIND_MAX_ENTRIES];
+    int first, count;
+    int since_keyframe;
+} rg_rewind_t;
+
+// Returns NULL if any of the buffers can't be allocated. The ring goes to slow memory.
+rg_rewind_t *rg_rewind_alloc(size_t ring_size, size_t state_capacity);
+void rg_rewind_free(rg_rewind_t *rewind);
+// Takes a snapshot with `save` and stores it, dropping the oldest entries as needed. Returns false if the
+// snapshot doesn't fit state_capacity, the ring must then be reallocated with a larger one.
+bool rg_rewind_capture(rg_rewind_t *rewind, rg_rewind_save_t save, uint32_t tick);
+// Decodes entry `index` (0 is the oldest) into rewind->state, the ring is left untouched
+bool rg_rewind_decode(rg_rewind_t *rewind, int index);
+// Passes the newest snapshot captured at or before `tick` (or the oldest one) to `load`. The entries after
+// it are discarded and the snapshot itself is consumed, the next capture starts a new keyframe.
+bool rg_rewind_restore(rg_rewind_t *rewind, uint32_t tick, rg_rewind_load_t load);
+
+static inline const rg_rewind_entry_t *rg_rewind_entry(const rg_rewind_t *rewind, int index)
+{
+    return &rewind->entries[(rewind->first + index) % RG_REWIND_MAX_ENTRIES];
+}
@@ -34,6 +34,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #endif
+#include <utime.h>
 
 static bool disk_mounted = false;
 #if defined(RG_STORAGE_SDSPI_HOST) || defined(RG_STORAGE_SDMMC_HOST)
@@ -43,6 +44,8 @@ static sdmmc_card_t *card_handle = NULL;
 static wl_handle_t wl_handle = WL_INVALID_HANDLE;
 #endif
 
+static const char *SETTING_UNZIP_CACHE = "UnzipCache";
+
 #define CHECK_PATH(path)          \
     if (!(path && path[0]))       \
     {                             \
@@ -532,10 +535,63 @@ bool rg_storage_write_file(const char *path, const void *data_ptr, size_t data_l
     return true;
 }
 
+bool rg_storage_replace_file(const char *path, rg_storage_writer_t *writer, void *arg)
+{
+    RG_ASSERT_ARG(writer);
+    CHECK_PATH(path);
+
+    char newname[RG_PATH_MAX + 8], bakname[RG_PATH_MAX + 8];
+    snprintf(newname, sizeof(newname), "%s.new", path);
+    snprintf(bakname, sizeof(bakname), "%s.bak", path);
+
+    if (!writer(newname, arg))
+    {
+        remove(newname);
+        return false;
+    }
+
+    // FAT can't rename over an existing file, so there's a moment where only the .bak exists
+    rename(path, bakname);
+    if (rename(newname, path) != 0)
+    {
+        RG_LOGE("Rename failed (%d): '%s'", errno, newname);
+        rename(bakname, path);
+        remove(newname);
+        return false;
+    }
+
+    remove(bakname);
+    return true;
+}
+
+bool rg_storage_recover_file(const char *path)
+{
+    CHECK_PATH(path);
+
+    char bakname[RG_PATH_MAX + 8];
+    snprintf(bakname, sizeof(bakname), "%s.bak", path);
+
+    if (rg_storage_exists(path) || !rg_storage_exists(bakname))
+        return false;
+
+    RG_LOGW("Restoring '%s' left behind by an interrupted write", bakname);
+    return rename(bakname, path) == 0;
+}
+
+void rg_storage_set_unzip_cache(int size_mb)
+{
+    rg_settings_set_number(NS_GLOBAL, SETTING_UNZIP_CACHE, RG_MAX(size_mb, 0));
+}
+
+int rg_storage_get_unzip_cache(void)
+{
+    return rg_settings_get_number(NS_GLOBAL, SETTING_UNZIP_CACHE, 0);
+}
+
 /**
  * This is a minimal UNZIP implementation that utilizes only the miniz primitives found in ESP32's ROM.
- * I think that we should use miniz' ZIP API instead and bundle miniz with retro-go. But first I need
- * to do some testing to determine if the increased executable size is acceptable...
+ * The entry is located through the central directory, then inflated from large sector-aligned reads,
+ * either straight into the caller's buffer or through a 32KB window when it is consumed in pieces.
  */
 #if RG_ZIP_SUPPORT
 
@@ -545,7 +601,12 @@ bool rg_storage_write_file(const char *path, const void *data_ptr, size_t data_l
 #include <miniz.h>
 #endif
 
-#define ZIP_MAGIC 0x04034b50
+#define ZIP_LOCAL_MAGIC   0x04034b50
+#define ZIP_CENTRAL_MAGIC 0x02014b50
+#define ZIP_END_MAGIC     0x06054b50
+#define ZIP_READ_SIZE     0x10000
+#define ZIP_SECTOR_SIZE   0x200
+
 typedef struct __attribute__((packed))
 {
     uint32_t magic;
@@ -559,123 +620,783 @@ typedef struct __attribute__((packed))
     uint32_t uncompressed_size;
     uint16_t filename_size;
     uint16_t extra_field_size;
-    uint8_t filename[226];
+    // uint8_t filename[];
     // uint8_t extra_field[];
     // uint8_t compressed_data[];
 } zip_header_t;
 
-bool rg_storage_unzip_file(const char *zip_path, const char *filter, void **data_out, size_t *data_len, uint32_t flags)
+typedef struct __attribute__((packed))
 {
-    RG_ASSERT_ARG(data_out && data_len);
-    CHECK_PATH(zip_path);
+    uint32_t magic;
+    uint16_t version_made_by;
+    uint16_t version;
+    uint16_t flags;
+    uint16_t compression;
+    uint16_t modified_time;
+    uint16_t modified_date;
+    uint32_t checksum;
+    uint32_t compressed_size;
+    uint32_t uncompressed_size;
+    uint16_t filename_size;
+    uint16_t extra_field_size;
+    uint16_t comment_size;
+    uint16_t disk_number;
+    uint16_t internal_attributes;
+    uint32_t external_attributes;
+    uint32_t header_offset;
+    // uint8_t filename[];
+    // uint8_t extra_field[];
+    // uint8_t comment[];
+} zip_central_header_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t disk_number;
+    uint16_t central_disk;
+    uint16_t disk_entries;
+    uint16_t total_entries;
+    uint32_t central_size;
+    uint32_t central_offset;
+    uint16_t comment_size;
+} zip_end_header_t;
+
+struct rg_unzip_s
+{
+    FILE *fp;
+    char filename[256];
+    uint16_t compression;
+    uint32_t checksum;
+    uint32_t crc;
+    size_t stream_remaining;
+    size_t output_size;
+    size_t output_pos;
+    uint8_t *read_buffer;
+    size_t read_pos;
+    size_t read_len;
+    uint8_t *window;
+    size_t window_pos;
+    size_t window_len;
+    tinfl_status status;
+    tinfl_decompressor decomp;
+};
 
-    zip_header_t header = {0};
-    int header_pos = 0;
+static bool zip_read_at(FILE *fp, size_t offset, void *buffer, size_t length)
+{
+    return fseek(fp, offset, SEEK_SET) == 0 && fread(buffer, length, 1, fp) == 1;
+}
 
-    FILE *fp = fopen(zip_path, "rb");
-    if (!fp)
+static bool zip_find_central_directory(FILE *fp, zip_end_header_t *end)
+{
+    fseek(fp, 0, SEEK_END);
+    size_t file_size = ftell(fp);
+
+    // The end record is followed by a comment of up to 64KB. Most archives have none,
+    // so we first look at a small tail and only read the whole range if that fails.
+    const size_t tail_sizes[2] = {0x400, 0x10000 + sizeof(zip_end_header_t)};
+    bool found = false;
+
+    for (int i = 0; i < 2 && !found; ++i)
     {
-        RG_LOGE("Fopen failed (%d): '%s'", errno, zip_path);
+        size_t tail_size = RG_MIN(tail_sizes[i], file_size);
+        if (tail_size < sizeof(zip_end_header_t))
+            break;
+
+        uint8_t *buffer = malloc(tail_size);
+        if (buffer && zip_read_at(fp, file_size - tail_size, buffer, tail_size))
+        {
+            for (size_t pos = tail_size - sizeof(zip_end_header_t) + 1; pos-- > 0;)
+            {
+                memcpy(end, buffer + pos, sizeof(zip_end_header_t));
+                if (end->magic == ZIP_END_MAGIC)
+                {
+                    found = true;
+                    break;
+                }
+            }
+        }
+        free(buffer);
+
+        if (tail_size == file_size)
+            break;
+    }
+
+    return found && (size_t)end->central_offset + end->central_size <= file_size;
+}
+
+static int zip_match_entry(const char *filename, const char *filter)
+{
+    size_t len = strlen(filename);
+    if (len == 0 || filename[len - 1] == '/' || strncmp(filename, "__MACOSX/", 9) == 0)
+        return -1; // Directories and resource forks are never what we want
+    if (!filter)
+        return 1;
+    if (strcasecmp(filename, filter) == 0 || strcasecmp(rg_basename(filename), filter) == 0)
+        return 3;
+    if (rg_extension_match(filename, filter))
+        return 2;
+    return 0;
+}
+
+static bool zip_open_entry(rg_unzip_t *zip, const char *zip_path, const char *filter)
+{
+    zip_end_header_t end;
+    zip_central_header_t central, selected = {0};
+    zip_header_t header;
+    int selected_score = -1;
+    uint8_t *directory = NULL;
+
+    if (!zip_find_central_directory(zip->fp, &end))
+    {
+        RG_LOGE("No valid central directory found: '%s'", zip_path);
         return false;
     }
 
-    // Very inefficient, we should read a block at a time and search it for a header. But I'm lazy.
-    // Thankfully the header is usually found on the very first read :)
-    for (header_pos = 0; !feof(fp) && header_pos < 0x10000; ++header_pos)
+    if (!(directory = malloc(end.central_size + 1)) || !zip_read_at(zip->fp, end.central_offset, directory, end.central_size))
     {
-        fseek(fp, header_pos, SEEK_SET);
-        fread(&header, sizeof(header), 1, fp);
-        if (header.magic == ZIP_MAGIC)
+        RG_LOGE("Failed to read central directory (%d): '%s'", errno, zip_path);
+        free(directory);
+        return false;
+    }
+
+    // Index every entry and keep the best match: exact name, then extension, then any file
+    for (size_t pos = 0, i = 0; i < end.total_entries && pos + sizeof(central) <= end.central_size; ++i)
+    {
+        memcpy(&central, directory + pos, sizeof(central));
+        if (central.magic != ZIP_CENTRAL_MAGIC)
+            break;
+
+        char filename[sizeof(zip->filename)];
+        size_t filename_size = RG_MIN(central.filename_size, end.central_size - pos - sizeof(central));
+        memcpy(filename, directory + pos + sizeof(central), RG_MIN(filename_size, sizeof(filename) - 1));
+        filename[RG_MIN(filename_size, sizeof(filename) - 1)] = 0;
+        pos += sizeof(central) + central.filename_size + central.extra_field_size + central.comment_size;
+
+        int score = zip_match_entry(filename, filter);
+        if (score > selected_score)
+        {
+            memcpy(zip->filename, filename, sizeof(filename));
+            selected = central;
+            selected_score = score;
+        }
+        if (score == 3)
             break;
     }
+    free(directory);
 
-    if (header.magic != ZIP_MAGIC)
+    if (selected_score < 0)
     {
-        RG_LOGE("No valid header found: '%s'", zip_path);
-        fclose(fp);
+        RG_LOGE("No file found in archive: '%s'", zip_path);
         return false;
     }
+    if (selected_score == 0)
+        RG_LOGW("No file matching '%s' in archive, using '%s'", filter, zip->filename);
 
-    // Zero terminate or truncate filename just in case
-    header.filename[RG_MIN(header.filename_size, 225)] = 0;
+    if (selected.flags & 1)
+    {
+        RG_LOGE("Encrypted entries aren't supported: '%s'", zip->filename);
+        return false;
+    }
+    if (selected.compression != 0 && selected.compression != 8)
+    {
+        RG_LOGE("Unsupported compression method %d: '%s'", selected.compression, zip->filename);
+        return false;
+    }
+    if (selected.compressed_size == 0xFFFFFFFF || selected.uncompressed_size == 0xFFFFFFFF)
+    {
+        RG_LOGE("ZIP64 entries aren't supported: '%s'", zip->filename);
+        return false;
+    }
 
-    RG_LOGI("Found file at %d, name: '%s', size: %d", header_pos, header.filename, (int)header.uncompressed_size);
+    // The local extra field may differ from the central one, only the local header knows where the data starts.
+    // The sizes come from the central directory because they are zero in the local header of streamed archives.
+    if (!zip_read_at(zip->fp, selected.header_offset, &header, sizeof(header)) || header.magic != ZIP_LOCAL_MAGIC)
+    {
+        RG_LOGE("No valid local header found: '%s'", zip_path);
+        return false;
+    }
 
-    size_t stream_offset = header_pos + 30 + header.filename_size + header.extra_field_size;
-    size_t stream_remaining = header.compressed_size;
-    size_t output_buffer_align = RG_MAX(0x1000, (flags & 0xF) * 0x2000);
-    size_t output_buffer_size;
-    size_t output_buffer_pos = 0;
-    uint8_t *output_buffer = NULL;
+    size_t stream_offset = selected.header_offset + sizeof(header) + header.filename_size + header.extra_field_size;
+    if (fseek(zip->fp, stream_offset, SEEK_SET) != 0)
+    {
+        RG_LOGE("Seek error (%d): '%s'", errno, zip_path);
+        return false;
+    }
 
-    if (flags & RG_FILE_USER_BUFFER)
+    RG_LOGI("Found file at %d, name: '%s', size: %d", (int)stream_offset, zip->filename, (int)selected.uncompressed_size);
+
+    zip->compression = selected.compression;
+    zip->checksum = selected.checksum;
+    zip->stream_remaining = selected.compressed_size;
+    zip->output_size = selected.uncompressed_size;
+    zip->output_pos = 0;
+    return true;
+}
+
+static bool zip_fill_read_buffer(rg_unzip_t *zip)
+{
+    // The first read ends on a sector boundary so that the following ones are whole aligned chunks,
+    // which the FAT driver can transfer straight from the card without going through its own buffer.
+    size_t input_size = ZIP_READ_SIZE - (ftell(zip->fp) & (ZIP_SECTOR_SIZE - 1));
+    input_size = RG_MIN(input_size, zip->stream_remaining);
+
+    if (fread(zip->read_buffer, input_size, 1, zip->fp) != 1)
     {
-        output_buffer_size = RG_MIN(*data_len, header.uncompressed_size);
-        output_buffer = *data_out;
+        RG_LOGE("Read error (%d): '%s'", errno, zip->filename);
+        return false;
     }
-    else
+
+    zip->stream_remaining -= input_size;
+    zip->read_pos = 0;
+    zip->read_len = input_size;
+    return true;
+}
+
+static bool zip_inflate(rg_unzip_t *zip, uint8_t *output_start, uint8_t *output_next, size_t *output_size, int flags)
+{
+    if (zip->status == TINFL_STATUS_DONE)
+    {
+        RG_LOGE("Unexpected end of stream: '%s'", zip->filename);
+        return false;
+    }
+
+    if (zip->read_pos == zip->read_len && zip->stream_remaining > 0 && !zip_fill_read_buffer(zip))
+        return false;
+
+    size_t input_size = zip->read_len - zip->read_pos;
+    zip->status = tinfl_decompress(&zip->decomp, zip->read_buffer + zip->read_pos, &input_size, output_start,
+                                   output_next, output_size, flags | (zip->stream_remaining ? TINFL_FLAG_HAS_MORE_INPUT : 0));
+    zip->read_pos += input_size;
+
+    if (zip->status < TINFL_STATUS_DONE)
     {
-        output_buffer_size = header.uncompressed_size;
-        output_buffer = malloc((output_buffer_size + (output_buffer_align - 1)) & ~(output_buffer_align - 1));
+        RG_LOGE("Decompression failed (%d): '%s'", (int)zip->status, zip->filename);
+        return false;
     }
+    return true;
+}
 
-    size_t read_buffer_size = 0x8000;
-    uint8_t *read_buffer = malloc(read_buffer_size);
-    tinfl_decompressor *decomp = malloc(sizeof(tinfl_decompressor));
+rg_unzip_t *rg_storage_unzip_open(const char *zip_path, const char *filter)
+{
+    if (!(zip_path && zip_path[0]))
+    {
+        RG_LOGE("No path given");
+        return NULL;
+    }
 
-    if (!read_buffer || !output_buffer || !decomp)
+    rg_unzip_t *zip = calloc(1, sizeof(rg_unzip_t));
+    if (!zip)
     {
         RG_LOGE("Memory allocation failed: '%s'", zip_path);
-        goto _fail;
+        return NULL;
     }
 
-    tinfl_status status;
-    tinfl_init(decomp);
+    if (!(zip->fp = fopen(zip_path, "rb")))
+    {
+        RG_LOGE("Fopen failed (%d): '%s'", errno, zip_path);
+        free(zip);
+        return NULL;
+    }
+
+    if (!zip_open_entry(zip, zip_path, filter))
+    {
+        rg_storage_unzip_close(zip);
+        return NULL;
+    }
 
-    do
+    if (zip->compression == 8)
     {
-        size_t input_size = RG_MIN(read_buffer_size, stream_remaining);
-        size_t output_size = output_buffer_size - output_buffer_pos;
-        if (fseek(fp, stream_offset, SEEK_SET) != 0 || fread(read_buffer, input_size, 1, fp) != 1)
+        if (!(zip->read_buffer = malloc(RG_MIN(ZIP_READ_SIZE, RG_MAX(zip->stream_remaining, 1)))))
         {
-            RG_LOGE("Read error (%d): '%s'", errno, zip_path);
-            goto _fail;
+            RG_LOGE("Memory allocation failed: '%s'", zip_path);
+            rg_storage_unzip_close(zip);
+            return NULL;
+        }
+        zip->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+        tinfl_init(&zip->decomp);
+    }
+
+    return zip;
+}
+
+size_t rg_storage_unzip_read(rg_unzip_t *zip, void *buffer, size_t length)
+{
+    RG_ASSERT_ARG(zip && (buffer || !length));
+
+    uint8_t *output = buffer;
+    size_t output_pos = 0;
+
+    length = RG_MIN(length, zip->output_size - zip->output_pos);
+
+    if (zip->compression == 0)
+    {
+        if (length && fread(output, length, 1, zip->fp) != 1)
+        {
+            RG_LOGE("Read error (%d): '%s'", errno, zip->filename);
+            return 0;
+        }
+        output_pos = length;
+    }
+    else if (zip->output_pos == 0 && length == zip->output_size)
+    {
+        // The whole entry fits in the caller's buffer, it can serve as the dictionary itself
+        while (output_pos < length)
+        {
+            size_t output_size = length - output_pos;
+            if (!zip_inflate(zip, output, output + output_pos, &output_size, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF))
+                break;
+            output_pos += output_size;
+        }
+    }
+    else
+    {
+        if (!zip->window && !(zip->window = malloc(TINFL_LZ_DICT_SIZE)))
+        {
+            RG_LOGE("Memory allocation failed: '%s'", zip->filename);
+            return 0;
+        }
+
+        while (output_pos < length)
+        {
+            if (zip->window_len > 0)
+            {
+                size_t chunk = RG_MIN(zip->window_len, length - output_pos);
+                memcpy(output + output_pos, zip->window + zip->window_pos, chunk);
+                zip->window_pos = (zip->window_pos + chunk) & (TINFL_LZ_DICT_SIZE - 1);
+                zip->window_len -= chunk;
+                output_pos += chunk;
+                continue;
+            }
+            size_t output_size = TINFL_LZ_DICT_SIZE - zip->window_pos;
+            if (!zip_inflate(zip, zip->window, zip->window + zip->window_pos, &output_size, 0))
+                break;
+            zip->window_len = output_size;
+        }
+    }
+
+    zip->crc = rg_crc32(zip->crc, output, output_pos);
+    zip->output_pos += output_pos;
+
+    if (zip->output_pos == zip->output_size && zip->crc != zip->checksum)
+    {
+        RG_LOGE("Checksum mismatch (0x%08X != 0x%08X): '%s'", (unsigned)zip->crc, (unsigned)zip->checksum, zip->filename);
+        return 0;
+    }
+
+    return output_pos;
+}
+
+size_t rg_storage_unzip_size(rg_unzip_t *zip)
+{
+    RG_ASSERT_ARG(zip);
+    return zip->output_size;
+}
+
+void rg_storage_unzip_close(rg_unzip_t *zip)
+{
+    if (!zip)
+        return;
+    if (zip->fp)
+        fclose(zip->fp);
+    free(zip->read_buffer);
+    free(zip->window);
+    free(zip);
+}
+
+#define ZIP_CACHE_PATH RG_BASE_PATH_CACHE "/unzip"
+
+typedef struct
+{
+    char path[RG_PATH_MAX + 1];
+    size_t size;
+    time_t mtime;
+} zip_cache_file_t;
+
+typedef struct
+{
+    zip_cache_file_t *files;
+    size_t count;
+    int64_t total_size;
+} zip_cache_scan_t;
+
+static int zip_cache_scan_cb(const rg_scandir_t *file, void *arg)
+{
+    zip_cache_scan_t *scan = arg;
+    zip_cache_file_t *files = realloc(scan->files, (scan->count + 1) * sizeof(zip_cache_file_t));
+    if (!files)
+        return RG_SCANDIR_STOP;
+    scan->files = files;
+    snprintf(files[scan->count].path, RG_PATH_MAX + 1, "%s", file->path);
+    files[scan->count].size = file->size;
+    files[scan->count].mtime = file->mtime;
+    scan->total_size += file->size;
+    scan->count++;
+    return RG_SCANDIR_CONTINUE;
+}
+
+// Returns the path the entry is (or would be) cached at, or false if the cache is disabled or too small
+static bool zip_cache_path(rg_unzip_t *zip, const char *zip_path, char *path_out)
+{
+    int64_t limit = (int64_t)rg_storage_get_unzip_cache() * 1024 * 1024;
+    if (zip->output_size == 0 || zip->output_size > limit)
+        return false;
+
+    // The archive's path, size and mtime identify it, the entry's checksum tells which file we extracted
+    rg_stat_t info = rg_storage_stat(zip_path);
+    uint32_t key[3] = {rg_hash(zip_path, strlen(zip_path)), (uint32_t)info.size, (uint32_t)info.mtime};
+    snprintf(path_out, RG_PATH_MAX + 1, "%s/%08X%08X.bin", ZIP_CACHE_PATH,
+             (unsigned)rg_crc32(0, (const uint8_t *)key, sizeof(key)), (unsigned)zip->checksum);
+    return true;
+}
+
+static bool zip_cache_hit(rg_unzip_t *zip, const char *cache_path)
+{
+    rg_stat_t info = rg_storage_stat(cache_path);
+    if (!info.is_file || info.size != zip->output_size)
+        return false;
+    // The mtime is what the eviction goes by, so a hit makes the file the most recently used
+    utime(cache_path, NULL);
+    RG_LOGI("Using cached '%s' for '%s'", cache_path, zip->filename);
+    return true;
+}
+
+static bool zip_cache_reserve(size_t size)
+{
+    int64_t limit = (int64_t)rg_storage_get_unzip_cache() * 1024 * 1024;
+    zip_cache_scan_t scan = {0};
+
+    rg_storage_mkdir(ZIP_CACHE_PATH);
+    rg_storage_scandir(ZIP_CACHE_PATH, zip_cache_scan_cb, &scan, RG_SCANDIR_FILES | RG_SCANDIR_STAT);
+
+    // Evict the least recently used files until the new one fits
+    while (scan.total_size + size > limit && scan.count > 0)
+    {
+        size_t oldest = 0;
+        for (size_t i = 1; i < scan.count; ++i)
+        {
+            if (scan.files[i].mtime < scan.files[oldest].mtime)
+                oldest = i;
         }
-        stream_offset += input_size;
-        stream_remaining -= input_size;
-        status = tinfl_decompress(
-            decomp, read_buffer, &input_size, output_buffer, output_buffer + output_buffer_pos, &output_size,
-            TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF | (stream_remaining ? TINFL_FLAG_HAS_MORE_INPUT : 0));
-        output_buffer_pos += output_size;
-    } while (status == TINFL_STATUS_NEEDS_MORE_INPUT);
-
-    // With user-provided buffer we might not reach TINFL_STATUS_DONE, but it doesn't mean we've failed
-    if (status < TINFL_STATUS_DONE || output_buffer_pos != output_buffer_size) // (status != TINFL_STATUS_DONE)
-    {
-        RG_LOGE("Decompression failed (%d): %s", (int)status, zip_path);
+        RG_LOGI("Evicting '%s' (%d bytes)", scan.files[oldest].path, (int)scan.files[oldest].size);
+        rg_storage_delete(scan.files[oldest].path);
+        scan.total_size -= scan.files[oldest].size;
+        scan.files[oldest] = scan.files[--scan.count];
+    }
+    free(scan.files);
+
+    return scan.total_size + size <= limit;
+}
+
+static bool zip_cache_store(const char *cache_path, const void *data, size_t data_len)
+{
+    char temp_path[RG_PATH_MAX + 1];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", cache_path) >= (int)sizeof(temp_path))
+    {
+        RG_LOGW("Path too long to cache '%s'", cache_path);
+        return false;
+    }
+
+    // A partially written file must never be mistaken for a cached entry, hence the rename
+    if (!zip_cache_reserve(data_len) || !rg_storage_write_file(temp_path, data, data_len, 0) || rename(temp_path, cache_path) != 0)
+    {
+        RG_LOGW("Failed to cache '%s'", cache_path);
+        rg_storage_delete(temp_path);
+        return false;
+    }
+    return true;
+}
+
+bool rg_storage_unzip_cache(const char *zip_path, const char *filter, char *path_out)
+{
+    RG_ASSERT_ARG(path_out);
+
+    rg_unzip_t *zip = rg_storage_unzip_open(zip_path, filter);
+    if (!zip)
+        return false;
+
+    if (!zip_cache_path(zip, zip_path, path_out))
+    {
+        rg_storage_unzip_close(zip);
+        return false;
+    }
+
+    if (zip_cache_hit(zip, path_out))
+    {
+        rg_storage_unzip_close(zip);
+        return true;
+    }
+
+    char temp_path[RG_PATH_MAX + 1];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path_out) >= (int)sizeof(temp_path))
+    {
+        // Not _fail, the truncated name could be somebody else's file
+        RG_LOGW("Path too long to cache '%s'", path_out);
+        rg_storage_unzip_close(zip);
+        return false;
+    }
+
+    size_t chunk_size = 0x10000, chunk_len;
+    uint8_t *chunk = malloc(chunk_size);
+    FILE *fp = NULL;
+
+    if (!chunk || !zip_cache_reserve(zip->output_size) || !(fp = fopen(temp_path, "wb")))
         goto _fail;
+
+    // Inflate straight to the card, the entry might not fit in memory
+    while ((chunk_len = rg_storage_unzip_read(zip, chunk, chunk_size)) > 0)
+    {
+        if (fwrite(chunk, chunk_len, 1, fp) != 1)
+            goto _fail;
     }
+    if (zip->output_pos != zip->output_size)
+        goto _fail;
 
-    free(read_buffer);
-    free(decomp);
     fclose(fp);
+    fp = NULL;
+    if (rename(temp_path, path_out) != 0)
+        goto _fail;
+
+    free(chunk);
+    rg_storage_unzip_close(zip);
+    return true;
+
+_fail:
+    RG_LOGW("Failed to cache '%s'", path_out);
+    if (fp)
+        fclose(fp);
+    rg_storage_delete(temp_path);
+    free(chunk);
+    rg_storage_unzip_close(zip);
+    return false;
+}
+
+bool rg_storage_unzip_file(const char *zip_path, const char *filter, void **data_out, size_t *data_len, uint32_t flags)
+{
+    RG_ASSERT_ARG(data_out && data_len);
+    CHECK_PATH(zip_path);
+
+    rg_unzip_t *zip = rg_storage_unzip_open(zip_path, filter);
+    if (!zip)
+        return false;
+
+    char cache_path[RG_PATH_MAX + 1];
+    bool cache_enabled = zip_cache_path(zip, zip_path, cache_path);
+    if (cache_enabled && zip_cache_hit(zip, cache_path))
+    {
+        rg_storage_unzip_close(zip);
+        return rg_storage_read_file(cache_path, data_out, data_len, flags);
+    }
+
+    size_t output_buffer_align = RG_MAX(0x1000, (flags & 0xF) * 0x2000);
+    size_t zip_size = zip->output_size;
+    size_t output_buffer_alloc_size;
+    size_t output_buffer_size;
+    uint8_t *output_buffer;
+
+    if (flags & RG_FILE_USER_BUFFER)
+    {
+        output_buffer_size = RG_MIN(*data_len, zip->output_size);
+        output_buffer_alloc_size = output_buffer_size;
+        output_buffer = *data_out;
+    }
+    else
+    {
+        output_buffer_size = zip->output_size;
+        output_buffer_alloc_size = (output_buffer_size + (output_buffer_align - 1)) & ~(output_buffer_align - 1);
+        output_buffer = malloc(output_buffer_alloc_size);
+    }
+
+    if (!output_buffer)
+    {
+        RG_LOGE("Memory allocation failed: '%s'", zip_path);
+        rg_storage_unzip_close(zip);
+        return false;
+    }
+
+    // With a user-provided buffer we might not reach the end of the stream, but it doesn't mean we've failed
+    if (rg_storage_unzip_read(zip, output_buffer, output_buffer_size) != output_buffer_size)
+    {
+        if (!(flags & RG_FILE_USER_BUFFER))
+            free(output_buffer);
+        rg_storage_unzip_close(zip);
+        return false;
+    }
+
+    rg_storage_unzip_close(zip);
+
+    if (cache_enabled && output_buffer_size == zip_size)
+        zip_cache_store(cache_path, output_buffer, output_buffer_size);
+
+    // Wipe the extra allocated space, if any
+    if (output_buffer_alloc_size > output_buffer_size)
+    {
+        memset(output_buffer + output_buffer_size, 0, output_buffer_alloc_size - output_buffer_size);
+    }
 
     *data_out = output_buffer;
     *data_len = output_buffer_size;
     return true;
+}
+
+#define DEFLATE_FILE_MAGIC 0x315A4752 // "RGZ1"
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t size;  // Inflated size
+    uint32_t crc32; // Of the inflated data
+} deflate_header_t;
+
+static mz_bool deflate_write_cb(const void *buffer, int length, void *arg)
+{
+    return fwrite(buffer, length, 1, (FILE *)arg) == 1;
+}
+
+bool rg_storage_deflate_file(const char *path, const void *data_ptr, size_t data_len)
+{
+    RG_ASSERT_ARG(data_ptr || !data_len);
+    CHECK_PATH(path);
+
+    // The compressor state is a few hundred KB, it only lives for the duration of the call
+    tdefl_compressor *comp = rg_alloc(sizeof(tdefl_compressor), MEM_SLOW | MEM_NOPANIC);
+    if (!comp)
+    {
+        RG_LOGE("Memory allocation failed: '%s'", path);
+        return false;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        RG_LOGE("Fopen failed (%d): '%s'", errno, path);
+        free(comp);
+        return false;
+    }
+
+    deflate_header_t header = {DEFLATE_FILE_MAGIC, data_len, rg_crc32(0, data_ptr, data_len)};
+    bool success = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if (success)
+    {
+        // Save states are mostly runs and repeated tables, a fast greedy pass gets nearly all of the gain
+        tdefl_init(comp, &deflate_write_cb, fp, TDEFL_GREEDY_PARSING_FLAG | 16);
+        success = tdefl_compress_buffer(comp, data_ptr, data_len, TDEFL_FINISH) == TDEFL_STATUS_DONE;
+    }
+    success = (fclose(fp) == 0) && success;
+    free(comp);
+
+    if (!success)
+        RG_LOGE("Fwrite failed (%d): '%s'", errno, path);
+    return success;
+}
+
+bool rg_storage_is_deflated(const char *path)
+{
+    CHECK_PATH(path);
+    deflate_header_t header = {0};
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    bool found = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == DEFLATE_FILE_MAGIC;
+    fclose(fp);
+    return found;
+}
+
+bool rg_storage_inflate_file(const char *path, void **data_out, size_t *data_len)
+{
+    RG_ASSERT_ARG(data_out && data_len);
+    CHECK_PATH(path);
+
+    void *input = NULL, *output = NULL;
+    tinfl_decompressor *decomp = NULL;
+    size_t input_len = 0;
+
+    if (!rg_storage_read_file(path, &input, &input_len, 0))
+        return false;
+
+    const deflate_header_t *header = input;
+    if (input_len < sizeof(deflate_header_t) || header->magic != DEFLATE_FILE_MAGIC)
+    {
+        RG_LOGE("Not a deflated file: '%s'", path);
+        goto _fail;
+    }
+
+    decomp = malloc(sizeof(tinfl_decompressor));
+    output = malloc(RG_MAX(header->size, 1));
+    if (!decomp || !output)
+    {
+        RG_LOGE("Memory allocation failed: '%s'", path);
+        goto _fail;
+    }
+
+    size_t stream_len = input_len - sizeof(deflate_header_t);
+    size_t output_len = header->size;
+    tinfl_init(decomp);
+    tinfl_status status = tinfl_decompress(decomp, (const uint8_t *)(header + 1), &stream_len, output, output,
+                                           &output_len, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    if (status != TINFL_STATUS_DONE || output_len != header->size || rg_crc32(0, output, output_len) != header->crc32)
+    {
+        RG_LOGE("Inflate failed (%d): '%s'", (int)status, path);
+        goto _fail;
+    }
+
+    *data_out = output;
+    *data_len = output_len;
+    free(decomp);
+    free(input);
+    return true;
 
 _fail:
-    if (!(flags & RG_FILE_USER_BUFFER))
-        free(output_buffer);
-    free(read_buffer);
+    free(output);
     free(decomp);
-    fclose(fp);
+    free(input);
     return false;
 }
 #else
+rg_unzip_t *rg_storage_unzip_open(const char *zip_path, const char *filter)
+{
+    RG_LOGE("ZIP support hasn't been enabled!");
+    return NULL;
+}
+
+bool rg_storage_unzip_cache(const char *zip_path, const char *filter, char *path_out)
+{
+    return false;
+}
+
+size_t rg_storage_unzip_read(rg_unzip_t *zip, void *buffer, size_t length)
+{
+    return 0;
+}
+
+size_t rg_storage_unzip_size(rg_unzip_t *zip)
+{
+    return 0;
+}
+
+void rg_storage_unzip_close(rg_unzip_t *zip)
+{
+}
+
 bool rg_storage_unzip_file(const char *zip_path, const char *filter, void **data_out, size_t *data_len, uint32_t flags)
 {
     RG_LOGE("ZIP support hasn't been enabled!");
     return false;
 }
+
+bool rg_storage_deflate_file(const char *path, const void *data_ptr, size_t data_len)
+{
+    RG_LOGE("ZIP support hasn't been enabled!");
+    return false;
+}
+
+bool rg_storage_is_deflated(const char *path)
+{
+    return false;
+}
+
+bool rg_storage_inflate_file(const char *path, void **data_out, size_t *data_len)
+{
+    RG_LOGE("ZIP support hasn't been enabled!");
+    return false;
+}
 #endif
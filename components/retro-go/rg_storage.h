@@ -77,4 +77,30 @@ enum
 };
 bool rg_storage_read_file(const char *path, void **data_out, size_t *data_len, uint32_t flags);
 bool rg_storage_write_file(const char *path, const void *data_ptr, size_t data_len, uint32_t flags);
+
+// Replaces `path` with what `writer` wrote to `path.new`. The previous file is only moved aside (to
+// `path.bak`) once the new one is complete, rg_storage_recover_file() puts it back if we got interrupted.
+typedef bool (rg_storage_writer_t)(const char *path, void *arg);
+bool rg_storage_replace_file(const char *path, rg_storage_writer_t *writer, void *arg);
+bool rg_storage_recover_file(const char *path);
 bool rg_storage_unzip_file(const char *zip_path, const char *filter, void **data_out, size_t *data_len, uint32_t flags);
+
+// Streaming access to a single archive entry. The filter is either a file name or a list of extensions
+// ("gba agb"), when nothing matches (or filter is NULL) the first file of the archive is used.
+typedef struct rg_unzip_s rg_unzip_t;
+rg_unzip_t *rg_storage_unzip_open(const char *zip_path, const char *filter);
+size_t rg_storage_unzip_read(rg_unzip_t *zip, void *buffer, size_t length);
+size_t rg_storage_unzip_size(rg_unzip_t *zip);
+void rg_storage_unzip_close(rg_unzip_t *zip);
+
+// Inflated entries can be kept in RG_BASE_PATH_CACHE, up to size_mb in total (0 disables the cache).
+// rg_storage_unzip_file() uses it transparently, rg_storage_unzip_cache() fills it and returns the
+// cached file's path (RG_PATH_MAX + 1) so that it can be read like a regular ROM.
+void rg_storage_set_unzip_cache(int size_mb);
+int rg_storage_get_unzip_cache(void);
+bool rg_storage_unzip_cache(const char *zip_path, const char *filter, char *path_out);
+
+// Deflated files hold a small header (size, crc32) and a raw deflate stream, see rg_emu_save_state()
+bool rg_storage_deflate_file(const char *path, const void *data_ptr, size_t data_len);
+bool rg_storage_inflate_file(const char *path, void **data_out, size_t *data_len);
+bool rg_storage_is_deflated(const char *path);
@@ -36,6 +36,7 @@ static bool create_window(const rg_surface_t *parent, const rg_rect_t *rect, rg_
     out->data += (rect->top * out->stride) + (rect->left * RG_PIXEL_GET_SIZE(out->format));
     out->width = RG_MIN(rect->width, out->width - rect->left);
     out->height = RG_MIN(rect->height, out->height - rect->top);
+    out->dirty_rows = NULL;
     out->free_data = false;
     out->free_palette = false;
     return true;
@@ -74,9 +75,38 @@ void rg_surface_free(rg_surface_t *surface)
         free(surface->data);
     if (surface->free_palette)
         free(surface->palette);
+    free(surface->dirty_rows);
     free(surface);
 }
 
+bool rg_surface_track_dirty_rows(rg_surface_t *surface)
+{
+    CHECK_SURFACE(surface, false);
+    // The bitmap must cover every row the surface may ever show, so size it for the current height
+    size_t words = (surface->height + (surface->offset / surface->stride) + 31) / 32;
+    free(surface->dirty_rows);
+    if (!(surface->dirty_rows = malloc(words * 4)))
+    {
+        RG_LOGE("Dirty rows allocation failed!");
+        return false;
+    }
+    memset(surface->dirty_rows, 0xFF, words * 4);
+    return true;
+}
+
+void rg_surface_set_dirty_rows(rg_surface_t *surface, int first, int count, bool dirty)
+{
+    if (!surface || !surface->dirty_rows)
+        return;
+    for (int row = first; row < first + count; ++row)
+    {
+        if (dirty)
+            surface->dirty_rows[row >> 5] |= (1u << (row & 31));
+        else
+            surface->dirty_rows[row >> 5] &= ~(1u << (row & 31));
+    }
+}
+
 bool rg_surface_copy(const rg_surface_t *source, const rg_rect_t *source_rect, rg_surface_t *dest,
                      const rg_rect_t *dest_rect, bool scale)
 {
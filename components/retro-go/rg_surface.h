@@ -37,10 +37,16 @@ typedef struct
     int format;
     uint16_t *palette;
     void *data;
+    uint32_t *dirty_rows; // Optional, see rg_surface_track_dirty_rows()
     bool free_data;
     bool free_palette;
 } rg_surface_t;
 
+// Bit N of dirty_rows covers row N of data (before offset is applied). A set bit means the row changed
+// since the previous rg_display_submit(), a NULL bitmap means that any row might have changed.
+#define RG_SURFACE_ROW_IS_DIRTY(surface, row) \
+    (!(surface)->dirty_rows || (((surface)->dirty_rows[(row) >> 5] >> ((row) & 31)) & 1))
+
 // rg_image_t always contains a RG_PIXEL_565_LE surface
 typedef rg_surface_t rg_image_t;
 
@@ -51,6 +57,8 @@ rg_surface_t *rg_surface_create(int width, int height, int format, uint32_t allo
 rg_surface_t *rg_surface_load_image(const uint8_t *data, size_t data_len, uint32_t flags);
 rg_surface_t *rg_surface_load_image_file(const char *filename, uint32_t flags);
 void rg_surface_free(rg_surface_t *surface);
+bool rg_surface_track_dirty_rows(rg_surface_t *surface);
+void rg_surface_set_dirty_rows(rg_surface_t *surface, int first, int count, bool dirty);
 bool rg_surface_copy(const rg_surface_t *source, const rg_rect_t *source_rect, rg_surface_t *dest,
                      const rg_rect_t *dest_rect, bool scale);
 bool rg_surface_fill(rg_surface_t *dest, const rg_rect_t *rect, rg_color_t color);
@@ -1,4 +1,5 @@
 #include "rg_system.h"
+#include "rg_rewind.h"
 
 #include <sys/time.h>
 #include <stdarg.h>
@@ -54,6 +55,87 @@ struct rg_task_s
     char name[16];
 };
 
+#define PROFILE_FRAMES 256  // Per-frame phase history, power of two
+#define PROFILE_EVENTS 2048 // Scopes kept for the Chrome trace, power of two
+typedef struct
+{
+    int64_t start;
+    uint32_t duration;
+    uint8_t phase, core;
+} profile_event_t;
+
+// Written from several tasks without a lock, a scope landing while the frame is being closed may be
+// attributed to the next frame. That's fine for statistics.
+static struct
+{
+    uint32_t frames[PROFILE_FRAMES][RG_PROFILE_PHASES]; // Time spent in each phase, in us
+    uint32_t frame;                                     // Current frame, monotonic
+    profile_event_t events[PROFILE_EVENTS];
+    uint32_t event;                                     // Next event, monotonic
+} *phases;
+
+// Deadline-based frameskip: a frame is due every app.frameTime, we skip rendering the next one when
+// its predicted cost would make it end past its deadline (plus whatever audio we have buffered).
+static struct
+{
+    rg_frameskip_tuning_t tuning;
+    int64_t deadline;   // When the frame being decided on should end
+    int lastCost;       // Busy time of the last frame, from rg_system_tick
+    int renderCost;     // Moving average of the busy time of rendered frames
+    int skipCost;       // Moving average of the busy time of skipped frames
+    int skipped;        // Frames skipped in a row
+    int pressure;       // Frames left during which the hysteresis applies
+    bool active;        // The app uses the controller, the once a second auto frameskip is disabled
+} frameskip = {
+    .tuning = {.maxSkip = 2, .tolerance = 1500, .hysteresis = 2000},
+};
+
+static const char *phase_names[RG_PROFILE_PHASES] = {
+    [RG_PROFILE_EMULATE] = "emulate",
+    [RG_PROFILE_DISPLAY] = "display",
+    [RG_PROFILE_AUDIO] = "audio",
+    [RG_PROFILE_INPUT] = "input",
+};
+
+// Rewind snapshots go to the ring of rg_rewind.c, how often depends on how long they take
+#define REWIND_RING_SIZE         (4 * 1024 * 1024)
+#define REWIND_MAX_STATE_SIZE    (1024 * 1024)
+#define REWIND_MIN_INTERVAL      4
+#define REWIND_MAX_INTERVAL      60
+
+static rg_rewind_t *rewinder;
+static int rewind_countdown = 0;
+static size_t rewind_capacity = 0x8000;
+static bool rewind_enabled = false;
+static void rewind_free(void);
+static void rewind_tick(void);
+
+// Run-ahead keeps a single snapshot of the real frame while the core emulates ahead of it
+#define RUNAHEAD_MAX_FRAMES 2
+
+static struct
+{
+    uint8_t *buffer;
+    size_t capacity;
+    size_t size;
+    int saveTime;
+} runahead = {.capacity = 0x8000};
+static int runahead_frames = 0;
+
+// Save states are serialised into a staging buffer, then deflated and written by the rg_savestate task
+static struct
+{
+    uint8_t *buffer;
+    size_t capacity;
+    size_t size;
+    rg_surface_t *preview; // Copy of the last frame, for the launcher
+    uint8_t slot;
+    volatile bool busy;
+    volatile bool written; // The slot and boot config are updated by the main loop, see savestate_finish
+} savestate = {.capacity = 0x8000};
+static void savestate_flush(void);
+static void savestate_finish(void);
+
 #ifdef RG_ENABLE_PROFILING
 typedef struct
 {
@@ -90,6 +172,8 @@ static const char *SETTING_BOOT_SLOT = "BootSlot";
 static const char *SETTING_BOOT_FLAGS = "BootFlags";
 static const char *SETTING_TIMEZONE = "Timezone";
 static const char *SETTING_INDICATOR_MASK = "Indicators";
+static const char *SETTING_REWIND = "Rewind";
+static const char *SETTING_RUNAHEAD = "RunAhead";
 static const char *SETTING_LOG_LEVEL = "LogLevel";
 
 #define logbuf_putc(buf, c) (buf)->console[(buf)->cursor++] = c, (buf)->cursor %= RG_LOGBUF_SIZE;
@@ -263,8 +347,8 @@ static void system_monitor_task(void *arg)
             (int)roundf(statistics.fullFPS),
             (int)roundf((battery.volts * 1000) ?: battery.level));
 
-        // Auto frameskip
-        if (statistics.ticks > app.tickRate * 2)
+        // Auto frameskip, for apps that don't use rg_system_render_next_frame
+        if (statistics.ticks > app.tickRate * 2 && !frameskip.active)
         {
             float speed = ((float)statistics.totalFPS / app.tickRate) * 100.f / app.speed;
             // We don't fully go back to 0 frameskip because if we dip below 95% once, we're clearly
@@ -364,6 +448,9 @@ rg_app_t *rg_system_reinit(int sampleRate, const rg_handlers_t *handlers, void *
     app.sampleRate = sampleRate;
     if (handlers)
         app.handlers = *handlers;
+    rewind_free();
+    free(runahead.buffer);
+    runahead.buffer = NULL;
     rg_audio_set_sample_rate(app.sampleRate);
 
     return &app;
@@ -509,6 +596,11 @@ rg_app_t *rg_system_init(int sampleRate, const rg_handlers_t *handlers, void *_u
     // Do these last to not interfere with panic handling above
     if (handlers)
         app.handlers = *handlers;
+    rewind_enabled = rg_settings_get_boolean(NS_APP, SETTING_REWIND, false);
+    runahead_frames = RG_MIN(RG_MAX((int)rg_settings_get_number(NS_APP, SETTING_RUNAHEAD, 0), 0), RUNAHEAD_MAX_FRAMES);
+
+    if (!phases)
+        phases = rg_alloc(sizeof(*phases), MEM_SLOW);
 
 #ifdef RG_ENABLE_PROFILING
     RG_LOGI("Profiling has been enabled at compile time!\n");
@@ -579,7 +671,10 @@ rg_task_t *rg_task_create(const char *name, void (*taskFunc)(void *arg), void *a
     if (affinity < 0)
         affinity = tskNO_AFFINITY;
     if (xTaskCreatePinnedToCore(task_wrapper, name, stackSize, task, priority, &handle, affinity) == pdPASS)
+    {
+        task->handle = handle; // So that the caller can rg_task_notify() before the task even started
         return task;
+    }
 #endif
 
     RG_LOGE("Task creation failed: name='%s', fn='%p', stack=%d\n", name, taskFunc, (int)stackSize);
@@ -652,6 +747,20 @@ size_t rg_task_messages_waiting(rg_task_t *task)
     return uxQueueMessagesWaiting(task->queue);
 }
 
+bool rg_task_notify(rg_task_t *task)
+{
+    RG_ASSERT_ARG(task);
+    if (!task->handle)
+        return false;
+    return xTaskNotifyGive(task->handle) == pdPASS;
+}
+
+bool rg_task_wait(int timeoutMS)
+{
+    int timeout = timeoutMS >= 0 ? pdMS_TO_TICKS(timeoutMS) : portMAX_DELAY;
+    return ulTaskNotifyTake(pdTRUE, timeout) > 0;
+}
+
 void rg_task_delay(uint32_t ms)
 {
     vTaskDelay(pdMS_TO_TICKS(ms));
@@ -750,6 +859,126 @@ void rg_system_tick(int busyTime)
     statistics.lastTick = rg_system_timer();
     statistics.busyTime += busyTime;
     statistics.ticks++;
+    frameskip.lastCost = busyTime;
+
+    if (phases)
+    {
+        uint32_t next = phases->frame + 1;
+        memset(phases->frames[next % PROFILE_FRAMES], 0, sizeof(phases->frames[0]));
+        __atomic_store_n(&phases->frame, next, __ATOMIC_SEQ_CST);
+    }
+
+    savestate_finish();
+    rewind_tick();
+}
+
+bool rg_system_render_next_frame(bool rendered, bool displayBusy)
+{
+    const rg_frameskip_tuning_t *tuning = &frameskip.tuning;
+    const int64_t now = rg_system_timer();
+    const int frameTime = app.frameTime;
+
+    // First frame or the speed changed, start over. If we're very late we stay late by two frames
+    // at most, there is no point in skipping forever to catch up with time that's gone.
+    if (!frameskip.active || frameskip.deadline - now > frameTime * 2)
+        frameskip.deadline = now;
+    else if (now - frameskip.deadline > frameTime * 2)
+        frameskip.deadline = now - frameTime * 2;
+    frameskip.active = true;
+
+    int *average = rendered ? &frameskip.renderCost : &frameskip.skipCost;
+    *average = *average ? *average + (frameskip.lastCost - *average) / 4 : frameskip.lastCost;
+
+    frameskip.deadline += frameTime;
+
+    // Audio buffered beyond one frame lets the sink ride out a late frame, count it as headroom
+    rg_audio_counters_t audio = rg_audio_get_counters();
+    int sampleRate = rg_audio_get_sample_rate();
+    int cushion = 0;
+    if (audio.bufferSize > 0 && sampleRate > 0)
+        cushion = RG_MIN(RG_MAX((int)((int64_t)audio.bufferFill * 1000000 / sampleRate) - frameTime, 0), frameTime);
+
+    int64_t predictedEnd = now + RG_MAX(frameskip.renderCost, frameskip.skipCost);
+    int64_t allowedEnd = frameskip.deadline + tuning->tolerance + cushion;
+    if (frameskip.pressure > 0)
+        allowedEnd -= tuning->hysteresis;
+
+    // app.frameskip is a fixed frameskip (user setting, fast forward), the controller only skips more
+    bool render = frameskip.skipped >= app.frameskip &&
+                  ((predictedEnd <= allowedEnd && !displayBusy) || frameskip.skipped >= RG_MAX(tuning->maxSkip, app.frameskip));
+    if (render)
+    {
+        frameskip.skipped = 0;
+        frameskip.pressure = RG_MAX(frameskip.pressure - 1, 0);
+    }
+    else
+    {
+        frameskip.skipped++;
+        frameskip.pressure = 8;
+    }
+    return render;
+}
+
+void rg_system_set_frameskip_tuning(rg_frameskip_tuning_t tuning)
+{
+    frameskip.tuning = tuning;
+}
+
+IRAM_ATTR void rg_profile_end(rg_profile_phase_t phase, int64_t start)
+{
+    if (!phases || (unsigned)phase >= RG_PROFILE_PHASES)
+        return;
+    uint32_t duration = rg_system_timer() - start;
+    uint32_t frame = __atomic_load_n(&phases->frame, __ATOMIC_SEQ_CST) % PROFILE_FRAMES;
+    __atomic_fetch_add(&phases->frames[frame][phase], duration, __ATOMIC_SEQ_CST);
+    uint32_t index = __atomic_fetch_add(&phases->event, 1, __ATOMIC_SEQ_CST) % PROFILE_EVENTS;
+    phases->events[index] = (profile_event_t){start, duration, phase, RG_PERF_CURRENT_CORE()};
+}
+
+void rg_profile_scope_end(rg_profile_scope_t *scope)
+{
+    rg_profile_end(scope->phase, scope->start);
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+rg_profile_stats_t rg_profile_get_stats(rg_profile_phase_t phase)
+{
+    rg_profile_stats_t stats = {0};
+    if (!phases || (unsigned)phase >= RG_PROFILE_PHASES)
+        return stats;
+
+    // Only completed frames, the oldest slot is being zeroed by the next tick
+    uint32_t values[PROFILE_FRAMES];
+    uint32_t frame = __atomic_load_n(&phases->frame, __ATOMIC_SEQ_CST);
+    int count = RG_MIN(frame, PROFILE_FRAMES - 2);
+    if (count == 0)
+        return stats;
+
+    int64_t total = 0;
+    for (int i = 0; i < count; ++i)
+        total += values[i] = phases->frames[(frame - 1 - i) % PROFILE_FRAMES][phase];
+    qsort(values, count, sizeof(values[0]), compare_uint32);
+
+    stats.frames = count;
+    stats.min = values[0];
+    stats.max = values[count - 1];
+    stats.avg = total / count;
+    stats.p50 = values[count * 50 / 100];
+    stats.p90 = values[count * 90 / 100];
+    stats.p99 = values[count * 99 / 100];
+    return stats;
+}
+
+const char *rg_profile_get_name(rg_profile_phase_t phase)
+{
+    if ((unsigned)phase >= RG_PROFILE_PHASES)
+        return "unknown";
+    return phase_names[phase];
 }
 
 IRAM_ATTR int64_t rg_system_timer(void)
@@ -770,6 +999,7 @@ static void shutdown_cleanup(void)
     rg_display_clear(C_BLACK);                // Let the user know that something is happening
     rg_gui_draw_hourglass();                  // ...
     rg_system_event(RG_EVENT_SHUTDOWN, NULL); // Allow apps to save their state if they want
+    savestate_flush();                        // Let a pending save state reach the disk
     rg_audio_deinit();                        // Disable sound ASAP to avoid audio garbage
     // rg_system_save_time();                    // RTC might save to storage, do it before
     rg_storage_deinit();                      // Unmount storage
@@ -813,6 +1043,9 @@ void rg_system_switch_app(const char *partition, const char *name, const char *a
 {
     RG_LOGI("Switching to app %s (%s)", partition ?: "-", name ?: "-");
 
+    // The save's own boot config update must not land after ours
+    savestate_flush();
+
     if (update_boot_config(partition, name, args, save_slot, flags))
         rg_system_restart();
 
@@ -891,11 +1124,47 @@ void rg_system_log(int level, const char *context, const char *format, ...)
     va_end(va);
 }
 
+// Chrome's trace event format, timestamps are in us
+static void save_chrome_trace(FILE *fp)
+{
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"%s\"}}", app.name);
+    for (int core = 0; core < 2; ++core)
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"core %d\"}}", core, core);
+
+    uint32_t end = __atomic_load_n(&phases->event, __ATOMIC_SEQ_CST);
+    uint32_t start = end > PROFILE_EVENTS ? end - PROFILE_EVENTS : 0;
+    for (uint32_t i = start; i < end; ++i)
+    {
+        const profile_event_t *event = &phases->events[i % PROFILE_EVENTS];
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%lld,\"dur\":%u}",
+                rg_profile_get_name(event->phase), event->core, (long long)event->start, (unsigned)event->duration);
+    }
+    fputs("\n]}\n", fp);
+}
+
 bool rg_system_save_trace(const char *filename, bool panic_trace)
 {
     if (!filename)
         filename = RG_STORAGE_ROOT "/trace.txt";
 
+    size_t length = strlen(filename);
+    if (length > 5 && strcmp(filename + length - 5, ".json") == 0)
+    {
+        if (!phases)
+            return false;
+        RG_LOGI("Saving phase trace to '%s'...\n", filename);
+        FILE *fp = fopen(filename, "w");
+        if (!fp)
+        {
+            RG_LOGE("Open file '%s' failed, can't save trace!", filename);
+            return false;
+        }
+        save_chrome_trace(fp);
+        fclose(fp);
+        return true;
+    }
+
     RG_LOGI("Saving debug trace to '%s'...\n", filename);
     FILE *fp = fopen(filename, "w");
     if (!fp)
@@ -914,6 +1183,13 @@ bool rg_system_save_trace(const char *filename, bool panic_trace)
     fprintf(fp, "Free block: %d + %d\n", stats->freeBlockInt, stats->freeBlockExt);
     fprintf(fp, "Stack HWM: %d\n", stats->freeStackMain);
     fprintf(fp, "Uptime: %ds (%d ticks)\n", stats->uptime, stats->ticks);
+    for (int i = 0; phases && !panic_trace && i < RG_PROFILE_PHASES; ++i)
+    {
+        rg_profile_stats_t phase = rg_profile_get_stats(i);
+        if (phase.max > 0)
+            fprintf(fp, "Phase %s: avg=%dus min=%d p50=%d p90=%d p99=%d max=%d (%d frames)\n", rg_profile_get_name(i),
+                    phase.avg, phase.min, phase.p50, phase.p90, phase.p99, phase.max, phase.frames);
+    }
     if (panic_trace && panicTrace.configNs[0])
         fprintf(fp, "Panic configNs: %.16s\n", panicTrace.configNs);
     if (panic_trace && panicTrace.message[0])
@@ -1157,6 +1433,26 @@ char *rg_emu_get_path(rg_path_type_t pathType, const char *filename)
     return buffer;
 }
 
+// The state size isn't known in advance, the buffer grows until the snapshot fits
+static bool snapshot_state(uint8_t **buffer, size_t *capacity, size_t *size, uint32_t alloc_flags)
+{
+    while (true)
+    {
+        if (!*buffer)
+            *buffer = rg_alloc(*capacity, alloc_flags | MEM_NOPANIC);
+        if (!*buffer)
+            return false;
+        *size = *capacity;
+        if (app.handlers.saveStateMem(*buffer, size))
+            return true;
+        free(*buffer);
+        *buffer = NULL;
+        if (*capacity >= REWIND_MAX_STATE_SIZE)
+            return false;
+        *capacity *= 2;
+    }
+}
+
 static void emu_update_save_slot(uint8_t slot)
 {
     static uint8_t last_written = 0xFF;
@@ -1176,6 +1472,98 @@ static void emu_update_save_slot(uint8_t slot)
     rg_storage_commit();
 }
 
+static bool savestate_writer(const char *path, void *arg)
+{
+    return rg_storage_deflate_file(path, savestate.buffer, savestate.size);
+}
+
+static bool handler_writer(const char *path, void *arg)
+{
+    return (*app.handlers.saveState)(path);
+}
+
+// Only touches the disk, settings belong to the main loop
+static void savestate_task(void *arg)
+{
+    char *filename = rg_emu_get_path(RG_PATH_SAVE_STATE + savestate.slot, app.romPath);
+    int64_t startTime = rg_system_timer();
+
+    if (rg_storage_replace_file(filename, &savestate_writer, NULL))
+    {
+        if (savestate.preview)
+        {
+            char *filename = rg_emu_get_path(RG_PATH_SCREENSHOT + savestate.slot, app.romPath);
+            rg_surface_save_image_file(savestate.preview, filename, 0, 0);
+            free(filename);
+        }
+        savestate.written = true;
+        RG_LOGI("State written in %dms.\n", (int)((rg_system_timer() - startTime) / 1000));
+    }
+    else
+    {
+        RG_LOGE("Save failed!\n");
+    }
+
+    free(filename);
+
+    rg_surface_free(savestate.preview);
+    savestate.preview = NULL;
+
+    rg_system_set_indicator(RG_INDICATOR_ACTIVITY_SYSTEM, 0);
+
+    savestate.busy = false;
+}
+
+static bool save_state_async(uint8_t slot)
+{
+#if RG_ZIP_SUPPORT
+    // The staging buffer is reused, a previous save must be done with it
+    savestate_flush();
+
+    int64_t startTime = rg_system_timer();
+    if (!snapshot_state(&savestate.buffer, &savestate.capacity, &savestate.size, MEM_SLOW))
+    {
+        RG_LOGW("Snapshot failed, saving directly.\n");
+        return false;
+    }
+
+    // The core will draw over its surface as soon as we return
+    const rg_surface_t *frame = rg_display_get_info()->source.surface;
+    savestate.preview = frame ? rg_surface_convert(frame, rg_display_get_width() / 2, 0, RG_PIXEL_565_LE) : NULL;
+    savestate.slot = slot;
+    savestate.busy = true;
+
+    if (!rg_task_create("rg_savestate", &savestate_task, NULL, 8 * 1024, RG_TASK_PRIORITY_1, RG_PERF_CORE_0))
+    {
+        rg_surface_free(savestate.preview);
+        savestate.preview = NULL;
+        savestate.busy = false;
+        return false;
+    }
+
+    RG_LOGI("Snapshot taken in %dus (%d bytes).\n", (int)(rg_system_timer() - startTime), (int)savestate.size);
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void savestate_flush(void)
+{
+    while (savestate.busy)
+        rg_task_delay(10);
+    savestate_finish();
+}
+
+static void savestate_finish(void)
+{
+    if (savestate.written && !savestate.busy)
+    {
+        savestate.written = false;
+        emu_update_save_slot(savestate.slot);
+    }
+}
+
 bool rg_emu_load_state(uint8_t slot)
 {
     if (!app.romPath || !app.handlers.loadState)
@@ -1187,11 +1575,29 @@ bool rg_emu_load_state(uint8_t slot)
     char *filename = rg_emu_get_path(RG_PATH_SAVE_STATE + slot, app.romPath);
     bool success = false;
 
+    savestate_flush();
+
+    // A save interrupted between its two renames leaves the previous state behind as .bak
+    rg_storage_recover_file(filename);
+
     RG_LOGI("Loading state from '%s'.\n", filename);
 
     rg_gui_draw_hourglass();
 
-    if (!(success = (*app.handlers.loadState)(filename)))
+    // Deflated states are written by the rg_savestate task, legacy states still go through the core's loader
+    if (app.handlers.loadStateMem && rg_storage_is_deflated(filename))
+    {
+        void *data = NULL;
+        size_t data_len = 0;
+        success = rg_storage_inflate_file(filename, &data, &data_len) && app.handlers.loadStateMem(data, data_len);
+        free(data);
+    }
+    else
+    {
+        success = (*app.handlers.loadState)(filename);
+    }
+
+    if (!success)
     {
         RG_LOGE("Load failed!\n");
     }
@@ -1214,37 +1620,31 @@ bool rg_emu_save_state(uint8_t slot)
     }
 
     char *filename = rg_emu_get_path(RG_PATH_SAVE_STATE + slot, app.romPath);
-    char tempname[RG_PATH_MAX + 8];
     bool success = false;
 
     RG_LOGI("Saving state to '%s'.\n", filename);
 
     rg_system_set_indicator(RG_INDICATOR_ACTIVITY_SYSTEM, 1);
-    rg_gui_draw_hourglass();
 
     if (!rg_storage_mkdir(rg_dirname(filename)))
     {
         RG_LOGE("Unable to create dir, save might fail...\n");
     }
 
-    #define tempname(ext) strcat(strcpy(tempname, filename), ext)
-
-    if ((*app.handlers.saveState)(tempname(".new")))
+    // Only the snapshot stalls the emulation when the core can serialise to memory
+    if (app.handlers.saveStateMem && save_state_async(slot))
     {
-        rename(filename, tempname(".bak"));
-
-        if (rename(tempname(".new"), filename) == 0)
-        {
-            remove(tempname(".bak"));
-            success = true;
-        }
+        free(filename);
+        return true;
     }
 
+    rg_gui_draw_hourglass();
+
+    success = rg_storage_replace_file(filename, &handler_writer, NULL);
+
     if (!success)
     {
         RG_LOGE("Save failed!\n");
-        rename(filename, tempname(".bak"));
-        remove(tempname(".new"));
         rg_gui_alert(_("Save failed"), NULL);
     }
     else
@@ -1256,7 +1656,6 @@ bool rg_emu_save_state(uint8_t slot)
         emu_update_save_slot(slot);
     }
 
-    #undef tempname
     free(filename);
 
     rg_storage_commit();
@@ -1265,6 +1664,182 @@ bool rg_emu_save_state(uint8_t slot)
     return success;
 }
 
+static void rewind_free(void)
+{
+    rg_rewind_free(rewinder);
+    rewinder = NULL;
+}
+
+static bool rewind_alloc(void)
+{
+    size_t capacity = rewind_capacity, size = 0;
+    uint8_t *state = NULL;
+
+    // Find out how large a snapshot is. It can still grow a bit later (optional blocks), in which
+    // case we start over with twice the capacity.
+    for (; capacity <= REWIND_MAX_STATE_SIZE; capacity *= 2)
+    {
+        free(state);
+        if (!(state = malloc(capacity)))
+            break;
+        size = capacity;
+        if (app.handlers.saveStateMem(state, &size))
+            break;
+        size = 0;
+    }
+    free(state);
+
+    if (!size)
+    {
+        RG_LOGE("Snapshot failed, rewind disabled");
+        return false;
+    }
+
+    // The ring is sized by free memory only. The snapshot cost is accounted for by the capture interval
+    // (see rewind_capture), a slower core captures less often and the same ring covers more frames.
+    size_t ring_size = REWIND_RING_SIZE;
+#ifdef ESP_PLATFORM
+    update_memory_statistics();
+    if (statistics.freeBlockExt > 0)
+        ring_size = RG_MIN(ring_size, statistics.freeBlockExt / 2);
+    else
+        ring_size = RG_MIN(ring_size, statistics.freeBlockInt / 4);
+#endif
+
+    if (ring_size < capacity * 4)
+    {
+        RG_LOGE("Not enough memory for rewind (state: %d bytes)", (int)size);
+        return false;
+    }
+
+    if (!(rewinder = rg_rewind_alloc(ring_size, capacity)))
+    {
+        RG_LOGE("Memory allocation failed, rewind disabled");
+        return false;
+    }
+
+    rewind_capacity = capacity;
+    RG_LOGI("Rewind ready, ring: %dKB, state: %d bytes", (int)(ring_size / 1024), (int)size);
+    return true;
+}
+
+static void rewind_capture(void)
+{
+    int64_t start = rg_system_timer();
+
+    if (!rewinder && !rewind_alloc())
+    {
+        rewind_enabled = false;
+        return;
+    }
+
+    if (!rg_rewind_capture(rewinder, app.handlers.saveStateMem, statistics.ticks))
+    {
+        RG_LOGW("Snapshot failed, restarting rewind with a larger buffer");
+        rewind_capacity = rewinder->state_capacity * 2;
+        rewind_free();
+        return;
+    }
+
+    // Spend at most half of the idle time of a frame on snapshots, on average
+    int cost = rg_system_timer() - start;
+    int allowance = RG_MAX((int)(app.frameTime * (100.f - statistics.busyPercent) / 200.f), 1);
+    statistics.rewindCost = statistics.rewindCost ? (statistics.rewindCost * 7 + cost) / 8 : cost;
+    statistics.rewindInterval = RG_MIN(RG_MAX((statistics.rewindCost + allowance - 1) / allowance, REWIND_MIN_INTERVAL), REWIND_MAX_INTERVAL);
+    statistics.rewindDepth = statistics.ticks - rg_rewind_entry(rewinder, 0)->tick;
+    rewind_countdown = statistics.rewindInterval;
+}
+
+static void rewind_tick(void)
+{
+    if (rewind_enabled && app.handlers.saveStateMem && (!rewinder || --rewind_countdown <= 0))
+        rewind_capture();
+}
+
+void rg_emu_set_rewind(bool enable)
+{
+    rg_settings_set_boolean(NS_APP, SETTING_REWIND, enable);
+    rewind_enabled = enable;
+    if (!enable)
+    {
+        rewind_free();
+        statistics.rewindDepth = 0;
+    }
+}
+
+bool rg_emu_get_rewind(void)
+{
+    return rewind_enabled;
+}
+
+bool rg_emu_rewind(int frames)
+{
+    if (!rewinder || rewinder->count == 0 || !app.handlers.loadStateMem)
+        return false;
+
+    rewind_countdown = statistics.rewindInterval;
+
+    if (!rg_rewind_restore(rewinder, statistics.ticks - RG_MAX(frames, 0), app.handlers.loadStateMem))
+    {
+        RG_LOGE("Rewind failed!");
+        return false;
+    }
+
+    statistics.rewindDepth = rewinder->count ? statistics.ticks - rg_rewind_entry(rewinder, 0)->tick : 0;
+    return true;
+}
+
+void rg_emu_set_runahead(int frames)
+{
+    frames = RG_MIN(RG_MAX(frames, 0), RUNAHEAD_MAX_FRAMES);
+    rg_settings_set_number(NS_APP, SETTING_RUNAHEAD, frames);
+    runahead_frames = frames;
+    if (!frames)
+    {
+        free(runahead.buffer);
+        runahead.buffer = NULL;
+        statistics.runaheadCost = 0;
+    }
+}
+
+int rg_emu_get_runahead(void)
+{
+    return runahead_frames;
+}
+
+bool rg_emu_runahead_save(void)
+{
+    if (!runahead_frames || !app.handlers.saveStateMem || !app.handlers.loadStateMem)
+        return false;
+
+    int64_t startTime = rg_system_timer();
+    if (!snapshot_state(&runahead.buffer, &runahead.capacity, &runahead.size, MEM_ANY))
+    {
+        RG_LOGE("Snapshot failed, run-ahead disabled");
+        runahead_frames = 0;
+        return false;
+    }
+    runahead.saveTime = rg_system_timer() - startTime;
+    return true;
+}
+
+bool rg_emu_runahead_load(void)
+{
+    if (!runahead.buffer)
+        return false;
+
+    int64_t startTime = rg_system_timer();
+    bool success = app.handlers.loadStateMem(runahead.buffer, runahead.size);
+    statistics.runaheadCost = runahead.saveTime + (rg_system_timer() - startTime);
+
+    if (!success)
+    {
+        RG_LOGE("Restore failed, run-ahead disabled");
+        runahead_frames = 0;
+    }
+    return success;
+}
+
 bool rg_emu_screenshot(const char *filename, int width, int height)
 {
     if (!app.handlers.screenshot)
@@ -1302,6 +1877,8 @@ uint8_t rg_emu_get_last_used_slot(const char *romPath)
 
 rg_emu_states_t *rg_emu_get_states(const char *romPath, size_t slots)
 {
+    savestate_flush();
+
     rg_emu_states_t *result = calloc(1, sizeof(rg_emu_states_t) + sizeof(rg_emu_slot_t) * slots);
 
     for (size_t i = 0; i < slots; i++)
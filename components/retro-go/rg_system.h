@@ -125,6 +125,8 @@ typedef struct
 {
     bool (*loadState)(const char *filename);                         // rg_emu_load_state() handler
     bool (*saveState)(const char *filename);                         // rg_emu_save_state() handler
+    bool (*loadStateMem)(const void *data, size_t size);             // rg_emu_rewind() handler
+    bool (*saveStateMem)(void *data, size_t *size);                  // Rewind snapshots, *size is the capacity on entry
     bool (*reset)(bool hard);                                        // rg_emu_reset() handler
     bool (*screenshot)(const char *filename, int width, int height); // rg_emu_screenshot() handler
     void (*event)(int event, void *data);                            // listen to retro-go system events
@@ -202,8 +204,53 @@ typedef struct
     int freeBlockInt;
     int freeBlockExt;
     int freeStackMain;
+    int rewindCost;     // Average time (us) taken by a rewind snapshot
+    int rewindInterval; // Frames between rewind snapshots
+    int rewindDepth;    // Frames that can currently be rewound
+    int runaheadCost;   // Time (us) taken by the last run-ahead snapshot and restore
 } rg_stats_t;
 
+// Per-frame frameskip controller, see rg_system_render_next_frame
+typedef struct
+{
+    int maxSkip;    // Most frames skipped in a row. app->frameskip is the least, and raises this cap
+    int tolerance;  // How late (us) a frame may end before the next one is skipped
+    int hysteresis; // Extra headroom (us) required to stop skipping once we've started
+} rg_frameskip_tuning_t;
+
+// Frame phase profiler. Phases are timed with RG_PROFILE_SCOPE (or begin/end) from any task and
+// accumulated per frame, rg_system_tick closes the frame. Saving a trace with a .json filename
+// writes the recent scopes in Chrome's trace event format (chrome://tracing, Perfetto).
+typedef enum
+{
+    RG_PROFILE_EMULATE = 0, // Core: CPU and chips emulation, including rendering and sound generation
+    RG_PROFILE_DISPLAY,     // Display task: scaling and sending a frame to the LCD
+    RG_PROFILE_AUDIO,       // rg_audio_submit, including the time it paces the core
+    RG_PROFILE_INPUT,       // Input task: polling the gamepad
+    RG_PROFILE_PHASES,
+} rg_profile_phase_t;
+
+typedef struct
+{
+    int frames;              // Frames aggregated
+    int min, max, avg;       // In us per frame
+    int p50, p90, p99;
+} rg_profile_stats_t;
+
+typedef struct
+{
+    rg_profile_phase_t phase;
+    int64_t start;
+} rg_profile_scope_t;
+
+void rg_profile_end(rg_profile_phase_t phase, int64_t start);
+void rg_profile_scope_end(rg_profile_scope_t *scope);
+rg_profile_stats_t rg_profile_get_stats(rg_profile_phase_t phase);
+const char *rg_profile_get_name(rg_profile_phase_t phase);
+#define rg_profile_begin() rg_system_timer()
+#define RG_PROFILE_SCOPE(phase) \
+    rg_profile_scope_t _rgps_ __attribute__((cleanup(rg_profile_scope_end))) = {(phase), rg_system_timer()}
+
 rg_app_t *rg_system_init(int sampleRate, const rg_handlers_t *handlers, void *_unused);
 rg_app_t *rg_system_reinit(int sampleRate, const rg_handlers_t *handlers, void *_unused);
 void rg_system_panic(const char *context, const char *message) __attribute__((noreturn));
@@ -227,6 +274,10 @@ int  rg_system_get_cpu_speed(void);
 void rg_system_set_log_level(rg_log_level_t level);
 int  rg_system_get_log_level(void);
 void rg_system_tick(int busyTime);
+// Call after rg_system_tick and audio submission, returns whether the next frame should be rendered.
+// `rendered` is whether this frame was, `displayBusy` if the display couldn't take it yet.
+bool rg_system_render_next_frame(bool rendered, bool displayBusy);
+void rg_system_set_frameskip_tuning(rg_frameskip_tuning_t tuning);
 void rg_system_vlog(int level, const char *context, const char *format, va_list va);
 void rg_system_log(int level, const char *context, const char *format, ...) __attribute__((format(printf,3,4)));
 bool rg_system_save_trace(const char *filename, bool append);
@@ -261,6 +312,10 @@ bool rg_task_peek(rg_task_msg_t *out);
 bool rg_task_receive(rg_task_msg_t *out);
 bool rg_task_is_blocked(rg_task_t *task);
 size_t rg_task_messages_waiting(rg_task_t *task);
+// Lightweight wake-up signal, independent of the message queue. Notifications sent before
+// the task waits are not lost, rg_task_wait returns immediately and consumes all of them.
+bool rg_task_notify(rg_task_t *task);
+bool rg_task_wait(int timeoutMS);
 // The main difference between rg_task_delay and rg_usleep is that rg_task_delay will yield
 // to other tasks and will not busy wait time smaller than a tick. Meaning rg_usleep
 // is more accurate but rg_task_delay is more multitasking-friendly.
@@ -282,6 +337,18 @@ rg_emu_states_t *rg_emu_get_states(const char *romPath, size_t slots);
 uint8_t rg_emu_get_last_used_slot(const char *romPath);
 void rg_emu_set_speed(float speed);
 float rg_emu_get_speed(void);
+// Rewind needs the loadStateMem/saveStateMem handlers. Snapshots are taken by rg_system_tick, their
+// interval adapts to their cost so that the core keeps running at full speed.
+void rg_emu_set_rewind(bool enable);
+bool rg_emu_get_rewind(void);
+bool rg_emu_rewind(int frames);
+// Run-ahead hides input lag: the core runs its real frame without video, snapshots it with
+// rg_emu_runahead_save, emulates rg_emu_get_runahead() frames with no audio (drawing only the last),
+// then goes back to the real frame with rg_emu_runahead_load. It uses the same handlers as rewind.
+void rg_emu_set_runahead(int frames);
+int rg_emu_get_runahead(void);
+bool rg_emu_runahead_save(void);
+bool rg_emu_runahead_load(void);
 
 /* Utilities */
 
@@ -256,6 +256,148 @@ uint32_t rg_crc32(uint32_t crc, const uint8_t *buf, size_t len)
 #endif
 }
 
+/**
+ * RLE format, one control byte followed by its data:
+ *  0x00-0x7F: (n + 1) literal bytes
+ *  0x80-0xFE: the next byte repeated (n - 0x80 + 3) times
+ *  0xFF:      16bit little endian count, the next byte repeated (count + 130) times
+ * XOR deltas between two states are mostly zeroes, long runs are what matters.
+*/
+#define RLE_MAX_RUN (0xFFFF + 130)
+
+static inline uint8_t rle_byte(const uint8_t *src, const uint8_t *ref, size_t pos)
+{
+    return ref ? src[pos] ^ ref[pos] : src[pos];
+}
+
+static inline uint32_t rle_word(const uint8_t *src, const uint8_t *ref, size_t pos)
+{
+    uint32_t a, b = 0;
+    memcpy(&a, src + pos, 4);
+    if (ref)
+        memcpy(&b, ref + pos, 4);
+    return a ^ b;
+}
+
+size_t rg_rle_encode(uint8_t *dst, size_t dst_len, const uint8_t *src, const uint8_t *ref, size_t len)
+{
+    size_t pos = 0, out = 0, literal = 0;
+
+    while (pos <= len)
+    {
+        size_t run = 0;
+        uint8_t value = 0;
+
+        if (pos < len)
+        {
+            value = rle_byte(src, ref, pos);
+            uint32_t pattern = value * 0x01010101u;
+            run = 1;
+            while (pos + run + 4 <= len && run + 4 <= RLE_MAX_RUN && rle_word(src, ref, pos + run) == pattern)
+                run += 4;
+            while (pos + run < len && run < RLE_MAX_RUN && rle_byte(src, ref, pos + run) == value)
+                run++;
+            if (run < 3)
+            {
+                pos += run;
+                continue;
+            }
+        }
+
+        // Flush the literals that precede the run (or the end)
+        while (literal < pos)
+        {
+            size_t count = RG_MIN(pos - literal, 128);
+            if (out + count + 1 > dst_len)
+                return 0;
+            dst[out++] = count - 1;
+            for (size_t i = 0; i < count; ++i)
+                dst[out++] = rle_byte(src, ref, literal + i);
+            literal += count;
+        }
+
+        if (pos == len)
+            break;
+
+        if (run <= 129)
+        {
+            if (out + 2 > dst_len)
+                return 0;
+            dst[out++] = 0x80 + run - 3;
+        }
+        else
+        {
+            if (out + 4 > dst_len)
+                return 0;
+            dst[out++] = 0xFF;
+            dst[out++] = (run - 130) & 0xFF;
+            dst[out++] = (run - 130) >> 8;
+        }
+        dst[out++] = value;
+        pos += run;
+        literal = pos;
+    }
+
+    return out;
+}
+
+bool rg_rle_decode(uint8_t *dst, size_t len, const uint8_t *src, size_t src_len, bool xor)
+{
+    size_t pos = 0, in = 0;
+
+    while (in < src_len)
+    {
+        uint8_t ctrl = src[in++];
+        size_t count;
+
+        if (ctrl < 0x80)
+        {
+            count = ctrl + 1;
+            if (in + count > src_len || pos + count > len)
+                return false;
+            if (xor)
+            {
+                for (size_t i = 0; i < count; ++i)
+                    dst[pos + i] ^= src[in + i];
+            }
+            else
+            {
+                memcpy(dst + pos, src + in, count);
+            }
+            in += count;
+        }
+        else
+        {
+            if (ctrl == 0xFF)
+            {
+                if (in + 2 > src_len)
+                    return false;
+                count = (src[in] | (src[in + 1] << 8)) + 130;
+                in += 2;
+            }
+            else
+            {
+                count = ctrl - 0x80 + 3;
+            }
+            if (in + 1 > src_len || pos + count > len)
+                return false;
+            uint8_t value = src[in++];
+            if (!xor)
+            {
+                memset(dst + pos, value, count);
+            }
+            else if (value) // Zero runs leave the reference untouched
+            {
+                for (size_t i = 0; i < count; ++i)
+                    dst[pos + i] ^= value;
+            }
+        }
+        pos += count;
+    }
+
+    return pos == len;
+}
+
 /**
  * This function is the SuperFastHash from:
  *  http://www.azillionmonkeys.com/qed/hash.html
@@ -73,6 +73,13 @@ const char *rg_relpath(const char *path);
 uint32_t rg_crc32(uint32_t crc, const uint8_t *buf, size_t len);
 uint32_t rg_hash(const char *buf, size_t len);
 
+/* Compression */
+// Run-length encodes src (XORed with ref first, if not NULL) into dst. Returns the encoded size, or 0 if
+// dst_len is too small. The worst case is len + len / 128 + 1 bytes.
+size_t rg_rle_encode(uint8_t *dst, size_t dst_len, const uint8_t *src, const uint8_t *ref, size_t len);
+// Decodes into dst, XORing over its current content if xor is true. Returns false if the data is invalid.
+bool rg_rle_decode(uint8_t *dst, size_t len, const uint8_t *src, size_t src_len, bool xor);
+
 /* Misc */
 void *rg_alloc(size_t size, uint32_t caps);
 // rg_usleep behaves like usleep in libc: it will sleep for *at least* `us` microseconds, but possibly more
@@ -30,8 +30,10 @@
 
 // Storage
 #define RG_STORAGE_ROOT             "/sd"
+#ifdef ESP_PLATFORM // Host builds (tests/) use stdlib storage
 #define RG_STORAGE_SDMMC_HOST       SDMMC_HOST_SLOT_1
 #define RG_STORAGE_SDMMC_SPEED      SDMMC_FREQ_HIGHSPEED
+#endif
 #define RG_GPIO_SDMMC_CLK           GPIO_NUM_43
 #define RG_GPIO_SDMMC_CMD           GPIO_NUM_44
 #define RG_GPIO_SDMMC_D0            GPIO_NUM_39
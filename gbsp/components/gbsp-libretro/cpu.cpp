@@ -1466,6 +1466,11 @@ u8 *memory_map_read[8 * 1024];
 GBA_CACHE_ALIGN u16 io_registers[512];
 #endif
 
+/* Set by execute_arm_slice: execute_arm returns once the cycles run out
+ * instead of handing them to update_gba */
+static bool slice_mode = false;
+static s32 slice_cycles_left = 0;
+
 IRAM_ATTR void execute_arm(u32 cycles)
 {
   u32 opcode;
@@ -1487,6 +1492,10 @@ IRAM_ATTR void execute_arm(u32 cycles)
   {
     /* Do not execute until CPU is active */
     if (unlikely(reg[CPU_HALT_STATE] != CPU_ACTIVE)) {
+       if (unlikely(slice_mode)) {
+          slice_cycles_left = cycles_remaining;
+          return;
+       }
        u32 ret = update_gba(cycles_remaining);
        if (completed_frame(ret))
           return;
@@ -3057,6 +3066,10 @@ skip_instruction:
     } while(likely(cycles_remaining > 0));
 
     collapse_flags();
+    if (unlikely(slice_mode)) {
+       slice_cycles_left = cycles_remaining;
+       return;
+    }
     update_ret = update_gba(cycles_remaining);
     if (completed_frame(update_ret))
        return;
@@ -3537,6 +3550,10 @@ thumb_loop:
     } while(likely(cycles_remaining > 0));
 
     collapse_flags();
+    if (unlikely(slice_mode)) {
+       slice_cycles_left = cycles_remaining;
+       return;
+    }
     update_ret = update_gba(cycles_remaining);
     if (completed_frame(update_ret))
        return;
@@ -3549,6 +3566,16 @@ thumb_loop:
   }
 }
 
+/* Interpret at most the given cycles without running the rest of the
+ * system, returns the cycles left (zero or less unless the CPU halted) */
+s32 execute_arm_slice(s32 cycles)
+{
+  slice_mode = true;
+  execute_arm(cycles);
+  slice_mode = false;
+  return slice_cycles_left;
+}
+
 void init_cpu(void)
 {
   // Initialize CPU registers
@@ -97,6 +97,7 @@ typedef enum
 extern u32 instruction_count;
 
 void execute_arm(u32 cycles);
+s32 execute_arm_slice(s32 cycles);
 u32 check_and_raise_interrupts(void);
 cpu_alert_type check_interrupt(void);
 cpu_alert_type flag_interrupt(irq_type irq_raised);
@@ -18,6 +18,7 @@
  */
 
 #include "common.h"
+#include "jit_memory.h"
 
 /* Sound */
 #define gbc_sound_tone_control_low(channel, regn)                             \
@@ -1413,11 +1414,17 @@ void function_cc write_gpio(u32 address, u32 value) {
     case 0x02:                                                                \
       /* external work RAM */                                                 \
       address##type(ewram, (address & 0x3FFFF)) = eswap##type(value);         \
+      if (gba_code_page_check(gba_code_pages_ewram, address & 0x3FFFF,        \
+                              address))                                       \
+        return CPU_ALERT_SMC;                                                 \
       break;                                                                  \
                                                                               \
     case 0x03:                                                                \
       /* internal work RAM */                                                 \
       address##type(iwram, (address & 0x7FFF) + 0x8000) = eswap##type(value); \
+      if (gba_code_page_check(gba_code_pages_iwram, address & 0x7FFF,         \
+                              address))                                       \
+        return CPU_ALERT_SMC;                                                 \
       break;                                                                  \
                                                                               \
     case 0x04:                                                                \
@@ -1766,6 +1773,9 @@ const dma_region_type dma_region_map[17] =
                                           eswap##tfsize(read_value);          \
   if (address##tfsize(iwram, type##_ptr & 0x7FFF))                            \
     alerts |= CPU_ALERT_SMC;                                                  \
+  if (gba_code_page_check(gba_code_pages_iwram, type##_ptr & 0x7FFF,          \
+                          type##_ptr))                                        \
+    alerts |= CPU_ALERT_SMC;                                                  \
 
 #define dma_write_vram(type, tfsize) {                                        \
   u32 wraddr = type##_ptr & 0x1FFFF;                                          \
@@ -1789,6 +1799,9 @@ const dma_region_type dma_region_map[17] =
   address##tfsize(ewram, type##_ptr & 0x3FFFF) = eswap##tfsize(read_value);   \
   if (address##tfsize(ewram, (type##_ptr & 0x3FFFF) + 0x40000))               \
     alerts |= CPU_ALERT_SMC;                                                  \
+  if (gba_code_page_check(gba_code_pages_ewram, type##_ptr & 0x3FFFF,         \
+                          type##_ptr))                                        \
+    alerts |= CPU_ALERT_SMC;                                                  \
 
 #define print_line()                                                          \
   dma_print(src_op, dest_op, tfsize);                                         \
@@ -2497,9 +2510,74 @@ unsigned memory_write_savestate(u8 *dst)
   return (unsigned int)(dst - startp);
 }
 
-static s32 load_gamepak_raw(const char *name)
+static void map_gamepak_buffers(u32 ldblks)
 {
   unsigned i, j;
+  u32 rom_blocks = gamepak_size >> 15;
+
+  for (i = 0; i < ldblks; i++)
+  {
+    for (j = 0; j < 32 && i*32 + j < rom_blocks; j++)
+    {
+      u32 phyn = i*32 + j;
+      u8* blkptr = &gamepak_buffers[i][32 * 1024 * j];
+      u32 entry = evict_gamepak_page();
+      gamepak_blk_queue[entry].phy_rom = phyn;
+      // Map it to the read handlers now
+      map_rom_entry(read, phyn, blkptr, rom_blocks);
+    }
+  }
+}
+
+static s32 load_gamepak_zip(const char *name)
+{
+  u32 i, rom_size, loaded = 0;
+  rg_unzip_t *zip = rg_storage_unzip_open(name, "gba agb bin");
+  if (!zip)
+    return -1;
+
+  // Archives can't be paged in on demand, the whole ROM must fit in the buffers
+  rom_size = (u32)rg_storage_unzip_size(zip);
+  gamepak_size = (rom_size + 0x7FFF) & ~0x7FFF;
+  if (gamepak_must_swap())
+  {
+    RG_LOGE("ROM too large to be loaded from an archive (%u bytes)", (unsigned)rom_size);
+    rg_storage_unzip_close(zip);
+    return -1;
+  }
+
+  map_null(read, 0x8000000, 0xD000000);
+
+  // Inflate straight into the ROM buffers, 1MB at a time
+  for (i = 0; loaded < rom_size; i++)
+  {
+    u32 len = (u32)rg_storage_unzip_read(zip, gamepak_buffers[i], gamepak_buffer_blocksize);
+    if (len == 0)
+      break;
+    loaded += len;
+  }
+  rg_storage_unzip_close(zip);
+
+  if (loaded != rom_size)
+    return -1;
+
+  map_gamepak_buffers(i);
+  return 0;
+}
+
+static s32 load_gamepak_raw(const char *name)
+{
+  unsigned i;
+  char cache_path[RG_PATH_MAX + 1];
+
+  // A cached copy is a plain file, which can be paged in like any other ROM
+  if (rg_extension_match(name, "zip"))
+  {
+    if (!rg_storage_unzip_cache(name, "gba agb bin", cache_path))
+      return load_gamepak_zip(name);
+    name = cache_path;
+  }
+
   gamepak_file_large = fopen(name, "rb");
   if(gamepak_file_large)
   {
@@ -2511,7 +2589,6 @@ static s32 load_gamepak_raw(const char *name)
 
     // Load stuff in 1MB chunks
     u32 buf_blocks = (gamepak_size + gamepak_buffer_blocksize-1) / (gamepak_buffer_blocksize);
-    u32 rom_blocks = gamepak_size >> 15;
     u32 ldblks = buf_blocks < gamepak_buffer_count ?
                     buf_blocks : gamepak_buffer_count;
 
@@ -2520,20 +2597,9 @@ static s32 load_gamepak_raw(const char *name)
 
     // Proceed to read the whole ROM or as much as possible.
     for (i = 0; i < ldblks; i++)
-    {
-      // Load 1MB chunk and map it
       fread(gamepak_buffers[i], gamepak_buffer_blocksize, 1, gamepak_file_large);
-      for (j = 0; j < 32 && i*32 + j < rom_blocks; j++)
-      {
-        u32 phyn = i*32 + j;
-        u8* blkptr = &gamepak_buffers[i][32 * 1024 * j];
-        u32 entry = evict_gamepak_page();
-        gamepak_blk_queue[entry].phy_rom = phyn;
-        // Map it to the read handlers now
-        map_rom_entry(read, phyn, blkptr, rom_blocks);
-      }
-    }
 
+    map_gamepak_buffers(ldblks);
     return 0;
   }
 
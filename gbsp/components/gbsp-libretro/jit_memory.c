@@ -27,15 +27,20 @@
 
 #include "common.h"
 #include "gba_memory.h"
+#include "jit_memory.h"
+
+uint32_t gba_code_pages_ewram[GBA_CODE_PAGES_EWRAM / 32];
+uint32_t gba_code_pages_iwram[GBA_CODE_PAGES_IWRAM / 32];
+bool (*gba_code_write_hook)(uint32_t addr);
 
 uint32_t gba_mem_read32(uint32_t addr)
 {
     return read_memory32(addr);
 }
 
-void gba_mem_write32(uint32_t addr, uint32_t value)
+uint32_t gba_mem_write32(uint32_t addr, uint32_t value)
 {
-    write_memory32(addr, value);
+    return write_memory32(addr, value);
 }
 
 uint16_t gba_mem_read16(uint32_t addr)
@@ -43,9 +48,9 @@ uint16_t gba_mem_read16(uint32_t addr)
     return (uint16_t)read_memory16(addr);
 }
 
-void gba_mem_write16(uint32_t addr, uint16_t value)
+uint32_t gba_mem_write16(uint32_t addr, uint16_t value)
 {
-    write_memory16(addr, value);
+    return write_memory16(addr, value);
 }
 
 uint8_t gba_mem_read8(uint32_t addr)
@@ -53,7 +58,19 @@ uint8_t gba_mem_read8(uint32_t addr)
     return (uint8_t)read_memory8(addr);
 }
 
-void gba_mem_write8(uint32_t addr, uint8_t value)
+uint32_t gba_mem_write8(uint32_t addr, uint8_t value)
+{
+    return write_memory8(addr, value);
+}
+
+void gba_mem_get_regions(gba_mem_regions_t *regions)
 {
-    write_memory8(addr, value);
+    regions->ewram_host = ewram;
+    regions->iwram_host = &iwram[0x8000];
+    regions->vram_host = vram;
+    regions->palette_host = (uint8_t *)palette_ram;
+    regions->rom_pages = &memory_map_read[0x8000000 >> 15];
+    regions->rom_size = gamepak_size;
+    regions->ws_seq = ws_cyc_seq;
+    regions->ws_nseq = ws_cyc_nseq;
 }
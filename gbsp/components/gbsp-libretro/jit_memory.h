@@ -0,0 +1,64 @@
+/*
+ * JIT Memory Access Interface
+ *
+ * Memory access entry points the JIT compiler calls into, and the host
+ * memory of the regions it may access directly from emitted code.
+ */
+
+#ifndef JIT_MEMORY_H
+#define JIT_MEMORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Host memory of the GBA regions emitted code reads and writes directly */
+typedef struct gba_mem_regions {
+    uint8_t *ewram_host;            /* 256KB at 0x02000000 */
+    uint8_t *iwram_host;            /* 32KB at 0x03000000 */
+    uint8_t *vram_host;             /* 96KB at 0x06000000 */
+    uint8_t *palette_host;          /* 1KB at 0x05000000 */
+    uint8_t **rom_pages;            /* 32KB ROM pages from 0x08000000, NULL if not loaded */
+    uint32_t rom_size;              /* ROM size in bytes */
+    uint8_t (*ws_seq)[2];           /* Sequential access cycles by region and bus width (16/32) */
+    uint8_t (*ws_nseq)[2];          /* Non-sequential access cycles, same layout */
+} gba_mem_regions_t;
+
+/* Writes return the CPU_ALERT_* flags of the store, compiled code leaves
+ * the block when they aren't zero */
+uint32_t gba_mem_read32(uint32_t addr);
+uint32_t gba_mem_write32(uint32_t addr, uint32_t value);
+uint16_t gba_mem_read16(uint32_t addr);
+uint32_t gba_mem_write16(uint32_t addr, uint16_t value);
+uint8_t gba_mem_read8(uint32_t addr);
+uint32_t gba_mem_write8(uint32_t addr, uint8_t value);
+
+/* Fill in the direct-mapped regions, NULL members make the JIT use the helpers
+ * (and charge a single cycle per access without waitstate tables) */
+void gba_mem_get_regions(gba_mem_regions_t *regions);
+
+/*
+ * Work RAM pages holding translated code, one bit per 256 bytes. Stores to
+ * a marked page call gba_code_write_hook, which drops the blocks compiled
+ * from it and returns true if there were any: the store then raises
+ * CPU_ALERT_SMC, compiled code must not go on with a block that may be one
+ * of them. The JIT owns the bits and the hook.
+ */
+#define GBA_CODE_PAGE_SHIFT     8
+#define GBA_CODE_PAGES_EWRAM    ((256 * 1024) >> GBA_CODE_PAGE_SHIFT)
+#define GBA_CODE_PAGES_IWRAM    ((32 * 1024) >> GBA_CODE_PAGE_SHIFT)
+
+extern uint32_t gba_code_pages_ewram[GBA_CODE_PAGES_EWRAM / 32];
+extern uint32_t gba_code_pages_iwram[GBA_CODE_PAGES_IWRAM / 32];
+extern bool (*gba_code_write_hook)(uint32_t addr);
+
+/* offset is the address within the region the pages belong to */
+static inline bool gba_code_page_check(const uint32_t *pages, uint32_t offset, uint32_t addr)
+{
+    uint32_t page = offset >> GBA_CODE_PAGE_SHIFT;
+
+    if (pages[page >> 5] & (1u << (page & 31)))
+        return gba_code_write_hook(addr);
+    return false;
+}
+
+#endif
@@ -2,6 +2,14 @@
  * JIT Cache Management for ESP32-P4
  * 
  * Manages translation caches and block hash table.
+ *
+ * Each translation cache is split into chunks of GBA_JIT_CODE_CHUNK_SIZE
+ * bytes. Blocks are appended to the chunk currently being filled, and once
+ * the cache is full the least recently dispatched chunk is evicted as a
+ * whole, unlinking every block in it. Fresh blocks go to young chunks;
+ * a block that was dispatched GBA_JIT_HOT_EXEC_COUNT times when its chunk
+ * got evicted is recompiled into an old chunk, and old chunks are only
+ * evicted once they hold more than half of the cache.
  */
 
 #include "jit_core.h"
@@ -14,9 +22,34 @@ static const char *TAG = "JIT_CACHE";
 
 /* Global cache pointers */
 uint8_t *g_rom_cache = NULL;
-uint8_t *g_rom_cache_ptr = NULL;
 uint8_t *g_ram_cache = NULL;
-uint8_t *g_ram_cache_ptr = NULL;
+
+/* Chunk generations */
+#define CHUNK_FREE      0
+#define CHUNK_YOUNG     1
+#define CHUNK_OLD       2
+
+typedef struct code_chunk {
+    uint8_t *base;
+    uint32_t used;                  /* Bytes handed out to blocks */
+    uint32_t last_used;             /* s_lru_clock of the last dispatch into one of its blocks */
+    uint8_t generation;             /* CHUNK_FREE, CHUNK_YOUNG or CHUNK_OLD */
+    block_entry_t *blocks;          /* Blocks with code in the chunk, through chunk_next */
+} code_chunk_t;
+
+typedef struct code_cache {
+    uint8_t *base;
+    code_chunk_t *chunks;
+    uint32_t chunk_count;
+    code_chunk_t *current[3];       /* Chunk being filled, per generation */
+} code_cache_t;
+
+static code_cache_t s_rom_code;
+static code_cache_t s_ram_code;
+static uint32_t s_lru_clock = 0;
+
+/* Chunk of the last jit_alloc_code reservation, committed by jit_block_register */
+static code_chunk_t *s_reserved_chunk = NULL;
 
 /* Block hash table */
 block_entry_t **g_block_hash = NULL;
@@ -30,21 +63,42 @@ jit_config_t g_jit_config = {
     .ram_cache_size = GBA_JIT_RAM_CACHE_SIZE,
     .block_hash_size = GBA_JIT_BLOCK_HASH_SIZE,
     .max_block_instructions = GBA_JIT_MAX_BLOCK_INSTRUCTIONS,
-    .enable_l1 = 0,
+    .tier_threshold = GBA_JIT_TIER_THRESHOLD,
+    .deadline_interval = GBA_JIT_DEADLINE_INTERVAL,
+    .enable_l1 = 1,
+    /* Off until jit_run_differential has run clean on hardware, it turns them on itself */
     .enable_l2 = 0,
     .enable_thumb = 0,
-    .enable_stats = GBA_JIT_ENABLE_STATS
+    .enable_stats = GBA_JIT_ENABLE_STATS,
+    .enable_reg_cache = 0
 };
 
-/* Block entry pool for faster allocation */
+/* Block entry pool for faster allocation, evicted entries are recycled */
 static block_entry_t *s_block_pool = NULL;
 static uint32_t s_block_pool_index = 0;
 static uint32_t s_block_pool_size = 0;
+static block_entry_t *s_block_free = NULL;
+
+/* Blocks in the hash table, which is doubled when they outnumber its buckets */
+static uint32_t s_live_blocks = 0;
+
+/* Exits waiting for their target to be compiled, bucketed by block_hash(target) */
+static jit_exit_t **s_pending_exits = NULL;
+
+/* Blocks compiled from EWRAM/IWRAM, walked when their code is written to */
+static block_entry_t *s_ram_blocks = NULL;
 
 /* Failed translation bitmap - tracks PCs that cannot be translated */
 #define FAILED_PC_BITMAP_SIZE 8192
 static uint32_t *s_failed_pc_bitmap = NULL;
 
+/* PCs of blocks that were hot when evicted, indexed like the failed bitmap */
+static uint32_t *s_hot_pc_bitmap = NULL;
+
+/* Dispatches to PCs without a block, hashed and saturating at UINT8_MAX */
+#define TIER_COUNT_SIZE 16384
+static uint8_t *s_tier_counts = NULL;
+
 /* --------------------------------------------------------------------- */
 /*  Hash Functions                                                       */
 /* --------------------------------------------------------------------- */
@@ -60,46 +114,47 @@ static inline uint32_t block_hash(uint32_t pc, bool is_thumb)
     return hash & (g_jit_config.block_hash_size - 1);
 }
 
-static inline void mark_pc_failed(uint32_t pc, bool is_thumb)
+static inline uint32_t pc_bitmap_index(uint32_t pc, bool is_thumb)
 {
-    if (s_failed_pc_bitmap == NULL) return;
     uint32_t idx = (pc >> 2) & (FAILED_PC_BITMAP_SIZE * 32 - 1);
     if (is_thumb) idx ^= 1;
+    return idx;
+}
+
+static inline void mark_pc_failed(uint32_t pc, bool is_thumb)
+{
+    if (s_failed_pc_bitmap == NULL) return;
+    uint32_t idx = pc_bitmap_index(pc, is_thumb);
     s_failed_pc_bitmap[idx / 32] |= (1U << (idx % 32));
 }
 
 static inline bool is_pc_failed(uint32_t pc, bool is_thumb)
 {
     if (s_failed_pc_bitmap == NULL) return false;
-    uint32_t idx = (pc >> 2) & (FAILED_PC_BITMAP_SIZE * 32 - 1);
-    if (is_thumb) idx ^= 1;
+    uint32_t idx = pc_bitmap_index(pc, is_thumb);
     return (s_failed_pc_bitmap[idx / 32] & (1U << (idx % 32))) != 0;
 }
 
-/* --------------------------------------------------------------------- */
-/*  Cache Management                                                     */
-/* --------------------------------------------------------------------- */
+static inline bool mark_pc_hot(uint32_t pc, bool is_thumb)
+{
+    if (s_hot_pc_bitmap == NULL) return false;
+    uint32_t idx = pc_bitmap_index(pc, is_thumb);
+    bool was_hot = (s_hot_pc_bitmap[idx / 32] & (1U << (idx % 32))) != 0;
+    s_hot_pc_bitmap[idx / 32] |= (1U << (idx % 32));
+    return !was_hot;
+}
 
-static void *cache_alloc(uint32_t size, bool is_ram)
+static inline bool is_pc_hot(uint32_t pc, bool is_thumb)
 {
-    uint8_t **ptr = is_ram ? &g_ram_cache_ptr : &g_rom_cache_ptr;
-    uint8_t *base = is_ram ? g_ram_cache : g_rom_cache;
-    uint32_t max_size = is_ram ? g_jit_config.ram_cache_size : g_jit_config.rom_cache_size;
-    
-    size = (size + 15) & ~15;
-    
-    if (*ptr - base + size > max_size) {
-        GBA_JIT_LOGE(TAG, "Cache full! Requested %u bytes", size);
-        g_jit_stats.cache_full_count++;
-        return NULL;
-    }
-    
-    void *code = *ptr;
-    *ptr += size;
-    
-    return code;
+    if (s_hot_pc_bitmap == NULL) return false;
+    uint32_t idx = pc_bitmap_index(pc, is_thumb);
+    return (s_hot_pc_bitmap[idx / 32] & (1U << (idx % 32))) != 0;
 }
 
+/* --------------------------------------------------------------------- */
+/*  Cache Management                                                     */
+/* --------------------------------------------------------------------- */
+
 static void jit_cache_flush(void *addr, size_t size)
 {
     if (addr == NULL || size == 0) {
@@ -113,6 +168,151 @@ static void jit_cache_flush(void *addr, size_t size)
     cache_ll_invalidate_all(1, CACHE_TYPE_INSTRUCTION, CACHE_LL_ID_ALL);
 }
 
+/* A patched exit stub only needs its own lines pushed out of L1, the full
+ * L2 flush is left to jit_cache_flush, once per compiled block */
+static void jit_stub_flush(uintptr_t addr)
+{
+    cache_ll_l1_writeback_dcache_addr(CACHE_LL_ID_ALL, (uint32_t)addr, 8);
+    cache_ll_l1_invalidate_icache_addr(CACHE_LL_ID_ALL, (uint32_t)addr, 8);
+}
+
+/* --------------------------------------------------------------------- */
+/*  Block Linking                                                        */
+/* --------------------------------------------------------------------- */
+
+static block_entry_t *find_block(uint32_t pc, bool is_thumb)
+{
+    block_entry_t *entry = g_block_hash[block_hash(pc, is_thumb)];
+    while (entry != NULL) {
+        if (entry->pc == pc && entry->is_thumb == is_thumb && entry->valid) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static void exit_list_remove(jit_exit_t **list, jit_exit_t *exit)
+{
+    while (*list != NULL) {
+        if (*list == exit) {
+            *list = exit->next;
+            exit->next = NULL;
+            return;
+        }
+        list = &(*list)->next;
+    }
+}
+
+static void exit_add_pending(jit_exit_t *exit)
+{
+    uint32_t idx = block_hash(exit->target_pc, exit->owner->is_thumb);
+    exit->linked = NULL;
+    exit->next = s_pending_exits[idx];
+    s_pending_exits[idx] = exit;
+}
+
+static void exit_link(jit_exit_t *exit, block_entry_t *target)
+{
+    sljit_set_jump_addr(exit->jump_addr, (sljit_uw)target->body, 0);
+    jit_stub_flush(exit->jump_addr);
+    exit->linked = target;
+    exit->next = target->incoming;
+    target->incoming = exit;
+    g_jit_stats.links++;
+}
+
+static void exit_unlink(jit_exit_t *exit)
+{
+    sljit_set_jump_addr(exit->jump_addr, exit->fallback_addr, 0);
+    jit_stub_flush(exit->jump_addr);
+    exit->linked = NULL;
+    exit->next = NULL;
+    g_jit_stats.unlinks++;
+}
+
+/* Take a block out of the hash table and every exit list. Its code stays
+ * in place until the chunk is evicted, only the dispatcher won't find it. */
+static void block_unlink(block_entry_t *entry)
+{
+    if (!entry->valid) {
+        return;
+    }
+    entry->valid = 0;
+    
+    /* Exits into this block go back to the dispatcher and wait for a recompile */
+    while (entry->incoming != NULL) {
+        jit_exit_t *exit = entry->incoming;
+        entry->incoming = exit->next;
+        exit_unlink(exit);
+        if (s_pending_exits != NULL && exit->owner != entry) {
+            exit_add_pending(exit);
+        }
+    }
+    
+    /* And this block's own exits must not be patched anymore */
+    for (int i = 0; i < entry->exit_count; i++) {
+        jit_exit_t *exit = &entry->exits[i];
+        if (exit->linked != NULL) {
+            exit_list_remove(&exit->linked->incoming, exit);
+            exit->linked = NULL;
+        } else if (s_pending_exits != NULL) {
+            exit_list_remove(&s_pending_exits[block_hash(exit->target_pc, entry->is_thumb)], exit);
+        }
+    }
+    entry->exit_count = 0;
+    
+    block_entry_t **list = &g_block_hash[block_hash(entry->pc, entry->is_thumb)];
+    while (*list != NULL) {
+        if (*list == entry) {
+            *list = entry->next;
+            entry->next = NULL;
+            s_live_blocks--;
+            break;
+        }
+        list = &(*list)->next;
+    }
+}
+
+/* --------------------------------------------------------------------- */
+/*  Self-Modifying Code                                                  */
+/* --------------------------------------------------------------------- */
+
+/* Code page bitmap of a work RAM address, NULL outside of work RAM */
+static uint32_t *code_pages(uint32_t addr, uint32_t *offset)
+{
+    switch (addr >> 24) {
+        case 0x02:
+            *offset = addr & 0x3FFFF;
+            return gba_code_pages_ewram;
+        case 0x03:
+            *offset = addr & 0x7FFF;
+            return gba_code_pages_iwram;
+        default:
+            return NULL;
+    }
+}
+
+/* Mark the pages covering [start, end) as holding code */
+static void code_pages_mark(uint32_t start, uint32_t end)
+{
+    for (uint32_t addr = start & ~((1u << GBA_CODE_PAGE_SHIFT) - 1); addr < end;
+         addr += 1u << GBA_CODE_PAGE_SHIFT) {
+        uint32_t offset;
+        uint32_t *pages = code_pages(addr, &offset);
+        if (pages != NULL) {
+            uint32_t page = offset >> GBA_CODE_PAGE_SHIFT;
+            pages[page >> 5] |= 1u << (page & 31);
+        }
+    }
+}
+
+static void code_pages_clear(void)
+{
+    memset(gba_code_pages_ewram, 0, sizeof(gba_code_pages_ewram));
+    memset(gba_code_pages_iwram, 0, sizeof(gba_code_pages_iwram));
+}
+
 /* --------------------------------------------------------------------- */
 /*  Block Pool Management                                                */
 /* --------------------------------------------------------------------- */
@@ -148,15 +348,249 @@ static void block_pool_deinit(void)
 
 static block_entry_t *block_pool_alloc(void)
 {
-    if (s_block_pool_index >= s_block_pool_size) {
+    block_entry_t *entry;
+    
+    if (s_block_free != NULL) {
+        entry = s_block_free;
+        s_block_free = entry->next;
+    } else if (s_block_pool_index < s_block_pool_size) {
+        entry = &s_block_pool[s_block_pool_index++];
+    } else {
         return NULL;
     }
     
-    block_entry_t *entry = &s_block_pool[s_block_pool_index++];
     memset(entry, 0, sizeof(block_entry_t));
     return entry;
 }
 
+static void block_pool_free(block_entry_t *entry)
+{
+    entry->next = s_block_free;
+    s_block_free = entry;
+}
+
+/* --------------------------------------------------------------------- */
+/*  Code Chunks                                                          */
+/* --------------------------------------------------------------------- */
+
+static void code_cache_reset(code_cache_t *cache)
+{
+    for (uint32_t i = 0; i < cache->chunk_count; i++) {
+        cache->chunks[i] = (code_chunk_t){
+            .base = cache->base + i * GBA_JIT_CODE_CHUNK_SIZE,
+            .generation = CHUNK_FREE,
+        };
+    }
+    memset(cache->current, 0, sizeof(cache->current));
+}
+
+static int code_cache_init(code_cache_t *cache, uint8_t *base, uint32_t size)
+{
+    cache->base = base;
+    cache->chunk_count = size / GBA_JIT_CODE_CHUNK_SIZE;
+    
+    /* One chunk per generation being filled, plus one to evict */
+    if (cache->chunk_count < 3) {
+        ESP_LOGE(TAG, "Translation cache of %u bytes is too small for %u byte chunks",
+                 size, GBA_JIT_CODE_CHUNK_SIZE);
+        return -1;
+    }
+    
+    cache->chunks = (code_chunk_t *)heap_caps_malloc(
+        cache->chunk_count * sizeof(code_chunk_t),
+        MALLOC_CAP_8BIT
+    );
+    if (cache->chunks == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate cache chunk table");
+        return -1;
+    }
+    
+    code_cache_reset(cache);
+    return 0;
+}
+
+static void code_cache_deinit(code_cache_t *cache)
+{
+    if (cache->chunks != NULL) {
+        heap_caps_free(cache->chunks);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void chunk_evict(code_cache_t *cache, code_chunk_t *chunk)
+{
+    /* Work RAM blocks are also tracked for code writes */
+    if (cache == &s_ram_code) {
+        block_entry_t **list = &s_ram_blocks;
+        while (*list != NULL) {
+            if ((*list)->chunk == chunk) {
+                *list = (*list)->ram_next;
+            } else {
+                list = &(*list)->ram_next;
+            }
+        }
+    }
+    
+    block_entry_t *entry = chunk->blocks;
+    while (entry != NULL) {
+        block_entry_t *next = entry->chunk_next;
+        
+        if (entry->valid && entry->exec_count >= GBA_JIT_HOT_EXEC_COUNT) {
+            mark_pc_hot(entry->pc, entry->is_thumb);
+        }
+        if (entry->valid) {
+            g_jit_stats.evicted_blocks++;
+        }
+        block_unlink(entry);
+        block_pool_free(entry);
+        entry = next;
+    }
+    
+    chunk->blocks = NULL;
+    chunk->used = 0;
+    chunk->generation = CHUNK_FREE;
+    g_jit_stats.chunk_evictions++;
+}
+
+/* Least recently used chunk of a generation, leaving the ones being filled alone */
+static code_chunk_t *chunk_lru(code_cache_t *cache, uint8_t generation)
+{
+    code_chunk_t *victim = NULL;
+    
+    for (uint32_t i = 0; i < cache->chunk_count; i++) {
+        code_chunk_t *chunk = &cache->chunks[i];
+        if (chunk->generation != generation ||
+            chunk == cache->current[CHUNK_YOUNG] || chunk == cache->current[CHUNK_OLD]) {
+            continue;
+        }
+        if (victim == NULL || (int32_t)(chunk->last_used - victim->last_used) < 0) {
+            victim = chunk;
+        }
+    }
+    return victim;
+}
+
+static bool chunk_evict_lru(code_cache_t *cache)
+{
+    uint32_t old_chunks = 0;
+    for (uint32_t i = 0; i < cache->chunk_count; i++) {
+        old_chunks += cache->chunks[i].generation == CHUNK_OLD;
+    }
+    
+    /* Old blocks already survived an eviction, keep them unless they crowd out the young ones */
+    code_chunk_t *victim = NULL;
+    if (old_chunks * 2 > cache->chunk_count) {
+        victim = chunk_lru(cache, CHUNK_OLD);
+    }
+    if (victim == NULL) {
+        victim = chunk_lru(cache, CHUNK_YOUNG);
+    }
+    if (victim == NULL) {
+        victim = chunk_lru(cache, CHUNK_OLD);
+    }
+    if (victim == NULL) {
+        return false;
+    }
+    
+    chunk_evict(cache, victim);
+    return true;
+}
+
+static code_chunk_t *chunk_take(code_cache_t *cache, uint8_t generation)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (uint32_t i = 0; i < cache->chunk_count; i++) {
+            code_chunk_t *chunk = &cache->chunks[i];
+            if (chunk->generation == CHUNK_FREE) {
+                chunk->generation = generation;
+                chunk->last_used = s_lru_clock;
+                return chunk;
+            }
+        }
+        if (!chunk_evict_lru(cache)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static code_cache_t *code_cache_of(uint32_t pc)
+{
+    return jit_is_ram_address(pc) ? &s_ram_code : &s_rom_code;
+}
+
+static void code_cache_usage(const code_cache_t *cache, const char *name, uint32_t size)
+{
+    uint32_t used = 0, young = 0, old = 0;
+    
+    for (uint32_t i = 0; i < cache->chunk_count; i++) {
+        used += cache->chunks[i].used;
+        young += cache->chunks[i].generation == CHUNK_YOUNG;
+        old += cache->chunks[i].generation == CHUNK_OLD;
+    }
+    ESP_LOGI(TAG, "%s cache used: %u / %u bytes (%u%%), chunks: %u young, %u old, %u total",
+             name, used, size, size ? used * 100 / size : 0, young, old, cache->chunk_count);
+}
+
+/* --------------------------------------------------------------------- */
+/*  Hash Table Resizing                                                  */
+/* --------------------------------------------------------------------- */
+
+/* Double the bucket count, keeping the old table if memory runs out */
+static void block_hash_grow(void)
+{
+    uint32_t old_size = g_jit_config.block_hash_size;
+    uint32_t new_size = old_size * 2;
+    
+    block_entry_t **hash = (block_entry_t **)heap_caps_calloc(
+        new_size, sizeof(block_entry_t *), MALLOC_CAP_8BIT);
+    jit_exit_t **pending = NULL;
+    if (s_pending_exits != NULL) {
+        pending = (jit_exit_t **)heap_caps_calloc(new_size, sizeof(jit_exit_t *), MALLOC_CAP_8BIT);
+    }
+    if (hash == NULL || (s_pending_exits != NULL && pending == NULL)) {
+        ESP_LOGW(TAG, "Failed to grow block hash to %u buckets", new_size);
+        if (hash != NULL) heap_caps_free(hash);
+        if (pending != NULL) heap_caps_free(pending);
+        return;
+    }
+    
+    block_entry_t **old_hash = g_block_hash;
+    jit_exit_t **old_pending = s_pending_exits;
+    g_block_hash = hash;
+    s_pending_exits = pending;
+    g_jit_config.block_hash_size = new_size;
+    
+    /* Both tables are keyed by block_hash, which depends on the size */
+    for (uint32_t i = 0; i < old_size; i++) {
+        block_entry_t *entry = old_hash[i];
+        while (entry != NULL) {
+            block_entry_t *next = entry->next;
+            uint32_t idx = block_hash(entry->pc, entry->is_thumb);
+            entry->next = hash[idx];
+            hash[idx] = entry;
+            entry = next;
+        }
+        
+        if (old_pending != NULL) {
+            jit_exit_t *exit = old_pending[i];
+            while (exit != NULL) {
+                jit_exit_t *next = exit->next;
+                exit_add_pending(exit);
+                exit = next;
+            }
+        }
+    }
+    
+    heap_caps_free(old_hash);
+    if (old_pending != NULL) {
+        heap_caps_free(old_pending);
+    }
+    
+    g_jit_stats.hash_resizes++;
+    ESP_LOGI(TAG, "Block hash grown to %u buckets for %u blocks", new_size, s_live_blocks);
+}
+
 /* --------------------------------------------------------------------- */
 /*  Public API                                                           */
 /* --------------------------------------------------------------------- */
@@ -215,6 +649,28 @@ int jit_init(const jit_config_t *config)
         return -1;
     }
     
+    if (code_cache_init(&s_rom_code, g_rom_cache, g_jit_config.rom_cache_size) != 0 ||
+        code_cache_init(&s_ram_code, g_ram_cache, g_jit_config.ram_cache_size) != 0) {
+        code_cache_deinit(&s_rom_code);
+        code_cache_deinit(&s_ram_code);
+        block_pool_deinit();
+        heap_caps_free(g_rom_cache);
+        heap_caps_free(g_ram_cache);
+        heap_caps_free(g_block_hash);
+        g_rom_cache = NULL;
+        g_ram_cache = NULL;
+        g_block_hash = NULL;
+        return -1;
+    }
+    
+    s_pending_exits = (jit_exit_t **)heap_caps_calloc(
+        g_jit_config.block_hash_size, sizeof(jit_exit_t *),
+        MALLOC_CAP_8BIT
+    );
+    if (s_pending_exits == NULL) {
+        ESP_LOGW(TAG, "Failed to allocate pending exit table, blocks will only link backwards");
+    }
+    
     s_failed_pc_bitmap = (uint32_t *)heap_caps_malloc(
         FAILED_PC_BITMAP_SIZE * sizeof(uint32_t),
         MALLOC_CAP_8BIT
@@ -225,31 +681,53 @@ int jit_init(const jit_config_t *config)
         memset(s_failed_pc_bitmap, 0, FAILED_PC_BITMAP_SIZE * sizeof(uint32_t));
     }
     
-    g_rom_cache_ptr = g_rom_cache;
-    g_ram_cache_ptr = g_ram_cache;
+    s_hot_pc_bitmap = (uint32_t *)heap_caps_calloc(
+        FAILED_PC_BITMAP_SIZE, sizeof(uint32_t),
+        MALLOC_CAP_8BIT
+    );
+    if (s_hot_pc_bitmap == NULL) {
+        ESP_LOGW(TAG, "Failed to allocate hot PC bitmap, every block will be young");
+    }
+    
+    s_tier_counts = (uint8_t *)heap_caps_calloc(TIER_COUNT_SIZE, 1, MALLOC_CAP_8BIT);
+    if (s_tier_counts == NULL) {
+        ESP_LOGW(TAG, "Failed to allocate tier counters, every block will be compiled on first use");
+    }
     
     memset(g_block_hash, 0, g_jit_config.block_hash_size * sizeof(block_entry_t *));
     memset(&g_jit_stats, 0, sizeof(jit_stats_t));
     
-    ESP_LOGI(TAG, "JIT cache initialized: ROM=%uKB, RAM=%uKB, Hash=%u, Pool=%u",
+    s_live_blocks = 0;
+    s_reserved_chunk = NULL;
+    s_ram_blocks = NULL;
+    code_pages_clear();
+    gba_code_write_hook = jit_code_written;
+    
+    ESP_LOGI(TAG, "JIT cache initialized: ROM=%uKB, RAM=%uKB, Chunk=%uKB, Hash=%u, Pool=%u",
              g_jit_config.rom_cache_size / 1024, g_jit_config.ram_cache_size / 1024,
-             g_jit_config.block_hash_size, s_block_pool_size);
+             GBA_JIT_CODE_CHUNK_SIZE / 1024, g_jit_config.block_hash_size, s_block_pool_size);
     
     return 0;
 }
 
 void jit_deinit(void)
 {
+    code_pages_clear();
+    gba_code_write_hook = NULL;
+    s_ram_blocks = NULL;
+    s_reserved_chunk = NULL;
+    
+    code_cache_deinit(&s_rom_code);
+    code_cache_deinit(&s_ram_code);
+    
     if (g_rom_cache != NULL) {
         heap_caps_free(g_rom_cache);
         g_rom_cache = NULL;
-        g_rom_cache_ptr = NULL;
     }
     
     if (g_ram_cache != NULL) {
         heap_caps_free(g_ram_cache);
         g_ram_cache = NULL;
-        g_ram_cache_ptr = NULL;
     }
     
     if (g_block_hash != NULL) {
@@ -257,17 +735,55 @@ void jit_deinit(void)
         g_block_hash = NULL;
     }
     
+    if (s_pending_exits != NULL) {
+        heap_caps_free(s_pending_exits);
+        s_pending_exits = NULL;
+    }
+    
+    if (s_failed_pc_bitmap != NULL) {
+        heap_caps_free(s_failed_pc_bitmap);
+        s_failed_pc_bitmap = NULL;
+    }
+    
+    if (s_hot_pc_bitmap != NULL) {
+        heap_caps_free(s_hot_pc_bitmap);
+        s_hot_pc_bitmap = NULL;
+    }
+    
+    if (s_tier_counts != NULL) {
+        heap_caps_free(s_tier_counts);
+        s_tier_counts = NULL;
+    }
+    
     block_pool_deinit();
 }
 
 void jit_reset(void)
 {
-    g_rom_cache_ptr = g_rom_cache;
-    g_ram_cache_ptr = g_ram_cache;
+    code_cache_reset(&s_rom_code);
+    code_cache_reset(&s_ram_code);
+    s_reserved_chunk = NULL;
     
     memset(g_block_hash, 0, g_jit_config.block_hash_size * sizeof(block_entry_t *));
     memset(&g_jit_stats, 0, sizeof(jit_stats_t));
     s_block_pool_index = 0;
+    s_block_free = NULL;
+    s_live_blocks = 0;
+    s_ram_blocks = NULL;
+    code_pages_clear();
+    
+    if (s_hot_pc_bitmap != NULL) {
+        memset(s_hot_pc_bitmap, 0, FAILED_PC_BITMAP_SIZE * sizeof(uint32_t));
+    }
+    
+    if (s_tier_counts != NULL) {
+        memset(s_tier_counts, 0, TIER_COUNT_SIZE);
+    }
+    
+    /* All code is dropped at once, so there is nothing to unpatch */
+    if (s_pending_exits != NULL) {
+        memset(s_pending_exits, 0, g_jit_config.block_hash_size * sizeof(jit_exit_t *));
+    }
 }
 
 void jit_flush_cache(void)
@@ -292,7 +808,10 @@ block_entry_t *jit_block_lookup(uint32_t pc, bool is_thumb)
     
     while (entry != NULL) {
         if (entry->pc == pc && entry->is_thumb == is_thumb && entry->valid) {
-            entry->exec_count++;
+            if (entry->exec_count < UINT16_MAX) {
+                entry->exec_count++;
+            }
+            entry->chunk->last_used = ++s_lru_clock;
             g_jit_stats.jit_hits++;
             g_jit_stats.cache_hits++;
             return entry;
@@ -305,17 +824,91 @@ block_entry_t *jit_block_lookup(uint32_t pc, bool is_thumb)
     return NULL;
 }
 
-block_entry_t *jit_block_register(uint32_t pc, bool is_thumb, void *code, uint32_t size, bool l1_only)
+bool jit_block_should_compile(uint32_t pc, bool is_thumb)
 {
-    uint32_t idx = block_hash(pc, is_thumb);
+    uint32_t threshold = g_jit_config.tier_threshold;
+    
+    if (is_pc_failed(pc, is_thumb)) {
+        return false;
+    }
+    
+    /* Blocks that were hot before their chunk got evicted come straight back */
+    if (s_tier_counts == NULL || is_pc_hot(pc, is_thumb)) {
+        return true;
+    }
     
+    if (threshold > UINT8_MAX) {
+        threshold = UINT8_MAX;
+    }
+    
+    uint8_t *count = &s_tier_counts[pc_bitmap_index(pc, is_thumb) & (TIER_COUNT_SIZE - 1)];
+    if (*count + 1u >= threshold) {
+        /* Counted from zero again if the block is evicted while still cold */
+        *count = 0;
+        return true;
+    }
+    (*count)++;
+    g_jit_stats.tier_deferrals++;
+    return false;
+}
+
+void *jit_alloc_code(uint32_t pc, bool is_thumb, uint32_t size)
+{
+    code_cache_t *cache = code_cache_of(pc);
+    uint8_t generation = is_pc_hot(pc, is_thumb) ? CHUNK_OLD : CHUNK_YOUNG;
+    
+    size = (size + 15) & ~15;
+    s_reserved_chunk = NULL;
+    
+    if (cache->chunks == NULL || size > GBA_JIT_CODE_CHUNK_SIZE) {
+        GBA_JIT_LOGE(TAG, "No room for %u bytes of code", size);
+        g_jit_stats.cache_full_count++;
+        return NULL;
+    }
+    
+    code_chunk_t *chunk = cache->current[generation];
+    if (chunk == NULL || chunk->used + size > GBA_JIT_CODE_CHUNK_SIZE) {
+        chunk = chunk_take(cache, generation);
+        if (chunk == NULL) {
+            GBA_JIT_LOGE(TAG, "No chunk left to evict for %u bytes of code", size);
+            g_jit_stats.cache_full_count++;
+            return NULL;
+        }
+        cache->current[generation] = chunk;
+    }
+    
+    s_reserved_chunk = chunk;
+    return chunk->base + chunk->used;
+}
+
+block_entry_t *jit_block_register(uint32_t pc, uint32_t end_pc, bool is_thumb, void *code, uint32_t size, bool l1_only)
+{
+    code_chunk_t *chunk = s_reserved_chunk;
+    s_reserved_chunk = NULL;
+    
+    if (chunk == NULL || (uint8_t *)code != chunk->base + chunk->used) {
+        ESP_LOGE(TAG, "Block at PC=0x%08X was not generated into the reserved chunk", pc);
+        return NULL;
+    }
+    
+    /* Entries come back as chunks are evicted, so make some room if they ran out */
     block_entry_t *entry = block_pool_alloc();
+    while (entry == NULL && chunk_evict_lru(code_cache_of(pc))) {
+        entry = block_pool_alloc();
+    }
     if (entry == NULL) {
         ESP_LOGE(TAG, "Block pool exhausted");
         return NULL;
     }
     
+    if (s_live_blocks >= g_jit_config.block_hash_size &&
+        g_jit_config.block_hash_size < GBA_JIT_MAX_BLOCK_HASH_SIZE) {
+        block_hash_grow();
+    }
+    uint32_t idx = block_hash(pc, is_thumb);
+    
     entry->pc = pc;
+    entry->end_pc = end_pc;
     entry->native_code = (uint8_t *)code;
     entry->code_size = size;
     entry->is_thumb = is_thumb;
@@ -325,6 +918,22 @@ block_entry_t *jit_block_register(uint32_t pc, bool is_thumb, void *code, uint32
     
     entry->next = g_block_hash[idx];
     g_block_hash[idx] = entry;
+    s_live_blocks++;
+    
+    entry->chunk = chunk;
+    entry->chunk_next = chunk->blocks;
+    chunk->blocks = entry;
+    chunk->used += (size + 15) & ~15;
+    chunk->last_used = ++s_lru_clock;
+    if (chunk->generation == CHUNK_OLD) {
+        g_jit_stats.promotions++;
+    }
+    
+    if (jit_is_ram_address(pc)) {
+        entry->ram_next = s_ram_blocks;
+        s_ram_blocks = entry;
+        code_pages_mark(pc, end_pc);
+    }
     
     g_jit_stats.total_blocks++;
     g_jit_stats.compile_successes++;
@@ -332,31 +941,120 @@ block_entry_t *jit_block_register(uint32_t pc, bool is_thumb, void *code, uint32
     return entry;
 }
 
-void jit_block_invalidate(uint32_t pc, bool is_thumb)
+void jit_block_link(block_entry_t *block)
 {
-    uint32_t idx = block_hash(pc, is_thumb);
-    block_entry_t *entry = g_block_hash[idx];
-    block_entry_t *prev = NULL;
+    for (int i = 0; i < block->exit_count; i++) {
+        jit_exit_t *exit = &block->exits[i];
+        block_entry_t *target = find_block(exit->target_pc, block->is_thumb);
+        if (target != NULL) {
+            exit_link(exit, target);
+        } else if (s_pending_exits != NULL) {
+            exit_add_pending(exit);
+        }
+    }
     
-    while (entry != NULL) {
-        if (entry->pc == pc && entry->is_thumb == is_thumb) {
-            entry->valid = 0;
-            if (prev != NULL) {
-                prev->next = entry->next;
-            } else {
-                g_block_hash[idx] = entry->next;
+    if (s_pending_exits == NULL) {
+        return;
+    }
+    
+    jit_exit_t **list = &s_pending_exits[block_hash(block->pc, block->is_thumb)];
+    while (*list != NULL) {
+        jit_exit_t *exit = *list;
+        if (exit->target_pc == block->pc && exit->owner->is_thumb == block->is_thumb) {
+            *list = exit->next;
+            exit_link(exit, block);
+        } else {
+            list = &exit->next;
+        }
+    }
+}
+
+void jit_block_chain_returned(block_entry_t *block)
+{
+    /* Breadth-first over the linked exits, the entry block was counted by the lookup */
+    block_entry_t *queue[GBA_JIT_CHAIN_SAMPLE_BLOCKS];
+    uint32_t stamp = s_lru_clock;
+    int head = 0, count = 0;
+    
+    block->sampled = stamp;
+    queue[count++] = block;
+    
+    while (head < count) {
+        block_entry_t *entry = queue[head++];
+        for (int i = 0; i < entry->exit_count && count < GBA_JIT_CHAIN_SAMPLE_BLOCKS; i++) {
+            block_entry_t *target = entry->exits[i].linked;
+            if (target == NULL || target->sampled == stamp) {
+                continue;
             }
-            return;
+            target->sampled = stamp;
+            if (target->exec_count < UINT16_MAX) {
+                target->exec_count++;
+            }
+            target->chunk->last_used = stamp;
+            queue[count++] = target;
+        }
+    }
+}
+
+void jit_block_invalidate(uint32_t pc, bool is_thumb)
+{
+    /* The entry stays on its chunk's list until the chunk is evicted */
+    block_entry_t *entry = find_block(pc, is_thumb);
+    if (entry != NULL) {
+        block_unlink(entry);
+    }
+}
+
+bool jit_code_written(uint32_t addr)
+{
+    uint32_t offset;
+    uint32_t *pages = code_pages(addr, &offset);
+    bool dropped = false;
+    
+    if (pages == NULL) {
+        return false;
+    }
+    
+    /* Compare region offsets, blocks may have been entered through a mirror */
+    uint32_t page_start = offset & ~((1u << GBA_CODE_PAGE_SHIFT) - 1);
+    uint32_t page_end = page_start + (1u << GBA_CODE_PAGE_SHIFT);
+    
+    block_entry_t **list = &s_ram_blocks;
+    while (*list != NULL) {
+        block_entry_t *entry = *list;
+        uint32_t start;
+        if ((entry->pc >> 24) == (addr >> 24) && code_pages(entry->pc, &start) != NULL &&
+            start < page_end && start + (entry->end_pc - entry->pc) > page_start) {
+            *list = entry->ram_next;
+            entry->ram_next = NULL;
+            block_unlink(entry);
+            g_jit_stats.smc_invalidations++;
+            dropped = true;
+        } else {
+            list = &entry->ram_next;
         }
-        prev = entry;
-        entry = entry->next;
     }
+    
+    uint32_t page = offset >> GBA_CODE_PAGE_SHIFT;
+    pages[page >> 5] &= ~(1u << (page & 31));
+    
+    /* Whatever failed to translate there may be different code now */
+    if (s_failed_pc_bitmap != NULL) {
+        uint32_t idx = ((addr & ~((1u << GBA_CODE_PAGE_SHIFT) - 1)) >> 2) & (FAILED_PC_BITMAP_SIZE * 32 - 1);
+        memset(&s_failed_pc_bitmap[idx / 32], 0, (1u << GBA_CODE_PAGE_SHIFT) / 4 / 8);
+    }
+    
+    return dropped;
 }
 
 void jit_mark_pc_failed(uint32_t pc, bool is_thumb)
 {
     bool was_failed = is_pc_failed(pc, is_thumb);
     mark_pc_failed(pc, is_thumb);
+    if (jit_is_ram_address(pc)) {
+        /* So that new code copied over it gets another chance */
+        code_pages_mark(pc, pc + 4);
+    }
     if (!was_failed) {
         g_jit_stats.failed_pc_count++;
         ESP_LOGD(TAG, "Marked PC=0x%08X as failed (total failed PCs: %u)", 
@@ -369,11 +1067,6 @@ bool jit_is_pc_failed(uint32_t pc, bool is_thumb)
     return is_pc_failed(pc, is_thumb);
 }
 
-void *jit_alloc_code(uint32_t size, bool is_ram)
-{
-    return cache_alloc(size, is_ram);
-}
-
 void jit_code_flush(void *addr, size_t size)
 {
     jit_cache_flush(addr, size);
@@ -394,9 +1087,26 @@ void jit_print_stats(void)
     ESP_LOGI(TAG, "JIT hits: %u", g_jit_stats.jit_hits);
     ESP_LOGI(TAG, "Interpreter fallbacks: %u", g_jit_stats.interpreter_fallbacks);
     ESP_LOGI(TAG, "Cache full count: %u", g_jit_stats.cache_full_count);
+    ESP_LOGI(TAG, "Links: %u, unlinks: %u", g_jit_stats.links, g_jit_stats.unlinks);
+    ESP_LOGI(TAG, "SMC invalidations: %u", g_jit_stats.smc_invalidations);
+    ESP_LOGI(TAG, "Chunk evictions: %u (%u blocks), promotions: %u, hash resizes: %u",
+             g_jit_stats.chunk_evictions, g_jit_stats.evicted_blocks,
+             g_jit_stats.promotions, g_jit_stats.hash_resizes);
     ESP_LOGI(TAG, "L1 instructions: %u", g_jit_stats.l1_instructions);
     ESP_LOGI(TAG, "L2 instructions: %u", g_jit_stats.l2_instructions);
     ESP_LOGI(TAG, "Complex instructions: %u", g_jit_stats.complex_instructions);
+    ESP_LOGI(TAG, "Partial blocks: %u", g_jit_stats.partial_blocks);
+    ESP_LOGI(TAG, "Tier deferrals: %u", g_jit_stats.tier_deferrals);
+    
+    uint32_t mem_fast = g_jit_stats.mem_iwram + g_jit_stats.mem_ewram + g_jit_stats.mem_rom +
+                        g_jit_stats.mem_vram + g_jit_stats.mem_palette;
+    if (mem_fast + g_jit_stats.mem_slow > 0) {
+        ESP_LOGI(TAG, "Inline memory: IWRAM %u, EWRAM %u, ROM %u, VRAM %u, palette %u, slow %u",
+                 g_jit_stats.mem_iwram, g_jit_stats.mem_ewram, g_jit_stats.mem_rom,
+                 g_jit_stats.mem_vram, g_jit_stats.mem_palette, g_jit_stats.mem_slow);
+        ESP_LOGI(TAG, "Memory fast path rate: %u%%",
+                 (uint32_t)((uint64_t)mem_fast * 100 / (mem_fast + g_jit_stats.mem_slow)));
+    }
     
     if (g_jit_stats.jit_hits + g_jit_stats.interpreter_fallbacks > 0) {
         uint32_t hit_rate = g_jit_stats.jit_hits * 100 / 
@@ -404,24 +1114,17 @@ void jit_print_stats(void)
         ESP_LOGI(TAG, "JIT hit rate: %u%%", hit_rate);
     }
     
-    if (g_rom_cache != NULL && g_rom_cache_ptr != NULL) {
-        uint32_t used = g_rom_cache_ptr - g_rom_cache;
-        ESP_LOGI(TAG, "ROM cache used: %u / %u bytes (%u%%)",
-                 used, g_jit_config.rom_cache_size,
-                 used * 100 / g_jit_config.rom_cache_size);
+    if (s_rom_code.chunks != NULL) {
+        code_cache_usage(&s_rom_code, "ROM", g_jit_config.rom_cache_size);
     }
     
-    if (g_ram_cache != NULL && g_ram_cache_ptr != NULL) {
-        uint32_t used = g_ram_cache_ptr - g_ram_cache;
-        ESP_LOGI(TAG, "RAM cache used: %u / %u bytes (%u%%)",
-                 used, g_jit_config.ram_cache_size,
-                 used * 100 / g_jit_config.ram_cache_size);
+    if (s_ram_code.chunks != NULL) {
+        code_cache_usage(&s_ram_code, "RAM", g_jit_config.ram_cache_size);
     }
 }
 
 bool jit_is_ram_address(uint32_t addr)
 {
-    if (addr >= 0x02000000 && addr < 0x02040000) return true;
-    if (addr >= 0x03000000 && addr < 0x03008000) return true;
-    return false;
+    /* Including the mirrors, code_pages() folds them */
+    return (addr >> 24) == 0x02 || (addr >> 24) == 0x03;
 }
@@ -33,24 +33,69 @@ extern "C" {
 #define JIT_FEATURE_BLOCK_LINKING      0x08
 #define JIT_FEATURE_REGISTER_CACHING   0x10
 
+/* Frame shared by every block so that linked blocks can jump into each
+ * other. S0 holds the CPU state, then come the cached ARM registers and
+ * the operands of the pending flag-setting operation. */
+#define JIT_BLOCK_SCRATCHES            6
+#define JIT_BLOCK_CACHED_REGS          8
+#define JIT_BLOCK_FLAG_REGS            3
+#define JIT_BLOCK_SAVEDS               (1 + JIT_BLOCK_CACHED_REGS + JIT_BLOCK_FLAG_REGS)
+#define JIT_BLOCK_LOCALS               64
+
 /* --------------------------------------------------------------------- */
 /*  Data Structures                                                      */
 /* --------------------------------------------------------------------- */
 
+/* Maximum statically known exits per block (branch taken + not taken) */
+#define JIT_MAX_BLOCK_EXITS 2
+
+struct block_entry;
+struct code_chunk;
+
+/* Exit stub of a block towards a statically known PC. The stub holds a
+ * rewritable jump: it falls through to a return to the dispatcher until the
+ * target is compiled, then it is patched to jump straight into it. */
+typedef struct jit_exit {
+    uint32_t target_pc;             /* ARM PC the exit leads to */
+    uintptr_t jump_addr;            /* Patchable jump instruction */
+    uintptr_t fallback_addr;        /* Code returning target_pc to the dispatcher */
+    struct block_entry *owner;      /* Block the stub belongs to */
+    struct block_entry *linked;     /* Block the jump goes to, NULL if unlinked */
+    struct jit_exit *next;          /* Next exit into `linked`, or next pending exit in the same bucket */
+} jit_exit_t;
+
+/* Exit stub as recorded by the translator, resolved to addresses once the code is generated */
+typedef struct jit_exit_site {
+    uint32_t target_pc;
+    struct sljit_jump *jump;
+    struct sljit_label *fallback;
+} jit_exit_site_t;
+
 /* Block entry in the translation cache */
 typedef struct block_entry {
     uint32_t pc;                    /* Original ARM PC */
+    uint32_t end_pc;                /* First address after the block's instructions */
     uint8_t *native_code;           /* Pointer to native RISC-V code */
+    uint8_t *body;                  /* Code after the prologue, where linked blocks jump to */
     uint32_t code_size;             /* Size of native code in bytes */
-    uint16_t exec_count;            /* Number of times executed */
+    uint16_t exec_count;            /* Number of times dispatched, saturating */
+    uint32_t sampled;               /* Dispatch of the last chain sample that credited it */
     uint8_t is_thumb;               /* 1 if Thumb mode block */
     uint8_t valid;                  /* 1 if block is valid */
     uint8_t l1_only;                /* 1 if only L1 instructions */
     uint8_t flags;                  /* Block flags */
+    uint8_t exit_count;             /* Used entries in exits */
+    jit_exit_t exits[JIT_MAX_BLOCK_EXITS];
+    jit_exit_t *incoming;           /* Exits of other blocks linked to this one */
     struct block_entry *next;       /* Hash collision chain */
+    struct block_entry *ram_next;   /* Next block compiled from work RAM */
+    struct code_chunk *chunk;       /* Cache chunk holding the native code */
+    struct block_entry *chunk_next; /* Next block in the same chunk */
 } block_entry_t;
 
-/* GBA CPU state for JIT execution */
+/* GBA CPU state for JIT execution. It stays live across blocks (and linked
+ * chains of blocks), the core's register file is only synchronized with
+ * jit_state_load/jit_state_store around interpreter and update_gba calls. */
 typedef struct gba_cpu_state {
     uint32_t reg[16];               /* R0-R15 */
     uint32_t cpsr;                  /* Current program status register */
@@ -64,6 +109,8 @@ typedef struct gba_cpu_state {
     uint8_t z_flag;                 /* Zero flag */
     uint8_t c_flag;                 /* Carry flag */
     uint8_t v_flag;                 /* Overflow flag */
+    
+    uint32_t alert;                 /* CPU_ALERT_* of the stores since the dispatcher entered the chain */
 } gba_cpu_state_t;
 
 /* JIT statistics */
@@ -72,15 +119,30 @@ typedef struct jit_stats {
     uint32_t total_compiles;        /* Total compile attempts */
     uint32_t jit_hits;              /* JIT execution hits */
     uint32_t interpreter_fallbacks; /* Fallbacks to interpreter */
-    uint32_t cache_full_count;      /* Cache full events */
+    uint32_t cache_full_count;      /* Blocks that found no room in the cache */
     uint32_t l1_instructions;       /* L1 instructions translated */
     uint32_t l2_instructions;       /* L2 instructions translated */
     uint32_t complex_instructions;  /* Complex instructions (fallback) */
+    uint32_t partial_blocks;        /* Blocks ending before an instruction left to the interpreter */
+    uint32_t tier_deferrals;        /* Dispatches interpreted because the PC wasn't hot yet */
     uint32_t failed_pc_count;      /* Number of failed PCs marked */
     uint32_t compile_successes;     /* Successful compilations */
     uint32_t compile_failures;      /* Failed compilations */
     uint32_t cache_hits;            /* Cache lookup hits */
     uint32_t cache_misses;          /* Cache lookup misses */
+    uint32_t links;                 /* Exit stubs patched to jump into another block */
+    uint32_t unlinks;               /* Exit stubs restored because their target was invalidated */
+    uint32_t smc_invalidations;     /* Blocks dropped because their code was written to */
+    uint32_t chunk_evictions;       /* Cache chunks recycled, least recently used first */
+    uint32_t evicted_blocks;        /* Blocks dropped along with their chunk */
+    uint32_t promotions;            /* Hot blocks recompiled into the old generation */
+    uint32_t hash_resizes;          /* Times the block hash table was doubled */
+    uint32_t mem_iwram;             /* Inline IWRAM accesses */
+    uint32_t mem_ewram;             /* Inline EWRAM accesses */
+    uint32_t mem_rom;               /* Inline ROM reads */
+    uint32_t mem_vram;              /* Inline VRAM reads */
+    uint32_t mem_palette;           /* Inline palette reads */
+    uint32_t mem_slow;              /* Accesses through the gba_mem_* helpers */
 } jit_stats_t;
 
 /* JIT configuration */
@@ -89,10 +151,13 @@ typedef struct jit_config {
     uint32_t ram_cache_size;        /* RAM translation cache size */
     uint32_t block_hash_size;       /* Block hash table size */
     uint32_t max_block_instructions;/* Max instructions per block */
+    uint32_t tier_threshold;        /* Interpreted dispatches of a PC before it is compiled */
+    uint32_t deadline_interval;     /* Instructions between due event checks in a block, 0 for none */
     uint8_t enable_l1;              /* Enable L1 translation */
     uint8_t enable_l2;              /* Enable L2 translation */
     uint8_t enable_thumb;           /* Enable Thumb translation */
     uint8_t enable_stats;           /* Enable statistics */
+    uint8_t enable_reg_cache;       /* Keep hot ARM registers in host registers within a block */
 } jit_config_t;
 
 /* --------------------------------------------------------------------- */
@@ -192,6 +257,63 @@ block_entry_t *jit_block_compile(uint32_t pc, bool is_thumb);
  */
 uint32_t jit_execute_block(block_entry_t *block, gba_cpu_state_t *cpu);
 
+/**
+ * Get the exit stubs recorded by the last jit_translate_block call
+ * @param sites Receives the site array
+ * @return Number of sites
+ */
+int jit_translate_get_exit_sites(const jit_exit_site_t **sites);
+
+/**
+ * Copy the core's register file (R0-R15 then CPSR) into the JIT state
+ * @param cpu JIT CPU state
+ * @param regs Core registers, regs[16] is the CPSR
+ */
+void jit_state_load(gba_cpu_state_t *cpu, const uint32_t *regs);
+
+/**
+ * Write the JIT state back to the core's register file, packing the flags into the CPSR
+ * @param cpu JIT CPU state
+ * @param regs Core registers, regs[16] is the CPSR
+ */
+void jit_state_store(const gba_cpu_state_t *cpu, uint32_t *regs);
+
+/**
+ * Patch the exit stubs of a freshly compiled block towards already compiled
+ * targets, and the pending exits of other blocks towards it
+ * @param block Newly registered block
+ */
+void jit_block_link(block_entry_t *block);
+
+/**
+ * Credit the blocks linked from a dispatched block, which ran without a
+ * lookup, so that hot chains stay resident and get promoted
+ * @param block Block the dispatcher entered
+ */
+void jit_block_chain_returned(block_entry_t *block);
+
+/**
+ * Invalidate a block, unlinking every exit that jumps into it
+ * @param pc ARM program counter
+ * @param is_thumb Thumb mode flag
+ */
+void jit_block_invalidate(uint32_t pc, bool is_thumb);
+
+/**
+ * Drop every block compiled from the work RAM page holding addr. Installed
+ * as gba_code_write_hook, the core calls it on stores to a marked page.
+ * @param addr GBA address that was written
+ * @return true if blocks were dropped, the running one may be among them
+ */
+bool jit_code_written(uint32_t addr);
+
+/**
+ * Check if an address is in work RAM (EWRAM or IWRAM, mirrors included)
+ * @param addr GBA address
+ * @return true if code there can be overwritten
+ */
+bool jit_is_ram_address(uint32_t addr);
+
 /**
  * Get JIT statistics
  * @param stats Statistics structure to fill
@@ -218,6 +340,13 @@ trans_level_t jit_can_translate(uint32_t opcode, bool is_thumb);
  */
 bool is_l1_instruction(uint32_t opcode);
 
+/**
+ * Check if an ARM instruction is L2 (medium) translatable
+ * @param opcode ARM opcode (32-bit)
+ * @return true if L2 translatable
+ */
+bool is_l2_instruction(uint32_t opcode);
+
 /**
  * Check if a Thumb instruction is L1 (simple) translatable
  * @param opcode Thumb opcode (16-bit)
@@ -225,6 +354,14 @@ bool is_l1_instruction(uint32_t opcode);
  */
 bool is_l1_thumb_instruction(uint16_t opcode);
 
+/**
+ * Count a dispatch to a PC that has no block yet
+ * @param pc ARM program counter
+ * @param is_thumb Thumb mode flag
+ * @return true once the PC was reached often enough to be worth compiling
+ */
+bool jit_block_should_compile(uint32_t pc, bool is_thumb);
+
 /**
  * Mark a PC as failed translation (will not retry)
  * @param pc ARM program counter
@@ -240,17 +377,33 @@ void jit_mark_pc_failed(uint32_t pc, bool is_thumb);
  */
 bool jit_is_pc_failed(uint32_t pc, bool is_thumb);
 
+/* --------------------------------------------------------------------- */
+/*  Self-Test (jit_test.c, built with -DGBSP_JIT_SELFTEST=1)             */
+/* --------------------------------------------------------------------- */
+
+/**
+ * Run the hand-assembled tests, the differential test and the compile
+ * benchmark against mock memory
+ * @return Number of failed tests
+ */
+int jit_run_tests(void);
+
+/**
+ * Differential test of the JIT against the reference model, with L2 and
+ * Thumb translation on and the register cache both on and off
+ * @param rom Optional ROM image, its ARM code is used instead of random streams
+ * @param rom_size ROM size in bytes
+ * @param iterations Number of blocks to compare
+ * @return Number of mismatches
+ */
+int jit_run_differential(const uint8_t *rom, uint32_t rom_size, int iterations);
+
 /* --------------------------------------------------------------------- */
 /*  Memory Access Functions (to be provided by GBA core)                 */
 /* --------------------------------------------------------------------- */
 
-/* These functions must be implemented by the GBA emulator core */
-extern uint32_t gba_mem_read32(uint32_t addr);
-extern void gba_mem_write32(uint32_t addr, uint32_t value);
-extern uint16_t gba_mem_read16(uint32_t addr);
-extern void gba_mem_write16(uint32_t addr, uint16_t value);
-extern uint8_t gba_mem_read8(uint32_t addr);
-extern void gba_mem_write8(uint32_t addr, uint8_t value);
+/* These functions are implemented by the GBA emulator core */
+#include "jit_memory.h"
 
 /* --------------------------------------------------------------------- */
 /*  External Data                                                        */
@@ -258,11 +411,10 @@ extern void gba_mem_write8(uint32_t addr, uint8_t value);
 
 extern block_entry_t **g_block_hash;
 extern uint8_t *g_rom_cache;
-extern uint8_t *g_rom_cache_ptr;
 extern uint8_t *g_ram_cache;
-extern uint8_t *g_ram_cache_ptr;
 extern jit_stats_t g_jit_stats;
 extern jit_config_t g_jit_config;
+extern gba_cpu_state_t g_jit_cpu;
 
 #ifdef __cplusplus
 }
@@ -79,150 +79,227 @@ static insn_type_t detect_insn_type(uint32_t opcode)
 /* --------------------------------------------------------------------- */
 
 /*
- * JIT指令验证状态 (2026-02-23)
- * 
- * ✅ 已验证正常：
- *    - 数据处理指令 (type=0x00/0x01):
- *      ✅ ADD, SUB, MOV, AND, ORR, CMP
- * 
- * 🔶 已启用待验证：
- *    - 数据处理指令: EOR, BIC, MVN, TST, ADC, SBC, TEQ, CMN, RSB, RSC
- * 
- * ❌ 已验证有问题：
- *    - 分支指令 (type=0x05): B, BL - 导致PC跳转错误
- *    - 加载/存储指令 (type=0x02/0x03): LDR, STR - 导致Load access fault崩溃
- * 
- * ⏳ 待验证：
- *    - 块传输指令 (type=0x04): LDM, STM
+ * L1 covers data processing, word/byte transfers and branches, in the
+ * forms the translators implement: register operands are unshifted and
+ * R15 is neither read as an operand nor written by anything but MOV.
+ * Everything else is left to L2, Thumb or the interpreter.
  */
 
+/* Flag-setting variants translated like their plain version */
+static bool dp_drops_flags(uint32_t opcode)
+{
+    uint32_t op = (opcode >> 21) & 0x0F;
+    bool is_imm = (opcode >> 25) & 0x01;
+    
+    if (!((opcode >> 20) & 0x01)) {
+        return false;
+    }
+    
+    switch (op) {
+        case 0x5: case 0x6: case 0x7:           /* ADCS, SBCS, RSCS */
+            return true;
+        case 0x1: case 0xC: case 0xE: case 0xF: /* EORS, ORRS, BICS, MVNS #imm */
+            return is_imm;
+        case 0x0: case 0x8: case 0x9: case 0xD: /* A rotated immediate also sets C */
+            return is_imm && ((opcode >> 8) & 0x0F) != 0;
+        default:
+            return false;
+    }
+}
+
 bool is_l1_instruction(uint32_t opcode)
 {
     uint32_t type = (opcode >> 25) & 0x07;
     
-    /* ✅ 数据处理指令 - 已验证正常 */
+    if ((opcode >> 28) == 0x0F) {
+        return false;
+    }
+    
     if (type == 0x00 || type == 0x01) {
-        uint32_t opcode_field = (opcode >> 21) & 0x0F;
+        uint32_t op = (opcode >> 21) & 0x0F;
+        bool s_bit = (opcode >> 20) & 0x01;
+        uint32_t rn = (opcode >> 16) & 0x0F;
+        uint32_t rd = (opcode >> 12) & 0x0F;
         
-        /* BX 指令 - 排除 */
-        if ((opcode & 0x0FFFFFF0) == 0x012FFF10) {
+        /* Multiplies, swaps and halfword transfers */
+        if (type == 0x00 && (opcode & 0x90) == 0x90) {
             return false;
         }
         
-        /* MUL 指令 - 排除 */
-        if ((opcode & 0x0FC000F0) == 0x00000090) {
+        /* TST/TEQ/CMP/CMN without S are MRS, MSR and BX */
+        if (op >= 0x08 && op <= 0x0B && !s_bit) {
             return false;
         }
         
-        /* MLA 指令 - 排除 */
-        if ((opcode & 0x0FC000F0) == 0x01000090) {
+        if (type == 0x00 && ((opcode & 0xFF0) != 0 || (opcode & 0x0F) == 15)) {
             return false;
         }
         
-        /* UMULL/SMULL 指令 - 排除 */
-        if ((opcode & 0x0F8000F0) == 0x00800090) {
+        if (rn == 15 && op != 0x0D && op != 0x0F) {
             return false;
         }
         
-        switch (opcode_field) {
-            case 0x00:  /* ✅ AND - 已验证正常 */
-            case 0x01:  /* 🔶 EOR - 已启用待验证 */
-            case 0x02:  /* ✅ SUB - 已验证正常 */
-            case 0x03:  /* 🔶 RSB - 已启用待验证 */
-            case 0x04:  /* ✅ ADD - 已验证正常 */
-            case 0x05:  /* 🔶 ADC - 已启用待验证 */
-            case 0x06:  /* 🔶 SBC - 已启用待验证 */
-            case 0x07:  /* 🔶 RSC - 已启用待验证 */
-            case 0x08:  /* 🔶 TST - 已启用待验证 */
-            case 0x09:  /* 🔶 TEQ - 已启用待验证 */
-            case 0x0A:  /* ✅ CMP - 已验证正常 */
-            case 0x0B:  /* 🔶 CMN - 已启用待验证 */
-            case 0x0C:  /* ✅ ORR - 已验证正常 */
-            case 0x0D:  /* ✅ MOV - 已验证正常 */
-            case 0x0E:  /* 🔶 BIC - 已启用待验证 */
-            case 0x0F:  /* 🔶 MVN - 已启用待验证 */
-                return true;
-            default:
-                return false;
+        if (rd == 15 && (op != 0x0D || s_bit)) {
+            return false;
         }
+        
+        return !dp_drops_flags(opcode);
     }
     
-    /* ✅ 加载/存储指令 - 标志同步修复后启用 */
     if (type == 0x02 || type == 0x03) {
+        bool is_load = (opcode >> 20) & 0x01;
+        bool is_byte = (opcode >> 22) & 0x01;
+        uint32_t rn = (opcode >> 16) & 0x0F;
+        uint32_t rd = (opcode >> 12) & 0x0F;
+        
+        /* Pre-indexed without writeback */
+        if (!((opcode >> 24) & 0x01) || ((opcode >> 21) & 0x01) || rd == 15) {
+            return false;
+        }
+        if (type == 0x03) {
+            /* Unshifted word register offsets */
+            return !is_byte && rn != 15 && (opcode & 0xFF0) == 0 && (opcode & 0x0F) != 15;
+        }
+        bool up = (opcode >> 23) & 0x01;
+        
+        /* PC-relative loads are folded to a constant address, always added */
+        if (rn == 15 && (!is_load || !up)) {
+            return false;
+        }
+        /* Byte offsets are only ever added */
+        return !is_byte || up;
+    }
+    
+    /* B and BL */
+    if (type == 0x05) {
         return true;
     }
     
-    /* ⏳ 块传输指令 - 待验证 */
-    if (type == 0x04) {
+    return false;
+}
+
+/*
+ * L2 covers the instructions with a translator of their own: MUL/MLA,
+ * halfword and signed transfers, BX and LDM/STM. Long multiplies stay
+ * out, their helpers return 64 bits through a 32-bit register here.
+ */
+bool is_l2_instruction(uint32_t opcode)
+{
+    uint32_t type = (opcode >> 25) & 0x07;
+    uint32_t rn = (opcode >> 16) & 0x0F;
+    uint32_t rd = (opcode >> 12) & 0x0F;
+    
+    if ((opcode >> 28) == 0x0F) {
         return false;
     }
     
-    /* ✅ 分支指令 - 已启用，标志同步修复后可用 */
-    if (type == 0x05) {
-        return true;
+    if (type == 0x00) {
+        if ((opcode & 0x0FFFFFF0) == 0x012FFF10) {
+            return true;                        /* BX */
+        }
+        
+        if ((opcode & 0x0FC000F0) == 0x00000090) {
+            /* MUL, MLA, R15 gives unpredictable results */
+            return rn != 15 && (opcode & 0x0F) != 15 && ((opcode >> 8) & 0x0F) != 15 &&
+                   (!((opcode >> 21) & 0x01) || rd != 15);
+        }
+        
+        if ((opcode & 0x90) == 0x90 && (opcode & 0x60) != 0) {
+            bool is_load = (opcode >> 20) & 0x01;
+            bool pre_index = (opcode >> 24) & 0x01;
+            bool writeback = !pre_index || ((opcode >> 21) & 0x01);
+            
+            /* LDRD/STRD encodings don't exist on the ARM7 */
+            if (!is_load && (opcode & 0x60) != 0x20) {
+                return false;
+            }
+            if (rd == 15 || (writeback && rn == 15)) {
+                return false;
+            }
+            /* Register offset needs the immediate bits clear */
+            if (!((opcode >> 22) & 0x01) && ((opcode & 0x0F00) != 0 || (opcode & 0x0F) == 15)) {
+                return false;
+            }
+            return !(writeback && rn == rd);
+        }
+        
+        return false;
     }
     
-    /* 协处理器指令 - 不支持 */
-    if (type == 0x07) {
-        return false;
+    if (type == 0x04) {
+        uint16_t reg_list = opcode & 0xFFFF;
+        bool is_load = (opcode >> 20) & 0x01;
+        bool writeback = (opcode >> 21) & 0x01;
+        
+        /* User bank transfers and SPSR restores stay in the interpreter */
+        if (((opcode >> 22) & 0x01) || reg_list == 0 || rn == 15) {
+            return false;
+        }
+        /* A stored base that was written back depends on its position in the list */
+        if (!is_load && writeback && ((reg_list >> rn) & 1)) {
+            return false;
+        }
+        return true;
     }
     
     return false;
 }
 
+/*
+ * Thumb formats, see the ARM7TDMI data sheet. SWI, LDMIA/STMIA with the
+ * base in the list and the undefined encodings are left to the interpreter.
+ */
 bool is_l1_thumb_instruction(uint16_t opcode)
 {
-    uint16_t op = (opcode >> 11) & 0x1F;
-    
-    switch (op) {
-        case 0x00:  /* LSL/LSR/ASR/ADD/SUB 寄存器 - ⏳ 待验证 */
-        case 0x01:  /* LSL/LSR/ASR/ADD/SUB 寄存器 - ⏳ 待验证 */
-        case 0x02:  /* LSL/LSR/ASR/ADD/SUB 寄存器 - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x03:  /* MOV/CMP/ADD 立即数 - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x04:  /* ALU操作 - ⏳ 待验证 */
-        case 0x05:  /* ALU操作 - ⏳ 待验证 */
-        case 0x06:  /* ALU操作 - ⏳ 待验证 */
-        case 0x07:  /* ALU操作 - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x08:  /* ADD 立即数(8位) - ⏳ 待验证 */
-        case 0x09:  /* ADD 立即数(8位) - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x0A:  /* SUB 立即数(8位) - ⏳ 待验证 */
-        case 0x0B:  /* SUB 立即数(8位) - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x0C:  /* ALU操作(AND/EOR/ADC等) - ⏳ 待验证 */
-        case 0x0D:  /* ALU操作(AND/EOR/ADC等) - ⏳ 待验证 */
-        case 0x0E:  /* ALU操作(AND/EOR/ADC等) - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x0F:  /* ❌ BX/CMP/MOV/LDR PC - 已验证有问题: BX导致PC跳转错误 */
-            return false;  /* ❌ BX指令导致ROM卡死 */
-        case 0x10:  /* LDR PC相对 - ⏳ 待验证 */
-        case 0x11:  /* LDR PC相对 - ⏳ 待验证 */
-        case 0x12:  /* LDR PC相对 - ⏳ 待验证 */
-        case 0x13:  /* LDR PC相对 - ⏳ 待验证 */
-        case 0x14:  /* LDR PC相对 - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x15:  /* STR 寄存器偏移 - ⏳ 待验证 */
-        case 0x16:  /* STR 寄存器偏移 - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x17:  /* STRB 立即数 - ⏳ 待验证 */
-        case 0x18:  /* STRB 立即数 - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x19:  /* LDR 立即数 - ⏳ 待验证 */
-        case 0x1A:  /* LDR 立即数 - ⏳ 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x1B:  /* ❌ LDRH 立即数 - 待验证 */
-            return false;  /* ❌ Thumb指令全部禁用 */
-        case 0x1C:  /* ❌ 条件分支/SWI - 已验证有问题: 分支导致PC跳转错误 */
-            return false;  /* ❌ 条件分支导致ROM卡死 */
-        case 0x1D:  /* ❌ 无条件分支 B - 已验证有问题: PC跳转错误 */
-            return false;  /* ❌ B指令导致ROM卡死 */
-        case 0x1E:  /* ❌ 长分支前缀 BL前缀 - 已验证有问题: PC跳转错误 */
-            return false;  /* ❌ BL前缀导致ROM卡死 */
-        case 0x1F:  /* ❌ 长分支后缀 BL后缀 - 已验证有问题: PC跳转错误 */
-            return false;  /* ❌ BL后缀导致ROM卡死 */
+    switch (opcode >> 12) {
+        case 0x0:                               /* LSL, LSR */
+        case 0x1:                               /* ASR, ADD/SUB */
+        case 0x2:                               /* MOV, CMP */
+        case 0x3:                               /* ADD, SUB immediate */
+        case 0x5:                               /* Register offset transfers */
+        case 0x6:                               /* LDR/STR immediate offset */
+        case 0x7:                               /* LDRB/STRB immediate offset */
+        case 0x8:                               /* LDRH/STRH */
+        case 0x9:                               /* SP-relative LDR/STR */
+        case 0xA:                               /* ADD to PC/SP */
+            return true;
+            
+        case 0x4:
+            if ((opcode & 0xFC00) == 0x4000) {
+                return true;                    /* ALU operations */
+            }
+            if ((opcode & 0xFC00) == 0x4400) {
+                /* Hi register operations, BX with H1 set is BLX on later cores */
+                uint32_t op = (opcode >> 8) & 0x3;
+                return op != 0x3 || !(opcode & 0x80);
+            }
+            return true;                        /* LDR PC-relative */
+            
+        case 0xB:
+            if ((opcode & 0xFF00) == 0xB000) {
+                return true;                    /* ADD SP, #imm */
+            }
+            if ((opcode & 0xF600) == 0xB400) {
+                return (opcode & 0x01FF) != 0;  /* PUSH/POP */
+            }
+            return false;
+            
+        case 0xC:
+            {
+                uint32_t rb = (opcode >> 8) & 0x7;
+                /* LDMIA/STMIA, the base in the list changes the writeback */
+                return (opcode & 0xFF) != 0 && !((opcode >> rb) & 1);
+            }
+            
+        case 0xD:
+            return ((opcode >> 8) & 0xF) < 0xE;  /* Conditional branch */
+            
+        case 0xE:
+            return !(opcode & 0x0800);           /* B */
+            
+        case 0xF:
+            return true;                        /* BL prefix and suffix */
+            
         default:
             return false;
     }
@@ -245,20 +322,8 @@ trans_level_t jit_get_translation_level(uint32_t opcode, bool is_thumb)
         return TRANS_LEVEL_L1;
     }
     
-    uint8_t cond = opcode >> 28;
-    if (cond == 0x0E) {
-        uint32_t type = (opcode >> 25) & 0x07;
-        
-        if (type == 0x00 || type == 0x01) {
-            uint32_t s_bit = (opcode >> 20) & 0x01;
-            if (s_bit) {
-                return TRANS_LEVEL_L2;
-            }
-        }
-        
-        if (type == 0x02 || type == 0x03) {
-            return TRANS_LEVEL_L2;
-        }
+    if (is_l2_instruction(opcode)) {
+        return TRANS_LEVEL_L2;
     }
     
     return TRANS_LEVEL_NONE;
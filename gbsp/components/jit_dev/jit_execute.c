@@ -13,9 +13,12 @@ static const char *TAG = "JIT_EXEC";
 extern jit_stats_t g_jit_stats;
 extern jit_config_t g_jit_config;
 
-extern void *jit_alloc_code(uint32_t size, bool is_ram);
+/* CPU state shared by all blocks, see jit_state_load/jit_state_store */
+gba_cpu_state_t g_jit_cpu;
+
+extern void *jit_alloc_code(uint32_t pc, bool is_thumb, uint32_t size);
 extern void jit_code_flush(void *addr, size_t size);
-extern block_entry_t *jit_block_register(uint32_t pc, bool is_thumb, void *code, uint32_t size, bool l1_only);
+extern block_entry_t *jit_block_register(uint32_t pc, uint32_t end_pc, bool is_thumb, void *code, uint32_t size, bool l1_only);
 extern bool jit_is_ram_address(uint32_t addr);
 
 extern trans_level_t jit_get_translation_level(uint32_t opcode, bool is_thumb);
@@ -54,12 +57,16 @@ block_entry_t *jit_block_compile(uint32_t pc, bool is_thumb)
     }
     
     sljit_emit_enter(C, 0, SLJIT_ARGS2(W, P, W), 
-                     6, 5, 64);
+                     JIT_BLOCK_SCRATCHES, JIT_BLOCK_SAVEDS, JIT_BLOCK_LOCALS);
     
     sljit_emit_op1(C, SLJIT_MOV_P, SLJIT_S0, 0, SLJIT_R0, 0);
     
+    /* Linked blocks jump here, reusing the frame of the first block in the chain */
+    struct sljit_label *body = sljit_emit_label(C);
+    
     uint32_t end_pc = pc;
     
+    /* A block stops before the first instruction it can't translate and exits to it */
     bool l1_only = jit_translate_block(C, pc, is_thumb, &end_pc);
     
     if (end_pc == pc) {
@@ -70,16 +77,42 @@ block_entry_t *jit_block_compile(uint32_t pc, bool is_thumb)
         return NULL;
     }
     
-    if (!l1_only) {
-        ESP_LOGI(TAG, "Non-L1 block at PC=0x%08X, using interpreter", pc);
+    /* sljit only shrinks the code while generating it, so its current size is an upper bound */
+    sljit_uw max_size = C->size * sizeof(sljit_u16);
+    void *buffer = jit_alloc_code(pc, is_thumb, max_size);
+    if (buffer == NULL) {
+        ESP_LOGE(TAG, "No room in the translation cache for PC=0x%08X", pc);
         sljit_free_compiler(C);
-        jit_mark_pc_failed(pc, is_thumb);
         g_jit_stats.compile_failures++;
         return NULL;
     }
     
-    void *code = sljit_generate_code(C, 0, NULL);
-    size_t code_size = sljit_get_generated_code_size(C);
+    struct sljit_generate_code_buffer target = {
+        .buffer = buffer,
+        .size = max_size,
+        .executable_offset = 0,
+    };
+    void *code = sljit_generate_code(C, SLJIT_GENERATE_CODE_BUFFER, &target);
+    
+    /* The reduced size in halfwords is exact, executable_size counts whole instructions */
+    size_t code_size = C->size * sizeof(sljit_u16);
+    
+    /* Addresses are only available until the compiler is freed */
+    const jit_exit_site_t *sites;
+    int site_count = jit_translate_get_exit_sites(&sites);
+    jit_exit_t exits[JIT_MAX_BLOCK_EXITS];
+    uint8_t *body_addr = NULL;
+    
+    if (code != NULL) {
+        body_addr = (uint8_t *)sljit_get_label_addr(body);
+        for (int i = 0; i < site_count; i++) {
+            exits[i] = (jit_exit_t){
+                .target_pc = sites[i].target_pc,
+                .jump_addr = sljit_get_jump_addr(sites[i].jump),
+                .fallback_addr = sljit_get_label_addr(sites[i].fallback),
+            };
+        }
+    }
     
     sljit_free_compiler(C);
     
@@ -90,19 +123,28 @@ block_entry_t *jit_block_compile(uint32_t pc, bool is_thumb)
         return NULL;
     }
     
-    jit_code_flush(code, code_size);
-    
-    block_entry_t *entry = jit_block_register(pc, is_thumb, code, code_size, l1_only);
+    block_entry_t *entry = jit_block_register(pc, end_pc, is_thumb, code, code_size, l1_only);
     
     if (entry == NULL) {
+        /* Nothing was committed, the next block reuses the reservation. The PC
+         * itself is fine, it gets another chance once entries are recycled. */
         ESP_LOGE(TAG, "Failed to register block for PC=0x%08X (cache full?)", pc);
-        heap_caps_free(code);
-        jit_mark_pc_failed(pc, is_thumb);
         g_jit_stats.cache_full_count++;
         g_jit_stats.compile_failures++;
         return NULL;
     }
     
+    entry->body = body_addr;
+    entry->exit_count = site_count;
+    for (int i = 0; i < site_count; i++) {
+        entry->exits[i] = exits[i];
+        entry->exits[i].owner = entry;
+    }
+    jit_block_link(entry);
+    
+    /* After linking, so the block's own patched exits are covered too */
+    jit_code_flush(code, code_size);
+    
     // 临时注释 - 调试日志
     // ESP_LOGD(TAG, "Block compiled: PC=0x%08X, size=%u bytes", pc, code_size);
     
@@ -125,11 +167,13 @@ uint32_t jit_execute_block(block_entry_t *block, gba_cpu_state_t *cpu)
     typedef uint32_t (*block_func_t)(void *, uint32_t);
     block_func_t func = (block_func_t)block->native_code;
     
+    cpu->alert = 0;
     uint32_t new_pc = func(cpu, cpu->cycles_target);
     
     cpu->reg[15] = new_pc;
     
-    g_jit_stats.jit_hits++;
+    /* Hits are counted by jit_block_lookup, linked blocks are credited here */
+    jit_block_chain_returned(block);
     
     if (new_pc != old_pc + 4 && new_pc != old_pc + 8) {
         if (new_pc < 0x1000) {
@@ -141,6 +185,30 @@ uint32_t jit_execute_block(block_entry_t *block, gba_cpu_state_t *cpu)
     return new_pc;
 }
 
+/* --------------------------------------------------------------------- */
+/*  CPU State Synchronization                                            */
+/* --------------------------------------------------------------------- */
+
+void jit_state_load(gba_cpu_state_t *cpu, const uint32_t *regs)
+{
+    memcpy(cpu->reg, regs, sizeof(cpu->reg));
+    cpu->cpsr = regs[16];
+    cpu->n_flag = (cpu->cpsr >> 31) & 1;
+    cpu->z_flag = (cpu->cpsr >> 30) & 1;
+    cpu->c_flag = (cpu->cpsr >> 29) & 1;
+    cpu->v_flag = (cpu->cpsr >> 28) & 1;
+}
+
+void jit_state_store(const gba_cpu_state_t *cpu, uint32_t *regs)
+{
+    memcpy(regs, cpu->reg, sizeof(cpu->reg));
+    regs[16] = (cpu->cpsr & 0x0FFFFFFF) |
+               ((cpu->n_flag & 1) << 31) |
+               ((cpu->z_flag & 1) << 30) |
+               ((cpu->c_flag & 1) << 29) |
+               ((cpu->v_flag & 1) << 28);
+}
+
 /* --------------------------------------------------------------------- */
 /*  Translation Level Check                                              */
 /* --------------------------------------------------------------------- */
@@ -2,10 +2,17 @@
  * JIT Test Suite for GBA Dynamic Recompiler
  * 
  * Standalone test for verifying JIT functionality.
+ *
+ * Besides the hand-assembled tests, randomized ARM and Thumb instruction
+ * streams (or stretches of a real ROM) are run through the JIT and a
+ * reference model in lockstep, diffing registers, flags, the next PC and
+ * every memory write after each block. A compile throughput benchmark
+ * reuses the generator.
  */
 
 #include "jit_core.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -14,6 +21,42 @@ static const char *TAG = "JIT_TEST";
 /* Mock memory for testing */
 static uint8_t s_test_memory[0x100000];
 
+/* Hand-assembled tests run from the start of the ROM area, which the mocks
+ * fold onto s_test_memory. The BIOS region is never compiled. */
+#define TEST_CODE_BASE      0x08000000
+
+/* Writes through the mocks, so that both engines' stores can be compared and undone.
+ * Room for a stream of STMs storing every register they may. */
+#define WRITE_LOG_SIZE 512
+
+typedef struct {
+    uint32_t addr;
+    uint32_t value;
+    uint32_t old;
+    uint8_t size;
+} mem_write_t;
+
+static mem_write_t s_write_log[WRITE_LOG_SIZE];
+static int s_write_count = 0;
+static bool s_write_logging = false;
+
+static void log_write(uint32_t addr, uint32_t value, uint8_t size)
+{
+    if (!s_write_logging || s_write_count >= WRITE_LOG_SIZE) {
+        return;
+    }
+    mem_write_t *w = &s_write_log[s_write_count++];
+    w->addr = addr;
+    w->value = value;
+    w->size = size;
+    memcpy(&w->old, s_test_memory + addr, size);
+}
+
+/* Mock code page tracking, owned by the core */
+uint32_t gba_code_pages_ewram[GBA_CODE_PAGES_EWRAM / 32];
+uint32_t gba_code_pages_iwram[GBA_CODE_PAGES_IWRAM / 32];
+bool (*gba_code_write_hook)(uint32_t addr);
+
 /* Mock GBA memory access functions */
 uint32_t gba_mem_read32(uint32_t addr)
 {
@@ -21,10 +64,12 @@ uint32_t gba_mem_read32(uint32_t addr)
     return *(uint32_t *)(s_test_memory + addr);
 }
 
-void gba_mem_write32(uint32_t addr, uint32_t value)
+uint32_t gba_mem_write32(uint32_t addr, uint32_t value)
 {
     addr &= 0xFFFFF;
+    log_write(addr, value, 4);
     *(uint32_t *)(s_test_memory + addr) = value;
+    return 0;
 }
 
 uint16_t gba_mem_read16(uint32_t addr)
@@ -33,10 +78,12 @@ uint16_t gba_mem_read16(uint32_t addr)
     return *(uint16_t *)(s_test_memory + addr);
 }
 
-void gba_mem_write16(uint32_t addr, uint16_t value)
+uint32_t gba_mem_write16(uint32_t addr, uint16_t value)
 {
     addr &= 0xFFFFF;
+    log_write(addr, value, 2);
     *(uint16_t *)(s_test_memory + addr) = value;
+    return 0;
 }
 
 uint8_t gba_mem_read8(uint32_t addr)
@@ -45,10 +92,18 @@ uint8_t gba_mem_read8(uint32_t addr)
     return s_test_memory[addr];
 }
 
-void gba_mem_write8(uint32_t addr, uint8_t value)
+uint32_t gba_mem_write8(uint32_t addr, uint8_t value)
 {
     addr &= 0xFFFFF;
+    log_write(addr, value, 1);
     s_test_memory[addr] = value;
+    return 0;
+}
+
+void gba_mem_get_regions(gba_mem_regions_t *regions)
+{
+    /* No direct-mapped region, every access goes through the mocks above */
+    memset(regions, 0, sizeof(*regions));
 }
 
 /* --------------------------------------------------------------------- */
@@ -88,16 +143,16 @@ static int test_add_instruction(void)
     gba_cpu_state_t cpu;
     memset(&cpu, 0, sizeof(cpu));
     cpu.reg[1] = 10;
-    cpu.reg[15] = 0;
+    cpu.reg[15] = TEST_CODE_BASE;
     
-    block_entry_t *block = jit_block_compile(0, false);
+    block_entry_t *block = jit_block_compile(TEST_CODE_BASE, false);
     if (block == NULL) {
         ESP_LOGE(TAG, "  FAILED: Block compilation failed");
         jit_deinit();
         return -1;
     }
     
-    uint32_t new_pc = jit_execute_block(block, &cpu);
+    jit_execute_block(block, &cpu);
     
     if (cpu.reg[0] != 12) {
         ESP_LOGE(TAG, "  FAILED: Expected R0=12, got R0=%u", cpu.reg[0]);
@@ -129,9 +184,9 @@ static int test_sub_instruction(void)
     memset(&cpu, 0, sizeof(cpu));
     cpu.reg[1] = 20;
     cpu.reg[2] = 8;
-    cpu.reg[15] = 0;
+    cpu.reg[15] = TEST_CODE_BASE;
     
-    block_entry_t *block = jit_block_compile(0, false);
+    block_entry_t *block = jit_block_compile(TEST_CODE_BASE, false);
     if (block == NULL) {
         ESP_LOGE(TAG, "  FAILED: Block compilation failed");
         jit_deinit();
@@ -168,9 +223,9 @@ static int test_mov_instruction(void)
     
     gba_cpu_state_t cpu;
     memset(&cpu, 0, sizeof(cpu));
-    cpu.reg[15] = 0;
+    cpu.reg[15] = TEST_CODE_BASE;
     
-    block_entry_t *block = jit_block_compile(0, false);
+    block_entry_t *block = jit_block_compile(TEST_CODE_BASE, false);
     if (block == NULL) {
         ESP_LOGE(TAG, "  FAILED: Block compilation failed");
         jit_deinit();
@@ -209,9 +264,9 @@ static int test_and_instruction(void)
     memset(&cpu, 0, sizeof(cpu));
     cpu.reg[1] = 0xFF;
     cpu.reg[2] = 0x0F;
-    cpu.reg[15] = 0;
+    cpu.reg[15] = TEST_CODE_BASE;
     
-    block_entry_t *block = jit_block_compile(0, false);
+    block_entry_t *block = jit_block_compile(TEST_CODE_BASE, false);
     if (block == NULL) {
         ESP_LOGE(TAG, "  FAILED: Block compilation failed");
         jit_deinit();
@@ -250,9 +305,9 @@ static int test_orr_instruction(void)
     memset(&cpu, 0, sizeof(cpu));
     cpu.reg[1] = 0xF0;
     cpu.reg[2] = 0x0F;
-    cpu.reg[15] = 0;
+    cpu.reg[15] = TEST_CODE_BASE;
     
-    block_entry_t *block = jit_block_compile(0, false);
+    block_entry_t *block = jit_block_compile(TEST_CODE_BASE, false);
     if (block == NULL) {
         ESP_LOGE(TAG, "  FAILED: Block compilation failed");
         jit_deinit();
@@ -291,9 +346,9 @@ static int test_eor_instruction(void)
     memset(&cpu, 0, sizeof(cpu));
     cpu.reg[1] = 0xFF;
     cpu.reg[2] = 0x0F;
-    cpu.reg[15] = 0;
+    cpu.reg[15] = TEST_CODE_BASE;
     
-    block_entry_t *block = jit_block_compile(0, false);
+    block_entry_t *block = jit_block_compile(TEST_CODE_BASE, false);
     if (block == NULL) {
         ESP_LOGE(TAG, "  FAILED: Block compilation failed");
         jit_deinit();
@@ -326,14 +381,14 @@ static int test_block_lookup(void)
     code[0] = 0xE3A00042;
     code[1] = 0xEA000000;
     
-    block_entry_t *block1 = jit_block_compile(0, false);
+    block_entry_t *block1 = jit_block_compile(TEST_CODE_BASE, false);
     if (block1 == NULL) {
         ESP_LOGE(TAG, "  FAILED: First compilation failed");
         jit_deinit();
         return -1;
     }
     
-    block_entry_t *block2 = jit_block_lookup(0, false);
+    block_entry_t *block2 = jit_block_lookup(TEST_CODE_BASE, false);
     if (block2 == NULL) {
         ESP_LOGE(TAG, "  FAILED: Block lookup failed");
         jit_deinit();
@@ -352,11 +407,901 @@ static int test_block_lookup(void)
     return 0;
 }
 
+/* --------------------------------------------------------------------- */
+/*  Differential Testing                                                 */
+/* --------------------------------------------------------------------- */
+
+/* Streams are compiled from slots in the ROM area, loads and stores go
+ * around the middle of a data window further in the mock memory */
+#define DIFF_CODE_BASE      0x08000000
+#define DIFF_SLOT_SIZE      128
+#define DIFF_SLOT_COUNT     2048
+#define DIFF_DATA_BASE      0x08040000
+#define DIFF_DATA_SIZE      0x1000
+#define DIFF_MAX_STREAM     24
+#define DIFF_BASE_REG       12
+
+/* Thumb streams only reach the low registers: R7 is the base, R6 a word
+ * aligned offset and SP points into the data window as well. The others
+ * are the ones the stream writes. */
+#define DIFF_THUMB_BASE_REG     7
+#define DIFF_THUMB_OFFSET_REG   6
+#define DIFF_THUMB_DATA_REGS    6
+
+typedef struct {
+    uint32_t reg[16];
+    uint32_t n, z, c, v;
+} ref_cpu_t;
+
+static uint32_t s_diff_seed = 0x1234567;
+
+static uint32_t diff_rand(void)
+{
+    /* xorshift32 */
+    s_diff_seed ^= s_diff_seed << 13;
+    s_diff_seed ^= s_diff_seed >> 17;
+    s_diff_seed ^= s_diff_seed << 5;
+    return s_diff_seed;
+}
+
+static bool ref_condition(const ref_cpu_t *cpu, uint32_t cond)
+{
+    switch (cond) {
+        case 0x0: return cpu->z;
+        case 0x1: return !cpu->z;
+        case 0x2: return cpu->c;
+        case 0x3: return !cpu->c;
+        case 0x4: return cpu->n;
+        case 0x5: return !cpu->n;
+        case 0x6: return cpu->v;
+        case 0x7: return !cpu->v;
+        case 0x8: return cpu->c && !cpu->z;
+        case 0x9: return !cpu->c || cpu->z;
+        case 0xA: return cpu->n == cpu->v;
+        case 0xB: return cpu->n != cpu->v;
+        case 0xC: return !cpu->z && cpu->n == cpu->v;
+        case 0xD: return cpu->z || cpu->n != cpu->v;
+        case 0xE: return true;
+        default:  return false;
+    }
+}
+
+static uint32_t ref_shifter(const ref_cpu_t *cpu, uint32_t opcode, uint32_t *carry)
+{
+    *carry = cpu->c;
+    
+    if (opcode & (1u << 25)) {
+        uint32_t rotate = ((opcode >> 8) & 0xF) * 2;
+        uint32_t imm = opcode & 0xFF;
+        if (rotate == 0) {
+            return imm;
+        }
+        imm = (imm >> rotate) | (imm << (32 - rotate));
+        *carry = imm >> 31;
+        return imm;
+    }
+    
+    uint32_t rm = cpu->reg[opcode & 0xF];
+    uint32_t type = (opcode >> 5) & 3;
+    uint32_t amount;
+    
+    if (opcode & 0x10) {
+        amount = cpu->reg[(opcode >> 8) & 0xF] & 0xFF;
+        if (amount == 0) {
+            return rm;
+        }
+        switch (type) {
+            case 0:
+                if (amount > 32) { *carry = 0; return 0; }
+                *carry = (rm >> (32 - amount)) & 1;
+                return amount == 32 ? 0 : rm << amount;
+            case 1:
+                if (amount > 32) { *carry = 0; return 0; }
+                *carry = (rm >> (amount - 1)) & 1;
+                return amount == 32 ? 0 : rm >> amount;
+            case 2:
+                if (amount >= 32) { *carry = rm >> 31; return (uint32_t)((int32_t)rm >> 31); }
+                *carry = (rm >> (amount - 1)) & 1;
+                return (uint32_t)((int32_t)rm >> amount);
+            default:
+                amount &= 31;
+                if (amount == 0) { *carry = rm >> 31; return rm; }
+                *carry = (rm >> (amount - 1)) & 1;
+                return (rm >> amount) | (rm << (32 - amount));
+        }
+    }
+    
+    amount = (opcode >> 7) & 0x1F;
+    switch (type) {
+        case 0:
+            if (amount == 0) return rm;
+            *carry = (rm >> (32 - amount)) & 1;
+            return rm << amount;
+        case 1:
+            if (amount == 0) { *carry = rm >> 31; return 0; }
+            *carry = (rm >> (amount - 1)) & 1;
+            return rm >> amount;
+        case 2:
+            if (amount == 0) { *carry = rm >> 31; return (uint32_t)((int32_t)rm >> 31); }
+            *carry = (rm >> (amount - 1)) & 1;
+            return (uint32_t)((int32_t)rm >> amount);
+        default:
+            if (amount == 0) { *carry = rm & 1; return (cpu->c << 31) | (rm >> 1); }
+            *carry = (rm >> (amount - 1)) & 1;
+            return (rm >> amount) | (rm << (32 - amount));
+    }
+}
+
+static void ref_data_proc(ref_cpu_t *cpu, uint32_t opcode)
+{
+    uint32_t op = (opcode >> 21) & 0xF;
+    uint32_t rd = (opcode >> 12) & 0xF;
+    uint32_t op1 = cpu->reg[(opcode >> 16) & 0xF];
+    uint32_t carry;
+    uint32_t op2 = ref_shifter(cpu, opcode, &carry);
+    uint32_t cin = cpu->c;
+    uint32_t res;
+    bool logical = false;
+    uint32_t v = cpu->v;
+    
+    switch (op) {
+        case 0x0: case 0x8: res = op1 & op2; logical = true; break;
+        case 0x1: case 0x9: res = op1 ^ op2; logical = true; break;
+        case 0xC: res = op1 | op2; logical = true; break;
+        case 0xD: res = op2; logical = true; break;
+        case 0xE: res = op1 & ~op2; logical = true; break;
+        case 0xF: res = ~op2; logical = true; break;
+        case 0x2: case 0xA:
+            res = op1 - op2;
+            carry = op1 >= op2;
+            v = ((op1 ^ op2) & (op1 ^ res)) >> 31;
+            break;
+        case 0x3:
+            res = op2 - op1;
+            carry = op2 >= op1;
+            v = ((op2 ^ op1) & (op2 ^ res)) >> 31;
+            break;
+        case 0x4: case 0xB:
+            res = op1 + op2;
+            carry = res < op1;
+            v = (~(op1 ^ op2) & (op1 ^ res)) >> 31;
+            break;
+        case 0x5:
+            res = op1 + op2 + cin;
+            carry = (uint32_t)(((uint64_t)op1 + op2 + cin) >> 32);
+            v = (~(op1 ^ op2) & (op1 ^ res)) >> 31;
+            break;
+        case 0x6:
+            res = op1 - op2 - !cin;
+            carry = (uint64_t)op1 >= (uint64_t)op2 + !cin;
+            v = ((op1 ^ op2) & (op1 ^ res)) >> 31;
+            break;
+        default: /* RSC */
+            res = op2 - op1 - !cin;
+            carry = (uint64_t)op2 >= (uint64_t)op1 + !cin;
+            v = ((op2 ^ op1) & (op2 ^ res)) >> 31;
+            break;
+    }
+    
+    if (op < 0x8 || op > 0xB) {
+        cpu->reg[rd] = res;
+    }
+    if (opcode & (1u << 20)) {
+        cpu->n = res >> 31;
+        cpu->z = res == 0;
+        cpu->c = carry;
+        if (!logical) {
+            cpu->v = v;
+        }
+    }
+}
+
+static void ref_load_store(ref_cpu_t *cpu, uint32_t opcode)
+{
+    uint32_t rd = (opcode >> 12) & 0xF;
+    uint32_t offset = opcode & 0xFFF;
+    uint32_t addr = cpu->reg[(opcode >> 16) & 0xF];
+    addr = (opcode & (1u << 23)) ? addr + offset : addr - offset;
+    bool byte = (opcode >> 22) & 1;
+    
+    if (opcode & (1u << 20)) {
+        if (byte) {
+            cpu->reg[rd] = gba_mem_read8(addr);
+        } else {
+            uint32_t value = gba_mem_read32(addr & ~3);
+            uint32_t rotate = (addr & 3) * 8;
+            cpu->reg[rd] = rotate ? (value >> rotate) | (value << (32 - rotate)) : value;
+        }
+    } else if (byte) {
+        gba_mem_write8(addr, (uint8_t)cpu->reg[rd]);
+    } else {
+        gba_mem_write32(addr & ~3, cpu->reg[rd]);
+    }
+}
+
+/* Load (zero or sign-extended) or store size bytes of rd */
+static void ref_transfer(ref_cpu_t *cpu, uint32_t rd, uint32_t addr, bool is_load, int size, bool is_signed)
+{
+    if (!is_load) {
+        if (size == 1) {
+            gba_mem_write8(addr, (uint8_t)cpu->reg[rd]);
+        } else if (size == 2) {
+            gba_mem_write16(addr, (uint16_t)cpu->reg[rd]);
+        } else {
+            gba_mem_write32(addr, cpu->reg[rd]);
+        }
+        return;
+    }
+    
+    if (size == 1) {
+        cpu->reg[rd] = is_signed ? (uint32_t)(int8_t)gba_mem_read8(addr) : gba_mem_read8(addr);
+    } else if (size == 2) {
+        cpu->reg[rd] = is_signed ? (uint32_t)(int16_t)gba_mem_read16(addr) : gba_mem_read16(addr);
+    } else {
+        cpu->reg[rd] = gba_mem_read32(addr);
+    }
+}
+
+/* LDRH, STRH, LDRSB, LDRSH with an immediate offset */
+static void ref_halfword_xfer(ref_cpu_t *cpu, uint32_t opcode)
+{
+    uint32_t rd = (opcode >> 12) & 0xF;
+    uint32_t rn = (opcode >> 16) & 0xF;
+    uint32_t offset = ((opcode >> 4) & 0xF0) | (opcode & 0xF);
+    uint32_t sh = (opcode >> 5) & 0x3;
+    bool pre_index = (opcode >> 24) & 1;
+    uint32_t base = cpu->reg[rn];
+    uint32_t moved = (opcode & (1u << 23)) ? base + offset : base - offset;
+    
+    ref_transfer(cpu, rd, pre_index ? moved : base, (opcode >> 20) & 1, sh == 0x2 ? 1 : 2, sh != 0x1);
+    if (!pre_index || (opcode & (1u << 21))) {
+        cpu->reg[rn] = moved;
+    }
+}
+
+/* LDM, STM without the S bit or the PC, the lowest register at the lowest address */
+static void ref_block_xfer(ref_cpu_t *cpu, uint32_t opcode)
+{
+    uint32_t rn = (opcode >> 16) & 0xF;
+    uint32_t reg_list = opcode & 0xFFFF;
+    bool is_load = (opcode >> 20) & 1;
+    bool up = (opcode >> 23) & 1;
+    bool pre_index = (opcode >> 24) & 1;
+    uint32_t size = 4 * __builtin_popcount(reg_list);
+    uint32_t base = cpu->reg[rn];
+    uint32_t addr = up ? base + (pre_index ? 4 : 0) : base - size + (pre_index ? 0 : 4);
+    
+    if (opcode & (1u << 21)) {
+        /* A loaded base wins over the writeback */
+        cpu->reg[rn] = up ? base + size : base - size;
+    }
+    for (int i = 0; i < 15; i++) {
+        if ((reg_list >> i) & 1) {
+            if (!is_load && i == (int)rn) {
+                gba_mem_write32(addr, base);
+            } else {
+                ref_transfer(cpu, i, addr, is_load, 4, false);
+            }
+            addr += 4;
+        }
+    }
+}
+
+/* Instructions the reference model covers: data processing, immediate-offset
+ * LDR/STR and halfword transfers, and LDM/STM, none touching the PC */
+static bool ref_supports(uint32_t opcode)
+{
+    uint32_t type = (opcode >> 25) & 0x07;
+    uint32_t cond = opcode >> 28;
+    trans_level_t level = jit_can_translate(opcode, false);
+    
+    if (cond == 0xF || level == TRANS_LEVEL_NONE) {
+        return false;
+    }
+    
+    if (type == 0x00 && (opcode & 0x90) == 0x90) {
+        /* Immediate offset halfword transfers, not multiplies or swaps */
+        return level == TRANS_LEVEL_L2 && (opcode & 0x60) != 0 && (opcode & (1u << 22)) &&
+               ((opcode >> 12) & 0xF) != 15 && ((opcode >> 16) & 0xF) != 15;
+    }
+    
+    if (type == 0x04) {
+        return level == TRANS_LEVEL_L2 && !(opcode & (1u << 15));
+    }
+    
+    if (level != TRANS_LEVEL_L1) {
+        return false;
+    }
+    
+    if (type == 0x00 || type == 0x01) {
+        uint32_t op = (opcode >> 21) & 0xF;
+        if (op >= 0x8 && op <= 0xB && !(opcode & (1u << 20))) {
+            return false;   /* MRS/MSR */
+        }
+        if (((opcode >> 12) & 0xF) == 15 || ((opcode >> 16) & 0xF) == 15) {
+            return false;
+        }
+        if (type == 0x00 && ((opcode & 0xF) == 15 || ((opcode & 0x10) && ((opcode >> 8) & 0xF) == 15))) {
+            return false;
+        }
+        return true;
+    }
+    
+    if (type == 0x02) {
+        /* Pre-indexed without writeback */
+        return (opcode & (1u << 24)) && !(opcode & (1u << 21)) &&
+               ((opcode >> 12) & 0xF) != 15 && ((opcode >> 16) & 0xF) != 15;
+    }
+    
+    return false;
+}
+
+static void ref_execute(ref_cpu_t *cpu, uint32_t opcode)
+{
+    uint32_t type = (opcode >> 25) & 0x07;
+    
+    if (!ref_condition(cpu, opcode >> 28)) {
+        return;
+    }
+    if (type == 0x02) {
+        ref_load_store(cpu, opcode);
+    } else if (type == 0x04) {
+        ref_block_xfer(cpu, opcode);
+    } else if (type == 0x00 && (opcode & 0x90) == 0x90) {
+        ref_halfword_xfer(cpu, opcode);
+    } else {
+        ref_data_proc(cpu, opcode);
+    }
+}
+
+/* Thumb data processing, run as the equivalent ARM instruction */
+static void ref_thumb_data_proc(ref_cpu_t *cpu, uint32_t op, uint32_t rn, uint32_t rd, uint32_t operand)
+{
+    ref_data_proc(cpu, 0xE0100000 | (op << 21) | (rn << 16) | (rd << 12) | operand);
+}
+
+static void ref_thumb_alu(ref_cpu_t *cpu, uint16_t opcode)
+{
+    /* ARM data processing opcode of each format 4 operation, shifts are MOVS */
+    static const uint8_t arm_op[16] = {
+        0x0, 0x1, 0xD, 0xD, 0xD, 0x5, 0x6, 0xD, 0x8, 0x3, 0xA, 0xB, 0xC, 0x0, 0xE, 0xF
+    };
+    uint32_t rd = opcode & 0x7;
+    uint32_t rs = (opcode >> 3) & 0x7;
+    uint32_t op = (opcode >> 6) & 0xF;
+    
+    switch (op) {
+        case 0x2: case 0x3: case 0x4: case 0x7:
+            /* LSL, LSR, ASR, ROR by register */
+            ref_thumb_data_proc(cpu, 0xD, 0, rd, (rs << 8) | ((op == 0x7 ? 3 : op - 2) << 5) | 0x10 | rd);
+            break;
+        case 0x9:
+            /* NEG is RSBS rd, rs, #0 */
+            ref_thumb_data_proc(cpu, 0x3, rs, rd, 1u << 25);
+            break;
+        case 0xD: {
+            /* MUL only sets N and Z */
+            uint32_t res = cpu->reg[rd] * cpu->reg[rs];
+            cpu->reg[rd] = res;
+            cpu->n = res >> 31;
+            cpu->z = res == 0;
+            break;
+        }
+        default:
+            ref_thumb_data_proc(cpu, arm_op[op], rd, rd, rs);
+            break;
+    }
+}
+
+/* Formats 1-4, 7-11, 14 and 15 without the PC or LR */
+static void ref_thumb_execute(ref_cpu_t *cpu, uint16_t opcode)
+{
+    uint32_t rd = opcode & 0x7;
+    uint32_t rb = (opcode >> 3) & 0x7;
+    uint32_t reg_list = opcode & 0xFF;
+    uint32_t addr;
+    
+    switch (opcode >> 12) {
+        case 0x0:
+        case 0x1:
+            if ((opcode & 0x1800) != 0x1800) {
+                /* MOVS rd, rs, <shift> #imm, where LSR and ASR #0 mean 32 like on ARM */
+                ref_thumb_data_proc(cpu, 0xD, 0, rd, (((opcode >> 6) & 0x1F) << 7) | (((opcode >> 11) & 0x3) << 5) | rb);
+            } else {
+                uint32_t operand = (opcode & 0x0400) ? (1u << 25) | ((opcode >> 6) & 0x7) : (opcode >> 6) & 0x7;
+                ref_thumb_data_proc(cpu, (opcode & 0x0200) ? 0x2 : 0x4, rb, rd, operand);
+            }
+            break;
+        case 0x2:
+        case 0x3: {
+            /* MOV, CMP, ADD, SUB #imm8 */
+            static const uint8_t arm_op[4] = { 0xD, 0xA, 0x4, 0x2 };
+            rd = (opcode >> 8) & 0x7;
+            ref_thumb_data_proc(cpu, arm_op[(opcode >> 11) & 0x3], rd, rd, (1u << 25) | (opcode & 0xFF));
+            break;
+        }
+        case 0x4:
+            ref_thumb_alu(cpu, opcode);
+            break;
+        case 0x5: {
+            uint32_t op = (opcode >> 10) & 0x3;
+            addr = cpu->reg[rb] + cpu->reg[(opcode >> 6) & 0x7];
+            if (!(opcode & 0x0200)) {
+                /* STR, STRB, LDR, LDRB */
+                ref_transfer(cpu, rd, addr, op >= 0x2, (op & 1) ? 1 : 4, false);
+            } else {
+                /* STRH, LDSB, LDRH, LDSH */
+                ref_transfer(cpu, rd, addr, op != 0x0, op == 0x1 ? 1 : 2, op & 1);
+            }
+            break;
+        }
+        case 0x6:
+        case 0x7:
+        case 0x8: {
+            int size = (opcode & 0xF000) == 0x8000 ? 2 : (opcode & 0x1000) ? 1 : 4;
+            addr = cpu->reg[rb] + ((opcode >> 6) & 0x1F) * size;
+            ref_transfer(cpu, rd, addr, (opcode >> 11) & 1, size, false);
+            break;
+        }
+        case 0x9:
+            addr = cpu->reg[13] + ((opcode & 0xFF) << 2);
+            ref_transfer(cpu, (opcode >> 8) & 0x7, addr, (opcode >> 11) & 1, 4, false);
+            break;
+        case 0xB:
+            /* PUSH, POP */
+            if (opcode & 0x0800) {
+                addr = cpu->reg[13];
+                cpu->reg[13] += 4 * __builtin_popcount(reg_list);
+            } else {
+                cpu->reg[13] -= 4 * __builtin_popcount(reg_list);
+                addr = cpu->reg[13];
+            }
+            for (int i = 0; i < 8; i++) {
+                if ((reg_list >> i) & 1) {
+                    ref_transfer(cpu, i, addr, (opcode >> 11) & 1, 4, false);
+                    addr += 4;
+                }
+            }
+            break;
+        default: {
+            /* LDMIA, STMIA, the base is never in the list */
+            uint32_t base = (opcode >> 8) & 0x7;
+            addr = cpu->reg[base];
+            cpu->reg[base] += 4 * __builtin_popcount(reg_list);
+            for (int i = 0; i < 8; i++) {
+                if ((reg_list >> i) & 1) {
+                    ref_transfer(cpu, i, addr, (opcode >> 11) & 1, 4, false);
+                    addr += 4;
+                }
+            }
+            break;
+        }
+    }
+}
+
+static uint32_t gen_data_proc(void)
+{
+    uint32_t op = diff_rand() % 16;
+    uint32_t cond = (diff_rand() % 4 == 0) ? diff_rand() % 15 : 0xE;
+    uint32_t s = (op >= 0x8 && op <= 0xB) ? 1 : diff_rand() & 1;
+    uint32_t rd = diff_rand() % DIFF_BASE_REG;
+    uint32_t rn = diff_rand() % DIFF_BASE_REG;
+    uint32_t operand;
+    
+    if (diff_rand() & 1) {
+        operand = (1u << 25) | ((diff_rand() % 16) << 8) | (diff_rand() & 0xFF);
+    } else {
+        uint32_t rm = diff_rand() % DIFF_BASE_REG;
+        uint32_t type = diff_rand() % 4;
+        if (diff_rand() % 4 == 0) {
+            operand = ((diff_rand() % DIFF_BASE_REG) << 8) | (type << 5) | 0x10 | rm;
+        } else {
+            operand = ((diff_rand() % 32) << 7) | (type << 5) | rm;
+        }
+    }
+    
+    return (cond << 28) | (op << 21) | (s << 20) | (rn << 16) | (rd << 12) | operand;
+}
+
+static uint32_t gen_load_store(void)
+{
+    uint32_t byte = diff_rand() & 1;
+    uint32_t up = diff_rand() & 1;
+    uint32_t load = diff_rand() & 1;
+    uint32_t offset = byte ? diff_rand() % 256 : (diff_rand() % 64) * 4;
+    uint32_t rd = diff_rand() % DIFF_BASE_REG;
+    
+    return 0xE4000000 | (1u << 24) | (up << 23) | (byte << 22) | (load << 20) |
+           (DIFF_BASE_REG << 16) | (rd << 12) | offset;
+}
+
+/*
+ * The base register moves by at most 48 bytes per instruction and stays
+ * word aligned, so that a whole stream keeps to the data window and word
+ * accesses never need the rotation the mocks don't do
+ */
+static uint32_t gen_halfword(void)
+{
+    uint32_t sh = 1 + diff_rand() % 3;
+    uint32_t load = (sh != 0x1) || (diff_rand() & 1);
+    uint32_t pre_index = diff_rand() & 1;
+    uint32_t writeback = pre_index && (diff_rand() & 1);
+    uint32_t offset = (!pre_index || writeback) ? (diff_rand() % 13) * 4 :
+                      (sh == 0x2) ? diff_rand() % 256 : (diff_rand() % 128) * 2;
+    uint32_t rd = diff_rand() % DIFF_BASE_REG;
+    uint32_t cond = (diff_rand() % 4 == 0) ? diff_rand() % 15 : 0xE;
+    
+    return (cond << 28) | (pre_index << 24) | ((diff_rand() & 1) << 23) | (1u << 22) |
+           (writeback << 21) | (load << 20) | (DIFF_BASE_REG << 16) | (rd << 12) |
+           ((offset & 0xF0) << 4) | 0x90 | (sh << 5) | (offset & 0xF);
+}
+
+static uint32_t gen_block_xfer(void)
+{
+    uint32_t reg_list = 1 + diff_rand() % ((1u << DIFF_BASE_REG) - 1);
+    uint32_t cond = (diff_rand() % 4 == 0) ? diff_rand() % 15 : 0xE;
+    
+    /* P, U, W and L at random, S clear */
+    return (cond << 28) | 0x08000000 | ((diff_rand() & 0x3) << 23) | ((diff_rand() & 0x3) << 20) |
+           (DIFF_BASE_REG << 16) | reg_list;
+}
+
+/* Random stream of `count` instructions followed by a branch ending the block,
+ * L2 transfers are only mixed in with_l2 */
+static int gen_stream(uint32_t *code, int count, bool with_l2)
+{
+    for (int i = 0; i < count; i++) {
+        do {
+            switch (diff_rand() % 8) {
+                case 0: case 1: code[i] = gen_load_store(); break;
+                case 2:         code[i] = with_l2 ? gen_halfword() : gen_load_store(); break;
+                case 3:         code[i] = with_l2 ? gen_block_xfer() : gen_data_proc(); break;
+                default:        code[i] = gen_data_proc(); break;
+            }
+        } while (!ref_supports(code[i]));
+    }
+    code[count] = 0xEA000000;
+    return count + 1;
+}
+
+static uint16_t gen_thumb_alu(void)
+{
+    uint32_t rd = diff_rand() % DIFF_THUMB_DATA_REGS;
+    uint32_t rs = diff_rand() % 8;
+    
+    switch (diff_rand() % 4) {
+        case 0:     /* Format 1: LSL, LSR, ASR #imm */
+            return ((diff_rand() % 3) << 11) | ((diff_rand() % 32) << 6) | (rs << 3) | rd;
+        case 1:     /* Format 2: ADD, SUB with a register or #imm3 */
+            return 0x1800 | ((diff_rand() % 4) << 9) | ((diff_rand() % 8) << 6) | (rs << 3) | rd;
+        case 2:     /* Format 3: MOV, CMP, ADD, SUB #imm8 */
+            return 0x2000 | ((diff_rand() % 4) << 11) | (rd << 8) | (diff_rand() & 0xFF);
+        default:    /* Format 4 */
+            return 0x4000 | ((diff_rand() % 16) << 6) | (rs << 3) | rd;
+    }
+}
+
+/* The base moves by at most 24 bytes per instruction, SP too */
+static uint16_t gen_thumb_load_store(void)
+{
+    uint32_t rd = diff_rand() % DIFF_THUMB_DATA_REGS;
+    uint32_t rb = DIFF_THUMB_BASE_REG;
+    uint32_t reg_list = 1 + diff_rand() % ((1u << DIFF_THUMB_DATA_REGS) - 1);
+    
+    switch (diff_rand() % 6) {
+        case 0:     /* Formats 7 and 8: register offset */
+            return 0x5000 | ((diff_rand() % 8) << 9) | (DIFF_THUMB_OFFSET_REG << 6) | (rb << 3) | rd;
+        case 1:     /* Format 9: LDR, STR, LDRB, STRB #imm5 */
+            return 0x6000 | ((diff_rand() % 4) << 11) | ((diff_rand() % 32) << 6) | (rb << 3) | rd;
+        case 2:     /* Format 10: LDRH, STRH #imm5 */
+            return 0x8000 | ((diff_rand() & 1) << 11) | ((diff_rand() % 32) << 6) | (rb << 3) | rd;
+        case 3:     /* Format 11: SP-relative, within 512 bytes so that SP can't leave the window */
+            return 0x9000 | ((diff_rand() & 1) << 11) | (rd << 8) | (diff_rand() % 128);
+        case 4:     /* Format 14: PUSH, POP without LR or PC */
+            return 0xB400 | ((diff_rand() & 1) << 11) | reg_list;
+        default:    /* Format 15: LDMIA, STMIA */
+            return 0xC000 | ((diff_rand() & 1) << 11) | (rb << 8) | reg_list;
+    }
+}
+
+/* Same for Thumb, ending with B to the next instruction but one */
+static int gen_thumb_stream(uint16_t *code, int count)
+{
+    for (int i = 0; i < count; i++) {
+        do {
+            code[i] = (diff_rand() % 3 == 0) ? gen_thumb_load_store() : gen_thumb_alu();
+        } while (jit_can_translate(code[i], true) == TRANS_LEVEL_NONE);
+    }
+    code[count] = 0xE000;
+    return count + 1;
+}
+
+static void diff_random_state(ref_cpu_t *ref, bool is_thumb)
+{
+    for (int i = 0; i < 15; i++) {
+        /* Small values now and then, so that compares and shifts hit their edge cases */
+        ref->reg[i] = (diff_rand() & 1) ? diff_rand() : diff_rand() % 40;
+    }
+    if (is_thumb) {
+        ref->reg[DIFF_THUMB_BASE_REG] = DIFF_DATA_BASE + DIFF_DATA_SIZE / 2;
+        ref->reg[DIFF_THUMB_OFFSET_REG] = (diff_rand() % 16) * 4;
+        ref->reg[13] = DIFF_DATA_BASE + DIFF_DATA_SIZE / 2;
+    } else {
+        ref->reg[DIFF_BASE_REG] = DIFF_DATA_BASE + DIFF_DATA_SIZE / 2;
+    }
+    ref->n = diff_rand() & 1;
+    ref->z = diff_rand() & 1;
+    ref->c = diff_rand() & 1;
+    ref->v = diff_rand() & 1;
+}
+
+static void undo_writes(int from)
+{
+    while (s_write_count > from) {
+        mem_write_t *w = &s_write_log[--s_write_count];
+        memcpy(s_test_memory + w->addr, &w->old, w->size);
+    }
+}
+
+/**
+ * Run one block from `pc` through the JIT and the reference model
+ * @return 1 if they agree, 0 if the JIT rejected the block, -1 on mismatch
+ */
+static int diff_run_block(uint32_t pc, const ref_cpu_t *start, bool is_thumb)
+{
+    static mem_write_t jit_log[WRITE_LOG_SIZE];
+    uint32_t step = is_thumb ? 2 : 4;
+    
+    /* The reference model runs whole blocks, they must not stop at a deadline */
+    g_jit_config.deadline_interval = 0;
+    
+    block_entry_t *block = jit_block_compile(pc, is_thumb);
+    if (block == NULL) {
+        return 0;
+    }
+    
+    gba_cpu_state_t cpu;
+    memset(&cpu, 0, sizeof(cpu));
+    memcpy(cpu.reg, start->reg, sizeof(cpu.reg));
+    cpu.reg[15] = pc;
+    cpu.cpsr = 0x1F | (is_thumb ? 0x20 : 0) |
+               (start->n << 31) | (start->z << 30) | (start->c << 29) | (start->v << 28);
+    cpu.n_flag = start->n;
+    cpu.z_flag = start->z;
+    cpu.c_flag = start->c;
+    cpu.v_flag = start->v;
+    
+    /* A single cycle makes every exit return to us instead of chaining */
+    cpu.cycles = 1;
+    cpu.cycles_target = 1;
+    
+    s_write_count = 0;
+    s_write_logging = true;
+    uint32_t jit_pc = jit_execute_block(block, &cpu);
+    int jit_writes = s_write_count;
+    memcpy(jit_log, s_write_log, sizeof(jit_log));
+    undo_writes(0);
+    
+    ref_cpu_t ref = *start;
+    uint32_t ref_pc = block->end_pc;
+    for (uint32_t addr = pc; addr < block->end_pc; addr += step) {
+        if (is_thumb) {
+            uint16_t opcode = gba_mem_read16(addr);
+            if ((opcode & 0xF800) == 0xE000) {
+                ref_pc = addr + 4 + ((int32_t)((uint32_t)opcode << 21) >> 20);
+                break;
+            }
+            ref_thumb_execute(&ref, opcode);
+            continue;
+        }
+        uint32_t opcode = gba_mem_read32(addr);
+        if ((opcode & 0x0F000000) == 0x0A000000) {
+            if (ref_condition(&ref, opcode >> 28)) {
+                ref_pc = addr + 8 + ((int32_t)(opcode << 8) >> 6);
+                break;
+            }
+            continue;
+        }
+        ref_execute(&ref, opcode);
+    }
+    int ref_writes = s_write_count;
+    undo_writes(0);
+    s_write_logging = false;
+    
+    jit_block_invalidate(pc, is_thumb);
+    
+    bool match = jit_pc == ref_pc && cpu.n_flag == ref.n && cpu.z_flag == ref.z &&
+                 cpu.c_flag == ref.c && cpu.v_flag == ref.v && jit_writes == ref_writes;
+    for (int i = 0; i < 15 && match; i++) {
+        match = cpu.reg[i] == ref.reg[i];
+    }
+    for (int i = 0; i < jit_writes && match; i++) {
+        match = jit_log[i].addr == s_write_log[i].addr && jit_log[i].size == s_write_log[i].size &&
+                jit_log[i].value == s_write_log[i].value;
+    }
+    if (match) {
+        return 1;
+    }
+    
+    ESP_LOGE(TAG, "  Mismatch in %s block at 0x%08X (register cache %s):", is_thumb ? "Thumb" : "ARM",
+             pc, g_jit_config.enable_reg_cache ? "on" : "off");
+    for (uint32_t addr = pc; addr < block->end_pc; addr += step) {
+        if (is_thumb) {
+            ESP_LOGE(TAG, "    %08X: %04X", addr, gba_mem_read16(addr));
+        } else {
+            ESP_LOGE(TAG, "    %08X: %08X", addr, gba_mem_read32(addr));
+        }
+    }
+    for (int i = 0; i < 15; i++) {
+        if (cpu.reg[i] != ref.reg[i]) {
+            ESP_LOGE(TAG, "    R%d: jit=0x%08X ref=0x%08X (start 0x%08X)",
+                     i, cpu.reg[i], ref.reg[i], start->reg[i]);
+        }
+    }
+    ESP_LOGE(TAG, "    PC: jit=0x%08X ref=0x%08X", jit_pc, ref_pc);
+    ESP_LOGE(TAG, "    NZCV: jit=%u%u%u%u ref=%u%u%u%u start=%u%u%u%u",
+             cpu.n_flag, cpu.z_flag, cpu.c_flag, cpu.v_flag, ref.n, ref.z, ref.c, ref.v,
+             start->n, start->z, start->c, start->v);
+    ESP_LOGE(TAG, "    Writes: jit=%d ref=%d", jit_writes, ref_writes);
+    return -1;
+}
+
+/**
+ * Differential test of the JIT against the reference model
+ * @param rom Optional ROM image, its ARM code is used instead of random streams
+ * @param rom_size ROM size in bytes
+ * @param iterations Number of blocks to compare
+ * @return Number of mismatches
+ */
+int jit_run_differential(const uint8_t *rom, uint32_t rom_size, int iterations)
+{
+    int compared = 0, rejected = 0, mismatches = 0;
+    uint32_t rom_pos = 0;
+    jit_config_t saved_config = g_jit_config;
+    
+    /* Everything the reference model covers is compiled, whatever the defaults */
+    g_jit_config.enable_l1 = 1;
+    g_jit_config.enable_l2 = 1;
+    g_jit_config.enable_thumb = 1;
+    jit_init(NULL);
+    
+    for (int i = 0; i < iterations; i++) {
+        uint32_t slot = i % DIFF_SLOT_COUNT;
+        uint32_t pc = DIFF_CODE_BASE + slot * DIFF_SLOT_SIZE;
+        uint32_t *code = (uint32_t *)(s_test_memory + slot * DIFF_SLOT_SIZE);
+        /* Random streams alternate between ARM and Thumb, with and without the register cache */
+        bool is_thumb = rom == NULL && (i & 1);
+        g_jit_config.enable_reg_cache = (i >> 1) & 1;
+        
+        /* Slots are reused and failed PCs are only forgotten on init */
+        if (slot == 0 && i != 0) {
+            jit_deinit();
+            jit_init(NULL);
+        }
+        
+        int words = 0;
+        if (rom != NULL) {
+            /* Next run of real instructions the reference model understands */
+            while (words == 0 && rom_pos + 4 <= rom_size) {
+                uint32_t opcode;
+                memcpy(&opcode, rom + rom_pos, 4);
+                rom_pos += 4;
+                if (ref_supports(opcode)) {
+                    code[words++] = opcode;
+                    while (words < DIFF_MAX_STREAM && rom_pos + 4 <= rom_size) {
+                        memcpy(&opcode, rom + rom_pos, 4);
+                        if (!ref_supports(opcode)) {
+                            break;
+                        }
+                        code[words++] = opcode;
+                        rom_pos += 4;
+                    }
+                }
+            }
+            if (words == 0) {
+                break;
+            }
+            code[words++] = 0xEA000000;
+        } else if (is_thumb) {
+            gen_thumb_stream((uint16_t *)code, 1 + diff_rand() % DIFF_MAX_STREAM);
+        } else {
+            gen_stream(code, 1 + diff_rand() % DIFF_MAX_STREAM, true);
+        }
+        
+        for (uint32_t j = 0; j < DIFF_DATA_SIZE; j += 4) {
+            uint32_t value = diff_rand();
+            memcpy(s_test_memory + (DIFF_DATA_BASE & 0xFFFFF) + j, &value, 4);
+        }
+        
+        ref_cpu_t start;
+        diff_random_state(&start, is_thumb);
+        
+        int ret = diff_run_block(pc, &start, is_thumb);
+        if (ret > 0) {
+            compared++;
+        } else if (ret == 0) {
+            rejected++;
+        } else if (++mismatches >= 8) {
+            break;
+        }
+    }
+    
+    jit_deinit();
+    g_jit_config = saved_config;
+    
+    ESP_LOGI(TAG, "  %s: %d blocks matched, %d rejected by the JIT, %d mismatches",
+             rom != NULL ? "ROM trace" : "Random streams", compared, rejected, mismatches);
+    return mismatches;
+}
+
+static int test_differential_random(void)
+{
+    ESP_LOGI(TAG, "Test: Differential Random ARM and Thumb Streams");
+    
+    s_diff_seed = 0x1234567;
+    if (jit_run_differential(NULL, 0, 4096) != 0) {
+        ESP_LOGE(TAG, "  FAILED");
+        return -1;
+    }
+    
+    ESP_LOGI(TAG, "  PASSED");
+    return 0;
+}
+
+/* --------------------------------------------------------------------- */
+/*  Compile Throughput                                                   */
+/* --------------------------------------------------------------------- */
+
+#define BENCH_BLOCKS        1024
+#define BENCH_STREAM        32
+
+static int test_compile_throughput(void)
+{
+    ESP_LOGI(TAG, "Test: Compile Throughput");
+    
+    jit_init(NULL);
+    s_diff_seed = 0x89ABCDE;
+    
+    for (int i = 0; i < BENCH_BLOCKS; i++) {
+        gen_stream((uint32_t *)(s_test_memory + i * DIFF_SLOT_SIZE), BENCH_STREAM, false);
+    }
+    
+    int compiled = 0;
+    uint32_t arm_insns = 0;
+    uint32_t host_bytes = 0;
+    int64_t start = esp_timer_get_time();
+    
+    for (int i = 0; i < BENCH_BLOCKS; i++) {
+        block_entry_t *block = jit_block_compile(DIFF_CODE_BASE + i * DIFF_SLOT_SIZE, false);
+        if (block != NULL) {
+            compiled++;
+            arm_insns += (block->end_pc - block->pc) / 4;
+            host_bytes += block->code_size;
+        }
+    }
+    
+    int64_t elapsed = esp_timer_get_time() - start;
+    jit_deinit();
+    
+    if (compiled == 0 || elapsed <= 0) {
+        ESP_LOGE(TAG, "  FAILED: no block compiled");
+        return -1;
+    }
+    
+    ESP_LOGI(TAG, "  %d blocks in %lld us: %lld blocks/s, %lld ARM instructions/s",
+             compiled, (long long)elapsed, (long long)compiled * 1000000 / elapsed,
+             (long long)arm_insns * 1000000 / elapsed);
+    ESP_LOGI(TAG, "  %u host bytes per ARM instruction",
+             (unsigned)(arm_insns ? host_bytes / arm_insns : 0));
+    ESP_LOGI(TAG, "  PASSED");
+    return 0;
+}
+
 /* --------------------------------------------------------------------- */
 /*  Test Runner                                                          */
 /* --------------------------------------------------------------------- */
 
-void jit_run_tests(void)
+int jit_run_tests(void)
 {
     ESP_LOGI(TAG, "========================================");
     ESP_LOGI(TAG, "GBA JIT Test Suite");
@@ -373,8 +1318,12 @@ void jit_run_tests(void)
     if (test_orr_instruction() == 0) passed++; else failed++;
     if (test_eor_instruction() == 0) passed++; else failed++;
     if (test_block_lookup() == 0) passed++; else failed++;
+    if (test_differential_random() == 0) passed++; else failed++;
+    if (test_compile_throughput() == 0) passed++; else failed++;
     
     ESP_LOGI(TAG, "========================================");
     ESP_LOGI(TAG, "Results: %d passed, %d failed", passed, failed);
     ESP_LOGI(TAG, "========================================");
+    
+    return failed;
 }
@@ -14,17 +14,11 @@ static const char *TAG = "JIT_TRANS";
 extern jit_stats_t g_jit_stats;
 extern jit_config_t g_jit_config;
 
-extern bool is_l1_instruction(uint32_t opcode);
+extern trans_level_t jit_get_translation_level(uint32_t opcode, bool is_thumb);
 extern bool is_block_terminator(uint32_t opcode);
+static bool is_thumb_block_terminator(uint16_t opcode);
 extern void decode_arm_instruction(uint32_t opcode, arm_insn_t *insn);
 
-extern uint32_t gba_mem_read32(uint32_t addr);
-extern void gba_mem_write32(uint32_t addr, uint32_t value);
-extern uint16_t gba_mem_read16(uint32_t addr);
-extern void gba_mem_write16(uint32_t addr, uint16_t value);
-extern uint8_t gba_mem_read8(uint32_t addr);
-extern void gba_mem_write8(uint32_t addr, uint8_t value);
-
 static uint64_t jit_umull64(uint32_t a, uint32_t b)
 {
     return (uint64_t)a * (uint64_t)b;
@@ -65,259 +59,595 @@ typedef enum {
     ARM_COND_GT = 0xC, ARM_COND_LE = 0xD, ARM_COND_AL = 0xE
 } arm_cond_t;
 
-static struct sljit_jump *emit_condition_check(struct sljit_compiler *C, uint8_t cond)
+/* --------------------------------------------------------------------- */
+/*  Helper Functions                                                     */
+/* --------------------------------------------------------------------- */
+
+__attribute__((unused))
+static sljit_s32 arm_reg_to_sljit(int arm_reg)
+{
+    if (arm_reg == 15) return SLJIT_R0;
+    if (arm_reg >= 0 && arm_reg <= 14) {
+        return SLJIT_MEM1(SLJIT_S0) + offsetof(gba_cpu_state_t, reg[arm_reg]);
+    }
+    return SLJIT_R0;
+}
+
+/* --------------------------------------------------------------------- */
+/*  Block Prepass                                                        */
+/* --------------------------------------------------------------------- */
+
+/* Instructions of the block being translated, used by the analyses below */
+static uint32_t s_block_opcodes[GBA_JIT_MAX_BLOCK_INSTRUCTIONS];
+static int s_block_length = 0;
+static int s_insn_index = 0;        /* Instruction currently being translated */
+
+/* Translation level of an instruction, NONE for the levels turned off in the config */
+static trans_level_t insn_level(uint32_t opcode, bool is_thumb)
+{
+    trans_level_t level = jit_get_translation_level(opcode, is_thumb);
+    
+    switch (level) {
+        case TRANS_LEVEL_L1:    return g_jit_config.enable_l1 ? level : TRANS_LEVEL_NONE;
+        case TRANS_LEVEL_L2:    return g_jit_config.enable_l2 ? level : TRANS_LEVEL_NONE;
+        case TRANS_LEVEL_THUMB: return g_jit_config.enable_thumb ? level : TRANS_LEVEL_NONE;
+        default:                return TRANS_LEVEL_NONE;
+    }
+}
+
+/* Walk the block the same way jit_translate_block will */
+static void scan_block(uint32_t pc, bool is_thumb)
+{
+    int max_insns = g_jit_config.max_block_instructions;
+    if (max_insns > GBA_JIT_MAX_BLOCK_INSTRUCTIONS) {
+        max_insns = GBA_JIT_MAX_BLOCK_INSTRUCTIONS;
+    }
+    
+    s_block_length = 0;
+    s_insn_index = 0;
+    
+    for (uint32_t addr = pc; s_block_length < max_insns; addr += is_thumb ? 2 : 4) {
+        if (is_thumb) {
+            uint16_t opcode = gba_mem_read16(addr);
+            if (insn_level(opcode, true) == TRANS_LEVEL_NONE) break;
+            s_block_opcodes[s_block_length++] = opcode;
+            if (is_thumb_block_terminator(opcode)) break;
+        } else {
+            uint32_t opcode = gba_mem_read32(addr);
+            if (insn_level(opcode, false) == TRANS_LEVEL_NONE) break;
+            s_block_opcodes[s_block_length++] = opcode;
+            if (is_block_terminator(opcode)) break;
+        }
+    }
+}
+
+/* --------------------------------------------------------------------- */
+/*  Lazy Flags                                                           */
+/* --------------------------------------------------------------------- */
+
+/*
+ * Flag-setting instructions don't compute NZCV right away. The result and
+ * operands of the last flag-producing operation stay in dedicated saved
+ * registers and a flag is only computed when something reads it: a
+ * condition, an instruction consuming the carry, or a block exit.
+ * Conditions that only depend on a pending CMP/SUBS become a single
+ * compare-and-branch on the operands.
+ *
+ * A backwards liveness pass over the block tells which flags may still be
+ * read after each instruction. Flags overwritten before any read are not
+ * recorded at all. Everything is live at the end of the block.
+ */
+#define FLAG_N      0x1
+#define FLAG_Z      0x2
+#define FLAG_C      0x4
+#define FLAG_V      0x8
+#define FLAGS_NZ    (FLAG_N | FLAG_Z)
+#define FLAGS_ALL   (FLAG_N | FLAG_Z | FLAG_C | FLAG_V)
+
+/* Registers holding the pending operation, right after the cached ARM registers */
+#define FLAG_RES    SLJIT_S(1 + JIT_BLOCK_CACHED_REGS)
+#define FLAG_OP1    SLJIT_S(2 + JIT_BLOCK_CACHED_REGS)
+#define FLAG_OP2    SLJIT_S(3 + JIT_BLOCK_CACHED_REGS)
+
+typedef enum {
+    FLAGS_OP_LOGIC = 0,             /* N and Z from the result, C and V untouched */
+    FLAGS_OP_ADD,                   /* NZCV of op1 + op2 */
+    FLAGS_OP_SUB,                   /* NZCV of op1 - op2 */
+} flags_op_t;
+
+static struct {
+    uint8_t pending;                /* Flags only available through the pending operation */
+    uint8_t op;                     /* flags_op_t of the pending operation */
+    bool op2_is_imm;                /* op2 is op2_imm rather than FLAG_OP2 */
+    uint32_t op2_imm;
+    bool conditional;               /* Translating a conditionally executed instruction */
+} s_flags;
+
+/* Flags that may still be read after each instruction of the block */
+static uint8_t s_flags_live[GBA_JIT_MAX_BLOCK_INSTRUCTIONS];
+
+static const uint8_t cond_flags[16] = {
+    FLAG_Z, FLAG_Z,                 /* EQ, NE */
+    FLAG_C, FLAG_C,                 /* CS, CC */
+    FLAG_N, FLAG_N,                 /* MI, PL */
+    FLAG_V, FLAG_V,                 /* VS, VC */
+    FLAG_C | FLAG_Z, FLAG_C | FLAG_Z, /* HI, LS */
+    FLAG_N | FLAG_V, FLAG_N | FLAG_V, /* GE, LT */
+    FLAGS_NZ | FLAG_V, FLAGS_NZ | FLAG_V, /* GT, LE */
+    0, 0                            /* AL, NV */
+};
+
+/* Over-approximation of instructions that may leave the block */
+static bool arm_may_exit(uint32_t opcode)
+{
+    if ((opcode & 0x0E000000) == 0x0A000000) return true;             /* B, BL */
+    if ((opcode & 0x0F000000) == 0x0F000000) return true;             /* SWI */
+    if ((opcode & 0x0FFFFFD0) == 0x012FFF10) return true;             /* BX, BLX */
+    if ((opcode & 0x0E108000) == 0x08108000) return true;             /* LDM with PC */
+    if ((opcode & 0x08000000) == 0 && ((opcode >> 12) & 0xF) == 15) return true;
+    return false;
+}
+
+/*
+ * Flags an unconditional instruction is certain to overwrite. This must not
+ * claim more than the translators below actually write: the S variants
+ * aliased to their plain version (ADCS, ORRS #imm...) write nothing.
+ */
+static uint8_t arm_flags_killed(uint32_t opcode)
 {
-    struct sljit_jump *jump = NULL;
+    uint32_t op = (opcode >> 21) & 0xF;
+    bool is_imm = (opcode >> 25) & 1;
+    
+    if ((opcode >> 28) != ARM_COND_AL || !(opcode & 0x00100000)) return 0;
+    if ((opcode & 0x0C000000) != 0 || (opcode & 0x0E000090) == 0x00000090) return 0;
+    if (((opcode >> 12) & 0xF) == 15) return 0;
+    
+    switch (op) {
+        case 0x2: case 0x3: case 0x4: case 0xA: case 0xB:
+            return FLAGS_ALL;
+        case 0x5: case 0x6: case 0x7:
+            return 0;
+        case 0x1: case 0xC: case 0xE: case 0xF:
+            return is_imm ? 0 : FLAGS_NZ;
+        default:
+            return FLAGS_NZ;
+    }
+}
+
+static uint8_t arm_flags_read(uint32_t opcode)
+{
+    uint32_t cond = opcode >> 28;
+    uint32_t op = (opcode >> 21) & 0xF;
+    uint8_t read = cond_flags[cond];
+    
+    if ((opcode & 0x0C000000) == 0 && (opcode & 0x0E000090) != 0x00000090) {
+        if (op == 0x5 || op == 0x6 || op == 0x7) read |= FLAG_C;           /* ADC, SBC, RSC */
+        if (!(opcode & 0x02000000) && (opcode & 0xFF0) == 0x060) read |= FLAG_C; /* RRX */
+    }
+    return read;
+}
+
+static void flags_begin(bool is_thumb)
+{
+    uint8_t live = FLAGS_ALL;
+    
+    memset(&s_flags, 0, sizeof(s_flags));
+    
+    for (int i = s_block_length - 1; i >= 0; i--) {
+        uint32_t opcode = s_block_opcodes[i];
+        
+        /* Thumb flag usage isn't modelled, all of it stays live */
+        if (is_thumb || arm_may_exit(opcode)) {
+            s_flags_live[i] = FLAGS_ALL;
+            live = FLAGS_ALL;
+            continue;
+        }
+        s_flags_live[i] = live;
+        live = (live & ~arm_flags_killed(opcode)) | arm_flags_read(opcode);
+    }
+}
+
+static uint8_t flags_live_after(void)
+{
+    return s_insn_index < s_block_length ? s_flags_live[s_insn_index] : FLAGS_ALL;
+}
+
+/*
+ * Compute pending flags into the CPU state. Only R4 and R5 are used so the
+ * operands and result of the instruction being translated survive. With
+ * keep_pending the translation state is left alone, for exits that other
+ * paths of the block don't take.
+ */
+static void flags_materialize(struct sljit_compiler *C, uint8_t mask, bool keep_pending)
+{
+    sljit_s32 op2 = s_flags.op2_is_imm ? SLJIT_IMM : FLAG_OP2;
+    sljit_sw op2w = s_flags.op2_is_imm ? (sljit_sw)s_flags.op2_imm : 0;
+    
+    mask &= s_flags.pending;
+    
+    if (mask & FLAG_N) {
+        sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R4, 0, FLAG_RES, 0, SLJIT_IMM, 31);
+        sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET, SLJIT_R4, 0);
+    }
+    if (mask & FLAG_Z) {
+        sljit_emit_op2u(C, SLJIT_SUB32 | SLJIT_SET_Z, FLAG_RES, 0, SLJIT_IMM, 0);
+        sljit_emit_op_flags(C, SLJIT_MOV32, SLJIT_R4, 0, SLJIT_ZERO);
+        sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET, SLJIT_R4, 0);
+    }
+    if (mask & FLAG_C) {
+        if (s_flags.op == FLAGS_OP_SUB) {
+            /* ARM carry is "no borrow" */
+            sljit_emit_op2u(C, SLJIT_SUB32 | SLJIT_SET_LESS, FLAG_OP1, 0, op2, op2w);
+            sljit_emit_op_flags(C, SLJIT_MOV32, SLJIT_R4, 0, SLJIT_GREATER_EQUAL);
+        } else {
+            sljit_emit_op2u(C, SLJIT_SUB32 | SLJIT_SET_LESS, FLAG_RES, 0, FLAG_OP1, 0);
+            sljit_emit_op_flags(C, SLJIT_MOV32, SLJIT_R4, 0, SLJIT_LESS);
+        }
+        sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET, SLJIT_R4, 0);
+    }
+    if (mask & FLAG_V) {
+        /* Operands of the same sign (different signs for SUB) and a result of the other sign */
+        sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R4, 0, FLAG_OP1, 0, op2, op2w);
+        if (s_flags.op == FLAGS_OP_ADD) {
+            sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R4, 0, SLJIT_R4, 0, SLJIT_IMM, 0xFFFFFFFF);
+        }
+        sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R5, 0, FLAG_OP1, 0, FLAG_RES, 0);
+        sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, SLJIT_R4, 0, SLJIT_R5, 0);
+        sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R4, 0, SLJIT_R4, 0, SLJIT_IMM, 31);
+        sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET, SLJIT_R4, 0);
+    }
+    
+    if (!keep_pending) {
+        s_flags.pending &= ~mask;
+    }
+}
+
+static void flags_record(struct sljit_compiler *C, flags_op_t op, sljit_s32 res,
+                         sljit_s32 op1, sljit_s32 op2, sljit_sw op2w)
+{
+    uint8_t written = (op == FLAGS_OP_LOGIC) ? FLAGS_NZ : FLAGS_ALL;
+    uint8_t live = flags_live_after();
+    
+    /* Older flags this operation leaves alone are about to lose their registers */
+    flags_materialize(C, s_flags.pending & ~written & live, false);
+    s_flags.pending = 0;
+    
+    written &= live;
+    if (written == 0) {
+        return;
+    }
+    
+    sljit_emit_op1(C, SLJIT_MOV32, FLAG_RES, 0, res, 0);
+    if (op != FLAGS_OP_LOGIC) {
+        sljit_emit_op1(C, SLJIT_MOV32, FLAG_OP1, 0, op1, 0);
+        s_flags.op2_is_imm = (op2 == SLJIT_IMM);
+        s_flags.op2_imm = (uint32_t)op2w;
+        if (op2 != SLJIT_IMM) {
+            sljit_emit_op1(C, SLJIT_MOV32, FLAG_OP2, 0, op2, 0);
+        }
+    }
+    s_flags.op = op;
+    s_flags.pending = written;
+    
+    /* The other path through the instruction has nothing pending */
+    if (s_flags.conditional) {
+        flags_materialize(C, FLAGS_ALL, false);
+    }
+}
+
+static void emit_update_flags_nz_simple(struct sljit_compiler *C, sljit_s32 result_reg)
+{
+    flags_record(C, FLAGS_OP_LOGIC, result_reg, 0, 0, 0);
+}
+
+static void emit_update_flags_add(struct sljit_compiler *C, sljit_s32 result_reg,
+                                   sljit_s32 op1_reg, sljit_s32 op2_reg)
+{
+    flags_record(C, FLAGS_OP_ADD, result_reg, op1_reg, op2_reg, 0);
+}
+
+static void emit_update_flags_add_imm(struct sljit_compiler *C, sljit_s32 result_reg,
+                                       sljit_s32 op1_reg, uint32_t imm_val)
+{
+    flags_record(C, FLAGS_OP_ADD, result_reg, op1_reg, SLJIT_IMM, imm_val);
+}
+
+static void emit_update_flags_sub(struct sljit_compiler *C, sljit_s32 result_reg,
+                                   sljit_s32 op1_reg, sljit_s32 op2_reg)
+{
+    flags_record(C, FLAGS_OP_SUB, result_reg, op1_reg, op2_reg, 0);
+}
+
+static void emit_update_flags_sub_imm(struct sljit_compiler *C, sljit_s32 result_reg,
+                                       sljit_s32 op1_reg, uint32_t imm_val)
+{
+    flags_record(C, FLAGS_OP_SUB, result_reg, op1_reg, SLJIT_IMM, imm_val);
+}
+
+static void emit_load_carry(struct sljit_compiler *C, sljit_s32 dst)
+{
+    flags_materialize(C, FLAG_C, false);
+    sljit_emit_op1(C, SLJIT_MOV_U8, dst, 0, SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+}
+
+/* Compare-and-branch straight on the pending operation, NULL if it can't be done */
+static struct sljit_jump *emit_pending_condition_skip(struct sljit_compiler *C, uint8_t cond)
+{
+    sljit_s32 op2 = s_flags.op2_is_imm ? SLJIT_IMM : FLAG_OP2;
+    sljit_sw op2w = s_flags.op2_is_imm ? (sljit_sw)s_flags.op2_imm : 0;
+    sljit_s32 type;
+    
+    if (cond == ARM_COND_MI || cond == ARM_COND_PL) {
+        type = (cond == ARM_COND_MI) ? SLJIT_SIG_LESS : SLJIT_SIG_GREATER_EQUAL;
+        return sljit_emit_cmp(C, SLJIT_32 | (type ^ 0x1), FLAG_RES, 0, SLJIT_IMM, 0);
+    }
+    
+    if (s_flags.op == FLAGS_OP_SUB) {
+        switch (cond) {
+            case ARM_COND_EQ: type = SLJIT_EQUAL; break;
+            case ARM_COND_NE: type = SLJIT_NOT_EQUAL; break;
+            case ARM_COND_CS: type = SLJIT_GREATER_EQUAL; break;
+            case ARM_COND_CC: type = SLJIT_LESS; break;
+            case ARM_COND_HI: type = SLJIT_GREATER; break;
+            case ARM_COND_LS: type = SLJIT_LESS_EQUAL; break;
+            case ARM_COND_GE: type = SLJIT_SIG_GREATER_EQUAL; break;
+            case ARM_COND_LT: type = SLJIT_SIG_LESS; break;
+            case ARM_COND_GT: type = SLJIT_SIG_GREATER; break;
+            case ARM_COND_LE: type = SLJIT_SIG_LESS_EQUAL; break;
+            default: return NULL;
+        }
+        return sljit_emit_cmp(C, SLJIT_32 | (type ^ 0x1), FLAG_OP1, 0, op2, op2w);
+    }
+    
+    if (cond == ARM_COND_EQ || cond == ARM_COND_NE) {
+        type = (cond == ARM_COND_EQ) ? SLJIT_EQUAL : SLJIT_NOT_EQUAL;
+        return sljit_emit_cmp(C, SLJIT_32 | (type ^ 0x1), FLAG_RES, 0, SLJIT_IMM, 0);
+    }
+    
+    if (s_flags.op == FLAGS_OP_ADD && (cond == ARM_COND_CS || cond == ARM_COND_CC)) {
+        /* Carry out of an addition means the result wrapped below op1 */
+        type = (cond == ARM_COND_CS) ? SLJIT_LESS : SLJIT_GREATER_EQUAL;
+        return sljit_emit_cmp(C, SLJIT_32 | (type ^ 0x1), FLAG_RES, 0, FLAG_OP1, 0);
+    }
+    
+    return NULL;
+}
+
+/*
+ * Emit a jump taken when the condition does NOT hold, to skip the
+ * conditional code. Returns NULL for AL.
+ */
+static struct sljit_jump *emit_condition_skip(struct sljit_compiler *C, uint8_t cond)
+{
+    uint8_t needed = cond_flags[cond & 0xF];
+    
+    if (needed == 0) {
+        return NULL;
+    }
+    
+    if ((s_flags.pending & needed) == needed) {
+        struct sljit_jump *jump = emit_pending_condition_skip(C, cond);
+        if (jump != NULL) {
+            return jump;
+        }
+    }
+    
+    flags_materialize(C, needed, false);
     
     switch (cond) {
         case ARM_COND_EQ: /* Z==1 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
         case ARM_COND_NE: /* Z==0 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
+            return sljit_emit_cmp(C, SLJIT_32 | (cond == ARM_COND_EQ ? SLJIT_EQUAL : SLJIT_NOT_EQUAL),
+                                  SLJIT_R2, 0, SLJIT_IMM, 0);
         case ARM_COND_CS: /* C==1 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
         case ARM_COND_CC: /* C==0 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+            return sljit_emit_cmp(C, SLJIT_32 | (cond == ARM_COND_CS ? SLJIT_EQUAL : SLJIT_NOT_EQUAL),
+                                  SLJIT_R2, 0, SLJIT_IMM, 0);
         case ARM_COND_MI: /* N==1 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
         case ARM_COND_PL: /* N==0 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
+            return sljit_emit_cmp(C, SLJIT_32 | (cond == ARM_COND_MI ? SLJIT_EQUAL : SLJIT_NOT_EQUAL),
+                                  SLJIT_R2, 0, SLJIT_IMM, 0);
         case ARM_COND_VS: /* V==1 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
         case ARM_COND_VC: /* V==0 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
+            return sljit_emit_cmp(C, SLJIT_32 | (cond == ARM_COND_VS ? SLJIT_EQUAL : SLJIT_NOT_EQUAL),
+                                  SLJIT_R2, 0, SLJIT_IMM, 0);
         case ARM_COND_HI: /* C==1 && Z==0 */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-                sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, 1);
-                sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            }
-            break;
         case ARM_COND_LS: /* C==0 || Z==1 */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-                sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            }
-            break;
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
+            sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, 1);
+            sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
+            /* R2 == 0 means HI */
+            return sljit_emit_cmp(C, SLJIT_32 | (cond == ARM_COND_HI ? SLJIT_NOT_EQUAL : SLJIT_EQUAL),
+                                  SLJIT_R2, 0, SLJIT_IMM, 0);
         case ARM_COND_GE: /* N==V */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_R3, 0);
-            }
-            break;
         case ARM_COND_LT: /* N!=V */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_R3, 0);
-            }
-            break;
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
+            return sljit_emit_cmp(C, SLJIT_32 | (cond == ARM_COND_GE ? SLJIT_NOT_EQUAL : SLJIT_EQUAL),
+                                  SLJIT_R2, 0, SLJIT_R3, 0);
         case ARM_COND_GT: /* Z==0 && N==V */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R4, 0, 
-                               SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-                sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_R4, 0);
-                sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            }
-            break;
         case ARM_COND_LE: /* Z==1 || N!=V */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R4, 0, 
-                               SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-                sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_R4, 0);
-                sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            }
-            break;
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
+            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R4, 0, SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
+            sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_R4, 0);
+            sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
+            /* R2 == 0 means GT */
+            return sljit_emit_cmp(C, SLJIT_32 | (cond == ARM_COND_GT ? SLJIT_NOT_EQUAL : SLJIT_EQUAL),
+                                  SLJIT_R2, 0, SLJIT_IMM, 0);
         default:
-            break;
+            return NULL;
     }
-    
-    return jump;
 }
 
-static struct sljit_jump *emit_condition_check_inverse(struct sljit_compiler *C, uint8_t cond)
+/* --------------------------------------------------------------------- */
+/*  Register Allocation                                                  */
+/* --------------------------------------------------------------------- */
+
+/*
+ * The most used ARM registers of a block live in SLJIT saved registers
+ * (S1 and up) between the block entry and its exits. They are loaded once
+ * after the prologue and only the dirty ones are written back before
+ * leaving the block or calling a helper that looks at the CPU state.
+ * R15 is never cached, it is only written right before leaving anyway.
+ *
+ * Dirty tracking happens at translation time. Inside a conditionally
+ * executed instruction, registers are marked dirty even if the condition
+ * fails at run time, which only costs a redundant (but harmless) store.
+ */
+static struct {
+    sljit_s32 host[16];             /* Saved register caching the ARM register, 0 if none */
+    uint16_t cached;                /* ARM registers held in host registers */
+    uint16_t dirty;                 /* Cached registers written since they were loaded */
+} s_regs;
+
+static void count_arm_reg_uses(uint32_t opcode, uint8_t *uses)
 {
-    struct sljit_jump *jump = NULL;
+    uint32_t op = (opcode >> 21) & 0xF;
     
-    switch (cond) {
-        case ARM_COND_EQ: /* Z==1, inverse: Z==0 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
-        case ARM_COND_NE: /* Z==0, inverse: Z==1 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
-        case ARM_COND_CS: /* C==1, inverse: C==0 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
-        case ARM_COND_CC: /* C==0, inverse: C==1 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
-        case ARM_COND_MI: /* N==1, inverse: N==0 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
-        case ARM_COND_PL: /* N==0, inverse: N==1 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
-        case ARM_COND_VS: /* V==1, inverse: V==0 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
-        case ARM_COND_VC: /* V==0, inverse: V==1 */
-            sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                           SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-            jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            break;
-        case ARM_COND_HI: /* C==1 && Z==0, inverse: C==0 || Z==1 */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-                sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            }
-            break;
-        case ARM_COND_LS: /* C==0 || Z==1, inverse: C==1 && Z==0 */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-                sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, 1);
-                sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
+    switch ((opcode >> 25) & 0x7) {
+        case 0x0:
+            if ((opcode & 0x0FFFFFD0) == 0x012FFF10) {
+                /* BX / BLX */
+                uses[opcode & 0xF]++;
+                break;
             }
-            break;
-        case ARM_COND_GE: /* N==V, inverse: N!=V */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_R3, 0);
+            if ((opcode & 0x0E0000F0) == 0x00000090) {
+                /* Multiplies */
+                uses[(opcode >> 16) & 0xF]++;
+                uses[(opcode >> 12) & 0xF]++;
+                uses[(opcode >> 8) & 0xF]++;
+                uses[opcode & 0xF]++;
+                break;
             }
-            break;
-        case ARM_COND_LT: /* N!=V, inverse: N==V */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_R3, 0);
+            if ((opcode & 0x90) == 0x90) {
+                /* Halfword and signed transfers */
+                uses[(opcode >> 16) & 0xF]++;
+                uses[(opcode >> 12) & 0xF]++;
+                if (!(opcode & 0x00400000)) uses[opcode & 0xF]++;
+                break;
             }
+            uses[opcode & 0xF]++;
+            if (opcode & 0x10) uses[(opcode >> 8) & 0xF]++;
+            /* fall through */
+        case 0x1:
+            if (op != 0xD && op != 0xF) uses[(opcode >> 16) & 0xF]++;
+            if (op < 0x8 || op > 0xB) uses[(opcode >> 12) & 0xF]++;
             break;
-        case ARM_COND_GT: /* Z==0 && N==V, inverse: Z==1 || N!=V */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R4, 0, 
-                               SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-                sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_R4, 0);
-                sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
-            }
+            
+        case 0x2:
+        case 0x3:
+            uses[(opcode >> 16) & 0xF]++;
+            uses[(opcode >> 12) & 0xF]++;
+            if (opcode & 0x02000000) uses[opcode & 0xF]++;
             break;
-        case ARM_COND_LE: /* Z==1 || N!=V, inverse: Z==0 && N==V */
-            {
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R2, 0, 
-                               SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                               SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET);
-                sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R4, 0, 
-                               SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET);
-                sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_R4, 0);
-                sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
-                jump = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
+            
+        case 0x4:
+            uses[(opcode >> 16) & 0xF]++;
+            for (int i = 0; i < 16; i++) {
+                if (opcode & (1 << i)) uses[i]++;
             }
             break;
-        default:
+            
+        case 0x5:
+            if (opcode & 0x01000000) uses[14]++;
             break;
     }
-    
-    return jump;
 }
 
-/* --------------------------------------------------------------------- */
-/*  Helper Functions                                                     */
-/* --------------------------------------------------------------------- */
+static void count_thumb_reg_uses(uint16_t opcode, uint8_t *uses)
+{
+    if ((opcode & 0xFC00) == 0x4400) {
+        /* Hi register operations / BX */
+        uses[(opcode & 0x7) | ((opcode >> 4) & 0x8)]++;
+        uses[(opcode >> 3) & 0xF]++;
+    } else if ((opcode & 0xF000) == 0x9000 || (opcode & 0xFF00) == 0xB000 ||
+               (opcode & 0xF600) == 0xB400) {
+        /* SP relative, ADD SP, PUSH/POP */
+        uses[13]++;
+        uses[(opcode >> 8) & 0x7]++;
+    } else if ((opcode & 0xE000) == 0x2000) {
+        /* MOV/CMP/ADD/SUB immediate */
+        uses[(opcode >> 8) & 0x7]++;
+    } else if ((opcode & 0xF000) < 0xD000) {
+        uses[opcode & 0x7]++;
+        uses[(opcode >> 3) & 0x7]++;
+        if ((opcode & 0xF000) == 0x5000 || (opcode & 0xFC00) == 0x1800) {
+            uses[(opcode >> 6) & 0x7]++;
+        }
+    } else if ((opcode & 0xF800) == 0xF800) {
+        uses[14]++;
+    }
+}
 
-__attribute__((unused))
-static sljit_s32 arm_reg_to_sljit(int arm_reg)
+/* Pick the hottest registers of the block found by scan_block */
+static void regalloc_begin(struct sljit_compiler *C, bool is_thumb)
 {
-    if (arm_reg == 15) return SLJIT_R0;
-    if (arm_reg >= 0 && arm_reg <= 14) {
-        return SLJIT_MEM1(SLJIT_S0) + offsetof(gba_cpu_state_t, reg[arm_reg]);
+    uint8_t uses[16] = {0};
+    
+    memset(&s_regs, 0, sizeof(s_regs));
+    
+    if (!g_jit_config.enable_reg_cache) {
+        return;
+    }
+    
+    for (int i = 0; i < s_block_length; i++) {
+        if (is_thumb) {
+            count_thumb_reg_uses(s_block_opcodes[i], uses);
+        } else {
+            count_arm_reg_uses(s_block_opcodes[i], uses);
+        }
+    }
+    
+    uses[15] = 0;
+    
+    for (int n = 0; n < JIT_BLOCK_CACHED_REGS; n++) {
+        int best = -1;
+        for (int i = 0; i < 15; i++) {
+            /* A register used once gains nothing from being loaded up front */
+            if (uses[i] >= 2 && (best < 0 || uses[i] > uses[best])) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        uses[best] = 0;
+        s_regs.host[best] = SLJIT_S(1 + n);
+        s_regs.cached |= 1 << best;
+        sljit_emit_op1(C, SLJIT_MOV32, s_regs.host[best], 0,
+                       SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[best]));
+    }
+}
+
+/* Store dirty cached registers, they stay dirty for the code that follows */
+static void regalloc_writeback(struct sljit_compiler *C)
+{
+    for (int i = 0; i < 15; i++) {
+        if (s_regs.dirty & (1 << i)) {
+            sljit_emit_op1(C, SLJIT_MOV32, 
+                           SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[i]),
+                           s_regs.host[i], 0);
+        }
     }
-    return SLJIT_R0;
+}
+
+/* Store dirty cached registers before a helper that reads or writes the CPU state */
+static void regalloc_flush(struct sljit_compiler *C)
+{
+    regalloc_writeback(C);
+    s_regs.dirty = 0;
 }
 
 static void emit_load_reg(struct sljit_compiler *C, sljit_s32 dst, int arm_reg)
 {
-    if (arm_reg == 15) {
-        sljit_emit_op1(C, SLJIT_MOV32, dst, 0, 
-                       SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[15]));
+    if (s_regs.host[arm_reg]) {
+        sljit_emit_op1(C, SLJIT_MOV32, dst, 0, s_regs.host[arm_reg], 0);
     } else {
         sljit_emit_op1(C, SLJIT_MOV32, dst, 0, 
                        SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[arm_reg]));
@@ -326,234 +656,283 @@ static void emit_load_reg(struct sljit_compiler *C, sljit_s32 dst, int arm_reg)
 
 static void emit_store_reg(struct sljit_compiler *C, int arm_reg, sljit_s32 src)
 {
-    if (arm_reg == 15) {
+    if (s_regs.host[arm_reg]) {
+        sljit_emit_op1(C, SLJIT_MOV32, s_regs.host[arm_reg], 0, src, 0);
+        s_regs.dirty |= 1 << arm_reg;
+    } else {
         sljit_emit_op1(C, SLJIT_MOV32, 
-                       SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[15]),
+                       SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[arm_reg]),
                        src, 0);
+    }
+}
+
+static void emit_store_reg_imm(struct sljit_compiler *C, int arm_reg, uint32_t value)
+{
+    if (s_regs.host[arm_reg]) {
+        sljit_emit_op1(C, SLJIT_MOV32, s_regs.host[arm_reg], 0, SLJIT_IMM, value);
+        s_regs.dirty |= 1 << arm_reg;
+    } else {
+        sljit_emit_op1(C, SLJIT_MOV32, 
+                       SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[arm_reg]),
+                       SLJIT_IMM, value);
+    }
+}
+
+/* Return the PC held in R0 to the dispatcher */
+static void emit_block_return(struct sljit_compiler *C)
+{
+    flags_materialize(C, FLAGS_ALL, true);
+    regalloc_writeback(C);
+    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+}
+
+/* --------------------------------------------------------------------- */
+/*  Memory Access                                                        */
+/* --------------------------------------------------------------------- */
+
+/*
+ * Loads and stores check the region of the address inline and access
+ * IWRAM, EWRAM, ROM, VRAM and palette memory directly. Everything else
+ * (I/O, OAM, backup memory, unaligned accesses, ROM pages not loaded yet)
+ * goes through the gba_mem_* helpers. Writes are only inlined for the
+ * work RAMs: the other regions have side effects on write.
+ *
+ * Stores to a work RAM page holding translated code take the helper too,
+ * it tells the JIT to drop the blocks compiled from that page.
+ *
+ * Both take the address in R0 (and the value in R1 for writes), return a
+ * loaded value in R0 zero-extended and clobber R1-R5.
+ */
+#define MEM_MAX_FAST_PATHS  5
+#define MEM_MAX_SLOW_PATHS  4
+
+static gba_mem_regions_t s_mem;
+
+/*
+ * Cycles are charged the way the interpreter does, so code costs the same
+ * whether it runs compiled or not: a sequential fetch per instruction, a
+ * non-sequential access per load or store (sequential for the words of a
+ * block transfer) and a non-sequential fetch at branch targets. Costs are
+ * read from the waitstate tables when the code runs, WAITCNT may change
+ * them after the block was compiled.
+ */
+#define CYCLES_OFFSET  offsetof(gba_cpu_state_t, cycles)
+#define ALERT_OFFSET   offsetof(gba_cpu_state_t, alert)
+
+static uint8_t s_single_cycle[16][2] = {
+    {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1},
+    {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1},
+};
+
+/* Subtract count times a table entry, using R4 */
+static void emit_cycles_fixed(struct sljit_compiler *C, const uint8_t *entry, int count)
+{
+    sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R4, 0, SLJIT_MEM0(), (sljit_sw)entry);
+    if (count > 1) {
+        sljit_emit_op2(C, SLJIT_MUL32, SLJIT_R4, 0, SLJIT_R4, 0, SLJIT_IMM, count);
+    }
+    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_MEM1(SLJIT_S0), CYCLES_OFFSET,
+                   SLJIT_MEM1(SLJIT_S0), CYCLES_OFFSET, SLJIT_R4, 0);
+}
+
+/* Subtract the entry for the region of the address in addr, using R4 and R5 */
+static void emit_cycles_region(struct sljit_compiler *C, uint8_t (*table)[2], int width, sljit_s32 addr)
+{
+    sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R4, 0, addr, 0, SLJIT_IMM, 24);
+    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, SLJIT_R4, 0, SLJIT_IMM, 0xF);
+    sljit_emit_op1(C, SLJIT_MOV_P, SLJIT_R5, 0, SLJIT_IMM, (sljit_sw)&table[0][width]);
+    sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R4, 0, SLJIT_MEM2(SLJIT_R5, SLJIT_R4), 1);
+    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_MEM1(SLJIT_S0), CYCLES_OFFSET,
+                   SLJIT_MEM1(SLJIT_S0), CYCLES_OFFSET, SLJIT_R4, 0);
+}
+
+/* Sequential fetches of count instructions at pc */
+static void emit_fetch_cycles(struct sljit_compiler *C, uint32_t pc, bool is_thumb, int count)
+{
+    emit_cycles_fixed(C, &s_mem.ws_seq[(pc >> 24) & 0xF][is_thumb ? 0 : 1], count);
+}
+
+/* Non-sequential fetch at a branch target known at translation time */
+static void emit_branch_cycles(struct sljit_compiler *C, uint32_t target, bool is_thumb)
+{
+    emit_cycles_fixed(C, &s_mem.ws_nseq[(target >> 24) & 0xF][is_thumb ? 0 : 1], 1);
+}
+
+/* Same for a target in R0 */
+static void emit_branch_cycles_dynamic(struct sljit_compiler *C, bool is_thumb)
+{
+    emit_cycles_region(C, s_mem.ws_nseq, is_thumb ? 0 : 1, SLJIT_R0);
+}
+
+static void emit_mem_count(struct sljit_compiler *C, uint32_t *counter)
+{
+    if (g_jit_config.enable_stats) {
+        sljit_emit_op2(C, SLJIT_ADD32, SLJIT_MEM0(), (sljit_sw)counter,
+                       SLJIT_MEM0(), (sljit_sw)counter, SLJIT_IMM, 1);
+    }
+}
+
+/* Jump taken when the work RAM page at offset R2 holds translated code */
+static struct sljit_jump *emit_code_page_check(struct sljit_compiler *C, uint32_t *pages)
+{
+    sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R3, 0, SLJIT_R2, 0, SLJIT_IMM, GBA_CODE_PAGE_SHIFT + 5);
+    sljit_emit_op1(C, SLJIT_MOV_P, SLJIT_R4, 0, SLJIT_IMM, (sljit_sw)pages);
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R3, 0, SLJIT_MEM2(SLJIT_R4, SLJIT_R3), 2);
+    sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R4, 0, SLJIT_R2, 0, SLJIT_IMM, GBA_CODE_PAGE_SHIFT);
+    sljit_emit_op2(C, SLJIT_MLSHR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_R4, 0);
+    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_IMM, 1);
+    return sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R3, 0, SLJIT_IMM, 0);
+}
+
+/* Access size bytes at base + R2 (or at R2 without a base), then jump past the helper call */
+static struct sljit_jump *emit_mem_direct(struct sljit_compiler *C, int size, bool is_write,
+                                          uint8_t *base, uint32_t *counter)
+{
+    static const sljit_s32 mov_ops[5] = { 0, SLJIT_MOV_U8, SLJIT_MOV_U16, 0, SLJIT_MOV32 };
+
+    if (base != NULL) {
+        sljit_emit_op2(C, SLJIT_ADD, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, (sljit_sw)base);
+    }
+    if (is_write) {
+        sljit_emit_op1(C, mov_ops[size], SLJIT_MEM1(SLJIT_R2), 0, SLJIT_R1, 0);
+    } else {
+        sljit_emit_op1(C, mov_ops[size], SLJIT_R0, 0, SLJIT_MEM1(SLJIT_R2), 0);
+    }
+    emit_mem_count(C, counter);
+    return sljit_emit_jump(C, SLJIT_JUMP);
+}
+
+static void emit_mem_access(struct sljit_compiler *C, int size, bool is_write)
+{
+    struct sljit_jump *done[MEM_MAX_FAST_PATHS];
+    struct sljit_jump *slow[MEM_MAX_SLOW_PATHS];
+    struct sljit_jump *next;
+    int done_count = 0;
+    int slow_count = 0;
+    sljit_sw helper;
+
+    if (is_write) {
+        helper = (size == 4) ? SLJIT_FUNC_ADDR(gba_mem_write32) :
+                 (size == 2) ? SLJIT_FUNC_ADDR(gba_mem_write16) : SLJIT_FUNC_ADDR(gba_mem_write8);
+    } else {
+        helper = (size == 4) ? SLJIT_FUNC_ADDR(gba_mem_read32) :
+                 (size == 2) ? SLJIT_FUNC_ADDR(gba_mem_read16) : SLJIT_FUNC_ADDR(gba_mem_read8);
+    }
+
+    if (s_mem.iwram_host != NULL || s_mem.ewram_host != NULL ||
+        (!is_write && (s_mem.rom_pages != NULL || s_mem.vram_host != NULL || s_mem.palette_host != NULL))) {
+        /* Unaligned accesses rotate or get forced to alignment, the helpers know how */
+        if (size > 1) {
+            sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, size - 1);
+            slow[slow_count++] = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
+        }
+        sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R3, 0, SLJIT_R0, 0, SLJIT_IMM, 24);
+    }
+
+    if (s_mem.iwram_host != NULL) {
+        next = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R3, 0, SLJIT_IMM, 0x03);
+        sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, 0x7FFF);
+        if (is_write) {
+            slow[slow_count++] = emit_code_page_check(C, gba_code_pages_iwram);
+        }
+        done[done_count++] = emit_mem_direct(C, size, is_write, s_mem.iwram_host, &g_jit_stats.mem_iwram);
+        sljit_set_label(next, sljit_emit_label(C));
+    }
+
+    if (s_mem.ewram_host != NULL) {
+        next = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R3, 0, SLJIT_IMM, 0x02);
+        sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, 0x3FFFF);
+        if (is_write) {
+            slow[slow_count++] = emit_code_page_check(C, gba_code_pages_ewram);
+        }
+        done[done_count++] = emit_mem_direct(C, size, is_write, s_mem.ewram_host, &g_jit_stats.mem_ewram);
+        sljit_set_label(next, sljit_emit_label(C));
+    }
+
+    if (!is_write && s_mem.rom_pages != NULL) {
+        /* 0x08-0x0C, 0x0D can be the EEPROM */
+        sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R2, 0, SLJIT_R3, 0, SLJIT_IMM, 0x08);
+        next = sljit_emit_cmp(C, SLJIT_32 | SLJIT_GREATER, SLJIT_R2, 0, SLJIT_IMM, 0x0C - 0x08);
+        /* Past the end of the ROM reads return the address bus, not a mirror */
+        sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, 0x1FFFFFF);
+        slow[slow_count++] = sljit_emit_cmp(C, SLJIT_32 | SLJIT_GREATER_EQUAL,
+                                            SLJIT_R2, 0, SLJIT_IMM, s_mem.rom_size);
+        sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, 15);
+        sljit_emit_op1(C, SLJIT_MOV_P, SLJIT_R3, 0, SLJIT_IMM, (sljit_sw)s_mem.rom_pages);
+        sljit_emit_op1(C, SLJIT_MOV_P, SLJIT_R3, 0, SLJIT_MEM2(SLJIT_R3, SLJIT_R2), SLJIT_WORD_SHIFT);
+        /* Pages are loaded on demand by the helper */
+        slow[slow_count++] = sljit_emit_cmp(C, SLJIT_EQUAL, SLJIT_R3, 0, SLJIT_IMM, 0);
+        sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, 0x7FFF);
+        sljit_emit_op2(C, SLJIT_ADD, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R3, 0);
+        done[done_count++] = emit_mem_direct(C, size, false, NULL, &g_jit_stats.mem_rom);
+        sljit_set_label(next, sljit_emit_label(C));
+    }
+
+    if (!is_write && s_mem.vram_host != NULL) {
+        next = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R3, 0, SLJIT_IMM, 0x06);
+        sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, 0x1FFFF);
+        /* The upper 32KB mirror of OBJ VRAM is left to the helper */
+        slow[slow_count++] = sljit_emit_cmp(C, SLJIT_32 | SLJIT_GREATER_EQUAL,
+                                            SLJIT_R2, 0, SLJIT_IMM, 0x18000);
+        done[done_count++] = emit_mem_direct(C, size, false, s_mem.vram_host, &g_jit_stats.mem_vram);
+        sljit_set_label(next, sljit_emit_label(C));
+    }
+
+    if (!is_write && s_mem.palette_host != NULL) {
+        next = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL, SLJIT_R3, 0, SLJIT_IMM, 0x05);
+        sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, 0x3FF);
+        done[done_count++] = emit_mem_direct(C, size, false, s_mem.palette_host, &g_jit_stats.mem_palette);
+        sljit_set_label(next, sljit_emit_label(C));
+    }
+
+    if (slow_count > 0) {
+        struct sljit_label *slow_label = sljit_emit_label(C);
+        for (int i = 0; i < slow_count; i++) {
+            sljit_set_label(slow[i], slow_label);
+        }
+    }
+
+    emit_mem_count(C, &g_jit_stats.mem_slow);
+    if (is_write) {
+        /* Collect the alert for the next deadline check, the fast paths never raise one */
+        sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2(32, 32, 32), SLJIT_IMM, helper);
+        sljit_emit_op2(C, SLJIT_OR32, SLJIT_MEM1(SLJIT_S0), ALERT_OFFSET,
+                       SLJIT_MEM1(SLJIT_S0), ALERT_OFFSET, SLJIT_R0, 0);
     } else {
-        sljit_emit_op1(C, SLJIT_MOV32, 
-                       SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[arm_reg]),
-                       src, 0);
+        sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32), SLJIT_IMM, helper);
+    }
+
+    if (done_count > 0) {
+        struct sljit_label *done_label = sljit_emit_label(C);
+        for (int i = 0; i < done_count; i++) {
+            sljit_set_label(done[i], done_label);
+        }
     }
 }
 
-static void emit_update_flags_nz_simple(struct sljit_compiler *C, sljit_s32 result_reg)
+static void emit_mem_read(struct sljit_compiler *C, int size)
 {
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, result_reg, 0, SLJIT_IMM, 0x80000000);
-    struct sljit_jump *not_negative = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL,
-                                                      SLJIT_R4, 0, SLJIT_IMM, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_n_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(not_negative, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_n_clear, sljit_emit_label(C));
-    
-    struct sljit_jump *not_zero = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL,
-                                                  result_reg, 0, SLJIT_IMM, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_z_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(not_zero, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_z_clear, sljit_emit_label(C));
+    emit_cycles_region(C, s_mem.ws_nseq, size == 4, SLJIT_R0);
+    emit_mem_access(C, size, false);
 }
 
-static void emit_update_flags_add(struct sljit_compiler *C, sljit_s32 result_reg,
-                                   sljit_s32 op1_reg, sljit_s32 op2_reg)
+static void emit_mem_write(struct sljit_compiler *C, int size)
 {
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, result_reg, 0, SLJIT_IMM, 0x80000000);
-    struct sljit_jump *not_negative = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL,
-                                                      SLJIT_R4, 0, SLJIT_IMM, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_n_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(not_negative, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_n_clear, sljit_emit_label(C));
-    
-    struct sljit_jump *not_zero = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL,
-                                                  result_reg, 0, SLJIT_IMM, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_z_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(not_zero, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_z_clear, sljit_emit_label(C));
-    
-    struct sljit_jump *no_carry = sljit_emit_cmp(C, SLJIT_32 | SLJIT_LESS,
-                                                  op1_reg, 0, op2_reg, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_c_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(no_carry, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_c_clear, sljit_emit_label(C));
-    
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, op1_reg, 0, SLJIT_IMM, 0x80000000);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R5, 0, op2_reg, 0, SLJIT_IMM, 0x80000000);
-    sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R4, 0, SLJIT_R4, 0, SLJIT_R5, 0);
-    struct sljit_jump *no_overflow_1 = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL,
-                                                       SLJIT_R4, 0, SLJIT_IMM, 0);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, result_reg, 0, SLJIT_IMM, 0x80000000);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R5, 0, op1_reg, 0, SLJIT_IMM, 0x80000000);
-    struct sljit_jump *no_overflow_2 = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL,
-                                                       SLJIT_R4, 0, SLJIT_R5, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_v_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(no_overflow_2, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_v_clear, sljit_emit_label(C));
-    sljit_set_label(no_overflow_1, sljit_emit_label(C));
+    emit_cycles_region(C, s_mem.ws_nseq, size == 4, SLJIT_R0);
+    emit_mem_access(C, size, true);
 }
 
-static void emit_update_flags_sub(struct sljit_compiler *C, sljit_s32 result_reg,
-                                   sljit_s32 op1_reg, sljit_s32 op2_reg)
+/* Word of an LDM/STM, PUSH/POP */
+static void emit_block_mem_read(struct sljit_compiler *C)
 {
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, result_reg, 0, SLJIT_IMM, 0x80000000);
-    struct sljit_jump *not_negative = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL,
-                                                      SLJIT_R4, 0, SLJIT_IMM, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_n_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(not_negative, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_n_clear, sljit_emit_label(C));
-    
-    struct sljit_jump *not_zero = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL,
-                                                  result_reg, 0, SLJIT_IMM, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_z_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(not_zero, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_z_clear, sljit_emit_label(C));
-    
-    struct sljit_jump *no_carry = sljit_emit_cmp(C, SLJIT_32 | SLJIT_LESS,
-                                                  op1_reg, 0, op2_reg, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_c_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(no_carry, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_c_clear, sljit_emit_label(C));
-    
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, op1_reg, 0, SLJIT_IMM, 0x80000000);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R5, 0, op2_reg, 0, SLJIT_IMM, 0x80000000);
-    struct sljit_jump *no_overflow_1 = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL,
-                                                       SLJIT_R4, 0, SLJIT_R5, 0);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, result_reg, 0, SLJIT_IMM, 0x80000000);
-    struct sljit_jump *no_overflow_2 = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL,
-                                                       SLJIT_R4, 0, SLJIT_R5, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_v_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(no_overflow_2, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_v_clear, sljit_emit_label(C));
-    sljit_set_label(no_overflow_1, sljit_emit_label(C));
+    emit_cycles_region(C, s_mem.ws_seq, 1, SLJIT_R0);
+    emit_mem_access(C, 4, false);
 }
 
-static void emit_update_flags_sub_imm(struct sljit_compiler *C, sljit_s32 result_reg,
-                                       sljit_s32 op1_reg, uint32_t imm_val)
+static void emit_block_mem_write(struct sljit_compiler *C)
 {
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, result_reg, 0, SLJIT_IMM, 0x80000000);
-    struct sljit_jump *not_negative = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL,
-                                                      SLJIT_R4, 0, SLJIT_IMM, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_n_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(not_negative, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), N_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_n_clear, sljit_emit_label(C));
-    
-    struct sljit_jump *not_zero = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL,
-                                                  result_reg, 0, SLJIT_IMM, 0);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_z_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(not_zero, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), Z_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_z_clear, sljit_emit_label(C));
-    
-    struct sljit_jump *no_carry = sljit_emit_cmp(C, SLJIT_32 | SLJIT_LESS,
-                                                  op1_reg, 0, SLJIT_IMM, imm_val);
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_c_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(no_carry, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_c_clear, sljit_emit_label(C));
-    
-    uint32_t op2_sign = imm_val & 0x80000000;
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, op1_reg, 0, SLJIT_IMM, 0x80000000);
-    struct sljit_jump *no_overflow_1;
-    if (op2_sign) {
-        no_overflow_1 = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL,
-                                        SLJIT_R4, 0, SLJIT_IMM, 0);
-    } else {
-        no_overflow_1 = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL,
-                                        SLJIT_R4, 0, SLJIT_IMM, 0);
-    }
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R4, 0, result_reg, 0, SLJIT_IMM, 0x80000000);
-    struct sljit_jump *no_overflow_2;
-    if (op2_sign) {
-        no_overflow_2 = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL,
-                                        SLJIT_R4, 0, SLJIT_IMM, 0);
-    } else {
-        no_overflow_2 = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL,
-                                        SLJIT_R4, 0, SLJIT_IMM, 0);
-    }
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET,
-                   SLJIT_IMM, 1);
-    struct sljit_jump *skip_v_clear = sljit_emit_jump(C, SLJIT_JUMP);
-    sljit_set_label(no_overflow_2, sljit_emit_label(C));
-    sljit_emit_op1(C, SLJIT_MOV_U8, 
-                   SLJIT_MEM1(SLJIT_S0), V_FLAG_OFFSET,
-                   SLJIT_IMM, 0);
-    sljit_set_label(skip_v_clear, sljit_emit_label(C));
-    sljit_set_label(no_overflow_1, sljit_emit_label(C));
+    emit_cycles_region(C, s_mem.ws_seq, 1, SLJIT_R0);
+    emit_mem_access(C, 4, true);
 }
 
 /* --------------------------------------------------------------------- */
@@ -643,7 +1022,7 @@ static int translate_mov_reg(struct sljit_compiler *C, uint32_t opcode)
     emit_load_reg(C, SLJIT_R0, rm);
     
     if (rd == 15) {
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_block_return(C);
         return 1;
     }
     
@@ -775,7 +1154,7 @@ static int translate_bic_reg(struct sljit_compiler *C, uint32_t opcode)
     sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_R2, 0);
     
     if (rd == 15) {
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_block_return(C);
         return 1;
     }
     
@@ -794,7 +1173,7 @@ static int translate_mvn_reg(struct sljit_compiler *C, uint32_t opcode)
     sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFF);
     
     if (rd == 15) {
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_block_return(C);
         return 1;
     }
     
@@ -814,7 +1193,7 @@ static int translate_mvn_imm(struct sljit_compiler *C, uint32_t opcode)
     sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFF);
     
     if (rd == 15) {
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_block_return(C);
         return 1;
     }
     
@@ -859,7 +1238,7 @@ static int translate_adds_imm(struct sljit_compiler *C, uint32_t opcode)
     emit_load_reg(C, SLJIT_R1, rn);
     sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_IMM, imm_val);
     emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    emit_update_flags_add_imm(C, SLJIT_R0, SLJIT_R1, imm_val);
     
     return 0;
 }
@@ -874,7 +1253,7 @@ static int translate_adds_reg(struct sljit_compiler *C, uint32_t opcode)
     emit_load_reg(C, SLJIT_R2, rm);
     sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_R2, 0);
     emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    emit_update_flags_add(C, SLJIT_R0, SLJIT_R1, SLJIT_R2);
     
     return 0;
 }
@@ -890,7 +1269,7 @@ static int translate_subs_imm(struct sljit_compiler *C, uint32_t opcode)
     emit_load_reg(C, SLJIT_R1, rn);
     sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_IMM, imm_val);
     emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    emit_update_flags_sub_imm(C, SLJIT_R0, SLJIT_R1, imm_val);
     
     return 0;
 }
@@ -905,7 +1284,7 @@ static int translate_subs_reg(struct sljit_compiler *C, uint32_t opcode)
     emit_load_reg(C, SLJIT_R2, rm);
     sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_R2, 0);
     emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    emit_update_flags_sub(C, SLJIT_R0, SLJIT_R1, SLJIT_R2);
     
     return 0;
 }
@@ -968,7 +1347,7 @@ static int translate_bics_reg(struct sljit_compiler *C, uint32_t opcode)
     emit_update_flags_nz_simple(C, SLJIT_R0);
     
     if (rd == 15) {
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_block_return(C);
         return 1;
     }
     
@@ -1000,7 +1379,7 @@ static int translate_movs_reg(struct sljit_compiler *C, uint32_t opcode)
     
     if (rd == 15) {
         emit_update_flags_nz_simple(C, SLJIT_R0);
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_block_return(C);
         return 1;
     }
     
@@ -1031,11 +1410,11 @@ static int translate_rsbs_imm(struct sljit_compiler *C, uint32_t opcode)
     int rotate = ((opcode >> 8) & 0xF) << 1;
     uint32_t imm_val = (imm >> rotate) | (imm << (32 - rotate));
     
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, imm_val);
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R2, 0, SLJIT_IMM, imm_val);
     emit_load_reg(C, SLJIT_R1, rn);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R2, 0, SLJIT_R1, 0);
     emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    emit_update_flags_sub(C, SLJIT_R0, SLJIT_R2, SLJIT_R1);
     
     return 0;
 }
@@ -1046,11 +1425,11 @@ static int translate_rsbs_reg(struct sljit_compiler *C, uint32_t opcode)
     int rn = (opcode >> 16) & 0xF;
     int rm = opcode & 0xF;
     
-    emit_load_reg(C, SLJIT_R0, rm);
+    emit_load_reg(C, SLJIT_R2, rm);
     emit_load_reg(C, SLJIT_R1, rn);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R2, 0, SLJIT_R1, 0);
     emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    emit_update_flags_sub(C, SLJIT_R0, SLJIT_R2, SLJIT_R1);
     
     return 0;
 }
@@ -1078,7 +1457,7 @@ static int translate_cmn_imm(struct sljit_compiler *C, uint32_t opcode)
     
     emit_load_reg(C, SLJIT_R1, rn);
     sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_IMM, imm_val);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    emit_update_flags_add_imm(C, SLJIT_R0, SLJIT_R1, imm_val);
     
     return 0;
 }
@@ -1189,8 +1568,7 @@ static int translate_ldr_imm(struct sljit_compiler *C, uint32_t opcode, uint32_t
         }
     }
     
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read32));
+    emit_mem_read(C, 4);
     
     emit_store_reg(C, rd, SLJIT_R0);
     
@@ -1227,8 +1605,7 @@ static int translate_str_imm(struct sljit_compiler *C, uint32_t opcode)
     }
     
     emit_load_reg(C, SLJIT_R1, rd);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write32));
+    emit_mem_write(C, 4);
     
     if (writeback && !pre_index) {
         emit_load_reg(C, SLJIT_R0, rn);
@@ -1263,8 +1640,7 @@ static int translate_ldr_reg(struct sljit_compiler *C, uint32_t opcode)
         }
     }
     
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read32));
+    emit_mem_read(C, 4);
     
     emit_store_reg(C, rd, SLJIT_R0);
     
@@ -1303,8 +1679,7 @@ static int translate_str_reg(struct sljit_compiler *C, uint32_t opcode)
     }
     
     emit_load_reg(C, SLJIT_R1, rd);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write32));
+    emit_mem_write(C, 4);
     
     if (writeback && !pre_index) {
         emit_load_reg(C, SLJIT_R0, rn);
@@ -1320,44 +1695,6 @@ static int translate_str_reg(struct sljit_compiler *C, uint32_t opcode)
     return 0;
 }
 
-static int translate_ldrh_imm(struct sljit_compiler *C, uint32_t opcode, uint32_t pc)
-{
-    int rd = (opcode >> 12) & 0xF;
-    int rn = (opcode >> 16) & 0xF;
-    int offset = ((opcode >> 8) & 0xF) << 4 | (opcode & 0xF);
-    
-    if (rn == 15) {
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, pc + 8 + offset);
-    } else {
-        emit_load_reg(C, SLJIT_R0, rn);
-        sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    }
-    
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read16));
-    
-    emit_store_reg(C, rd, SLJIT_R0);
-    
-    return 0;
-}
-
-__attribute__((unused))
-static int translate_strh_imm(struct sljit_compiler *C, uint32_t opcode)
-{
-    int rd = (opcode >> 12) & 0xF;
-    int rn = (opcode >> 16) & 0xF;
-    int offset = ((opcode >> 8) & 0xF) << 4 | (opcode & 0xF);
-    
-    emit_load_reg(C, SLJIT_R0, rn);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    
-    emit_load_reg(C, SLJIT_R1, rd);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write16));
-    
-    return 0;
-}
-
 static int translate_ldrb_imm(struct sljit_compiler *C, uint32_t opcode, uint32_t pc)
 {
     int rd = (opcode >> 12) & 0xF;
@@ -1371,8 +1708,7 @@ static int translate_ldrb_imm(struct sljit_compiler *C, uint32_t opcode, uint32_
         sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
     }
     
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read8));
+    emit_mem_read(C, 1);
     
     emit_store_reg(C, rd, SLJIT_R0);
     
@@ -1389,191 +1725,87 @@ static int translate_strb_imm(struct sljit_compiler *C, uint32_t opcode)
     sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
     
     emit_load_reg(C, SLJIT_R1, rd);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write8));
+    emit_mem_write(C, 1);
     
     return 0;
 }
 
-static int translate_thumb_ldrh_imm(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rd = (opcode >> 8) & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    uint32_t offset = (opcode & 0x7C0) >> 4;
-    
-    emit_load_reg(C, SLJIT_R0, rn);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read16));
-    emit_store_reg(C, rd, SLJIT_R0);
-    
-    return 0;
-}
+/* --------------------------------------------------------------------- */
+/*  Block Data Transfer (LDM/STM)                                        */
+/* --------------------------------------------------------------------- */
 
-__attribute__((unused))
-static int translate_thumb_strh_imm(struct sljit_compiler *C, uint16_t opcode)
+static int count_bits(uint16_t mask)
 {
-    int rd = (opcode >> 8) & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    uint32_t offset = (opcode & 0x7C0) >> 4;
-    
-    emit_load_reg(C, SLJIT_R0, rn);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    emit_load_reg(C, SLJIT_R1, rd);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write16));
-    
-    return 0;
+    int count = 0;
+    while (mask) {
+        count += mask & 1;
+        mask >>= 1;
+    }
+    return count;
 }
 
-static int translate_ldrsb_imm(struct sljit_compiler *C, uint32_t opcode, uint32_t pc)
+/* Stack slot keeping the base address while registers are transferred */
+#define LOCAL_XFER_BASE  0
+
+/* Address of the lowest register, relative to the base */
+static int32_t block_xfer_start(uint32_t opcode, int num_regs)
 {
-    int rd = (opcode >> 12) & 0xF;
-    int rn = (opcode >> 16) & 0xF;
     int pre_index = (opcode >> 24) & 1;
     int up = (opcode >> 23) & 1;
-    int writeback = (opcode >> 21) & 1;
-    uint32_t offset = opcode & 0xFFF;
-    
-    if (rn == 15) {
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, pc + 8 + offset);
-    } else {
-        emit_load_reg(C, SLJIT_R0, rn);
-        if (pre_index) {
-            if (up) {
-                sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-            } else {
-                sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-            }
-        }
-    }
     
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read8));
-    sljit_emit_op2(C, SLJIT_SHL32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 24);
-    sljit_emit_op2(C, SLJIT_ASHR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 24);
-    
-    emit_store_reg(C, rd, SLJIT_R0);
-    
-    if (writeback && !pre_index && rn != 15) {
-        emit_load_reg(C, SLJIT_R0, rn);
-        if (up) {
-            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-        } else {
-            sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-        }
-        emit_store_reg(C, rn, SLJIT_R0);
+    if (up) {
+        return pre_index ? 4 : 0;
     }
-    
-    return 0;
+    return -num_regs * 4 + (pre_index ? 0 : 4);
 }
 
-static int translate_ldrsh_imm(struct sljit_compiler *C, uint32_t opcode, uint32_t pc)
+static void emit_block_xfer_writeback(struct sljit_compiler *C, uint32_t opcode, int num_regs)
 {
-    int rd = (opcode >> 12) & 0xF;
     int rn = (opcode >> 16) & 0xF;
-    int pre_index = (opcode >> 24) & 1;
     int up = (opcode >> 23) & 1;
-    int writeback = (opcode >> 21) & 1;
-    uint32_t offset = opcode & 0xFFF;
-    
-    if (rn == 15) {
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, pc + 8 + offset);
-    } else {
-        emit_load_reg(C, SLJIT_R0, rn);
-        if (pre_index) {
-            if (up) {
-                sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-            } else {
-                sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-            }
-        }
-    }
-    
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read16));
-    sljit_emit_op2(C, SLJIT_SHL32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 16);
-    sljit_emit_op2(C, SLJIT_ASHR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 16);
-    
-    emit_store_reg(C, rd, SLJIT_R0);
-    
-    if (writeback && !pre_index && rn != 15) {
-        emit_load_reg(C, SLJIT_R0, rn);
-        if (up) {
-            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-        } else {
-            sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-        }
-        emit_store_reg(C, rn, SLJIT_R0);
-    }
     
-    return 0;
-}
-
-/* --------------------------------------------------------------------- */
-/*  Block Data Transfer (LDM/STM)                                        */
-/* --------------------------------------------------------------------- */
-
-static int count_bits(uint16_t mask)
-{
-    int count = 0;
-    while (mask) {
-        count += mask & 1;
-        mask >>= 1;
-    }
-    return count;
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
+    sljit_emit_op2(C, up ? SLJIT_ADD32 : SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
+    emit_store_reg(C, rn, SLJIT_R0);
 }
 
 static int translate_ldm(struct sljit_compiler *C, uint32_t opcode)
 {
     int rn = (opcode >> 16) & 0xF;
     uint16_t reg_list = opcode & 0xFFFF;
-    int pre_index = (opcode >> 24) & 1;
-    int up = (opcode >> 23) & 1;
     int writeback = (opcode >> 21) & 1;
     int num_regs = count_bits(reg_list);
     int has_pc = (reg_list >> 15) & 1;
-    int offset = 0;
+    int32_t offset = block_xfer_start(opcode, num_regs);
     
+    /* Scratch registers don't survive the slow path of the loads */
     emit_load_reg(C, SLJIT_R0, rn);
-    
-    if (!up) {
-        sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
-    }
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE, SLJIT_R0, 0);
     
     for (int i = 0; i < 16; i++) {
         if ((reg_list >> i) & 1) {
-            if (pre_index) {
-                sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 4);
-            }
-            
-            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R1, 0, SLJIT_R0, 0);
-            sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                             SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read32));
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
+            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
+            emit_block_mem_read(C);
             
             if (i != 15) {
                 emit_store_reg(C, i, SLJIT_R0);
             } else {
                 sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFE);
                 emit_store_reg(C, 15, SLJIT_R0);
-                sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
-            }
-            
-            if (!pre_index) {
-                sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 4);
             }
             offset += 4;
         }
     }
     
-    if (writeback && !has_pc) {
-        emit_load_reg(C, SLJIT_R0, rn);
-        if (up) {
-            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
-        } else {
-            sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
-        }
-        emit_store_reg(C, rn, SLJIT_R0);
+    /* A loaded base wins over the writeback */
+    if (writeback && !((reg_list >> rn) & 1)) {
+        emit_block_xfer_writeback(C, opcode, num_regs);
+    }
+    
+    if (has_pc) {
+        emit_load_reg(C, SLJIT_R0, 15);
+        emit_block_return(C);
     }
     
     return has_pc ? 1 : 0;
@@ -1583,41 +1815,84 @@ static int translate_stm(struct sljit_compiler *C, uint32_t opcode)
 {
     int rn = (opcode >> 16) & 0xF;
     uint16_t reg_list = opcode & 0xFFFF;
-    int pre_index = (opcode >> 24) & 1;
-    int up = (opcode >> 23) & 1;
     int writeback = (opcode >> 21) & 1;
     int num_regs = count_bits(reg_list);
+    int32_t offset = block_xfer_start(opcode, num_regs);
     
     emit_load_reg(C, SLJIT_R0, rn);
-    
-    if (!up) {
-        sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
-    }
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE, SLJIT_R0, 0);
     
     for (int i = 0; i < 16; i++) {
         if ((reg_list >> i) & 1) {
-            if (pre_index) {
-                sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 4);
-            }
-            
-            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R1, 0, SLJIT_R0, 0);
-            emit_load_reg(C, SLJIT_R2, i);
-            sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                             SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write32));
-            
-            if (!pre_index) {
-                sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 4);
-            }
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
+            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
+            emit_load_reg(C, SLJIT_R1, i);
+            emit_block_mem_write(C);
+            offset += 4;
         }
     }
     
     if (writeback) {
+        emit_block_xfer_writeback(C, opcode, num_regs);
+    }
+    
+    return 0;
+}
+
+/* --------------------------------------------------------------------- */
+/*  Halfword and Signed Transfers                                        */
+/* --------------------------------------------------------------------- */
+
+/* LDRH, STRH, LDRSB and LDRSH in every addressing mode */
+static int translate_halfword_xfer(struct sljit_compiler *C, uint32_t opcode, uint32_t pc)
+{
+    int rd = (opcode >> 12) & 0xF;
+    int rn = (opcode >> 16) & 0xF;
+    int pre_index = (opcode >> 24) & 1;
+    int up = (opcode >> 23) & 1;
+    int writeback = !pre_index || ((opcode >> 21) & 1);
+    int is_load = (opcode >> 20) & 1;
+    uint32_t sh = (opcode >> 5) & 0x3;
+    int size = (sh == 0x2) ? 1 : 2;
+    
+    if (rn == 15) {
+        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, pc + 8);
+    } else {
         emit_load_reg(C, SLJIT_R0, rn);
-        if (up) {
-            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
-        } else {
-            sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
+    }
+    
+    if ((opcode >> 22) & 1) {
+        uint32_t offset = ((opcode >> 4) & 0xF0) | (opcode & 0xF);
+        sljit_emit_op2(C, up ? SLJIT_ADD32 : SLJIT_SUB32, SLJIT_R3, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
+    } else {
+        emit_load_reg(C, SLJIT_R2, opcode & 0xF);
+        sljit_emit_op2(C, up ? SLJIT_ADD32 : SLJIT_SUB32, SLJIT_R3, 0, SLJIT_R0, 0, SLJIT_R2, 0);
+    }
+    
+    if (pre_index) {
+        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_R3, 0);
+    }
+    
+    /* The access clobbers R1-R4, the new base waits on the stack */
+    if (writeback) {
+        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE, SLJIT_R3, 0);
+    }
+    
+    if (is_load) {
+        emit_mem_read(C, size);
+        if (sh != 0x1) {
+            int shift = (size == 1) ? 24 : 16;
+            sljit_emit_op2(C, SLJIT_SHL32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, shift);
+            sljit_emit_op2(C, SLJIT_ASHR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, shift);
         }
+        emit_store_reg(C, rd, SLJIT_R0);
+    } else {
+        emit_load_reg(C, SLJIT_R1, rd);
+        emit_mem_write(C, 2);
+    }
+    
+    if (writeback) {
+        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
         emit_store_reg(C, rn, SLJIT_R0);
     }
     
@@ -1641,6 +1916,11 @@ static int translate_mul(struct sljit_compiler *C, uint32_t opcode)
     
     emit_store_reg(C, rd, SLJIT_R0);
     
+    /* C is left meaningless by the ARM7, keeping it is as good as anything */
+    if ((opcode >> 20) & 1) {
+        emit_update_flags_nz_simple(C, SLJIT_R0);
+    }
+    
     return 0;
 }
 
@@ -1660,6 +1940,10 @@ static int translate_mla(struct sljit_compiler *C, uint32_t opcode)
     
     emit_store_reg(C, rd, SLJIT_R0);
     
+    if ((opcode >> 20) & 1) {
+        emit_update_flags_nz_simple(C, SLJIT_R0);
+    }
+    
     return 0;
 }
 
@@ -1946,8 +2230,7 @@ static int translate_rrx(struct sljit_compiler *C, uint32_t opcode)
     int rm = opcode & 0xF;
     
     emit_load_reg(C, SLJIT_R0, rm);
-    sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R1, 0, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+    emit_load_carry(C, SLJIT_R1);
     sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 1);
     sljit_emit_op2(C, SLJIT_SHL32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 31);
     sljit_emit_op2(C, SLJIT_OR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
@@ -2000,8 +2283,7 @@ static int translate_adc_imm(struct sljit_compiler *C, uint32_t opcode)
     
     emit_load_reg(C, SLJIT_R1, rn);
     sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R2, 0, SLJIT_IMM, imm_val);
-    sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+    emit_load_carry(C, SLJIT_R3);
     
     sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_R2, 0);
     sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R3, 0);
@@ -2020,8 +2302,7 @@ static int translate_sbc_imm(struct sljit_compiler *C, uint32_t opcode)
     
     emit_load_reg(C, SLJIT_R1, rn);
     sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R2, 0, SLJIT_IMM, imm_val);
-    sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+    emit_load_carry(C, SLJIT_R3);
     sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_IMM, 1);
     
     sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_R2, 0);
@@ -2041,8 +2322,7 @@ static int translate_rsc_imm(struct sljit_compiler *C, uint32_t opcode)
     
     emit_load_reg(C, SLJIT_R1, rn);
     sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R2, 0, SLJIT_IMM, imm_val);
-    sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+    emit_load_carry(C, SLJIT_R3);
     sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_IMM, 1);
     
     sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R2, 0, SLJIT_R1, 0);
@@ -2060,8 +2340,7 @@ static int translate_rsc_reg(struct sljit_compiler *C, uint32_t opcode)
     
     emit_load_reg(C, SLJIT_R1, rn);
     emit_load_reg(C, SLJIT_R2, rm);
-    sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_R3, 0, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+    emit_load_carry(C, SLJIT_R3);
     sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_IMM, 1);
     
     sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R2, 0, SLJIT_R1, 0);
@@ -2079,8 +2358,7 @@ static int translate_adc_reg(struct sljit_compiler *C, uint32_t opcode)
     
     emit_load_reg(C, SLJIT_R1, rn);
     emit_load_reg(C, SLJIT_R2, rm);
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R3, 0, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+    emit_load_carry(C, SLJIT_R3);
     sljit_emit_op2(C, SLJIT_AND32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_IMM, 1);
     sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_IMM, 1);
     
@@ -2099,8 +2377,7 @@ static int translate_sbc_reg(struct sljit_compiler *C, uint32_t opcode)
     
     emit_load_reg(C, SLJIT_R1, rn);
     emit_load_reg(C, SLJIT_R2, rm);
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R3, 0, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
+    emit_load_carry(C, SLJIT_R3);
     sljit_emit_op2(C, SLJIT_AND32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_IMM, 1);
     sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_IMM, 1);
     sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R3, 0, SLJIT_R3, 0, SLJIT_IMM, 1);
@@ -2144,14 +2421,90 @@ static int translate_swi(struct sljit_compiler *C, uint32_t opcode, uint32_t pc)
     sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R1, 0, SLJIT_IMM, swi_num);
     sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R2, 0, SLJIT_IMM, pc);
     
+    regalloc_flush(C);
     sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS3V(P, 32, 32),
                      SLJIT_IMM, SLJIT_FUNC_ADDR(jit_swi_handler));
     
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, 0x00000008);
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, 0x00000008);
+    emit_block_return(C);
+    
+    (void)swi_num;
+    return 1;
+}
+
+/* --------------------------------------------------------------------- */
+/*  Block Exits                                                          */
+/* --------------------------------------------------------------------- */
+
+/* Static exits of the block being translated, collected for linking */
+static jit_exit_site_t s_exit_sites[JIT_MAX_BLOCK_EXITS];
+static int s_exit_site_count = 0;
+
+/*
+ * Leave the block towards a statically known PC. While cycles remain, a
+ * rewritable jump leads to the target's body once it has been compiled.
+ * Until then (or when out of cycles) we return the PC to the dispatcher.
+ */
+static void emit_block_exit(struct sljit_compiler *C, uint32_t target_pc)
+{
+    /* The next block reloads its registers and flags from the CPU state */
+    flags_materialize(C, FLAGS_ALL, true);
+    regalloc_writeback(C);
+    
+    if (s_exit_site_count < JIT_MAX_BLOCK_EXITS) {
+        jit_exit_site_t *site = &s_exit_sites[s_exit_site_count++];
+        struct sljit_jump *out_of_cycles = sljit_emit_cmp(C, SLJIT_32 | SLJIT_SIG_LESS_EQUAL,
+                                                           SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, cycles),
+                                                           SLJIT_IMM, 0);
+        /* A raised alert goes to the dispatcher too, the next block mustn't run first */
+        struct sljit_jump *alerted = sljit_emit_cmp(C, SLJIT_32 | SLJIT_NOT_EQUAL,
+                                                    SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, alert),
+                                                    SLJIT_IMM, 0);
+        site->target_pc = target_pc;
+        site->jump = sljit_emit_jump(C, SLJIT_JUMP | SLJIT_REWRITABLE_JUMP);
+        site->fallback = sljit_emit_label(C);
+        sljit_set_label(site->jump, site->fallback);
+        sljit_set_label(out_of_cycles, site->fallback);
+        sljit_set_label(alerted, site->fallback);
+    }
+    
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target_pc);
+    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+}
+
+/*
+ * Return to the dispatcher before the instruction at pc when a store raised
+ * an alert (HALTCNT, IE/IME, DMA), and at a deadline when the cycles ran out
+ * inside the block, so that the next event isn't delayed by the rest of a
+ * long block. Like the interpreter, an instruction always completes.
+ */
+static void emit_deadline_exit(struct sljit_compiler *C, uint32_t pc, bool deadline)
+{
+    struct sljit_jump *out_of_cycles = NULL;
+    
+    if (deadline) {
+        out_of_cycles = sljit_emit_cmp(C, SLJIT_32 | SLJIT_SIG_LESS_EQUAL,
+                                       SLJIT_MEM1(SLJIT_S0), CYCLES_OFFSET, SLJIT_IMM, 0);
+    }
+    struct sljit_jump *in_time = sljit_emit_cmp(C, SLJIT_32 | SLJIT_EQUAL,
+                                                SLJIT_MEM1(SLJIT_S0), ALERT_OFFSET,
+                                                SLJIT_IMM, 0);
+    
+    if (out_of_cycles != NULL) {
+        sljit_set_label(out_of_cycles, sljit_emit_label(C));
+    }
+    flags_materialize(C, FLAGS_ALL, true);
+    regalloc_writeback(C);
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, pc);
     sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
     
-    (void)swi_num;
-    return 1;
+    sljit_set_label(in_time, sljit_emit_label(C));
+}
+
+int jit_translate_get_exit_sites(const jit_exit_site_t **sites)
+{
+    *sites = s_exit_sites;
+    return s_exit_site_count;
 }
 
 /* --------------------------------------------------------------------- */
@@ -2163,7 +2516,7 @@ static int translate_b(struct sljit_compiler *C, uint32_t opcode, uint32_t pc, u
     int32_t offset = (int32_t)((opcode & 0x00FFFFFF) << 2);
     if (offset & 0x02000000) offset |= 0xFC000000;
     uint32_t target = pc + 8 + offset;
-    uint32_t next_pc = pc + 8;
+    uint32_t next_pc = pc + 4;
     
     if (target < 0x1000) {
         ESP_LOGW(TAG, "B指令异常目标: PC=0x%08X -> target=0x%08X, offset=%d", 
@@ -2171,17 +2524,16 @@ static int translate_b(struct sljit_compiler *C, uint32_t opcode, uint32_t pc, u
     }
     
     if (cond == ARM_COND_AL) {
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target);
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_branch_cycles(C, target, false);
+        emit_block_exit(C, target);
     } else {
-        struct sljit_jump *skip_branch = emit_condition_check_inverse(C, cond);
+        struct sljit_jump *skip_branch = emit_condition_skip(C, cond);
         
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target);
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_branch_cycles(C, target, false);
+        emit_block_exit(C, target);
         
         sljit_set_label(skip_branch, sljit_emit_label(C));
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, next_pc);
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_block_exit(C, next_pc);
     }
     
     return 1;
@@ -2193,8 +2545,8 @@ static int translate_bl(struct sljit_compiler *C, uint32_t opcode, uint32_t pc,
     int32_t offset = (int32_t)((opcode & 0x00FFFFFF) << 2);
     if (offset & 0x02000000) offset |= 0xFC000000;
     uint32_t target = pc + 8 + offset;
-    uint32_t return_addr = pc + 8;
-    uint32_t next_pc = pc + 8;
+    uint32_t return_addr = pc + 4;
+    uint32_t next_pc = pc + 4;
     
     if (target < 0x1000 || (target >= 0x03000000 && target < 0x04000000)) {
         ESP_LOGW(TAG, "BL指令异常目标: PC=0x%08X -> target=0x%08X, offset=%d", 
@@ -2202,23 +2554,18 @@ static int translate_bl(struct sljit_compiler *C, uint32_t opcode, uint32_t pc,
     }
     
     if (cond == ARM_COND_AL) {
-        sljit_emit_op1(C, SLJIT_MOV32, 
-                       SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[14]),
-                       SLJIT_IMM, return_addr);
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target);
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_store_reg_imm(C, 14, return_addr);
+        emit_branch_cycles(C, target, false);
+        emit_block_exit(C, target);
     } else {
-        struct sljit_jump *skip_branch = emit_condition_check_inverse(C, cond);
+        struct sljit_jump *skip_branch = emit_condition_skip(C, cond);
         
-        sljit_emit_op1(C, SLJIT_MOV32, 
-                       SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[14]),
-                       SLJIT_IMM, return_addr);
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target);
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_store_reg_imm(C, 14, return_addr);
+        emit_branch_cycles(C, target, false);
+        emit_block_exit(C, target);
         
         sljit_set_label(skip_branch, sljit_emit_label(C));
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, next_pc);
-        sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+        emit_block_exit(C, next_pc);
     }
     
     return 1;
@@ -2232,6 +2579,7 @@ static int translate_bx(struct sljit_compiler *C, uint32_t opcode)
     
     sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R1, 0, SLJIT_R0, 0);
     sljit_emit_op2(C, SLJIT_AND32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 1);
+    sljit_emit_op2(C, SLJIT_SHL32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 5);
     
     sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R2, 0, 
                    SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, cpsr));
@@ -2243,7 +2591,8 @@ static int translate_bx(struct sljit_compiler *C, uint32_t opcode)
                    SLJIT_R2, 0);
     
     sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFE);
-    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+    emit_branch_cycles_dynamic(C, false);
+    emit_block_return(C);
     
     return 1;
 }
@@ -2253,9 +2602,7 @@ static int translate_blx_reg(struct sljit_compiler *C, uint32_t opcode, uint32_t
     int rm = opcode & 0xF;
     uint32_t return_addr = pc + 8;
     
-    sljit_emit_op1(C, SLJIT_MOV32, 
-                   SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[14]),
-                   SLJIT_IMM, return_addr);
+    emit_store_reg_imm(C, 14, return_addr);
     
     emit_load_reg(C, SLJIT_R0, rm);
     
@@ -2272,7 +2619,7 @@ static int translate_blx_reg(struct sljit_compiler *C, uint32_t opcode, uint32_t
                    SLJIT_R2, 0);
     
     sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFE);
-    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+    emit_block_return(C);
     
     return 1;
 }
@@ -2285,9 +2632,7 @@ static int translate_blx_imm(struct sljit_compiler *C, uint32_t opcode, uint32_t
     uint32_t return_addr = pc + 8;
     bool thumb = (opcode & 2) != 0;
     
-    sljit_emit_op1(C, SLJIT_MOV32, 
-                   SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[14]),
-                   SLJIT_IMM, return_addr);
+    emit_store_reg_imm(C, 14, return_addr);
     
     if (thumb) {
         sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, 
@@ -2299,7 +2644,7 @@ static int translate_blx_imm(struct sljit_compiler *C, uint32_t opcode, uint32_t
     }
     
     sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target | (thumb ? 1 : 0));
-    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+    emit_block_return(C);
     
     return 1;
 }
@@ -2308,171 +2653,167 @@ static int translate_blx_imm(struct sljit_compiler *C, uint32_t opcode, uint32_t
 /*  Main Translation Function                                            */
 /* --------------------------------------------------------------------- */
 
+/* Data processing, with an immediate or register second operand */
+static int translate_data_proc(struct sljit_compiler *C, uint32_t opcode)
+{
+    bool is_imm = (opcode >> 25) & 0x01;
+    bool s_bit = (opcode >> 20) & 0x01;
+    uint32_t op1 = (opcode >> 21) & 0x0F;
+    int result;
+    
+    switch (op1) {
+        case 0x0:
+            if (is_imm)
+                result = s_bit ? translate_ands_imm(C, opcode) : translate_and_imm(C, opcode);
+            else
+                result = s_bit ? translate_ands_reg(C, opcode) : translate_and_reg(C, opcode);
+            break;
+        case 0x1:
+            if (is_imm)
+                result = s_bit ? translate_eors_imm(C, opcode) : translate_eor_imm(C, opcode);
+            else
+                result = s_bit ? translate_eors_reg(C, opcode) : translate_eor_reg(C, opcode);
+            break;
+        case 0x2:
+            if (is_imm)
+                result = s_bit ? translate_subs_imm(C, opcode) : translate_sub_imm(C, opcode);
+            else
+                result = s_bit ? translate_subs_reg(C, opcode) : translate_sub_reg(C, opcode);
+            break;
+        case 0x3:
+            if (is_imm)
+                result = s_bit ? translate_rsbs_imm(C, opcode) : translate_rsb_imm(C, opcode);
+            else
+                result = s_bit ? translate_rsbs_reg(C, opcode) : translate_rsb_reg(C, opcode);
+            break;
+        case 0x4:
+            if (is_imm)
+                result = s_bit ? translate_adds_imm(C, opcode) : translate_add_imm(C, opcode);
+            else
+                result = s_bit ? translate_adds_reg(C, opcode) : translate_add_reg(C, opcode);
+            break;
+        case 0x5:
+            if (is_imm)
+                result = s_bit ? translate_adcs_imm(C, opcode) : translate_adc_imm(C, opcode);
+            else
+                result = s_bit ? translate_adcs_reg(C, opcode) : translate_adc_reg(C, opcode);
+            break;
+        case 0x6:
+            if (is_imm)
+                result = s_bit ? translate_sbcs_imm(C, opcode) : translate_sbc_imm(C, opcode);
+            else
+                result = s_bit ? translate_sbcs_reg(C, opcode) : translate_sbc_reg(C, opcode);
+            break;
+        case 0x7:
+            if (is_imm)
+                result = s_bit ? translate_rscs_imm(C, opcode) : translate_rsc_imm(C, opcode);
+            else
+                result = s_bit ? translate_rscs_reg(C, opcode) : translate_rsc_reg(C, opcode);
+            break;
+        case 0x8:
+            if (is_imm)
+                result = translate_tst_imm(C, opcode);
+            else
+                result = translate_tst_reg(C, opcode);
+            break;
+        case 0x9:
+            if (is_imm)
+                result = translate_teq_imm(C, opcode);
+            else
+                result = translate_teq_reg(C, opcode);
+            break;
+        case 0xA:
+            if (is_imm)
+                result = translate_cmp_imm(C, opcode);
+            else
+                result = translate_cmp_reg(C, opcode);
+            break;
+        case 0xB:
+            if (is_imm)
+                result = translate_cmn_imm(C, opcode);
+            else
+                result = translate_cmn_reg(C, opcode);
+            break;
+        case 0xC:
+            if (is_imm)
+                result = s_bit ? translate_orrs_imm(C, opcode) : translate_orr_imm(C, opcode);
+            else
+                result = s_bit ? translate_orrs_reg(C, opcode) : translate_orr_reg(C, opcode);
+            break;
+        case 0xD:
+            if (is_imm)
+                result = s_bit ? translate_movs_imm(C, opcode) : translate_mov_imm(C, opcode);
+            else
+                result = s_bit ? translate_movs_reg(C, opcode) : translate_mov_reg(C, opcode);
+            break;
+        case 0xE:
+            if (is_imm)
+                result = s_bit ? translate_bics_imm(C, opcode) : translate_bic_imm(C, opcode);
+            else
+                result = s_bit ? translate_bics_reg(C, opcode) : translate_bic_reg(C, opcode);
+            break;
+        case 0xF:
+            if (is_imm)
+                result = s_bit ? translate_mvns_imm(C, opcode) : translate_mvn_imm(C, opcode);
+            else
+                result = s_bit ? translate_mvns_reg(C, opcode) : translate_mvn_reg(C, opcode);
+            break;
+        default:
+            result = -1;
+            break;
+    }
+    
+    return result;
+}
+
 static int translate_instruction(struct sljit_compiler *C, uint32_t opcode, uint32_t pc)
 {
     uint8_t cond = (opcode >> 28) & 0xF;
     struct sljit_jump *cond_jump = NULL;
+    uint16_t dirty_before = s_regs.dirty;
     
     uint32_t bits_27_25 = (opcode >> 25) & 0x7;
     
     bool is_branch = (bits_27_25 == 0x5 || bits_27_25 == 0x6);
     
     if (cond != ARM_COND_AL && !is_branch) {
-        cond_jump = emit_condition_check(C, cond);
+        /* Flags set on only one of the paths can't stay pending */
+        if ((opcode & 0x0C100000) == 0x00100000) {
+            flags_materialize(C, FLAGS_ALL, false);
+        }
+        cond_jump = emit_condition_skip(C, cond);
+        s_flags.conditional = true;
     }
     
     int result = 0;
     
     switch (bits_27_25) {
         case 0x0:
-            if ((opcode & 0x0FC000F0) == 0x00000090) {
+            if ((opcode & 0x0FE000F0) == 0x00000090) {
                 result = translate_mul(C, opcode);
-            } else if ((opcode & 0x0FC000F0) == 0x01000090) {
+            } else if ((opcode & 0x0FE000F0) == 0x00200090) {
                 result = translate_mla(C, opcode);
             } else if ((opcode & 0x0F8000F0) == 0x00800090) {
-                result = translate_umull(C, opcode);
-            } else if ((opcode & 0x0FB00FF0) == 0x01200010) {
+                uint32_t op = (opcode >> 21) & 0x7;
+                switch (op) {
+                    case 0x4: result = translate_umull(C, opcode); break;
+                    case 0x5: result = translate_umlal(C, opcode); break;
+                    case 0x6: result = translate_smull(C, opcode); break;
+                    default: result = translate_smlal(C, opcode); break;
+                }
+            } else if ((opcode & 0x0FFFFFF0) == 0x012FFF10) {
                 result = translate_bx(C, opcode);
             } else if ((opcode & 0x0FFFFFF0) == 0x012FFF30) {
                 result = translate_blx_reg(C, opcode, pc);
-            } else if ((opcode & 0x0FB00FF0) == 0x010000D0) {
-                result = translate_ldrsb_imm(C, opcode, pc);
-            } else if ((opcode & 0x0FB00FF0) == 0x010000F0) {
-                result = translate_ldrsh_imm(C, opcode, pc);
-            } else if ((opcode & 0x0FC000F0) == 0x000000B0) {
-                result = translate_ldrh_imm(C, opcode, pc);
+            } else if ((opcode & 0x0E000090) == 0x00000090 && (opcode & 0x60) != 0) {
+                result = translate_halfword_xfer(C, opcode, pc);
             } else {
-                bool is_imm = (opcode >> 25) & 0x01;
-                bool s_bit = (opcode >> 20) & 0x01;
-                uint32_t op1 = (opcode >> 21) & 0x0F;
-                
-                switch (op1) {
-                    case 0x0:
-                        if (is_imm)
-                            result = s_bit ? translate_ands_imm(C, opcode) : translate_and_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_ands_reg(C, opcode) : translate_and_reg(C, opcode);
-                        break;
-                    case 0x1:
-                        if (is_imm)
-                            result = s_bit ? translate_eors_imm(C, opcode) : translate_eor_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_eors_reg(C, opcode) : translate_eor_reg(C, opcode);
-                        break;
-                    case 0x2:
-                        if (is_imm)
-                            result = s_bit ? translate_subs_imm(C, opcode) : translate_sub_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_subs_reg(C, opcode) : translate_sub_reg(C, opcode);
-                        break;
-                    case 0x3:
-                        if (is_imm)
-                            result = s_bit ? translate_rsbs_imm(C, opcode) : translate_rsb_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_rsbs_reg(C, opcode) : translate_rsb_reg(C, opcode);
-                        break;
-                    case 0x4:
-                        if (is_imm)
-                            result = s_bit ? translate_adds_imm(C, opcode) : translate_add_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_adds_reg(C, opcode) : translate_add_reg(C, opcode);
-                        break;
-                    case 0x5:
-                        if (is_imm)
-                            result = s_bit ? translate_adcs_imm(C, opcode) : translate_adc_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_adcs_reg(C, opcode) : translate_adc_reg(C, opcode);
-                        break;
-                    case 0x6:
-                        if (is_imm)
-                            result = s_bit ? translate_sbcs_imm(C, opcode) : translate_sbc_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_sbcs_reg(C, opcode) : translate_sbc_reg(C, opcode);
-                        break;
-                    case 0x7:
-                        if (is_imm)
-                            result = s_bit ? translate_rscs_imm(C, opcode) : translate_rsc_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_rscs_reg(C, opcode) : translate_rsc_reg(C, opcode);
-                        break;
-                    case 0x8:
-                        if (is_imm)
-                            result = translate_tst_imm(C, opcode);
-                        else
-                            result = translate_tst_reg(C, opcode);
-                        break;
-                    case 0x9:
-                        if (is_imm)
-                            result = translate_teq_imm(C, opcode);
-                        else
-                            result = translate_teq_reg(C, opcode);
-                        break;
-                    case 0xA:
-                        if (is_imm)
-                            result = translate_cmp_imm(C, opcode);
-                        else
-                            result = translate_cmp_reg(C, opcode);
-                        break;
-                    case 0xB:
-                        if (is_imm)
-                            result = translate_cmn_imm(C, opcode);
-                        else
-                            result = translate_cmn_reg(C, opcode);
-                        break;
-                    case 0xC:
-                        if (is_imm)
-                            result = s_bit ? translate_orrs_imm(C, opcode) : translate_orr_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_orrs_reg(C, opcode) : translate_orr_reg(C, opcode);
-                        break;
-                    case 0xD:
-                        if (is_imm)
-                            result = s_bit ? translate_movs_imm(C, opcode) : translate_mov_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_movs_reg(C, opcode) : translate_mov_reg(C, opcode);
-                        break;
-                    case 0xE:
-                        if (is_imm)
-                            result = s_bit ? translate_bics_imm(C, opcode) : translate_bic_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_bics_reg(C, opcode) : translate_bic_reg(C, opcode);
-                        break;
-                    case 0xF:
-                        if (is_imm)
-                            result = s_bit ? translate_mvns_imm(C, opcode) : translate_mvn_imm(C, opcode);
-                        else
-                            result = s_bit ? translate_mvns_reg(C, opcode) : translate_mvn_reg(C, opcode);
-                        break;
-                    default:
-                        result = -1;
-                        break;
-                }
+                result = translate_data_proc(C, opcode);
             }
             break;
             
         case 0x1:
-            if ((opcode & 0x0FC000F0) == 0x01000090) {
-                result = translate_mla(C, opcode);
-            } else if ((opcode & 0x0F8000F0) == 0x00800090) {
-                uint32_t op = (opcode >> 21) & 0x7;
-                switch (op) {
-                    case 0x0: result = translate_umull(C, opcode); break;
-                    case 0x2: result = translate_umlal(C, opcode); break;
-                    case 0x4: result = translate_smull(C, opcode); break;
-                    case 0x6: result = translate_smlal(C, opcode); break;
-                    default: result = translate_umull(C, opcode); break;
-                }
-            } else if ((opcode & 0x0FB00FF0) == 0x01200010) {
-                result = translate_bx(C, opcode);
-            } else {
-                bool s_bit = (opcode >> 20) & 0x01;
-                bool is_imm = (opcode >> 25) & 0x01;
-                if (is_imm) {
-                    result = s_bit ? translate_movs_imm(C, opcode) : translate_mov_imm(C, opcode);
-                } else {
-                    result = s_bit ? translate_movs_reg(C, opcode) : translate_mov_reg(C, opcode);
-                }
-            }
+            result = translate_data_proc(C, opcode);
             break;
             
         case 0x2:
@@ -2546,6 +2887,9 @@ static int translate_instruction(struct sljit_compiler *C, uint32_t opcode, uint
     
     if (cond_jump != NULL) {
         sljit_set_label(cond_jump, sljit_emit_label(C));
+        /* Either path may reach the following code */
+        s_regs.dirty |= dirty_before;
+        s_flags.conditional = false;
     }
     
     return result;
@@ -2555,758 +2899,660 @@ static int translate_instruction(struct sljit_compiler *C, uint32_t opcode, uint
 /*  Thumb Instruction Translation                                        */
 /* --------------------------------------------------------------------- */
 
-static int translate_thumb_mov_imm(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rd = (opcode >> 8) & 0x7;
-    uint32_t imm = opcode & 0xFF;
-    
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, imm);
-    emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_add_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rd = opcode & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    int rm = (opcode >> 6) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_sub_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rd = opcode & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    int rm = (opcode >> 6) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_add_imm(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rd = opcode & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    uint32_t imm = (opcode >> 6) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rn);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
-    emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_sub_imm(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rd = opcode & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    uint32_t imm = (opcode >> 6) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rn);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
-    emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_add_imm8(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rdn = (opcode >> 8) & 0x7;
-    uint32_t imm = opcode & 0xFF;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_sub_imm8(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rdn = (opcode >> 8) & 0x7;
-    uint32_t imm = opcode & 0xFF;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_and_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_eor_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_lsl_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_SHL32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
-
-static int translate_thumb_lsr_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
+/*
+ * Formats are numbered as in the ARM7TDMI data sheet. Apart from the
+ * conditional branch nothing is conditional, and every data processing
+ * instruction with a low register destination sets the flags.
+ */
 
-static int translate_thumb_asr_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_ASHR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
-}
+/* BL prefix translated right before, lets the suffix branch to a static target */
+static uint32_t s_thumb_bl_prefix_pc;
+static uint32_t s_thumb_bl_prefix_lr;
 
-static int translate_thumb_adc_reg(struct sljit_compiler *C, uint16_t opcode)
+/* Thumb reads R15 as the instruction address plus 4 */
+static void emit_load_thumb_reg(struct sljit_compiler *C, sljit_s32 dst, int reg, uint32_t pc)
 {
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R2, 0, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, 1);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R2, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
-    
-    return 0;
+    if (reg == 15) {
+        sljit_emit_op1(C, SLJIT_MOV32, dst, 0, SLJIT_IMM, pc + 4);
+    } else {
+        emit_load_reg(C, dst, reg);
+    }
 }
 
-static int translate_thumb_sbc_reg(struct sljit_compiler *C, uint16_t opcode)
+/* Shift by a register, the carry is only written for a non-zero amount */
+static uint32_t jit_shift_reg(gba_cpu_state_t *cpu, uint32_t value, uint32_t amount, uint32_t type)
 {
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R2, 0, 
-                   SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, 1);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R2, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    amount &= 0xFF;
+    if (amount == 0) {
+        return value;
+    }
     
-    return 0;
+    switch (type) {
+        case 0x0:   /* LSL */
+            if (amount < 32) {
+                cpu->c_flag = (value >> (32 - amount)) & 1;
+                return value << amount;
+            }
+            cpu->c_flag = (amount == 32) ? (value & 1) : 0;
+            return 0;
+        case 0x1:   /* LSR */
+            if (amount < 32) {
+                cpu->c_flag = (value >> (amount - 1)) & 1;
+                return value >> amount;
+            }
+            cpu->c_flag = (amount == 32) ? (value >> 31) : 0;
+            return 0;
+        case 0x2:   /* ASR */
+            if (amount < 32) {
+                cpu->c_flag = (value >> (amount - 1)) & 1;
+                return (uint32_t)((int32_t)value >> amount);
+            }
+            cpu->c_flag = value >> 31;
+            return (uint32_t)((int32_t)value >> 31);
+        default:    /* ROR */
+            amount &= 31;
+            if (amount != 0) {
+                value = (value >> amount) | (value << (32 - amount));
+            }
+            cpu->c_flag = value >> 31;
+            return value;
+    }
 }
 
-static int translate_thumb_tst_reg(struct sljit_compiler *C, uint16_t opcode)
+/* a + b + C with all four flags, SBC passes ~b */
+static uint32_t jit_add_with_carry(gba_cpu_state_t *cpu, uint32_t a, uint32_t b)
 {
-    int rn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    uint64_t sum = (uint64_t)a + b + cpu->c_flag;
+    uint32_t res = (uint32_t)sum;
     
-    return 0;
+    cpu->n_flag = res >> 31;
+    cpu->z_flag = (res == 0);
+    cpu->c_flag = (sum >> 32) & 1;
+    cpu->v_flag = ((~(a ^ b) & (a ^ res)) >> 31) & 1;
+    return res;
 }
 
-static int translate_thumb_cmp_reg(struct sljit_compiler *C, uint16_t opcode)
+/* Format 1: LSL, LSR, ASR by an immediate */
+static int translate_thumb_shift_imm(struct sljit_compiler *C, uint16_t opcode)
 {
-    int rn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
+    int rd = opcode & 0x7;
+    int rs = (opcode >> 3) & 0x7;
+    uint32_t type = (opcode >> 11) & 0x3;
+    uint32_t amount = (opcode >> 6) & 0x1F;
     
-    emit_load_reg(C, SLJIT_R0, rn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    emit_load_reg(C, SLJIT_R0, rs);
     
-    return 0;
-}
-
-static int translate_thumb_cmn_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
+    if (type == 0x0 && amount == 0) {
+        /* LSL #0 is a move keeping C */
+        emit_store_reg(C, rd, SLJIT_R0);
+        emit_update_flags_nz_simple(C, SLJIT_R0);
+        return 0;
+    }
     
-    emit_load_reg(C, SLJIT_R0, rn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    /* LSR #0 and ASR #0 encode a shift by 32 */
+    if (amount == 0) {
+        amount = 32;
+    }
     
-    return 0;
-}
-
-static int translate_thumb_orr_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
+    if (type == 0x0) {
+        sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R1, 0, SLJIT_R0, 0, SLJIT_IMM, 32 - amount);
+        sljit_emit_op2(C, SLJIT_SHL32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, amount);
+    } else {
+        sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R1, 0, SLJIT_R0, 0, SLJIT_IMM, amount - 1);
+        if (type == 0x2) {
+            sljit_emit_op2(C, SLJIT_ASHR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, amount == 32 ? 31 : amount);
+        } else if (amount == 32) {
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, 0);
+        } else {
+            sljit_emit_op2(C, SLJIT_LSHR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, amount);
+        }
+    }
+    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 1);
     
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_OR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
+    emit_store_reg(C, rd, SLJIT_R0);
     emit_update_flags_nz_simple(C, SLJIT_R0);
+    sljit_emit_op1(C, SLJIT_MOV_U8, SLJIT_MEM1(SLJIT_S0), C_FLAG_OFFSET, SLJIT_R1, 0);
     
     return 0;
 }
 
-static int translate_thumb_mul_reg(struct sljit_compiler *C, uint16_t opcode)
+/* Format 2: ADD, SUB with a register or a 3-bit immediate */
+static int translate_thumb_add_sub(struct sljit_compiler *C, uint16_t opcode)
 {
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
-    
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_MUL32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    int rd = opcode & 0x7;
+    int rs = (opcode >> 3) & 0x7;
+    int rn = (opcode >> 6) & 0x7;
+    bool is_imm = (opcode >> 10) & 1;
+    bool is_sub = (opcode >> 9) & 1;
+    sljit_s32 op = is_sub ? SLJIT_SUB32 : SLJIT_ADD32;
+    
+    emit_load_reg(C, SLJIT_R0, rs);
+    
+    if (is_imm) {
+        sljit_emit_op2(C, op, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, rn);
+        emit_store_reg(C, rd, SLJIT_R2);
+        if (is_sub) {
+            emit_update_flags_sub_imm(C, SLJIT_R2, SLJIT_R0, rn);
+        } else {
+            emit_update_flags_add_imm(C, SLJIT_R2, SLJIT_R0, rn);
+        }
+    } else {
+        emit_load_reg(C, SLJIT_R1, rn);
+        sljit_emit_op2(C, op, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+        emit_store_reg(C, rd, SLJIT_R2);
+        if (is_sub) {
+            emit_update_flags_sub(C, SLJIT_R2, SLJIT_R0, SLJIT_R1);
+        } else {
+            emit_update_flags_add(C, SLJIT_R2, SLJIT_R0, SLJIT_R1);
+        }
+    }
     
     return 0;
 }
 
-static int translate_thumb_bic_reg(struct sljit_compiler *C, uint16_t opcode)
+/* Format 3: MOV, CMP, ADD, SUB with an 8-bit immediate */
+static int translate_thumb_imm8(struct sljit_compiler *C, uint16_t opcode)
 {
-    int rdn = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
+    int rd = (opcode >> 8) & 0x7;
+    uint32_t imm = opcode & 0xFF;
     
-    emit_load_reg(C, SLJIT_R0, rdn);
-    emit_load_reg(C, SLJIT_R1, rm);
-    sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 0xFFFFFFFF);
-    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
-    emit_store_reg(C, rdn, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    switch ((opcode >> 11) & 0x3) {
+        case 0x0:   /* MOV */
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, imm);
+            emit_store_reg(C, rd, SLJIT_R0);
+            emit_update_flags_nz_simple(C, SLJIT_R0);
+            break;
+        case 0x1:   /* CMP */
+            emit_load_reg(C, SLJIT_R0, rd);
+            sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
+            emit_update_flags_sub_imm(C, SLJIT_R2, SLJIT_R0, imm);
+            break;
+        case 0x2:   /* ADD */
+            emit_load_reg(C, SLJIT_R0, rd);
+            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
+            emit_store_reg(C, rd, SLJIT_R2);
+            emit_update_flags_add_imm(C, SLJIT_R2, SLJIT_R0, imm);
+            break;
+        default:    /* SUB */
+            emit_load_reg(C, SLJIT_R0, rd);
+            sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
+            emit_store_reg(C, rd, SLJIT_R2);
+            emit_update_flags_sub_imm(C, SLJIT_R2, SLJIT_R0, imm);
+            break;
+    }
     
     return 0;
 }
 
-static int translate_thumb_mvn_reg(struct sljit_compiler *C, uint16_t opcode)
+/* Format 4: ALU operations on low registers */
+static int translate_thumb_alu(struct sljit_compiler *C, uint16_t opcode)
 {
     int rd = opcode & 0x7;
-    int rm = (opcode >> 3) & 0x7;
+    int rs = (opcode >> 3) & 0x7;
+    uint32_t op = (opcode >> 6) & 0xF;
     
-    emit_load_reg(C, SLJIT_R0, rm);
-    sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFF);
-    emit_store_reg(C, rd, SLJIT_R0);
-    emit_update_flags_nz_simple(C, SLJIT_R0);
+    switch (op) {
+        case 0x2:   /* LSL */
+        case 0x3:   /* LSR */
+        case 0x4:   /* ASR */
+        case 0x7:   /* ROR */
+            /* The helper writes C into the CPU state */
+            flags_materialize(C, FLAGS_ALL, false);
+            emit_load_reg(C, SLJIT_R1, rd);
+            emit_load_reg(C, SLJIT_R2, rs);
+            sljit_emit_op1(C, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R3, 0, SLJIT_IMM, op == 0x7 ? 3 : op - 2);
+            sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS4(32, P, 32, 32, 32),
+                             SLJIT_IMM, SLJIT_FUNC_ADDR(jit_shift_reg));
+            emit_store_reg(C, rd, SLJIT_R0);
+            emit_update_flags_nz_simple(C, SLJIT_R0);
+            return 0;
+            
+        case 0x5:   /* ADC */
+        case 0x6:   /* SBC */
+            flags_materialize(C, FLAGS_ALL, false);
+            emit_load_reg(C, SLJIT_R1, rd);
+            emit_load_reg(C, SLJIT_R2, rs);
+            if (op == 0x6) {
+                sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, 0xFFFFFFFF);
+            }
+            sljit_emit_op1(C, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
+            sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS3(32, P, 32, 32),
+                             SLJIT_IMM, SLJIT_FUNC_ADDR(jit_add_with_carry));
+            emit_store_reg(C, rd, SLJIT_R0);
+            return 0;
+    }
     
-    return 0;
-}
-
-static int translate_thumb_ldr_imm(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rd = (opcode >> 8) & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    uint32_t offset = (opcode & 0x7C0) >> 4;
+    emit_load_reg(C, SLJIT_R0, rd);
+    emit_load_reg(C, SLJIT_R1, rs);
+    
+    switch (op) {
+        case 0x0:   /* AND */
+            sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            break;
+        case 0x1:   /* EOR */
+            sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            break;
+        case 0x8:   /* TST */
+            sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            emit_update_flags_nz_simple(C, SLJIT_R2);
+            return 0;
+        case 0x9:   /* NEG */
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, 0);
+            sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            emit_store_reg(C, rd, SLJIT_R2);
+            emit_update_flags_sub(C, SLJIT_R2, SLJIT_R0, SLJIT_R1);
+            return 0;
+        case 0xA:   /* CMP */
+            sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            emit_update_flags_sub(C, SLJIT_R2, SLJIT_R0, SLJIT_R1);
+            return 0;
+        case 0xB:   /* CMN */
+            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            emit_update_flags_add(C, SLJIT_R2, SLJIT_R0, SLJIT_R1);
+            return 0;
+        case 0xC:   /* ORR */
+            sljit_emit_op2(C, SLJIT_OR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            break;
+        case 0xD:   /* MUL */
+            sljit_emit_op2(C, SLJIT_MUL32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            break;
+        case 0xE:   /* BIC */
+            sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 0xFFFFFFFF);
+            sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            break;
+        default:    /* MVN */
+            sljit_emit_op2(C, SLJIT_XOR32, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_IMM, 0xFFFFFFFF);
+            break;
+    }
     
-    emit_load_reg(C, SLJIT_R0, rn);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read32));
     emit_store_reg(C, rd, SLJIT_R0);
+    emit_update_flags_nz_simple(C, SLJIT_R0);
     
     return 0;
 }
 
-__attribute__((unused))
-static int translate_thumb_str_imm(struct sljit_compiler *C, uint16_t opcode)
+/* Format 5: ADD, CMP, MOV with a high register, BX */
+static int translate_thumb_hi_reg(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
 {
-    int rd = (opcode >> 8) & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    uint32_t offset = (opcode & 0x7C0) >> 4;
+    int rd = (opcode & 0x7) | ((opcode >> 4) & 0x8);
+    int rs = (opcode >> 3) & 0xF;
+    uint32_t op = (opcode >> 8) & 0x3;
     
-    emit_load_reg(C, SLJIT_R0, rn);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    emit_load_reg(C, SLJIT_R1, rd);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write32));
+    emit_load_thumb_reg(C, SLJIT_R1, rs, pc);
     
-    return 0;
-}
-
-static int translate_thumb_str_reg(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rd = opcode & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    int rm = (opcode >> 6) & 0x7;
+    switch (op) {
+        case 0x0:   /* ADD */
+            emit_load_thumb_reg(C, SLJIT_R0, rd, pc);
+            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            break;
+        case 0x1:   /* CMP */
+            emit_load_thumb_reg(C, SLJIT_R0, rd, pc);
+            sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R2, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+            emit_update_flags_sub(C, SLJIT_R2, SLJIT_R0, SLJIT_R1);
+            return 0;
+        case 0x2:   /* MOV */
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_R1, 0);
+            break;
+        default:    /* BX, bit 0 of the target selects the instruction set */
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_R1, 0);
+            sljit_emit_op2(C, SLJIT_AND32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 1);
+            sljit_emit_op2(C, SLJIT_SHL32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 5);
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R2, 0,
+                           SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, cpsr));
+            sljit_emit_op2(C, SLJIT_AND32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, 0xFFFFFFDF);
+            sljit_emit_op2(C, SLJIT_OR32, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R1, 0);
+            sljit_emit_op1(C, SLJIT_MOV32,
+                           SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, cpsr),
+                           SLJIT_R2, 0);
+            sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFE);
+            emit_branch_cycles_dynamic(C, true);
+            emit_block_return(C);
+            return 1;
+    }
     
-    emit_load_reg(C, SLJIT_R0, rn);
-    emit_load_reg(C, SLJIT_R2, rm);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R2, 0);
-    emit_load_reg(C, SLJIT_R1, rd);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write32));
+    if (rd == 15) {
+        sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFE);
+        emit_block_return(C);
+        return 1;
+    }
     
+    emit_store_reg(C, rd, SLJIT_R0);
     return 0;
 }
 
-__attribute__((unused))
-static int translate_thumb_ldrb_imm(struct sljit_compiler *C, uint16_t opcode)
+/* Transfer rd at the address in R0, loads are sign-extended when is_signed */
+static void emit_thumb_xfer(struct sljit_compiler *C, int rd, bool is_load, int size, bool is_signed)
 {
-    int rd = (opcode >> 8) & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    uint32_t offset = (opcode & 0x7C0) >> 6;
+    if (!is_load) {
+        emit_load_reg(C, SLJIT_R1, rd);
+        emit_mem_write(C, size);
+        return;
+    }
     
-    emit_load_reg(C, SLJIT_R0, rn);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read8));
+    emit_mem_read(C, size);
+    if (is_signed) {
+        int shift = (size == 1) ? 24 : 16;
+        sljit_emit_op2(C, SLJIT_SHL32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, shift);
+        sljit_emit_op2(C, SLJIT_ASHR32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, shift);
+    }
     emit_store_reg(C, rd, SLJIT_R0);
-    
-    return 0;
 }
 
-static int translate_thumb_strb_imm(struct sljit_compiler *C, uint16_t opcode)
+/* Word of a PUSH/POP or LDMIA/STMIA at the address in R0 */
+static void emit_thumb_block_xfer(struct sljit_compiler *C, int reg, bool is_load)
 {
-    int rd = (opcode >> 8) & 0x7;
-    int rn = (opcode >> 3) & 0x7;
-    uint32_t offset = (opcode & 0x7C0) >> 6;
-    
-    emit_load_reg(C, SLJIT_R0, rn);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    emit_load_reg(C, SLJIT_R1, rd);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write8));
-    
-    return 0;
+    if (is_load) {
+        emit_block_mem_read(C);
+        emit_store_reg(C, reg, SLJIT_R0);
+    } else {
+        emit_load_reg(C, SLJIT_R1, reg);
+        emit_block_mem_write(C);
+    }
 }
 
+/* Format 6: LDR relative to the word aligned PC */
 static int translate_thumb_ldr_pc(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
 {
     int rd = (opcode >> 8) & 0x7;
-    uint32_t offset = (opcode & 0xFF) << 2;
-    uint32_t addr = (pc + 4 + offset) & ~3;
+    uint32_t addr = ((pc + 4) & ~2u) + ((opcode & 0xFF) << 2);
     
     sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, addr);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read32));
-    emit_store_reg(C, rd, SLJIT_R0);
+    emit_thumb_xfer(C, rd, true, 4, false);
     
     return 0;
 }
 
-__attribute__((unused))
-static int translate_thumb_ldr_sp(struct sljit_compiler *C, uint16_t opcode)
+/* Formats 7 and 8: transfers with a register offset */
+static int translate_thumb_reg_offset(struct sljit_compiler *C, uint16_t opcode)
 {
-    int rd = (opcode >> 8) & 0x7;
-    uint32_t offset = (opcode & 0xFF) << 2;
+    int rd = opcode & 0x7;
+    int rb = (opcode >> 3) & 0x7;
+    int ro = (opcode >> 6) & 0x7;
+    uint32_t op = (opcode >> 10) & 0x3;
     
-    emit_load_reg(C, SLJIT_R0, 13);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read32));
-    emit_store_reg(C, rd, SLJIT_R0);
+    emit_load_reg(C, SLJIT_R0, rb);
+    emit_load_reg(C, SLJIT_R1, ro);
+    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+    
+    if (!(opcode & 0x0200)) {
+        /* STR, STRB, LDR, LDRB */
+        emit_thumb_xfer(C, rd, op >= 0x2, (op & 1) ? 1 : 4, false);
+    } else {
+        /* STRH, LDSB, LDRH, LDSH */
+        emit_thumb_xfer(C, rd, op != 0x0, (op == 0x1) ? 1 : 2, (op & 1) != 0);
+    }
     
     return 0;
 }
 
-__attribute__((unused))
-static int translate_thumb_str_sp(struct sljit_compiler *C, uint16_t opcode)
+/* Formats 9 and 10: transfers with an immediate offset */
+static int translate_thumb_imm_offset(struct sljit_compiler *C, uint16_t opcode)
 {
-    int rd = (opcode >> 8) & 0x7;
-    uint32_t offset = (opcode & 0xFF) << 2;
+    int rd = opcode & 0x7;
+    int rb = (opcode >> 3) & 0x7;
+    uint32_t offset = (opcode >> 6) & 0x1F;
+    bool is_load = (opcode >> 11) & 1;
+    int size;
     
-    emit_load_reg(C, SLJIT_R0, 13);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
-    emit_load_reg(C, SLJIT_R1, rd);
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write32));
+    if ((opcode & 0xF000) == 0x8000) {
+        size = 2;
+    } else {
+        size = (opcode & 0x1000) ? 1 : 4;
+    }
+    
+    emit_load_reg(C, SLJIT_R0, rb);
+    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset * size);
+    emit_thumb_xfer(C, rd, is_load, size, false);
     
     return 0;
 }
 
-__attribute__((unused))
-static int translate_thumb_add_sp_imm(struct sljit_compiler *C, uint16_t opcode)
+/* Format 11: SP-relative LDR, STR */
+static int translate_thumb_sp_offset(struct sljit_compiler *C, uint16_t opcode)
 {
-    uint32_t imm = (opcode & 0x7F) << 2;
+    int rd = (opcode >> 8) & 0x7;
     
     emit_load_reg(C, SLJIT_R0, 13);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
-    emit_store_reg(C, 13, SLJIT_R0);
+    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, (opcode & 0xFF) << 2);
+    emit_thumb_xfer(C, rd, (opcode >> 11) & 1, 4, false);
     
     return 0;
 }
 
-__attribute__((unused))
-static int translate_thumb_sub_sp_imm(struct sljit_compiler *C, uint16_t opcode)
+/* Format 12: ADD Rd, PC/SP, #imm */
+static int translate_thumb_load_address(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
 {
-    uint32_t imm = (opcode & 0x7F) << 2;
+    int rd = (opcode >> 8) & 0x7;
+    uint32_t offset = (opcode & 0xFF) << 2;
     
-    emit_load_reg(C, SLJIT_R0, 13);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
-    emit_store_reg(C, 13, SLJIT_R0);
+    if (opcode & 0x0800) {
+        emit_load_reg(C, SLJIT_R0, 13);
+        sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
+        emit_store_reg(C, rd, SLJIT_R0);
+    } else {
+        emit_store_reg_imm(C, rd, ((pc + 4) & ~2u) + offset);
+    }
     
     return 0;
 }
 
-__attribute__((unused))
-static int translate_thumb_push(struct sljit_compiler *C, uint16_t opcode)
+/* Format 13: ADD SP, #+/-imm */
+static int translate_thumb_add_sp(struct sljit_compiler *C, uint16_t opcode)
 {
-    uint8_t reg_list = opcode & 0xFF;
-    bool push_lr = (opcode >> 8) & 1;
-    int num_regs = count_bits(reg_list) + (push_lr ? 1 : 0);
+    uint32_t offset = (opcode & 0x7F) << 2;
     
     emit_load_reg(C, SLJIT_R0, 13);
-    sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
+    sljit_emit_op2(C, (opcode & 0x80) ? SLJIT_SUB32 : SLJIT_ADD32,
+                   SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
     emit_store_reg(C, 13, SLJIT_R0);
     
-    int offset = 0;
-    for (int i = 0; i < 8; i++) {
-        if ((reg_list >> i) & 1) {
-            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R1, 0, SLJIT_R0, 0);
-            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, offset);
-            emit_load_reg(C, SLJIT_R2, i);
-            sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                             SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write32));
-            offset += 4;
-        }
-    }
-    
-    if (push_lr) {
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R1, 0, SLJIT_R0, 0);
-        sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, offset);
-        emit_load_reg(C, SLJIT_R2, 14);
-        sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(32, 32),
-                         SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_write32));
-    }
-    
     return 0;
 }
 
-__attribute__((unused))
-static int translate_thumb_pop(struct sljit_compiler *C, uint16_t opcode)
+/* Format 14: PUSH {rlist, LR}, POP {rlist, PC} */
+static int translate_thumb_push_pop(struct sljit_compiler *C, uint16_t opcode)
 {
     uint8_t reg_list = opcode & 0xFF;
-    bool pop_pc = (opcode >> 8) & 1;
-    int num_regs = count_bits(reg_list);
+    bool is_pop = (opcode >> 11) & 1;
+    bool extra = (opcode >> 8) & 1;
+    int num_regs = count_bits(reg_list) + (extra ? 1 : 0);
+    int offset = 0;
     
+    /* Registers go from the lowest address up, the base waits on the stack */
     emit_load_reg(C, SLJIT_R0, 13);
+    if (!is_pop) {
+        sljit_emit_op2(C, SLJIT_SUB32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
+        emit_store_reg(C, 13, SLJIT_R0);
+    }
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE, SLJIT_R0, 0);
     
-    int offset = 0;
     for (int i = 0; i < 8; i++) {
         if ((reg_list >> i) & 1) {
-            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R1, 0, SLJIT_R0, 0);
-            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, offset);
-            sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                             SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read32));
-            emit_store_reg(C, i, SLJIT_R0);
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
+            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
+            emit_thumb_block_xfer(C, i, is_pop);
             offset += 4;
         }
     }
     
-    if (pop_pc) {
-        sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R1, 0, SLJIT_R0, 0);
-        sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, offset);
-        sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS1(W, 32),
-                         SLJIT_IMM, SLJIT_FUNC_ADDR(gba_mem_read32));
-        sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFE);
-        emit_store_reg(C, 15, SLJIT_R0);
+    if (!is_pop) {
+        if (extra) {
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
+            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
+            emit_thumb_block_xfer(C, 14, false);
+        }
+        return 0;
     }
     
-    emit_load_reg(C, SLJIT_R0, 13);
-    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, (num_regs + (pop_pc ? 1 : 0)) * 4);
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
+    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, num_regs * 4);
     emit_store_reg(C, 13, SLJIT_R0);
     
-    return pop_pc ? 1 : 0;
-}
-
-static int translate_thumb_b(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
-{
-    int32_t offset = (int8_t)(opcode & 0xFF);
-    offset <<= 1;
-    uint32_t target = pc + 4 + offset;
+    if (!extra) {
+        return 0;
+    }
     
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target);
-    emit_store_reg(C, 15, SLJIT_R0);
-    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+    /* POP {pc} stays in Thumb state */
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
+    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
+    emit_block_mem_read(C);
+    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFE);
+    emit_block_return(C);
     
     return 1;
 }
 
-static int translate_thumb_b_cond(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
+/* Format 15: LDMIA, STMIA with writeback, the base is never in the list */
+static int translate_thumb_ldm_stm(struct sljit_compiler *C, uint16_t opcode)
 {
-    int cond = (opcode >> 8) & 0xF;
-    int32_t offset = (int8_t)(opcode & 0xFF);
-    offset <<= 1;
-    uint32_t target = pc + 4 + offset;
-    
-    struct sljit_jump *cond_jump = emit_condition_check(C, cond);
-    
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target);
-    emit_store_reg(C, 15, SLJIT_R0);
-    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+    int rb = (opcode >> 8) & 0x7;
+    uint8_t reg_list = opcode & 0xFF;
+    bool is_load = (opcode >> 11) & 1;
+    int offset = 0;
     
-    if (cond_jump != NULL) {
-        sljit_set_label(cond_jump, sljit_emit_label(C));
-    }
+    emit_load_reg(C, SLJIT_R0, rb);
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE, SLJIT_R0, 0);
     
-    return 0;
-}
-
-__attribute__((unused))
-static int translate_thumb_bl(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
-{
-    int32_t offset = (opcode & 0x7FF);
-    if (offset & 0x400) {
-        offset |= 0xFFFFF800;
+    for (int i = 0; i < 8; i++) {
+        if ((reg_list >> i) & 1) {
+            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
+            sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
+            emit_thumb_block_xfer(C, i, is_load);
+            offset += 4;
+        }
     }
-    offset <<= 1;
-    uint32_t target = pc + 4 + offset;
-    
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, (pc + 4) | 1);
-    emit_store_reg(C, 14, SLJIT_R0);
     
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target);
-    emit_store_reg(C, 15, SLJIT_R0);
-    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_SP), LOCAL_XFER_BASE);
+    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, offset);
+    emit_store_reg(C, rb, SLJIT_R0);
     
-    return 1;
+    return 0;
 }
 
-static int translate_thumb_swi(struct sljit_compiler *C, uint16_t opcode)
+/* Format 16: conditional branch, both outcomes leave the block */
+static int translate_thumb_b_cond(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
 {
-    uint8_t swi_num = opcode & 0xFF;
+    uint8_t cond = (opcode >> 8) & 0xF;
+    int32_t offset = (int32_t)(int8_t)(opcode & 0xFF) << 1;
     
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_S0, 0);
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R1, 0, SLJIT_IMM, swi_num);
+    struct sljit_jump *skip_branch = emit_condition_skip(C, cond);
     
-    sljit_emit_icall(C, SLJIT_CALL, SLJIT_ARGS2V(P, 32),
-                     SLJIT_IMM, SLJIT_FUNC_ADDR(jit_swi_handler));
+    emit_branch_cycles(C, pc + 4 + offset, true);
+    emit_block_exit(C, pc + 4 + offset);
     
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, 0x00000008);
-    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+    /* The interpreter charges the non-sequential fetch either way */
+    sljit_set_label(skip_branch, sljit_emit_label(C));
+    emit_branch_cycles(C, pc + 2, true);
+    emit_block_exit(C, pc + 2);
     
     return 1;
 }
 
-static uint32_t thumb_bl_offset = 0;
-
-static int translate_thumb_bl_prefix(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
+/* Format 18: unconditional branch */
+static int translate_thumb_b(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
 {
-    int32_t offset = (opcode & 0x7FF);
-    if (offset & 0x400) {
-        offset |= 0xFFFFF800;
-    }
-    offset <<= 12;
+    int32_t offset = (int32_t)((uint32_t)opcode << 21) >> 20;
     
-    thumb_bl_offset = offset;
+    emit_branch_cycles(C, pc + 4 + offset, true);
+    emit_block_exit(C, pc + 4 + offset);
     
-    return 0;
+    return 1;
 }
 
-static int translate_thumb_bl_suffix(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
+/* Format 19: BL as a prefix setting the upper half of LR, then a suffix branching */
+static int translate_thumb_bl(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
 {
-    int32_t offset = thumb_bl_offset | ((opcode & 0x7FF) << 1);
+    int32_t offset = (int32_t)((uint32_t)opcode << 21) >> 21;
     
-    uint32_t target = pc + 2 + offset;
-    uint32_t return_addr = (pc + 2) | 1;
-    
-    sljit_emit_op1(C, SLJIT_MOV32, 
-                   SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, reg[14]),
-                   SLJIT_IMM, return_addr);
+    if (!(opcode & 0x0800)) {
+        uint32_t lr = pc + 4 + ((uint32_t)offset << 12);
+        emit_store_reg_imm(C, 14, lr);
+        s_thumb_bl_prefix_pc = pc;
+        s_thumb_bl_prefix_lr = lr;
+        return 0;
+    }
     
-    sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, target | 1);
-    emit_store_reg(C, 15, SLJIT_R0);
-    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+    uint32_t low = (opcode & 0x7FF) << 1;
     
-    return 1;
-}
-
-static int translate_thumb_bx(struct sljit_compiler *C, uint16_t opcode)
-{
-    int rm = (opcode >> 3) & 0xF;
+    if (s_thumb_bl_prefix_pc == pc - 2) {
+        emit_store_reg_imm(C, 14, (pc + 2) | 1);
+        emit_branch_cycles(C, s_thumb_bl_prefix_lr + low, true);
+        emit_block_exit(C, s_thumb_bl_prefix_lr + low);
+        return 1;
+    }
     
-    emit_load_reg(C, SLJIT_R0, rm);
-    emit_store_reg(C, 15, SLJIT_R0);
-    sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+    /* The prefix ran in an earlier block */
+    emit_load_reg(C, SLJIT_R0, 14);
+    sljit_emit_op2(C, SLJIT_ADD32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, low);
+    sljit_emit_op2(C, SLJIT_AND32, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xFFFFFFFE);
+    emit_store_reg_imm(C, 14, (pc + 2) | 1);
+    emit_branch_cycles_dynamic(C, true);
+    emit_block_return(C);
     
     return 1;
 }
 
 static int translate_thumb_instruction(struct sljit_compiler *C, uint16_t opcode, uint32_t pc)
 {
-    uint16_t op = (opcode >> 11) & 0x1F;
-    int result = 0;
+    int result;
     
-    switch (op) {
-        case 0x00:
-        case 0x01:
-        case 0x02:
-            {
-                uint16_t op2 = (opcode >> 9) & 0x7;
-                switch (op2) {
-                    case 0x0: result = translate_thumb_lsl_reg(C, opcode); break;
-                    case 0x1: result = translate_thumb_lsr_reg(C, opcode); break;
-                    case 0x2: result = translate_thumb_asr_reg(C, opcode); break;
-                    case 0x3: result = translate_thumb_add_reg(C, opcode); break;
-                    case 0x4: result = translate_thumb_sub_reg(C, opcode); break;
-                    case 0x5: result = translate_thumb_add_imm(C, opcode); break;
-                    case 0x6: result = translate_thumb_sub_imm(C, opcode); break;
-                    default: result = -1; break;
-                }
+    switch (opcode >> 12) {
+        case 0x0:
+        case 0x1:
+            if ((opcode & 0x1800) == 0x1800) {
+                result = translate_thumb_add_sub(C, opcode);
+            } else {
+                result = translate_thumb_shift_imm(C, opcode);
             }
             break;
-        case 0x03:
-            result = translate_thumb_mov_imm(C, opcode);
-            break;
-        case 0x04:
-        case 0x05:
-        case 0x06:
-        case 0x07:
-            result = translate_thumb_cmp_reg(C, opcode);
-            break;
-        case 0x08:
-        case 0x09:
-            result = translate_thumb_add_imm8(C, opcode);
-            break;
-        case 0x0A:
-        case 0x0B:
-            result = translate_thumb_sub_imm8(C, opcode);
-            break;
-        case 0x0C:
-        case 0x0D:
-        case 0x0E:
-            {
-                uint16_t op2 = (opcode >> 6) & 0xF;
-                switch (op2) {
-                    case 0x0: result = translate_thumb_and_reg(C, opcode); break;
-                    case 0x1: result = translate_thumb_eor_reg(C, opcode); break;
-                    case 0x2: result = translate_thumb_lsl_reg(C, opcode); break;
-                    case 0x3: result = translate_thumb_lsr_reg(C, opcode); break;
-                    case 0x4: result = translate_thumb_asr_reg(C, opcode); break;
-                    case 0x5: result = translate_thumb_adc_reg(C, opcode); break;
-                    case 0x6: result = translate_thumb_sbc_reg(C, opcode); break;
-                    case 0x7: result = translate_thumb_tst_reg(C, opcode); break;
-                    case 0x8: result = translate_thumb_tst_reg(C, opcode); break;
-                    case 0x9: result = translate_thumb_cmp_reg(C, opcode); break;
-                    case 0xA: result = translate_thumb_cmn_reg(C, opcode); break;
-                    case 0xB: result = translate_thumb_orr_reg(C, opcode); break;
-                    case 0xC: result = translate_thumb_mul_reg(C, opcode); break;
-                    case 0xD: result = translate_thumb_bic_reg(C, opcode); break;
-                    case 0xE: result = translate_thumb_mvn_reg(C, opcode); break;
-                    case 0xF: result = translate_thumb_mvn_reg(C, opcode); break;
-                    default: result = -1; break;
-                }
-            }
+        case 0x2:
+        case 0x3:
+            result = translate_thumb_imm8(C, opcode);
             break;
-        case 0x0F:
-            {
-                uint16_t op2 = (opcode >> 8) & 0x7;
-                switch (op2) {
-                    case 0x0: result = translate_thumb_add_reg(C, opcode); break;
-                    case 0x1: result = translate_thumb_cmp_reg(C, opcode); break;
-                    case 0x2: result = translate_thumb_mov_imm(C, opcode); break;
-                    case 0x3: result = translate_thumb_bx(C, opcode); break;
-                    case 0x4:
-                    case 0x5:
-                    case 0x6:
-                    case 0x7:
-                        result = translate_thumb_ldr_pc(C, opcode, pc);
-                        break;
-                    default: result = -1; break;
-                }
+        case 0x4:
+            if ((opcode & 0xFC00) == 0x4000) {
+                result = translate_thumb_alu(C, opcode);
+            } else if ((opcode & 0xFC00) == 0x4400) {
+                result = translate_thumb_hi_reg(C, opcode, pc);
+            } else {
+                result = translate_thumb_ldr_pc(C, opcode, pc);
             }
             break;
-        case 0x10:
-        case 0x11:
-        case 0x12:
-        case 0x13:
-        case 0x14:
-            result = translate_thumb_ldr_pc(C, opcode, pc);
-            break;
-        case 0x15:
-        case 0x16:
-            result = translate_thumb_str_reg(C, opcode);
+        case 0x5:
+            result = translate_thumb_reg_offset(C, opcode);
             break;
-        case 0x17:
-        case 0x18:
-            result = translate_thumb_strb_imm(C, opcode);
+        case 0x6:
+        case 0x7:
+        case 0x8:
+            result = translate_thumb_imm_offset(C, opcode);
             break;
-        case 0x19:
-        case 0x1A:
-            result = translate_thumb_ldr_imm(C, opcode);
+        case 0x9:
+            result = translate_thumb_sp_offset(C, opcode);
             break;
-        case 0x1B:
-            result = translate_thumb_ldrh_imm(C, opcode);
+        case 0xA:
+            result = translate_thumb_load_address(C, opcode, pc);
             break;
-        case 0x1C:
-            {
-                uint8_t cond = (opcode >> 8) & 0x0F;
-                if (cond == 0x0F) {
-                    result = translate_thumb_swi(C, opcode);
-                } else {
-                    result = translate_thumb_b_cond(C, opcode, pc);
-                }
+        case 0xB:
+            if ((opcode & 0xFF00) == 0xB000) {
+                result = translate_thumb_add_sp(C, opcode);
+            } else if ((opcode & 0xF600) == 0xB400) {
+                result = translate_thumb_push_pop(C, opcode);
+            } else {
+                result = -1;
             }
             break;
-        case 0x1D:
-            result = translate_thumb_b(C, opcode, pc);
+        case 0xC:
+            result = translate_thumb_ldm_stm(C, opcode);
             break;
-        case 0x1E:
-            result = translate_thumb_bl_prefix(C, opcode, pc);
+        case 0xD:
+            result = ((opcode >> 8) & 0xF) < 0xE ? translate_thumb_b_cond(C, opcode, pc) : -1;
             break;
-        case 0x1F:
-            result = translate_thumb_bl_suffix(C, opcode, pc);
+        case 0xE:
+            result = (opcode & 0x0800) ? -1 : translate_thumb_b(C, opcode, pc);
             break;
         default:
-            result = -1;
+            result = translate_thumb_bl(C, opcode, pc);
             break;
     }
     
@@ -3315,104 +3561,86 @@ static int translate_thumb_instruction(struct sljit_compiler *C, uint16_t opcode
 
 static bool is_thumb_block_terminator(uint16_t opcode)
 {
-    uint16_t op = (opcode >> 11) & 0x1F;
-    
-    if (op == 0x0F && ((opcode >> 8) & 0x7) == 0x3) {
-        return true;
+    if ((opcode & 0xF000) == 0xD000 && (opcode & 0x0F00) < 0x0E00) {
+        return true;                            /* B<cond> */
     }
-    
-    if (op >= 0x1C && op <= 0x1F) {
-        return true;
+    if ((opcode & 0xF000) == 0xE000 || (opcode & 0xF800) == 0xF800) {
+        return true;                            /* B, BL suffix */
     }
-    
+    if ((opcode & 0xFF00) == 0x4700 || (opcode & 0xFF00) == 0xBD00) {
+        return true;                            /* BX, POP {pc} */
+    }
+    /* ADD and MOV to PC */
+    return (opcode & 0xFC87) == 0x4487 && (opcode & 0x0300) != 0x0100;
+}
+
+/* Over-approximation of instructions that may store, and raise an alert */
+static bool arm_may_store(uint32_t opcode)
+{
+    if ((opcode & 0x0C100000) == 0x04000000) return true;             /* STR, STRB */
+    if ((opcode & 0x0E100000) == 0x08000000) return true;             /* STM */
+    if ((opcode & 0x0E1000F0) == 0x000000B0) return true;             /* STRH */
+    if ((opcode & 0x0FB00FF0) == 0x01000090) return true;             /* SWP, SWPB */
     return false;
 }
 
-static int get_arm_instruction_cycles(uint32_t opcode)
+static bool thumb_may_store(uint16_t opcode)
 {
-    uint32_t bits_27_25 = (opcode >> 25) & 0x7;
-    
-    switch (bits_27_25) {
-        case 0x0:
-            if ((opcode & 0x0FC000F0) == 0x00000090 ||
-                (opcode & 0x0FC000F0) == 0x01000090) {
-                return 3;
-            }
-            if ((opcode & 0x0F8000F0) == 0x00800090) {
-                return 4;
-            }
-            return 1;
-            
-        case 0x1:
-            return 1;
-            
-        case 0x2:
-        case 0x3:
-            if ((opcode >> 20) & 0x01) {
-                return 2;
-            }
-            if ((opcode >> 24) & 0x01) {
-                return 2;
-            }
-            return 1;
-            
-        case 0x4:
-            return 2;
-            
-        case 0x5:
-            return 2;
-            
-        case 0x6:
-            return 2;
-            
-        case 0x7:
-            return 2;
-            
+    switch (opcode >> 12) {
+        case 0x5:                               /* STR, STRH, STRB register offset */
+            return ((opcode >> 9) & 0x7) <= 0x2;
+        case 0x6: case 0x7: case 0x8: case 0x9: case 0xC:
+            return !(opcode & 0x0800);          /* Immediate offset, SP-relative, STMIA */
+        case 0xB:
+            return (opcode & 0xFE00) == 0xB400; /* PUSH */
         default:
-            return 1;
+            return false;
     }
 }
 
-static int get_thumb_instruction_cycles(uint16_t opcode)
+/* Deadline checks go every deadline_interval instructions */
+static bool is_deadline(int index)
 {
-    uint16_t op = (opcode >> 11) & 0x1F;
-    
-    switch (op) {
-        case 0x02:
-        case 0x03:
-        case 0x04:
-        case 0x05:
-        case 0x06:
-        case 0x07:
-            return 2;
-            
-        case 0x08:
-        case 0x09:
-        case 0x0A:
-        case 0x0B:
-        case 0x0C:
-        case 0x0D:
-        case 0x0E:
-            return 2;
-            
-        case 0x1C:
-        case 0x1D:
-        case 0x1E:
-        case 0x1F:
-            return 2;
-            
-        default:
-            return 1;
+    int interval = g_jit_config.deadline_interval;
+    return interval > 0 && index % interval == 0;
+}
+
+/*
+ * A segment runs up to the next deadline check, or up to the next store: the
+ * alert it may raise is checked before the following instruction, which is
+ * where the interpreter handles it
+ */
+static bool is_segment_start(int index, bool is_thumb)
+{
+    if (index == 0 || is_deadline(index)) {
+        return true;
+    }
+    if (index > s_block_length) {
+        return false;
     }
+    uint32_t opcode = s_block_opcodes[index - 1];
+    return is_thumb ? thumb_may_store(opcode) : arm_may_store(opcode);
 }
 
-__attribute__((unused)) static void emit_cycle_check(struct sljit_compiler *C)
+/*
+ * Charge the fetches of the instructions of a segment, called before each
+ * instruction. A block leaving between two segments has paid for exactly
+ * the instructions it ran.
+ */
+static void emit_segment_cycles(struct sljit_compiler *C, uint32_t pc, bool is_thumb, int index)
 {
-    struct sljit_jump *out_of_cycles = sljit_emit_cmp(C, SLJIT_32 | SLJIT_LESS_EQUAL,
-                                                       SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, cycles),
-                                                       SLJIT_IMM, 0);
+    int end = index + 1;
     
-    sljit_set_label(out_of_cycles, sljit_emit_label(C));
+    if (!is_segment_start(index, is_thumb)) {
+        return;
+    }
+    if (index > 0) {
+        emit_deadline_exit(C, pc, is_deadline(index));
+    }
+    while (end < s_block_length && !is_segment_start(end, is_thumb)) {
+        end++;
+    }
+    emit_fetch_cycles(C, pc, is_thumb, end - index);
 }
 
 bool jit_translate_block(struct sljit_compiler *C, uint32_t pc, bool is_thumb, uint32_t *end_pc)
@@ -3423,6 +3651,18 @@ bool jit_translate_block(struct sljit_compiler *C, uint32_t pc, bool is_thumb, u
     bool l1_only = true;
     bool has_error = false;
     bool has_return = false;
+    bool partial = false;
+    
+    s_exit_site_count = 0;
+    s_thumb_bl_prefix_pc = 0xFFFFFFFF;
+    scan_block(pc, is_thumb);
+    regalloc_begin(C, is_thumb);
+    flags_begin(is_thumb);
+    gba_mem_get_regions(&s_mem);
+    if (s_mem.ws_seq == NULL || s_mem.ws_nseq == NULL) {
+        s_mem.ws_seq = s_single_cycle;
+        s_mem.ws_nseq = s_single_cycle;
+    }
     
     // 临时注释 - 调试日志
     // ESP_LOGD(TAG, "开始翻译块: PC=0x%08X, thumb=%d", pc, is_thumb);
@@ -3431,13 +3671,17 @@ bool jit_translate_block(struct sljit_compiler *C, uint32_t pc, bool is_thumb, u
         while (current_pc < max_pc && instruction_count < g_jit_config.max_block_instructions) {
             uint16_t opcode = gba_mem_read16(current_pc);
             
-            if (!is_l1_thumb_instruction(opcode)) {
-                // 临时注释 - 调试日志
-                // ESP_LOGD(TAG, "Non-L1 Thumb instruction at PC=0x%08X: 0x%04X, falling back", current_pc, opcode);
+            if (insn_level(opcode, true) == TRANS_LEVEL_NONE) {
+                /* The rest of the block is left to the interpreter */
                 l1_only = false;
+                partial = true;
                 break;
             }
             
+            /* Deducted up front so that a branch leaving the block pays for itself */
+            emit_segment_cycles(C, current_pc, true, instruction_count);
+            
+            s_insn_index = instruction_count;
             int result = translate_thumb_instruction(C, opcode, current_pc);
             
             if (result < 0) {
@@ -3446,12 +3690,6 @@ bool jit_translate_block(struct sljit_compiler *C, uint32_t pc, bool is_thumb, u
                 break;
             }
             
-            int cycles = get_thumb_instruction_cycles(opcode);
-            sljit_emit_op2(C, SLJIT_SUB32, 
-                           SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, cycles),
-                           SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, cycles),
-                           SLJIT_IMM, cycles);
-            
             instruction_count++;
             current_pc += 2;
             
@@ -3465,20 +3703,24 @@ bool jit_translate_block(struct sljit_compiler *C, uint32_t pc, bool is_thumb, u
         }
         
         if (instruction_count > 0 && !has_error && !has_return) {
-            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, current_pc);
-            sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+            emit_block_exit(C, current_pc);
         }
     } else {
         while (current_pc < max_pc && instruction_count < g_jit_config.max_block_instructions) {
             uint32_t opcode = gba_mem_read32(current_pc);
             
-            if (!is_l1_instruction(opcode)) {
-                // 临时注释 - 调试日志
-                // ESP_LOGD(TAG, "Non-L1 instruction at PC=0x%08X: 0x%08X, falling back", current_pc, opcode);
+            trans_level_t level = insn_level(opcode, false);
+            if (level == TRANS_LEVEL_NONE) {
+                /* The rest of the block is left to the interpreter */
                 l1_only = false;
+                partial = true;
                 break;
             }
             
+            /* Deducted up front so that a branch leaving the block pays for itself */
+            emit_segment_cycles(C, current_pc, false, instruction_count);
+            
+            s_insn_index = instruction_count;
             int result = translate_instruction(C, opcode, current_pc);
             
             if (result < 0) {
@@ -3487,14 +3729,14 @@ bool jit_translate_block(struct sljit_compiler *C, uint32_t pc, bool is_thumb, u
                 break;
             }
             
-            int cycles = get_arm_instruction_cycles(opcode);
-            sljit_emit_op2(C, SLJIT_SUB32, 
-                           SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, cycles),
-                           SLJIT_MEM1(SLJIT_S0), offsetof(gba_cpu_state_t, cycles),
-                           SLJIT_IMM, cycles);
-            
             instruction_count++;
             current_pc += 4;
+            if (level == TRANS_LEVEL_L2) {
+                l1_only = false;
+                g_jit_stats.l2_instructions++;
+            } else {
+                g_jit_stats.l1_instructions++;
+            }
             
             if (result > 0) {
                 has_return = true;
@@ -3506,8 +3748,7 @@ bool jit_translate_block(struct sljit_compiler *C, uint32_t pc, bool is_thumb, u
         }
         
         if (instruction_count > 0 && !has_error && !has_return) {
-            sljit_emit_op1(C, SLJIT_MOV32, SLJIT_R0, 0, SLJIT_IMM, current_pc);
-            sljit_emit_return(C, SLJIT_MOV, SLJIT_R0, 0);
+            emit_block_exit(C, current_pc);
         }
     }
     
@@ -3518,6 +3759,10 @@ bool jit_translate_block(struct sljit_compiler *C, uint32_t pc, bool is_thumb, u
         return false;
     }
     
+    if (partial) {
+        g_jit_stats.partial_blocks++;
+    }
+    
     // 临时注释 - 调试日志
     // ESP_LOGD(TAG, "翻译完成: PC=0x%08X -> 0x%08X, 指令数=%d, l1_only=%d", 
     //          pc, current_pc, instruction_count, l1_only);
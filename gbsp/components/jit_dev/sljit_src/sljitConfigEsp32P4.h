@@ -159,12 +159,30 @@ extern "C" {
 /* RAM translation cache size - using PSRAM which has plenty of space */
 #define GBA_JIT_RAM_CACHE_SIZE (64 * 1024)
 
-/* Block hash table size */
+/* Block hash table size, doubled as blocks pile up */
 #define GBA_JIT_BLOCK_HASH_SIZE 4096
+#define GBA_JIT_MAX_BLOCK_HASH_SIZE 65536
+
+/* Translation caches are split into chunks, the unit of eviction */
+#define GBA_JIT_CODE_CHUNK_SIZE (16 * 1024)
+
+/* Dispatches after which a block survives the eviction of its chunk */
+#define GBA_JIT_HOT_EXEC_COUNT 32
+
+/* Linked blocks credited with a dispatch when a chain returns, they
+ * never go through jit_block_lookup themselves */
+#define GBA_JIT_CHAIN_SAMPLE_BLOCKS 8
+
+/* Dispatches that find no block for a PC before it gets compiled, the
+ * code is interpreted meanwhile */
+#define GBA_JIT_TIER_THRESHOLD 8
 
 /* Maximum instructions per block */
 #define GBA_JIT_MAX_BLOCK_INSTRUCTIONS 64
 
+/* Instructions between two checks for a due event inside a block */
+#define GBA_JIT_DEADLINE_INTERVAL 16
+
 /* Enable JIT statistics */
 #define GBA_JIT_ENABLE_STATS 1
 
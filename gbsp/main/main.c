@@ -16,10 +16,12 @@
 #include "bios.h"
 
 /* JIT configuration */
-static bool jit_enabled = true;  /* Enable JIT, but all instructions use interpreter */
+static bool jit_enabled = true;  /* Code the JIT can't compile yet is interpreted */
 static bool jit_initialized = false;
 static int jit_debug_counter = 0;
 #define JIT_DEBUG_INTERVAL 60
+/* Cycles interpreted at a time while a PC has no block */
+#define JIT_INTERP_SLICE_CYCLES 256
 
 u32 idle_loop_target_pc = 0xFFFFFFFF;
 u32 translation_gate_target_pc[MAX_TRANSLATION_GATES];
@@ -131,6 +133,14 @@ void app_main(void)
 
     reset_gba();
 
+#ifdef GBSP_JIT_SELFTEST
+    // The self-test replaces the JIT's memory glue with mocks, so the game itself runs interpreted
+    int failed = jit_run_tests();
+    if (failed)
+        RG_LOGE("JIT self-test: %d tests failed", failed);
+    jit_enabled = false;
+#endif
+
     if (jit_enabled) {
         int ret = jit_init(NULL);
         if (ret == 0) {
@@ -143,8 +153,6 @@ void app_main(void)
 
     while (true)
     {
-        // RG_TIMER_INIT();
-
         rg_audio_sample_t mixbuffer[AUDIO_BUFFER_LENGTH];
         uint32_t joystick = rg_input_read_gamepad();
 
@@ -168,6 +176,7 @@ void app_main(void)
         if (jit_initialized) {
             extern u32 reg[64];
             extern u32 update_gba(int remaining_cycles);
+            gba_cpu_state_t *jit_cpu = &g_jit_cpu;
             s32 cycles_remaining = execute_cycles;
             u32 update_ret = 0;
             int block_count = 0;
@@ -182,10 +191,17 @@ void app_main(void)
             //             (unsigned int)reg[15], cycles_remaining, (reg[16] & 0x20) != 0);
             // }
             
+            /* The JIT works on its own copy of the registers, reg[] is only
+             * brought up to date when update_gba or the interpreter need it */
+            jit_state_load(jit_cpu, reg);
+            jit_executed = true;
+            
             while (1) {
                 /* Check CPU halt state or need more cycles */
                 if (reg[CPU_HALT_STATE] != CPU_ACTIVE || cycles_remaining <= 0) {
+                    jit_state_store(jit_cpu, reg);
                     update_ret = update_gba(cycles_remaining);
+                    jit_state_load(jit_cpu, reg);
                     if (completed_frame(update_ret)) {
                         // 临时注释 - 之前的调试日志
                         // if (debug_this_frame) {
@@ -203,34 +219,21 @@ void app_main(void)
                 }
                 
                 /* Execute JIT blocks */
-                uint32_t pc = reg[15];
-                bool is_thumb = (reg[16] & 0x20) != 0;
+                uint32_t pc = jit_cpu->reg[15];
+                bool is_thumb = (jit_cpu->cpsr & 0x20) != 0;
                 
                 block_entry_t *block = jit_block_lookup(pc, is_thumb);
-                if (block == NULL) {
+                if (block == NULL && jit_block_should_compile(pc, is_thumb)) {
+                    /* A failed compile marks the PC itself */
                     block = jit_block_compile(pc, is_thumb);
-                    if (block == NULL) {
-                        jit_mark_pc_failed(pc, is_thumb);
-                        // 临时注释 - 之前的调试日志
-                        // if (debug_this_frame && fallback_count < 5) {
-                        //     RG_LOGW("JIT compile failed: PC=0x%08x, thumb=%d", (unsigned int)pc, is_thumb);
-                        // }
-                    }
                 }
                 
                 if (block && block->valid && block->native_code) {
-                    gba_cpu_state_t jit_cpu;
-                    memcpy(jit_cpu.reg, reg, sizeof(jit_cpu.reg));
-                    jit_cpu.cycles = cycles_remaining;
-                    jit_cpu.cycles_target = cycles_remaining;
-                    
-                    /* 从reg[REG_CPSR]提取标志位到jit_cpu */
-                    jit_cpu.n_flag = (reg[REG_CPSR] >> 31) & 1;
-                    jit_cpu.z_flag = (reg[REG_CPSR] >> 30) & 1;
-                    jit_cpu.c_flag = (reg[REG_CPSR] >> 29) & 1;
-                    jit_cpu.v_flag = (reg[REG_CPSR] >> 28) & 1;
+                    jit_cpu->cycles = cycles_remaining;
+                    jit_cpu->cycles_target = cycles_remaining;
                     
-                    uint32_t new_pc = jit_execute_block(block, &jit_cpu);
+                    /* Linked blocks keep running until the cycles run out or an exit isn't linked */
+                    uint32_t new_pc = jit_execute_block(block, jit_cpu);
                     
                     // 保留 - 新增的PC追踪日志
                     if (debug_this_frame && block_count < 10) {
@@ -238,25 +241,18 @@ void app_main(void)
                                 (unsigned int)pc, (unsigned int)new_pc, (unsigned int)block->pc);
                     }
                     
-                    memcpy(reg, jit_cpu.reg, sizeof(jit_cpu.reg));
-                    reg[15] = new_pc;
-                    
-                    /* 将jit_cpu标志位同步回reg[REG_CPSR] */
-                    reg[REG_CPSR] = (reg[REG_CPSR] & 0x0FFFFFFF) |
-                                    ((jit_cpu.n_flag & 1) << 31) |
-                                    ((jit_cpu.z_flag & 1) << 30) |
-                                    ((jit_cpu.c_flag & 1) << 29) |
-                                    ((jit_cpu.v_flag & 1) << 28);
-                    
-                    int32_t consumed = cycles_remaining - (int32_t)jit_cpu.cycles;
-                    if (consumed <= 0) consumed = 1;
-                    cycles_remaining -= consumed;
+                    /* Blocks charge exactly what the interpreter would, overshoot included */
+                    cycles_remaining = (int32_t)jit_cpu->cycles;
+                    if (new_pc == idle_loop_target_pc && cycles_remaining > 0) {
+                        cycles_remaining = 0;
+                    }
                     
-                    jit_executed = true;
                     block_count++;
                     
                     if (cycles_remaining <= 0) {
+                        jit_state_store(jit_cpu, reg);
                         update_ret = update_gba(cycles_remaining);
+                        jit_state_load(jit_cpu, reg);
                         if (completed_frame(update_ret)) {
                             // 临时注释 - 之前的调试日志
                             // if (debug_this_frame) {
@@ -276,14 +272,14 @@ void app_main(void)
                         }
                     }
                 } else {
-                    /* Block compilation failed, use interpreter for this frame */
-                    // 临时注释 - 之前的调试日志
-                    // if (debug_this_frame) {
-                    //     RG_LOGW("JIT fallback to interpreter: PC=0x%08x", (unsigned int)pc);
-                    // }
-                    execute_arm(execute_cycles);
+                    /* Not compiled (yet), interpret a slice and look again */
+                    s32 budget = cycles_remaining < JIT_INTERP_SLICE_CYCLES ?
+                                 cycles_remaining : JIT_INTERP_SLICE_CYCLES;
+                    jit_state_store(jit_cpu, reg);
+                    s32 left = execute_arm_slice(budget);
+                    jit_state_load(jit_cpu, reg);
+                    cycles_remaining -= budget - left;
                     fallback_count++;
-                    break;
                 }
             }
         }
@@ -291,23 +287,18 @@ void app_main(void)
         if (!jit_executed) {
             execute_arm(execute_cycles);
         }
-        // RG_TIMER_LAP("execute_arm");
+        // Draining the sound buffer is part of the emulation, rg_audio_submit accounts for the audio phase
+        size_t frames_count = sound_read_samples((s16 *)mixbuffer, AUDIO_BUFFER_LENGTH);
+        rg_profile_end(RG_PROFILE_EMULATE, start_time);
 
         if (!skip_next_frame)
             rg_display_submit(currentUpdate, 0);
 
-        size_t frames_count = sound_read_samples((s16 *)mixbuffer, AUDIO_BUFFER_LENGTH);
-        // RG_TIMER_LAP("sound_read_samples");
-
         rg_system_tick(rg_system_timer() - start_time);
 
         rg_audio_submit(mixbuffer, frames_count);
-        // RG_TIMER_LAP("rg_audio_submit");
 
-        if (skip_next_frame == 0)
-            skip_next_frame = app->frameskip;
-        else if (skip_next_frame > 0)
-            skip_next_frame--;
+        skip_next_frame = !rg_system_render_next_frame(!skip_next_frame, false);
     }
 
     RG_PANIC("GBsP Ended");
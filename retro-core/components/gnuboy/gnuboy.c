@@ -52,6 +52,12 @@ void gnuboy_set_framebuffer(void *buffer)
 }
 
 
+void gnuboy_set_dirty_lines(uint32_t *bitmap)
+{
+	GB.video.dirty_lines = bitmap;
+}
+
+
 void gnuboy_set_soundbuffer(void *buffer, size_t length)
 {
 	GB.audio.buffer = buffer;
@@ -82,6 +88,9 @@ void gnuboy_run(bool draw)
 	GB.video.enabled = draw;
 	GB.audio.pos = 0;
 
+	if (draw)
+		gb_lcd_begin_frame();
+
 	int cycles = 0;
 
 	// LCD is powered down, it won't touch LY or do vblank
@@ -696,7 +705,7 @@ typedef struct
 } sblock_t;
 
 
-static int do_save_load(const char *file, bool save)
+static int do_save_load(FILE *fp, bool save)
 {
 	uint32_t sav_ver = SAVE_VERSION;
 	const svar_t svars[] =
@@ -781,13 +790,8 @@ static int do_save_load(const char *file, bool save)
 		{NULL, 0},
 	};
 
-	FILE *fp = NULL;
-
 	if (save)
 	{
-		if (!(fp = fopen(file, "wb")))
-			goto _error;
-
 		for (int i = 0; svars[i].ptr; i++)
 		{
 			uint32_t d = 0;
@@ -825,9 +829,6 @@ static int do_save_load(const char *file, bool save)
 	}
 	else
 	{
-		if (!(fp = fopen(file, "rb")))
-			goto _error;
-
 		for (int i = 0; blocks[i].ptr != NULL; i++)
 		{
 			if (fread(blocks[i].ptr, 4096, blocks[i].len, fp) < 1)
@@ -883,26 +884,46 @@ static int do_save_load(const char *file, bool save)
 		gb_hw_updatemap();
 	}
 
-	fclose(fp);
 	free(buf);
 
 	return 0;
 
 _error:
-	if (fp) fclose(fp);
 	if (buf) free(buf);
 
 	return -1;
 }
 
 
+int gnuboy_save_state_fp(FILE *fp)
+{
+	return do_save_load(fp, true);
+}
+
+
+int gnuboy_load_state_fp(FILE *fp)
+{
+	return do_save_load(fp, false);
+}
+
+
 int gnuboy_save_state(const char *file)
 {
-	return do_save_load(file, true);
+	FILE *fp = fopen(file, "wb");
+	if (!fp)
+		return -1;
+	int ret = do_save_load(fp, true);
+	fclose(fp);
+	return ret;
 }
 
 
 int gnuboy_load_state(const char *file)
 {
-	return do_save_load(file, false);
+	FILE *fp = fopen(file, "rb");
+	if (!fp)
+		return -1;
+	int ret = do_save_load(fp, false);
+	fclose(fp);
+	return ret;
 }
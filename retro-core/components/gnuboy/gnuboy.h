@@ -109,6 +109,7 @@ void gnuboy_load_bank(int);
 void gnuboy_set_pad(int);
 
 void gnuboy_set_framebuffer(void *buffer);
+void gnuboy_set_dirty_lines(uint32_t *bitmap);
 void gnuboy_set_soundbuffer(void *buffer, size_t length);
 
 void gnuboy_get_time(int *day, int *hour, int *minute, int *second);
@@ -122,3 +123,5 @@ int gnuboy_load_sram(const char *file);
 int gnuboy_save_sram(const char *file, bool quick_save);
 int gnuboy_load_state(const char *file);
 int gnuboy_save_state(const char *file);
+int gnuboy_load_state_fp(FILE *fp);
+int gnuboy_save_state_fp(FILE *fp);
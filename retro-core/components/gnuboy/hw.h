@@ -242,6 +242,7 @@ typedef struct
 			void *buffer;
 		};
 		uint16_t palette[64];
+		uint32_t *dirty_lines; // [GB_HEIGHT / 32 + 1] Optional, lines that changed since the last drawn frame
 	} video;
 
 	struct {
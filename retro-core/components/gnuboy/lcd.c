@@ -27,6 +27,11 @@ static byte BUF[0x100];
 static int WX, WY;
 static bool pal_dirty;
 
+// Checksums of the lines of the frame being drawn and of the last drawn one, used to fill dirty_lines.
+// 0 marks a line that wasn't drawn.
+static uint32_t line_checksums[2][GB_HEIGHT];
+static int line_frame;
+
 
 /**
  * Drawing routines
@@ -461,6 +466,25 @@ void gb_lcd_pal_dirty(void)
 }
 
 
+void gb_lcd_begin_frame(void)
+{
+	// Lines that won't be drawn (LCD off) keep whatever the buffer held, they must show as changed
+	line_frame ^= 1;
+	memset(line_checksums[line_frame], 0, sizeof(line_checksums[0]));
+	if (host.video.dirty_lines)
+		memset(host.video.dirty_lines, 0xFF, (GB_HEIGHT + 31) / 32 * 4);
+}
+
+
+// Report every line as changed, for when the output changes without lcd_renderline noticing
+void gb_lcd_invalidate_lines(void)
+{
+	memset(line_checksums, 0, sizeof(line_checksums));
+	if (host.video.dirty_lines)
+		memset(host.video.dirty_lines, 0xFF, (GB_HEIGHT + 31) / 32 * 4);
+}
+
+
 void gb_lcd_reset(bool hard)
 {
 	if (hard)
@@ -595,10 +619,36 @@ static inline void sync_palette(void)
 			host.video.palette[i] = out;
 	}
 
+	// Paletted frames are converted by the host, every line already drawn changes color too
+	if (host.video.format == GB_PIXEL_PALETTED)
+		gb_lcd_invalidate_lines();
+
 	pal_dirty = false;
 }
 
 
+static inline void update_dirty(int SL, const void *line, size_t size)
+{
+	uint32_t *dirty_lines = host.video.dirty_lines;
+	const uint32_t *data = line;
+	uint32_t checksum = 0x811C9DC5;
+
+	if (!dirty_lines)
+		return;
+
+	for (size_t i = 0; i < size / 4; ++i)
+		checksum = (checksum ^ data[i]) * 0x01000193;
+	checksum |= 1;
+
+	if (checksum != line_checksums[line_frame ^ 1][SL])
+		dirty_lines[SL >> 5] |= (1u << (SL & 31));
+	else
+		dirty_lines[SL >> 5] &= ~(1u << (SL & 31));
+
+	line_checksums[line_frame][SL] = checksum;
+}
+
+
 /*
 	LCD controller operates with 154 lines per frame, of which lines
 	#0..#143 are visible and lines #144..#153 are processed in vblank
@@ -693,6 +743,7 @@ static inline void lcd_renderline()
 	if (host.video.format == GB_PIXEL_PALETTED)
 	{
 		memcpy(host.video.buffer8 + SL * 160 , BUF, 160);
+		update_dirty(SL, host.video.buffer8 + SL * 160, 160);
 	}
 	else
 	{
@@ -701,6 +752,7 @@ static inline void lcd_renderline()
 
 		for (int i = 0; i < 160; ++i)
 			dst[i] = pal[BUF[i]];
+		update_dirty(SL, dst, 320);
 	}
 }
 
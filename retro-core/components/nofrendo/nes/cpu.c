@@ -1054,7 +1054,6 @@ static nes6502_t cpu;
 #endif
 
 #define readword(a) mem_getword(a)
-#define readbyte(a) mem_getbyte(a)
 
 /*
 ** Middle man for faster albeit unsafe/inaccurate/unchecked memory access.
@@ -1065,10 +1064,14 @@ static nes6502_t cpu;
 
 #define fast_readbyte(a) ({uint16 _a = (a); cpu.pages[_a >> MEM_PAGESHIFT][_a];})
 #define fast_readword(a) ({uint16 _a = (a); ((_a & MEM_PAGEMASK) != MEM_PAGEMASK) ? PAGE_READWORD(cpu.pages[_a >> MEM_PAGESHIFT], _a) : mem_getword(_a);})
-#define writebyte(a, v)  {uint16 _a = (a), _v = (v); if (_a < 0x2000) cpu.pages[0][_a & 0x7FF] = _v; else mem_putbyte(_a, _v);}
+#define readbyte(a)      ({uint16 _a = (a); cpu.read_funcs[_a >> MEM_IOPAGESHIFT] ? cpu.read_funcs[_a >> MEM_IOPAGESHIFT](_a) : cpu.pages[_a >> MEM_PAGESHIFT][_a];})
+#define writebyte(a, v)  {uint16 _a = (a), _v = (v); if (_a < 0x2000) cpu.pages[0][_a & 0x7FF] = _v; \
+                          else if (cpu.write_funcs[_a >> MEM_IOPAGESHIFT]) cpu.write_funcs[_a >> MEM_IOPAGESHIFT](_a, _v); \
+                          else cpu.pages[_a >> MEM_PAGESHIFT][_a] = _v;}
 
 #else /* !NES6502_FASTMEM */
 
+#define readbyte(a) mem_getbyte(a)
 #define fast_readbyte(a) mem_getbyte(a)
 #define fast_readword(a) mem_getword(a)
 #define writebyte(a, v) mem_putbyte(a, v)
@@ -1534,10 +1537,12 @@ void nes6502_reset(void)
 }
 
 /* Create a nes6502 object */
-nes6502_t *nes6502_init(uint8 **memmap)
+nes6502_t *nes6502_init(uint8 **memmap, uint8 (**read_funcs)(uint32), void (**write_funcs)(uint32, uint8))
 {
    memset(&cpu, 0, sizeof(nes6502_t));
    cpu.pages = memmap;
+   cpu.read_funcs = read_funcs;
+   cpu.write_funcs = write_funcs;
 
    return &cpu;
 }
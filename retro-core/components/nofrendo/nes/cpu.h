@@ -58,6 +58,8 @@ typedef struct
 
    uint8 *zp, *stack;
    uint8 **pages;
+   uint8 (**read_funcs)(uint32 address);
+   void (**write_funcs)(uint32 address, uint8 value);
 
    bool int_pending;
    bool jammed;
@@ -74,7 +76,7 @@ void nes6502_irq_clear(void);
 uint32 nes6502_getcycles(void);
 void nes6502_burn(int cycles);
 
-nes6502_t *nes6502_init(uint8 **memmap);
+nes6502_t *nes6502_init(uint8 **memmap, uint8 (**read_funcs)(uint32), void (**write_funcs)(uint32, uint8));
 void nes6502_reset(void);
 void nes6502_shutdown(void);
 
@@ -33,6 +33,37 @@ static void dummy_write(uint32 address, uint8 value)
    UNUSED(value);
 }
 
+/* Unmapped pages read from the dummy page (all 0xFF), writes must never reach it */
+static void unmapped_write(uint32 address, uint8 value)
+{
+   MESSAGE_DEBUG("Write to unmapped region: $%2X to $%4X\n", value, address);
+}
+
+/* Pages shared by several handlers fall back to searching the lists, first match wins */
+static uint8 shared_read(uint32 address)
+{
+   for (mem_read_handler_t *mr = mem.read_handlers; mr->handler != NULL; mr++)
+   {
+      if (address >= mr->min_range && address <= mr->max_range)
+         return mr->handler(address);
+   }
+   return mem.pages[address >> MEM_PAGESHIFT][address];
+}
+
+static void shared_write(uint32 address, uint8 value)
+{
+   for (mem_write_handler_t *mw = mem.write_handlers; mw->handler != NULL; mw++)
+   {
+      if (address >= mw->min_range && address <= mw->max_range)
+      {
+         mw->handler(address, value);
+         return;
+      }
+   }
+   if (mem.flags[address >> MEM_PAGESHIFT] & MEM_PAGE_HAS_MEMORY)
+      mem.pages[address >> MEM_PAGESHIFT][address] = value;
+}
+
 /* read/write handlers for standard NES */
 static const mem_read_handler_t read_handlers[] =
 {
@@ -71,6 +102,14 @@ void mem_setpage(uint32 page, uint8 *ptr)
       mem.pages[page] = ptr - (page * MEM_PAGESIZE);
       mem.flags[page] |= MEM_PAGE_HAS_MEMORY;
    }
+
+   for (int i = page << (MEM_PAGESHIFT - MEM_IOPAGESHIFT); i < (page + 1) << (MEM_PAGESHIFT - MEM_IOPAGESHIFT); i++)
+   {
+      if (mem.io_write_funcs[i])
+         mem.write_funcs[i] = mem.io_write_funcs[i];
+      else
+         mem.write_funcs[i] = (ptr == MEM_PAGE_NOT_MAPPED) ? unmapped_write : NULL;
+   }
 }
 
 /* Get 2KB memory page */
@@ -93,50 +132,23 @@ uint8 *mem_getpage(uint32 page)
 /* read a byte of 6502 memory space */
 uint8 mem_getbyte(uint32 address)
 {
-   uint32 flags = mem.flags[address >> MEM_PAGESHIFT];
-
-   if (flags & MEM_PAGE_HAS_READ_HANDLER)
-   {
-      for (mem_read_handler_t *mr = mem.read_handlers; mr->handler != NULL; mr++)
-      {
-         if (address >= mr->min_range && address <= mr->max_range)
-            return mr->handler(address);
-      }
-   }
+   mem_read_func_t handler = mem.read_funcs[address >> MEM_IOPAGESHIFT];
 
-   if (flags & MEM_PAGE_HAS_MEMORY)
-   {
-      return mem.pages[address >> MEM_PAGESHIFT][address];
-   }
+   if (handler)
+      return handler(address);
 
-   MESSAGE_DEBUG("Read unmapped region: $%4X\n", address);
-   return 0xFF;
+   return mem.pages[address >> MEM_PAGESHIFT][address];
 }
 
 /* write a byte of data to 6502 memory space */
 void mem_putbyte(uint32 address, uint8 value)
 {
-   uint32 flags = mem.flags[address >> MEM_PAGESHIFT];
+   mem_write_func_t handler = mem.write_funcs[address >> MEM_IOPAGESHIFT];
 
-   if (flags & MEM_PAGE_HAS_WRITE_HANDLER)
-   {
-      for (mem_write_handler_t *mw = mem.write_handlers; mw->handler != NULL; mw++)
-      {
-         if (address >= mw->min_range && address <= mw->max_range)
-         {
-            mw->handler(address, value);
-            return;
-         }
-      }
-   }
-
-   if (flags & MEM_PAGE_HAS_MEMORY)
-   {
+   if (handler)
+      handler(address, value);
+   else
       mem.pages[address >> MEM_PAGESHIFT][address] = value;
-      return;
-   }
-
-   MESSAGE_DEBUG("Write to unmapped region: $%2X to $%4X\n", address, value);
 }
 
 uint32 mem_getword(uint32 address)
@@ -180,29 +192,57 @@ void mem_reset(void)
    mem_r->handler = NULL;
    mem_w->handler = NULL;
 
-   // Mark pages if they contain handlers (used for fast access in nes6502)
-   for (mem_read_handler_t *mr = mem.read_handlers; mr < mem_r; mr++)
-   {
-      for (int i = mr->min_range; i < mr->max_range; i++)
-         mem.flags[i >> MEM_PAGESHIFT] |= MEM_PAGE_HAS_READ_HANDLER;
-   }
-   for (mem_write_handler_t *mw = mem.write_handlers; mw < mem_w; mw++)
+   mem_rebuild(0, MEM_ADDRSPACE - 1);
+}
+
+/* Rebuild the dispatch of the I/O pages covering min_range..max_range. Mappers
+   that change their entries in mem.read_handlers/write_handlers must call it */
+void mem_rebuild(uint32 min_range, uint32 max_range)
+{
+   for (uint32 page = min_range >> MEM_IOPAGESHIFT; page <= (max_range >> MEM_IOPAGESHIFT) && page < MEM_IOPAGECOUNT; page++)
    {
-      for (int i = mw->min_range; i < mw->max_range; i++)
-         mem.flags[i >> MEM_PAGESHIFT] |= MEM_PAGE_HAS_WRITE_HANDLER;
+      uint32 first = page << MEM_IOPAGESHIFT;
+      uint32 last = first + MEM_IOPAGESIZE - 1;
+      mem_read_func_t read_func = NULL;
+      mem_write_func_t write_func = NULL;
+
+      // The first handler touching the page decides: it either covers all of it or we must search
+      for (mem_read_handler_t *mr = mem.read_handlers; mr->handler != NULL; mr++)
+      {
+         if (mr->min_range <= last && mr->max_range >= first)
+         {
+            read_func = (mr->min_range <= first && mr->max_range >= last) ? mr->handler : shared_read;
+            break;
+         }
+      }
+      for (mem_write_handler_t *mw = mem.write_handlers; mw->handler != NULL; mw++)
+      {
+         if (mw->min_range <= last && mw->max_range >= first)
+         {
+            write_func = (mw->min_range <= first && mw->max_range >= last) ? mw->handler : shared_write;
+            break;
+         }
+      }
+
+      mem.read_funcs[page] = read_func;
+      mem.io_write_funcs[page] = write_func;
+      if (write_func)
+         mem.write_funcs[page] = write_func;
+      else if (mem.flags[first >> MEM_PAGESHIFT] & MEM_PAGE_HAS_MEMORY)
+         mem.write_funcs[page] = NULL;
+      else
+         mem.write_funcs[page] = unmapped_write;
    }
 }
 
 mem_t *mem_init_(void)
 {
-   // Don't care if the alloc fails, dummy is just a safety net
-   mem.dummy = malloc(MEM_PAGESIZE);
+   // Unmapped pages read from it unconditionally, it can't be allowed to fail
+   memset(mem.dummy, 0xFF, MEM_PAGESIZE);
    mem_reset();
    return &mem;
 }
 
 void mem_shutdown(void)
 {
-   free(mem.dummy);
-   mem.dummy = NULL;
 }
@@ -29,10 +29,13 @@
 #define MEM_PAGESHIFT (11)
 #define MEM_PAGECOUNT (MEM_ADDRSPACE / MEM_PAGESIZE)
 
+/* Handlers are dispatched with a finer granularity than memory pages */
+#define MEM_IOPAGESIZE  0x100
+#define MEM_IOPAGESHIFT (8)
+#define MEM_IOPAGECOUNT (MEM_ADDRSPACE / MEM_IOPAGESIZE)
+
 #define MEM_RAMSIZE   0x800
 
-#define MEM_PAGE_HAS_READ_HANDLER   (1 << 0)
-#define MEM_PAGE_HAS_WRITE_HANDLER  (1 << 2)
 #define MEM_PAGE_HAS_MEMORY         (1 << 3)
 
 #define MEM_PAGE_NOT_MAPPED         NULL
@@ -41,16 +44,19 @@
 
 #define LAST_MEMORY_HANDLER  { -1, -1, NULL }
 
+typedef uint8 (*mem_read_func_t)(uint32 address);
+typedef void (*mem_write_func_t)(uint32 address, uint8 value);
+
 typedef struct
 {
    uint32 min_range, max_range;
-   uint8 (*handler)(uint32 address);
+   mem_read_func_t handler;
 } mem_read_handler_t;
 
 typedef struct
 {
    uint32 min_range, max_range;
-   void (*handler)(uint32 address, uint8 value);
+   mem_write_func_t handler;
 } mem_write_handler_t;
 
 typedef struct
@@ -66,13 +72,20 @@ typedef struct
    mem_read_handler_t read_handlers[MEM_HANDLERS_MAX];
    mem_write_handler_t write_handlers[MEM_HANDLERS_MAX];
 
+   /* Handler of each I/O page, NULL for plain memory. A page shared by several
+      handlers gets one that searches the lists above. See mem_rebuild() */
+   mem_read_func_t read_funcs[MEM_IOPAGECOUNT];
+   mem_write_func_t write_funcs[MEM_IOPAGECOUNT];
+   mem_write_func_t io_write_funcs[MEM_IOPAGECOUNT]; // write_funcs before unmapped pages
+
    /* Dummy memory to trap access to unmapped regions */
-   uint8 *dummy; // [MEM_PAGESIZE]
+   uint8 dummy[MEM_PAGESIZE];
 } mem_t;
 
 mem_t *mem_init_(void);
 void mem_shutdown(void);
 void mem_reset(void);
+void mem_rebuild(uint32 min_range, uint32 max_range);
 void mem_setpage(uint32 page, uint8 *ptr);
 uint8 *mem_getpage(uint32 page);
 uint8 mem_getbyte(uint32 address);
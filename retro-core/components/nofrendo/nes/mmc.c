@@ -142,6 +142,9 @@ void mmc_reset(void)
    /* The mapper's init will undo all we've just done, oh well :) */
    if (mapper.init)
       mapper.init(cart);
+
+   /* Some mappers fill CHR-RAM directly */
+   ppu_invalidatechr();
 }
 
 void mmc_shutdown()
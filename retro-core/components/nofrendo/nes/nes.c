@@ -235,7 +235,7 @@ nes_t *nes_init(nes_type_t system, int sample_rate, bool stereo, const char *fds
         goto _fail;
 
     /* cpu */
-    nes.cpu = nes6502_init(nes.mem->pages);
+    nes.cpu = nes6502_init(nes.mem->pages, nes.mem->read_funcs, nes.mem->write_funcs);
     if (NULL == nes.cpu)
         goto _fail;
 
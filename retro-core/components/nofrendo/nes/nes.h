@@ -88,6 +88,7 @@ typedef struct nes_s
 
     /* Video buffer */
     uint8 *vidbuf; // [NES_SCREEN_PITCH * NES_SCREEN_HEIGHT]
+    uint32 *dirty_lines; // [NES_SCREEN_HEIGHT / 32] Optional, lines that changed since the last drawn frame
 
     /* Misc */
     nes_type_t system;
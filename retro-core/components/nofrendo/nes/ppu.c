@@ -22,6 +22,7 @@
 */
 
 #include "nes.h"
+#include <stddef.h>
 
 /* PPU access */
 #define PPU_MEM_READ(x)      (ppu.page[(x) >> PPU_PAGESHIFT][(x)])
@@ -42,6 +43,19 @@
 
 #define INLINE static inline __attribute__((__always_inline__))
 
+/* Number of predecoded 1KB CHR banks kept around: the cart's CHR size, at least the 8 mapped ones */
+#define CHR_CACHE_MIN_BANKS  8
+#define CHR_CACHE_MAX_BANKS  32
+
+typedef struct
+{
+   const uint8 *source;    /* CHR bank this entry was decoded from */
+   uint32 valid[2];        /* one bit per tile */
+   uint32 last_used;
+   int refs;               /* number of pattern pages bound to this entry */
+   uint16 rows[2][64][8];  /* [hflip][tile][line], 2 bits per pixel, leftmost pixel in the top bits */
+} chr_bank_t;
+
 static const uint8 mirroring_maps[][4] = {
    [PPU_MIRROR_SCR0] = {0, 0, 0, 0},
    [PPU_MIRROR_SCR1] = {1, 1, 1, 1},
@@ -53,6 +67,18 @@ static const uint8 mirroring_maps[][4] = {
 /* the NES PPU */
 static ppu_t ppu;
 
+/* checksums of the lines of the last drawn frame, used to fill nes->dirty_lines */
+static uint32 line_checksums[NES_SCREEN_HEIGHT];
+
+/* predecoded pattern tables, chr_pages maps PPU pages 0-7 into chr_banks */
+static chr_bank_t *chr_banks[CHR_CACHE_MAX_BANKS];
+static chr_bank_t *chr_pages[8];
+static uint32 chr_clock;
+static int chr_cache_banks;
+
+/* 2 bit pixels of a pattern byte in row order, leftmost pixel in the top bits, and in reverse */
+static uint16 chr_spread[2][256];
+
 
 #ifndef PPU_MEM_READ
 INLINE uint8 PPU_MEM_READ(uint32 x)
@@ -74,6 +100,57 @@ void ppu_getcontext(ppu_t *dest)
    MESSAGE_ERROR("%s: Not implemented!\n", __func__);
 }
 
+/* Bind a pattern page to the cache entry of its CHR bank, recycling the least recently used free entry */
+static void ppu_bindchr(uint32 page, const uint8 *location)
+{
+   chr_bank_t *entry = NULL;
+
+   if (!chr_banks[0] || (chr_pages[page] && chr_pages[page]->source == location))
+      return;
+
+   if (chr_pages[page])
+      chr_pages[page]->refs--;
+
+   for (int i = 0; i < chr_cache_banks; i++)
+   {
+      if (chr_banks[i]->source == location)
+      {
+         entry = chr_banks[i];
+         break;
+      }
+      if (chr_banks[i]->refs == 0 && (!entry || chr_banks[i]->last_used < entry->last_used))
+         entry = chr_banks[i];
+   }
+
+   if (entry->source != location)
+   {
+      entry->source = location;
+      entry->valid[0] = entry->valid[1] = 0;
+   }
+
+   entry->last_used = ++chr_clock;
+   entry->refs++;
+   chr_pages[page] = entry;
+}
+
+/* Must be called when CHR memory is modified other than through the PPU */
+void ppu_invalidatechr(void)
+{
+   for (int i = 0; i < chr_cache_banks; i++)
+      chr_banks[i]->valid[0] = chr_banks[i]->valid[1] = 0;
+}
+
+INLINE void ppu_vwrite(uint32 address, uint8 value)
+{
+   PPU_MEM_WRITE(address, value);
+
+   if (address < 0x2000 && chr_pages[address >> PPU_PAGESHIFT])
+   {
+      uint32 tile = (address >> 4) & 63;
+      chr_pages[address >> PPU_PAGESHIFT]->valid[tile >> 5] &= ~(1 << (tile & 31));
+   }
+}
+
 void ppu_setpage(uint32 page, uint8 *location)
 {
    if (page >= PPU_PAGECOUNT || location == NULL)
@@ -83,6 +160,9 @@ void ppu_setpage(uint32 page, uint8 *location)
    }
    ppu.page[page] = location - (page << PPU_PAGESHIFT);
 
+   if (page < 8)
+      ppu_bindchr(page, location);
+
    /* Setup mirror if required (8-11 <=> 12-15) */
    if (page >= 12)
       ppu.page[page - 4] = location - ((page - 4) << PPU_PAGESHIFT);
@@ -295,7 +375,7 @@ void ppu_write(uint32 address, uint8 value)
          {
             MESSAGE_DEBUG("VRAM write to $%04X, scanline %d\n",
                            ppu.vaddr, nes_getptr()->scanline);
-            PPU_MEM_WRITE(ppu.vaddr, 0xFF); /* corrupt */
+            ppu_vwrite(ppu.vaddr, 0xFF); /* corrupt */
          }
          else
          {
@@ -304,7 +384,7 @@ void ppu_write(uint32 address, uint8 value)
             if (false == ppu.vram_present && addr >= 0x3000)
                ppu.vaddr -= 0x1000;
 
-            PPU_MEM_WRITE(addr, value);
+            ppu_vwrite(addr, value);
          }
       }
       else
@@ -357,46 +437,49 @@ void ppu_setvreadfunc(ppu_vreadfunc_t func)
 }
 
 /* rendering routines */
-INLINE uint32 get_patpix(uint32 tile_addr)
+static void decode_tile(chr_bank_t *bank, uint32 tile)
 {
-   uint32 pat1 = PPU_MEM_READ(tile_addr);
-   uint32 pat2 = PPU_MEM_READ(tile_addr + 8);
-   return ((pat2 & 0xAA) << 8) | ((pat2 & 0x55) << 1)
-        | ((pat1 & 0xAA) << 7) | ((pat1 & 0x55) << 0);
-}
+   const uint8 *data = bank->source + (tile << 4);
 
-INLINE void build_tile_colors(bool flip, uint32 pattern, uint8 *colors)
-{
-   /* swap pixels around if our tile is flipped */
-   if (flip)
+   for (int line = 0; line < 8; line++)
    {
-      colors[7] = (pattern >> 14) & 3;
-      colors[6] = (pattern >> 6) & 3;
-      colors[5] = (pattern >> 12) & 3;
-      colors[4] = (pattern >> 4) & 3;
-      colors[3] = (pattern >> 10) & 3;
-      colors[2] = (pattern >> 2) & 3;
-      colors[1] = (pattern >> 8) & 3;
-      colors[0] = pattern & 3;
-   }
-   else
-   {
-      colors[0] = (pattern >> 14) & 3;
-      colors[1] = (pattern >> 6) & 3;
-      colors[2] = (pattern >> 12) & 3;
-      colors[3] = (pattern >> 4) & 3;
-      colors[4] = (pattern >> 10) & 3;
-      colors[5] = (pattern >> 2) & 3;
-      colors[6] = (pattern >> 8) & 3;
-      colors[7] = pattern & 3;
+      uint32 pat1 = data[line], pat2 = data[line + 8];
+      bank->rows[0][tile][line] = chr_spread[0][pat1] | (chr_spread[0][pat2] << 1);
+      bank->rows[1][tile][line] = chr_spread[1][pat1] | (chr_spread[1][pat2] << 1);
    }
+
+   bank->valid[tile >> 5] |= 1 << (tile & 31);
+}
+
+/* Get one line of a tile, tile_addr being the address of its first bitplane byte */
+INLINE uint32 get_tileline(uint32 tile_addr, bool flip)
+{
+   chr_bank_t *bank = chr_pages[(tile_addr >> PPU_PAGESHIFT) & 7];
+   uint32 tile = (tile_addr >> 4) & 63;
+
+   if (!(bank->valid[tile >> 5] & (1 << (tile & 31))))
+      decode_tile(bank, tile);
+
+   return bank->rows[flip][tile][tile_addr & 7];
+}
+
+INLINE void build_tile_colors(uint32 pattern, uint8 *colors)
+{
+   colors[0] = (pattern >> 14) & 3;
+   colors[1] = (pattern >> 12) & 3;
+   colors[2] = (pattern >> 10) & 3;
+   colors[3] = (pattern >> 8) & 3;
+   colors[4] = (pattern >> 6) & 3;
+   colors[5] = (pattern >> 4) & 3;
+   colors[6] = (pattern >> 2) & 3;
+   colors[7] = pattern & 3;
 }
 
 /* we render a scanline of graphics first so we know exactly
 ** where the sprite 0 strike is going to occur (in terms of
 ** cpu cycles), using the relation that 3 pixels == 1 cpu cycle
 */
-INLINE void check_strike(uint8 *surface, uint8 attrib, uint32 pattern)
+INLINE void check_strike(uint8 *surface, uint32 pattern)
 {
    uint8 colors[8];
 
@@ -408,7 +491,7 @@ INLINE void check_strike(uint8 *surface, uint8 attrib, uint32 pattern)
    if (0 == pattern)
       return;
 
-   build_tile_colors(attrib & OAMF_HFLIP, pattern, colors);
+   build_tile_colors(pattern, colors);
 
    for (int i = 0; i < 8; i++)
    {
@@ -425,12 +508,12 @@ INLINE void check_strike(uint8 *surface, uint8 attrib, uint32 pattern)
 INLINE void draw_bgtile(uint8 *surface, uint32 pattern, const uint8 *colors)
 {
    *surface++ = colors[(pattern >> 14) & 3];
-   *surface++ = colors[(pattern >> 6) & 3];
    *surface++ = colors[(pattern >> 12) & 3];
-   *surface++ = colors[(pattern >> 4) & 3];
    *surface++ = colors[(pattern >> 10) & 3];
-   *surface++ = colors[(pattern >> 2) & 3];
    *surface++ = colors[(pattern >> 8) & 3];
+   *surface++ = colors[(pattern >> 6) & 3];
+   *surface++ = colors[(pattern >> 4) & 3];
+   *surface++ = colors[(pattern >> 2) & 3];
    *surface   = colors[pattern & 3];
 }
 
@@ -442,7 +525,7 @@ INLINE void draw_oamtile(uint8 *surface, uint8 attrib, uint32 pattern, const uin
    if (0 == pattern)
       return;
 
-   build_tile_colors(attrib & OAMF_HFLIP, pattern, colors);
+   build_tile_colors(pattern, colors);
 
    /* draw the character */
    if (attrib & OAMF_BEHIND)
@@ -499,7 +582,7 @@ INLINE void ppu_renderbg(uint8 *vidbuf)
          ppu.latchfunc(ppu.bg_base, tile_index);
 
       /* Fetch tile and draw it */
-      draw_bgtile(bmp_ptr, get_patpix(bg_offset + (tile_index << 4)), ppu.palette + col_high);
+      draw_bgtile(bmp_ptr, get_tileline(bg_offset + (tile_index << 4), false), ppu.palette + col_high);
       bmp_ptr += 8;
 
       x_tile++;
@@ -594,7 +677,7 @@ INLINE void ppu_renderoam(uint8 *vidbuf, int scanline, bool draw)
       /* Check for a strike on sprite 0 if strike flag isn't set */
       if (sprite_num == 0 && !ppu.strikeflag)
       {
-         check_strike(draw ? vidbuf + sprite->x_loc : NULL, sprite->attr, get_patpix(tile_addr));
+         check_strike(draw ? vidbuf + sprite->x_loc : NULL, get_tileline(tile_addr, sprite->attr & OAMF_HFLIP));
       }
 
       /* If we don't draw to buffer then we're done after sprite 0 */
@@ -605,7 +688,7 @@ INLINE void ppu_renderoam(uint8 *vidbuf, int scanline, bool draw)
       draw_oamtile(
          vidbuf + sprite->x_loc,
          sprite->attr,
-         get_patpix(tile_addr),
+         get_tileline(tile_addr, sprite->attr & OAMF_HFLIP),
          ppu.palette + 16 + ((sprite->attr & 3) << 2));
 
       /* maximum of 8 sprites per scanline */
@@ -655,6 +738,32 @@ void ppu_endline(void)
    }
 }
 
+INLINE void ppu_updatedirty(const uint8 *vidbuf, int scanline)
+{
+   uint32 *dirty_lines = nes_getptr()->dirty_lines;
+   const uint32 *data = (const uint32 *)vidbuf;
+   uint32 checksum = 0x811C9DC5;
+
+   if (!dirty_lines)
+      return;
+
+   for (int i = 0; i < NES_SCREEN_WIDTH / 4; i++)
+      checksum = (checksum ^ data[i]) * 0x01000193;
+
+   if (checksum != line_checksums[scanline])
+      dirty_lines[scanline >> 5] |= (1 << (scanline & 31));
+   else
+      dirty_lines[scanline >> 5] &= ~(1 << (scanline & 31));
+
+   line_checksums[scanline] = checksum;
+}
+
+/* Report every line of the next drawn frame as changed, for when the output changes without the PPU knowing */
+void ppu_invalidatelines(void)
+{
+   memset(line_checksums, 0, sizeof(line_checksums));
+}
+
 void ppu_renderline(uint8 *bmp, int scanline, bool draw_flag)
 {
    ppu.scanline = scanline;
@@ -681,6 +790,9 @@ void ppu_renderline(uint8 *bmp, int scanline, bool draw_flag)
 
       /* TODO: fetch obj data 1 scanline before */
       ppu_renderoam(vidbuf, scanline, draw_flag && OPT(PPU_DRAW_SPRITES));
+
+      if (draw_flag)
+         ppu_updatedirty(vidbuf, scanline);
    }
    // Vertical Blank
    else if (scanline == 241)
@@ -714,6 +826,33 @@ void ppu_reset(void)
    ppu.latch = 0;
    ppu.vram_accessible = true;
    ppu.scanlines = nes_getptr()->scanlines_per_frame;
+
+   /* Room for every CHR bank of the cart, up to a point: a cart that switches between more banks than
+   ** the cache holds would keep decoding the same tiles over and over. Failing to grow isn't fatal. */
+   rom_t *cart = nes_getptr()->cart;
+   int banks = cart ? (cart->chr_rom_banks ? cart->chr_rom_banks : cart->chr_ram_banks) * 8 : 0;
+   banks = MIN(MAX(banks, CHR_CACHE_MIN_BANKS), CHR_CACHE_MAX_BANKS);
+
+   for (; chr_cache_banks > banks; chr_cache_banks--)
+   {
+      free(chr_banks[chr_cache_banks - 1]);
+      chr_banks[chr_cache_banks - 1] = NULL;
+   }
+   for (; chr_cache_banks < banks; chr_cache_banks++)
+   {
+      if (!(chr_banks[chr_cache_banks] = calloc(1, sizeof(chr_bank_t))))
+         break;
+   }
+
+   /* Start from scratch, rebinding the pages that are already mapped */
+   for (int i = 0; i < chr_cache_banks; i++)
+      memset(chr_banks[i], 0, offsetof(chr_bank_t, rows));
+   memset(chr_pages, 0, sizeof(chr_pages));
+   for (int page = 0; page < 8; page++)
+   {
+      if (ppu.page[page])
+         ppu_bindchr(page, ppu.page[page] + (page << PPU_PAGESHIFT));
+   }
 }
 
 ppu_t *ppu_init(void)
@@ -724,6 +863,26 @@ ppu_t *ppu_init(void)
    if (!ppu.nametab)
       return NULL;
 
+   /* Separate allocations so that they stay in internal RAM where available, ppu_reset adds more
+   ** once the cart is known */
+   for (chr_cache_banks = 0; chr_cache_banks < CHR_CACHE_MIN_BANKS; chr_cache_banks++)
+   {
+      chr_banks[chr_cache_banks] = calloc(1, sizeof(chr_bank_t));
+      if (!chr_banks[chr_cache_banks])
+         return NULL;
+   }
+   memset(chr_pages, 0, sizeof(chr_pages));
+
+   for (int value = 0; value < 256; value++)
+   {
+      chr_spread[0][value] = chr_spread[1][value] = 0;
+      for (int x = 0; x < 8; x++)
+      {
+         chr_spread[0][value] |= ((value >> (7 - x)) & 1) << (14 - x * 2);
+         chr_spread[1][value] |= ((value >> (7 - x)) & 1) << (x * 2);
+      }
+   }
+
    ppu_setopt(PPU_DRAW_BACKGROUND, true);
    ppu_setopt(PPU_DRAW_SPRITES, true);
    ppu_setopt(PPU_LIMIT_SPRITES, true);
@@ -735,6 +894,13 @@ void ppu_shutdown(void)
 {
    free(ppu.nametab);
    ppu.nametab = NULL;
+   for (int i = 0; i < chr_cache_banks; i++)
+   {
+      free(chr_banks[i]);
+      chr_banks[i] = NULL;
+   }
+   chr_cache_banks = 0;
+   memset(chr_pages, 0, sizeof(chr_pages));
 }
 
 
@@ -812,7 +978,7 @@ static void draw_sprite(uint8 *bmp, int x, int y, uint8 tile_num, uint8 attrib)
       if (line == 8)
          tile_addr += 8;
 
-      draw_bgtile(vid, get_patpix(tile_addr), ppu.palette + 16 + col_high);
+      draw_bgtile(vid, get_tileline(tile_addr, false), ppu.palette + 16 + col_high);
       //draw_oamtile(vid, attrib, data_ptr[0], data_ptr[8], ppu.palette + 16 + col_high);
 
       tile_addr++;
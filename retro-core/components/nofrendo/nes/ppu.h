@@ -161,6 +161,7 @@ void ppu_setnametable(uint8 index, uint8 table);
 void ppu_setmirroring(ppu_mirror_t type);
 uint8 *ppu_getpage(uint32 page_num);
 uint8 *ppu_getnametable(uint8 table);
+void ppu_invalidatechr(void);
 
 /* Control */
 ppu_t *ppu_init(void);
@@ -183,6 +184,7 @@ void ppu_write(uint32 address, uint8 value);
 /* Rendering */
 void ppu_renderline(uint8 *bmp, int scanline, bool draw_flag);
 void ppu_endline(void);
+void ppu_invalidatelines(void);
 
 /* Debugging */
 void ppu_dumppattern(uint8 *bmp, int table_num, int x_loc, int y_loc, int col);
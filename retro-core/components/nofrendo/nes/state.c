@@ -116,27 +116,18 @@ static bool memory_zone_dirty(const void *ptr, size_t size)
 }
 
 
-int state_save(const char* fn)
+int state_save_fp(FILE *file)
 {
    uint32 numberOfBlocks = 0;
    uint8 buffer[600];
    nes_t *machine = nes_getptr();
-   FILE *file;
-
-   if (!(file = fopen(fn, "wb")))
-   {
-       MESSAGE_ERROR("state_save: file '%s' could not be opened.\n", fn);
-       return -1; //goto _error;
-   }
-
-   MESSAGE_INFO("state_save: file '%s' opened.\n", fn);
 
    _fwrite("SNSS\x00\x00\x00\x05", 8);
 
 
    /****************************************************/
 
-   MESSAGE_INFO("  - Saving base block\n");
+   MESSAGE_DEBUG("Saving base block\n");
 
    buffer[0] = machine->cpu->a_reg;
    buffer[1] = machine->cpu->x_reg;
@@ -173,7 +164,7 @@ int state_save(const char* fn)
 
    /****************************************************/
 
-   MESSAGE_INFO("  - Saving info block\n");
+   MESSAGE_DEBUG("Saving info block\n");
 
    _fwrite("INFO\x00\x00\x00\x01\x00\x00\x01\x00", 12);
    _fwrite(&buffer, 0x100);
@@ -182,7 +173,7 @@ int state_save(const char* fn)
 
    /****************************************************/
 
-   MESSAGE_INFO("  - Saving sound block\n");
+   MESSAGE_DEBUG("Saving sound block\n");
 
    buffer[0x00] = machine->apu->rectangle[0].regs[0];
    buffer[0x01] = machine->apu->rectangle[0].regs[1];
@@ -213,7 +204,7 @@ int state_save(const char* fn)
 
    if (memory_zone_dirty(machine->cart->chr_ram, 0x2000 * machine->cart->chr_ram_banks))
    {
-      MESSAGE_INFO("  - Saving VRAM block\n");
+      MESSAGE_DEBUG("Saving VRAM block\n");
 
       _fwrite("VRAM\x00\x00\x00\x01\x00\x00\x20\x00", 12);
       _fwrite(machine->cart->chr_ram, 0x2000 * machine->cart->chr_ram_banks);
@@ -225,7 +216,7 @@ int state_save(const char* fn)
 
    if (memory_zone_dirty(machine->cart->prg_ram, 0x2000 * machine->cart->prg_ram_banks))
    {
-      MESSAGE_INFO("  - Saving SRAM block\n");
+      MESSAGE_DEBUG("Saving SRAM block\n");
 
       // Byte 0 = SRAM enabled (unused)
       // Length is always $2001
@@ -239,7 +230,7 @@ int state_save(const char* fn)
 
    if (machine->mapper->number > 0)
    {
-      MESSAGE_INFO("  - Saving mapper block\n");
+      MESSAGE_DEBUG("Saving mapper block\n");
 
       memset(buffer, 0, sizeof(buffer));
 
@@ -272,49 +263,62 @@ int state_save(const char* fn)
 
    /****************************************************/
 
-   // Update number of blocks
+   // Update number of blocks, then leave the position at the end for the caller
+   long end = ftell(file);
    fseek(file, 4, SEEK_SET);
    numberOfBlocks = swap32(numberOfBlocks);
    _fwrite(&numberOfBlocks, 4);
-
-   fclose(file);
-
-   MESSAGE_INFO("state_save: Game saved!\n");
+   fseek(file, end, SEEK_SET);
 
    return 0;
 
 _error:
-   MESSAGE_ERROR("state_save: Save failed!\n");
-   fclose(file);
    return -1;
 }
 
 
-int state_load(const char* fn)
+int state_save(const char* fn)
 {
-   uint8 buffer[600];
-
-   nes_t *machine = nes_getptr();
    FILE *file;
 
-   if (!(file = fopen(fn, "rb")))
+   if (!(file = fopen(fn, "wb")))
    {
-       MESSAGE_ERROR("state_load: file '%s' could not be opened.\n", fn);
-       return -1; //goto _error;
-  }
+       MESSAGE_ERROR("state_save: file '%s' could not be opened.\n", fn);
+       return -1;
+   }
+
+   MESSAGE_INFO("state_save: file '%s' opened.\n", fn);
+
+   int ret = state_save_fp(file);
+   fclose(file);
+
+   if (ret == 0)
+      MESSAGE_INFO("state_save: Game saved!\n");
+   else
+      MESSAGE_ERROR("state_save: Save failed!\n");
+
+   return ret;
+}
+
+
+int state_load_fp(FILE *file)
+{
+   uint8 buffer[600];
+
+   nes_t *machine = nes_getptr();
 
    _fread(buffer, 8);
 
    if (memcmp(buffer, "SNSS", 4) != 0)
    {
-      MESSAGE_ERROR("state_load: file '%s' is not a save file.\n", fn);
+      MESSAGE_ERROR("state_load: not a save file.\n");
       goto _error;
    }
 
    uint32 numberOfBlocks = swap32(*((uint32*)&buffer[4]));
    uint32 nextBlock = 8;
 
-   MESSAGE_INFO("state_load: file '%s' opened, blocks=%u.\n", fn, numberOfBlocks);
+   MESSAGE_DEBUG("blocks=%u.\n", numberOfBlocks);
 
    for (uint32 blk = 0; blk < numberOfBlocks; blk++)
    {
@@ -332,7 +336,7 @@ int state_load(const char* fn)
 
       if (memcmp(buffer, "BASR", 4) == 0)
       {
-         MESSAGE_INFO("  - Found base block (%u bytes)\n", blockLength);
+         MESSAGE_DEBUG("Found base block (%u bytes)\n", blockLength);
 
          _fread(buffer, 9);
 
@@ -380,7 +384,7 @@ int state_load(const char* fn)
 
       else if (memcmp(buffer, "VRAM", 4) == 0)
       {
-         MESSAGE_INFO("  - Found VRAM block (%u bytes)\n", blockLength);
+         MESSAGE_DEBUG("Found VRAM block (%u bytes)\n", blockLength);
 
          if (machine->cart->chr_ram_banks < (blockLength / ROM_CHR_BANK_SIZE))
          {
@@ -389,6 +393,7 @@ int state_load(const char* fn)
          }
 
          _fread(machine->cart->chr_ram, blockLength);
+         ppu_invalidatechr();
       }
 
 
@@ -396,7 +401,7 @@ int state_load(const char* fn)
 
       else if (memcmp(buffer, "SRAM", 4) == 0)
       {
-         MESSAGE_INFO("  - Found SRAM block (%u bytes)\n", blockLength);
+         MESSAGE_DEBUG("Found SRAM block (%u bytes)\n", blockLength);
 
          if (machine->cart->prg_ram_banks < ((blockLength-1) / ROM_PRG_BANK_SIZE))
          {
@@ -413,7 +418,7 @@ int state_load(const char* fn)
 
       else if (memcmp(buffer, "MPRD", 4) == 0)
       {
-         MESSAGE_INFO("  - Found mapper block (%u bytes)\n", blockLength);
+         MESSAGE_DEBUG("Found mapper block (%u bytes)\n", blockLength);
 
          _fread(buffer, MIN(blockLength, sizeof(buffer)));
 
@@ -440,7 +445,7 @@ int state_load(const char* fn)
 
       else if (memcmp(buffer, "SOUN", 4) == 0)
       {
-         MESSAGE_INFO("  - Found sound block (%u bytes)\n", blockLength);
+         MESSAGE_DEBUG("Found sound block (%u bytes)\n", blockLength);
 
          _fread(buffer, 0x16);
 
@@ -455,7 +460,7 @@ int state_load(const char* fn)
 
       else if (memcmp(buffer, "INFO", 4) == 0)
       {
-         MESSAGE_INFO("  - Found info block (%u bytes)\n", blockLength);
+         MESSAGE_DEBUG("Found info block (%u bytes)\n", blockLength);
 
          _fread(buffer, 0x100);
 
@@ -471,15 +476,32 @@ int state_load(const char* fn)
       }
    }
 
-   /* close file, we're done */
-   fclose(file);
-
-   MESSAGE_INFO("state_load: Game restored\n");
-
    return 0;
 
 _error:
-   MESSAGE_ERROR("state_load: Load failed!\n");
-   fclose(file);
    return -1;
 }
+
+
+int state_load(const char* fn)
+{
+   FILE *file;
+
+   if (!(file = fopen(fn, "rb")))
+   {
+       MESSAGE_ERROR("state_load: file '%s' could not be opened.\n", fn);
+       return -1;
+   }
+
+   MESSAGE_INFO("state_load: file '%s' opened.\n", fn);
+
+   int ret = state_load_fp(file);
+   fclose(file);
+
+   if (ret == 0)
+      MESSAGE_INFO("state_load: Game restored\n");
+   else
+      MESSAGE_ERROR("state_load: Load failed!\n");
+
+   return ret;
+}
@@ -45,7 +45,7 @@ static uint8 sms_cram_expand_table[4];
 static uint8 gg_cram_expand_table[16];
 
 /* Internal buffer for drawing non 8-bit displays */
-static uint8 internal_buffer[0x200];
+static uint8 internal_buffer[0x200] __attribute__((aligned(4)));
 
 /* Precalculated pixel table */
 static uint16 pixel[PALETTE_SIZE];
@@ -321,6 +321,7 @@ void render_reset(void)
 
   /* Clear display bitmap */
   memset(bitmap.data, 0, bitmap.pitch * bitmap.height);
+  render_invalidatelines();
 
   /* Clear palette */
   for(i = 0; i < PALETTE_SIZE; i++)
@@ -365,9 +366,52 @@ void render_reset(void)
 static int prev_line = -1;
 static int skip_render = 0;
 
+/* Checksums of the lines of the frame being drawn and of the last drawn one, used to fill
+   bitmap.dirty_lines. 0 marks a line that wasn't drawn. */
+static uint32_t line_checksums[2][SMS_HEIGHT];
+static int line_frame = 0;
+
 void render_mode(int skip)
 {
     skip_render = skip;
+
+    /* Lines that won't be drawn keep whatever the buffer held, they must show as changed */
+    if (!skip)
+    {
+        line_frame ^= 1;
+        memset(line_checksums[line_frame], 0, sizeof(line_checksums[0]));
+        if (bitmap.dirty_lines)
+            memset(bitmap.dirty_lines, 0xFF, (SMS_HEIGHT + 31) / 32 * 4);
+    }
+}
+
+/* Report every line as changed, for when the output changes without render_line noticing */
+void render_invalidatelines(void)
+{
+  memset(line_checksums, 0, sizeof(line_checksums));
+  if (bitmap.dirty_lines)
+    memset(bitmap.dirty_lines, 0xFF, (SMS_HEIGHT + 31) / 32 * 4);
+}
+
+static inline void render_updatedirty(int vline, const uint8 *data, int width)
+{
+  uint32_t checksum = 0x811C9DC5;
+
+  if (!bitmap.dirty_lines || vline >= SMS_HEIGHT)
+    return;
+
+  for (int i = 0; i < width / 4; i++)
+    checksum = (checksum ^ ((const uint32_t *)data)[i]) * 0x01000193;
+  for (int i = width & ~3; i < width; i++)
+    checksum = (checksum ^ data[i]) * 0x01000193;
+  checksum |= 1;
+
+  if (checksum != line_checksums[line_frame ^ 1][vline])
+    bitmap.dirty_lines[vline >> 5] |= (1u << (vline & 31));
+  else
+    bitmap.dirty_lines[vline >> 5] &= ~(1u << (vline & 31));
+
+  line_checksums[line_frame][vline] = checksum;
 }
 
 /* Draw a line of the display */
@@ -488,6 +532,7 @@ void render_line(int line)
       internal_buffer,
       bitmap.viewport.w + 2*bitmap.viewport.x
     );
+    render_updatedirty(vline, internal_buffer, bitmap.viewport.w + 2*bitmap.viewport.x);
   }
 }
 
@@ -851,6 +896,9 @@ bool render_copy_palette(uint16* palette)
   for (int i = 0; i < 256; i += PALETTE_SIZE)
     memcpy(palette + i, pixel, PALETTE_SIZE * 2);
 
+  /* Same pixels, different colors */
+  render_invalidatelines();
+
   pal_dirty = 0;
   return true;
 }
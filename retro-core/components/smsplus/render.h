@@ -47,5 +47,6 @@ extern void render_bg_sms(int line);
 extern void render_obj_sms(int line);
 extern void palette_sync(int index);
 extern bool render_copy_palette(uint16* palette);
+extern void render_invalidatelines(void);
 
 #endif /* _RENDER_H_ */
@@ -14,6 +14,7 @@ typedef signed long int int32;
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <malloc.h>
 #include <limits.h>
 #include <math.h>
@@ -78,7 +78,7 @@ int sound_init(void)
   /* Calculate number of samples generated per frame */
   snd.sample_count = (snd.sample_rate / snd.fps) + 1;
   snd.buffer_size = snd.sample_count * 2;
-  MESSAGE_INFO("sample_count=%d fps=%d (actual=%f)\n", snd.sample_count, snd.fps, (float)snd.sample_rate / snd.fps);
+  MESSAGE_DEBUG("sample_count=%d fps=%d (actual=%f)\n", snd.sample_count, snd.fps, (float)snd.sample_rate / snd.fps);
 
   /* Prepare incremental info */
   snd.done_so_far = 0;
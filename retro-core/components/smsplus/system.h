@@ -88,6 +88,7 @@ typedef struct
     int ox, oy, ow, oh;
     int changed;
   } viewport;
+  uint32_t *dirty_lines; /* Optional, lines that changed since the last drawn frame */
 } bitmap_t;
 
 typedef struct
@@ -8,6 +8,7 @@ static bool slowFrame = false;
 
 static int video_time;
 static int audio_time;
+static bool muteAudio = false;
 
 static const char *sramFile;
 static int autoSaveSRAM = 0;
@@ -75,6 +76,29 @@ static bool load_state_handler(const char *filename)
     return true;
 }
 
+static bool save_state_mem_handler(void *data, size_t *size)
+{
+    FILE *fp = fmemopen(data, *size, "wb");
+    if (!fp)
+        return false;
+    setvbuf(fp, NULL, _IONBF, 0);
+    bool success = gnuboy_save_state_fp(fp) == 0 && !ferror(fp);
+    *size = ftell(fp);
+    fclose(fp);
+    return success;
+}
+
+static bool load_state_mem_handler(const void *data, size_t size)
+{
+    FILE *fp = fmemopen((void *)data, size, "rb");
+    if (!fp)
+        return false;
+    bool success = gnuboy_load_state_fp(fp) == 0;
+    fclose(fp);
+    update_rtc_time();
+    return success;
+}
+
 static bool reset_handler(bool hard)
 {
     gnuboy_reset(hard);
@@ -227,6 +251,8 @@ static void video_callback(void *buffer)
 
 static void audio_callback(void *buffer, size_t length)
 {
+    if (muteAudio)
+        return;
     int64_t startTime = rg_system_timer();
     rg_audio_submit(buffer, length >> 1);
     audio_time += rg_system_timer() - startTime;
@@ -246,6 +272,8 @@ void gbc_main(void)
     const rg_handlers_t handlers = {
         .loadState = &load_state_handler,
         .saveState = &save_state_handler,
+        .loadStateMem = &load_state_mem_handler,
+        .saveStateMem = &save_state_mem_handler,
         .reset = &reset_handler,
         .screenshot = &screenshot_handler,
         .event = &event_handler,
@@ -256,6 +284,8 @@ void gbc_main(void)
 
     updates[0] = rg_surface_create(GB_WIDTH, GB_HEIGHT, RG_PIXEL_565_BE, MEM_ANY);
     updates[1] = rg_surface_create(GB_WIDTH, GB_HEIGHT, RG_PIXEL_565_BE, MEM_ANY);
+    rg_surface_track_dirty_rows(updates[0]);
+    rg_surface_track_dirty_rows(updates[1]);
     currentUpdate = updates[0];
 
     useSystemTime = (bool)rg_settings_get_number(NS_APP, SETTING_SYSTIME, 1);
@@ -271,6 +301,7 @@ void gbc_main(void)
         RG_PANIC("Emulator init failed!");
 
     gnuboy_set_framebuffer(currentUpdate->data);
+    gnuboy_set_dirty_lines(currentUpdate->dirty_rows);
     gnuboy_set_soundbuffer(malloc(AUDIO_BUFFER_LENGTH * 4), AUDIO_BUFFER_LENGTH);
 
     // Load ROM
@@ -354,8 +385,27 @@ void gbc_main(void)
         {
             currentUpdate = updates[currentUpdate == updates[0]];
             gnuboy_set_framebuffer(currentUpdate->data);
+            gnuboy_set_dirty_lines(currentUpdate->dirty_rows);
+        }
+
+        if (drawFrame && rg_emu_get_runahead() > 0)
+        {
+            // The real frame is only heard, we display the one a few frames ahead with the same input
+            gnuboy_run(false);
+            if (rg_emu_runahead_save())
+            {
+                muteAudio = true;
+                for (int i = rg_emu_get_runahead(); i > 1; i--)
+                    gnuboy_run(false);
+                gnuboy_run(true);
+                muteAudio = false;
+                rg_emu_runahead_load();
+            }
+        }
+        else
+        {
+            gnuboy_run(drawFrame);
         }
-        gnuboy_run(drawFrame);
 
         if (autoSaveSRAM > 0)
         {
@@ -51,6 +51,28 @@ static bool load_state_handler(const char *filename)
     return true;
 }
 
+static bool save_state_mem_handler(void *data, size_t *size)
+{
+    FILE *fp = fmemopen(data, *size, "wb");
+    if (!fp)
+        return false;
+    setvbuf(fp, NULL, _IONBF, 0);
+    bool success = state_save_fp(fp) == 0 && !ferror(fp);
+    *size = ftell(fp);
+    fclose(fp);
+    return success;
+}
+
+static bool load_state_mem_handler(const void *data, size_t size)
+{
+    FILE *fp = fmemopen((void *)data, size, "rb");
+    if (!fp)
+        return false;
+    bool success = state_load_fp(fp) == 0;
+    fclose(fp);
+    return success;
+}
+
 static bool reset_handler(bool hard)
 {
     nes_reset(hard);
@@ -67,6 +89,11 @@ static void build_palette(int n)
         updates[1]->palette[i] = color;
     }
     free(pal);
+
+    // The pixels didn't change, but every row looks different now
+    rg_surface_set_dirty_rows(updates[0], 0, updates[0]->height, true);
+    rg_surface_set_dirty_rows(updates[1], 0, updates[1]->height, true);
+    ppu_invalidatelines();
 }
 
 static rg_gui_event_t sprite_limit_cb(rg_gui_option_t *option, rg_gui_event_t event)
@@ -193,6 +220,8 @@ void nes_main(void)
     const rg_handlers_t handlers = {
         .loadState = &load_state_handler,
         .saveState = &save_state_handler,
+        .loadStateMem = &load_state_mem_handler,
+        .saveStateMem = &save_state_mem_handler,
         .reset = &reset_handler,
         .event = &event_handler,
         .screenshot = &screenshot_handler,
@@ -207,6 +236,8 @@ void nes_main(void)
 
     updates[0] = rg_surface_create(NES_SCREEN_PITCH, NES_SCREEN_HEIGHT, RG_PIXEL_PAL565_BE, MEM_FAST);
     updates[1] = rg_surface_create(NES_SCREEN_PITCH, NES_SCREEN_HEIGHT, RG_PIXEL_PAL565_BE, MEM_FAST);
+    rg_surface_track_dirty_rows(updates[0]);
+    rg_surface_track_dirty_rows(updates[1]);
     currentUpdate = updates[0];
 
     nes = nes_init(SYS_DETECT, app->sampleRate, true, RG_BASE_PATH_BIOS "/fds_bios.bin");
@@ -288,33 +319,50 @@ void nes_main(void)
         {
             currentUpdate = updates[currentUpdate == updates[0]];
             nes_setvidbuf(currentUpdate->data);
+            nes->dirty_lines = currentUpdate->dirty_rows;
         }
 
         input_update(0, buttons);
-        nes_emulate(drawFrame);
+
+        rg_audio_sample_t *audioBuffer = (void*)nes->apu->buffer;
+        rg_audio_sample_t runaheadAudio[nes->apu->samples_per_frame];
+
+        if (drawFrame && rg_emu_get_runahead() > 0)
+        {
+            // The real frame is never shown, we display the one a few frames ahead with the same input
+            nes_emulate(false);
+            memcpy(runaheadAudio, audioBuffer, sizeof(runaheadAudio));
+            audioBuffer = runaheadAudio;
+            if (rg_emu_runahead_save())
+            {
+                for (int i = rg_emu_get_runahead(); i > 1; i--)
+                    nes_emulate(false);
+                nes_emulate(true);
+                rg_emu_runahead_load();
+            }
+        }
+        else
+        {
+            nes_emulate(drawFrame);
+        }
+        rg_profile_end(RG_PROFILE_EMULATE, startTime);
 
         // Tick before submitting audio/syncing
         rg_system_tick(rg_system_timer() - startTime);
 
         // Audio is used to pace emulation :)
-        rg_audio_submit((void*)nes->apu->buffer, nes->apu->samples_per_frame);
+        rg_audio_submit(audioBuffer, nes->apu->samples_per_frame);
 
-        if (skipFrames == 0)
+        if (nsfPlayer)
         {
-            int frameTime = 1000000 / (nes->refresh_rate * app->speed);
-            int elapsed = rg_system_timer() - startTime;
-            if (nsfPlayer)
+            if (skipFrames == 0)
                 skipFrames = 10, nsf_draw_overlay();
-            else if (app->frameskip > 0)
-                skipFrames = app->frameskip;
-            else if (elapsed > frameTime + 1500) // Allow some jitter
-                skipFrames = 1; // (elapsed / frameTime)
-            else if (drawFrame && slowFrame)
-                skipFrames = 1;
+            else
+                skipFrames--;
         }
-        else if (skipFrames > 0)
+        else
         {
-            skipFrames--;
+            skipFrames = !rg_system_render_next_frame(drawFrame, drawFrame && slowFrame);
         }
     }
 
@@ -54,6 +54,30 @@ static bool load_state_handler(const char *filename)
     return false;
 }
 
+static bool save_state_mem_handler(void *data, size_t *size)
+{
+    FILE *fp = fmemopen(data, *size, "wb");
+    if (!fp)
+        return false;
+    setvbuf(fp, NULL, _IONBF, 0);
+    system_save_state(fp);
+    bool success = !ferror(fp);
+    *size = ftell(fp);
+    fclose(fp);
+    return success;
+}
+
+static bool load_state_mem_handler(const void *data, size_t size)
+{
+    FILE *fp = fmemopen((void *)data, size, "rb");
+    if (!fp)
+        return false;
+    system_load_state(fp);
+    bool success = !ferror(fp);
+    fclose(fp);
+    return success;
+}
+
 static bool reset_handler(bool hard)
 {
     system_reset();
@@ -99,6 +123,8 @@ void sms_main(void)
     const rg_handlers_t handlers = {
         .loadState = &load_state_handler,
         .saveState = &save_state_handler,
+        .loadStateMem = &load_state_mem_handler,
+        .saveStateMem = &save_state_mem_handler,
         .reset = &reset_handler,
         .screenshot = &screenshot_handler,
         .event = &event_handler,
@@ -109,6 +135,8 @@ void sms_main(void)
 
     updates[0] = rg_surface_create(SMS_WIDTH, SMS_HEIGHT, RG_PIXEL_PAL565_BE, MEM_FAST);
     updates[1] = rg_surface_create(SMS_WIDTH, SMS_HEIGHT, RG_PIXEL_PAL565_BE, MEM_FAST);
+    rg_surface_track_dirty_rows(updates[0]);
+    rg_surface_track_dirty_rows(updates[1]);
     currentUpdate = updates[0];
 
     system_reset_config();
@@ -142,6 +170,7 @@ void sms_main(void)
     bitmap.height = SMS_HEIGHT;
     bitmap.pitch = bitmap.width;
     bitmap.data = currentUpdate->data;
+    bitmap.dirty_lines = currentUpdate->dirty_rows;
 
     system_poweron();
 
@@ -236,7 +265,31 @@ void sms_main(void)
             }
         }
 
-        system_frame(!drawFrame);
+        bool runAhead = drawFrame && rg_emu_get_runahead() > 0;
+
+        system_frame(!drawFrame || runAhead);
+
+        // The emulator's sound buffer isn't in a very convenient format, we must remix it.
+        size_t sample_count = snd.sample_count;
+        rg_audio_sample_t mixbuffer[sample_count];
+        for (size_t i = 0; i < sample_count; i++)
+        {
+            mixbuffer[i].left = snd.stream[0][i] * 2.75f;
+            mixbuffer[i].right = snd.stream[1][i] * 2.75f;
+        }
+
+        if (runAhead)
+        {
+            // The real frame is only heard, we display the one a few frames ahead with the same input
+            runAhead = rg_emu_runahead_save();
+            if (runAhead)
+            {
+                for (int i = rg_emu_get_runahead(); i > 1; i--)
+                    system_frame(1);
+                system_frame(0);
+            }
+            drawFrame = runAhead;
+        }
 
         if (drawFrame)
         {
@@ -246,16 +299,11 @@ void sms_main(void)
             rg_display_submit(currentUpdate, 0);
             currentUpdate = updates[currentUpdate == updates[0]]; // Swap
             bitmap.data = currentUpdate->data;
+            bitmap.dirty_lines = currentUpdate->dirty_rows;
         }
 
-        // The emulator's sound buffer isn't in a very convenient format, we must remix it.
-        size_t sample_count = snd.sample_count;
-        rg_audio_sample_t mixbuffer[sample_count];
-        for (size_t i = 0; i < sample_count; i++)
-        {
-            mixbuffer[i].left = snd.stream[0][i] * 2.75f;
-            mixbuffer[i].right = snd.stream[1][i] * 2.75f;
-        }
+        if (runAhead)
+            rg_emu_runahead_load();
 
         // Tick before submitting audio/syncing
         rg_system_tick(rg_system_timer() - startTime);
@@ -264,19 +312,6 @@ void sms_main(void)
         rg_audio_submit(mixbuffer, sample_count);
 
         // See if we need to skip a frame to keep up
-        if (skipFrames == 0)
-        {
-            int elapsed = rg_system_timer() - startTime;
-            if (app->frameskip > 0)
-                skipFrames = app->frameskip;
-            else if (elapsed > app->frameTime + 1500) // Allow some jitter
-                skipFrames = 1; // (elapsed / frameTime)
-            else if (drawFrame && slowFrame)
-                skipFrames = 1;
-        }
-        else if (skipFrames > 0)
-        {
-            skipFrames--;
-        }
+        skipFrames = !rg_system_render_next_frame(drawFrame, drawFrame && slowFrame);
     }
 }
@@ -72,12 +72,12 @@ static const char *SNES_BUTTONS[] = {
 #define AUDIO_LOW_PASS_RANGE ((60 * 65536) / 100)
 
 static rg_app_t *app;
-static rg_surface_t *updates[2];
+static rg_surface_t *updates[3];
 static rg_surface_t *currentUpdate;
 static rg_audio_sample_t *audioBuffers[2];
 static rg_audio_sample_t *currentAudioBuffer;
+static rg_audio_source_t audio_source;
 
-static volatile int bufferIndex = 0;
 static rg_mutex_t *frame_mutex;
 
 #ifdef USE_AUDIO_TASK
@@ -231,6 +231,7 @@ static rg_gui_event_t lowpass_filter_cb(rg_gui_option_t *option, rg_gui_event_t
     if (event == RG_DIALOG_PREV || event == RG_DIALOG_NEXT)
     {
         lowpass_filter = !lowpass_filter;
+        audio_source.lowpass = lowpass_filter ? AUDIO_LOW_PASS_RANGE : 0;
         rg_settings_set_number(NS_APP, SETTING_APU_FILTER, lowpass_filter);
     }
 
@@ -381,13 +382,12 @@ void JustifierButtons(uint32_t *justifiers)
     (void)justifiers;
 }
 
+// The low-pass filter is applied by the shared mixer, see audio_source.lowpass
 static inline void mix_samples(int32_t count)
 {
     currentAudioBuffer = audioBuffers[currentAudioBuffer == audioBuffers[0]];
-    if (lowpass_filter)
-        S9xMixSamplesLowPass((int16_t *)currentAudioBuffer, count, AUDIO_LOW_PASS_RANGE);
-    else
-        S9xMixSamples((int16_t *)currentAudioBuffer, count);
+    S9xMixSamples((int16_t *)currentAudioBuffer, count);
+    rg_audio_mix(&audio_source, (int16_t *)currentAudioBuffer, count >> 1);
 }
 
 #ifdef USE_AUDIO_TASK
@@ -399,7 +399,7 @@ static void audio_task(void *arg)
         if (msg.type == RG_TASK_MSG_STOP)
             break;
         mix_samples(AUDIO_BUFFER_LENGTH << 1);
-        rg_audio_submit(currentAudioBuffer, AUDIO_BUFFER_LENGTH);
+        rg_audio_mix_submit();
     }
 }
 #endif
@@ -427,23 +427,28 @@ void snes_main(void)
     // Load settings
     apu_enabled = rg_settings_get_number(NS_APP, SETTING_APU_EMULATION, 1);
     lowpass_filter = rg_settings_get_number(NS_APP, SETTING_APU_FILTER, 0);
+    rg_audio_source_init(&audio_source, 2, AUDIO_SAMPLE_RATE, 100);
+    audio_source.lowpass = lowpass_filter ? AUDIO_LOW_PASS_RANGE : 0;
     update_keymap(rg_settings_get_number(NS_APP, SETTING_KEYMAP, 0));
 
     // Allocate surfaces and audio buffers
-    updates[0] = rg_surface_create(SNES_WIDTH, SNES_HEIGHT_EXTENDED, RG_PIXEL_565_LE, 0);
-    updates[1] = rg_surface_create(SNES_WIDTH, SNES_HEIGHT_EXTENDED, RG_PIXEL_565_LE, 0);
-    updates[0]->height = SNES_HEIGHT;
-    updates[1]->height = SNES_HEIGHT;
+    // Triple buffering, the display task never holds more than two of them
+    for (size_t i = 0; i < RG_COUNT(updates); ++i)
+    {
+        updates[i] = rg_surface_create(SNES_WIDTH, SNES_HEIGHT_EXTENDED, RG_PIXEL_565_LE, 0);
+        if (!updates[i])
+            RG_PANIC("Failed to allocate buffers!");
+        updates[i]->height = SNES_HEIGHT;
+    }
     currentUpdate = updates[0];
-    bufferIndex = 0;
-    
+
     frame_mutex = rg_mutex_create();
 
     audioBuffers[0] = (rg_audio_sample_t *)malloc(AUDIO_BUFFER_LENGTH * 4);
     audioBuffers[1] = audioBuffers[0];
     currentAudioBuffer = audioBuffers[0];
 
-    if (!updates[0] || !updates[1] || !audioBuffers[0] || !audioBuffers[1])
+    if (!audioBuffers[0] || !audioBuffers[1])
         RG_PANIC("Failed to allocate buffers!");
 
 #ifdef USE_AUDIO_TASK
@@ -484,7 +489,7 @@ void snes_main(void)
 
     if (rg_extension_match(filename, "zip"))
     {
-        if (!rg_storage_unzip_file(filename, NULL, (void **)&Memory.ROM, &Memory.ROM_AllocSize, RG_FILE_USER_BUFFER))
+        if (!rg_storage_unzip_file(filename, "smc sfc swc fig", (void **)&Memory.ROM, &Memory.ROM_AllocSize, RG_FILE_USER_BUFFER))
             RG_PANIC("ROM file unzipping failed!");
         filename = NULL;
     }
@@ -539,7 +544,7 @@ void snes_main(void)
         IPPU.RenderThisFrame = drawFrame;
 
         rg_mutex_take(frame_mutex, -1);
-        currentUpdate = updates[bufferIndex];
+        currentUpdate = rg_display_acquire(updates, RG_COUNT(updates));
         GFX.Screen = currentUpdate->data;
         rg_mutex_give(frame_mutex);
 
@@ -555,10 +560,6 @@ void snes_main(void)
 
         if (drawFrame)
         {
-            rg_mutex_take(frame_mutex, -1);
-            bufferIndex = (bufferIndex + 1) & 1;
-            rg_mutex_give(frame_mutex);
-
             uint8_t *data = currentUpdate->data;
             size_t data_size = SNES_WIDTH * SNES_HEIGHT_EXTENDED * 2;
             uintptr_t aligned_addr = ((uintptr_t)data + 63) & ~63ULL;
@@ -567,7 +568,7 @@ void snes_main(void)
                 esp_cache_msync((void *)aligned_addr, aligned_size, ESP_CACHE_MSYNC_FLAG_DIR_C2M);
 
             slowFrame = !rg_display_sync(false);
-            rg_display_submit(currentUpdate, 0);
+            rg_display_submit(currentUpdate, RG_DISPLAY_SUBMIT_ASYNC);
         }
 
     #ifndef USE_AUDIO_TASK
@@ -575,7 +576,7 @@ void snes_main(void)
         {
             mix_samples(AUDIO_BUFFER_LENGTH << 1);
             rg_system_tick(rg_system_timer() - startTime);
-            rg_audio_submit(currentAudioBuffer, AUDIO_BUFFER_LENGTH);
+            rg_audio_mix_submit();
         }
         else
         {
@@ -585,19 +586,6 @@ void snes_main(void)
         rg_system_tick(rg_system_timer() - startTime);
     #endif
 
-        if (skipFrames == 0)
-        {
-            int elapsed = rg_system_timer() - startTime;
-            if (app->frameskip > 0)
-                skipFrames = app->frameskip;
-            else if (elapsed > app->frameTime + 1500) // Allow some jitter
-                skipFrames = 1; // (elapsed / frameTime)
-            else if (drawFrame && slowFrame)
-                skipFrames = 1;
-        }
-        else if (skipFrames > 0)
-        {
-            skipFrames--;
-        }
+        skipFrames = !rg_system_render_next_frame(drawFrame, drawFrame && slowFrame);
     }
 }
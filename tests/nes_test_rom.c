@@ -0,0 +1,225 @@
+// A synthetic cartridge that keeps the CPU, the PPU and the mappers busy. It's CNROM (32KB PRG, 4x8KB CHR)
+// or, with CHR RAM, NROM (32KB PRG, 8KB CHR RAM).
+//   - reset uploads tiles, nametables and palette through $2006/$2007 and enables NMI and rendering
+//   - the main loop mixes RAM, zero page, ROM, PRG RAM and I/O accesses, moves the sprites and switches
+//     CHR banks, in the middle of frames
+//   - the NMI handler does the OAM DMA, writes CHR/nametable/palette bytes, cycles $2000/$2001
+//     through scroll, nametable, pattern table, 8x16 sprites and clipping settings, and scrolls
+// It only has to be deterministic, not pretty.
+#include "nes_test_rom.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PRG_SIZE    0x8000
+#define CHR_SIZE    0x2000
+#define CHR_BANKS   4
+#define CHR_DATA    0xC000 // 8KB of tiles, uploaded to CHR RAM or copied to the first CHR ROM bank
+#define NT_DATA     0xE000 // 4KB of nametables
+#define PAL_DATA    0xF000 // 256 bytes, the last 32 stick
+#define OAM_DATA    0xF100 // 256 bytes
+#define CTRL_TABLE  0xF200 // 8 $2000 values then 8 $2001 values
+
+#define W(addr) ((addr) & 0xFF), ((addr) >> 8)
+#define OP(...) emit(sizeof((int[]){__VA_ARGS__}) / sizeof(int), __VA_ARGS__)
+
+static uint8_t *prg;
+static unsigned pc;
+
+static void emit(int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    while (count--)
+        prg[pc++ - 0x8000] = va_arg(args, int);
+    va_end(args);
+}
+
+// Backward branches only
+static void branch(int op, unsigned target)
+{
+    OP(op, (target - (pc + 2)) & 0xFF);
+}
+
+// Copies `pages` 256-byte pages from `src` to PPU address `dst` through $2007
+static void upload(unsigned src, unsigned dst, int pages)
+{
+    OP(0xA9, dst >> 8);          // LDA #>dst
+    OP(0x8D, W(0x2006));         // STA $2006
+    OP(0xA9, dst & 0xFF);        // LDA #<dst
+    OP(0x8D, W(0x2006));         // STA $2006
+    OP(0xA9, src & 0xFF);        // LDA #<src
+    OP(0x85, 0x00);              // STA $00
+    OP(0xA9, src >> 8);          // LDA #>src
+    OP(0x85, 0x01);              // STA $01
+    OP(0xA0, 0x00);              // LDY #0
+    OP(0xA2, pages);             // LDX #pages
+    unsigned loop = pc;
+    OP(0xB1, 0x00);              // LDA ($00),Y
+    OP(0x8D, W(0x2007));         // STA $2007
+    OP(0xC8);                    // INY
+    branch(0xD0, loop);          // BNE loop
+    OP(0xE6, 0x01);              // INC $01
+    OP(0xCA);                    // DEX
+    branch(0xD0, loop);          // BNE loop
+}
+
+static void assemble(void)
+{
+    unsigned reset = pc = 0x8000, loop;
+
+    OP(0x78);                    // SEI
+    OP(0xD8);                    // CLD
+    OP(0xA2, 0xFF);              // LDX #$FF
+    OP(0x9A);                    // TXS
+    OP(0xA9, 0x00);              // LDA #0
+    OP(0x8D, W(0x2000));         // STA $2000
+    OP(0x8D, W(0x2001));         // STA $2001
+    for (int i = 0; i < 2; ++i)
+    {
+        loop = pc;
+        OP(0x2C, W(0x2002));     // BIT $2002
+        branch(0x10, loop);      // BPL loop
+    }
+    upload(CHR_DATA, 0x0000, 32);
+    upload(NT_DATA, 0x2000, 16);
+    upload(PAL_DATA, 0x3F00, 1);
+    OP(0xA2, 0x00);              // LDX #0
+    loop = pc;
+    OP(0xBD, W(OAM_DATA));       // LDA OAM_DATA,X
+    OP(0x9D, W(0x0200));         // STA $0200,X
+    OP(0xE8);                    // INX
+    branch(0xD0, loop);          // BNE loop
+    OP(0xA9, 0x88);              // LDA #$88
+    OP(0x8D, W(0x2000));         // STA $2000
+    OP(0xA9, 0x1E);              // LDA #$1E
+    OP(0x8D, W(0x2001));         // STA $2001
+
+    unsigned main = pc;
+    OP(0xA2, 0x00);              // LDX #0
+    loop = pc;
+    OP(0xBD, W(0x0300));         // LDA $0300,X
+    OP(0x18);                    // CLC
+    OP(0x7D, W(0x8000));         // ADC $8000,X
+    OP(0x9D, W(0x0300));         // STA $0300,X
+    OP(0x9D, W(0x6000));         // STA $6000,X
+    OP(0x45, 0x20);              // EOR $20
+    OP(0x85, 0x20);              // STA $20
+    OP(0xAD, W(0x4016));         // LDA $4016
+    OP(0xE8);                    // INX
+    branch(0xD0, loop);          // BNE loop
+    OP(0xA2, 0x00);              // LDX #0
+    loop = pc;
+    OP(0xFE, W(0x0203));         // INC $0203,X
+    OP(0xE8, 0xE8, 0xE8, 0xE8);  // INX x4
+    branch(0xD0, loop);          // BNE loop
+    OP(0xA5, 0x20);              // LDA $20
+    OP(0x8D, W(0x4011));         // STA $4011
+    OP(0x29, 0x03);              // AND #$03
+    OP(0x8D, W(0x8000));         // STA $8000 (CHR bank)
+    OP(0x4C, W(main));           // JMP main
+
+    unsigned nmi = pc;
+    OP(0x48, 0x8A, 0x48, 0x98, 0x48); // PHA TXA PHA TYA PHA
+    OP(0xA9, 0x02);              // LDA #$02
+    OP(0x8D, W(0x4014));         // STA $4014
+    OP(0xE6, 0x10);              // INC $10
+    OP(0xA5, 0x10);              // LDA $10
+    OP(0x29, 0x0F);              // AND #$0F
+    OP(0x8D, W(0x2006));         // STA $2006
+    OP(0xA5, 0x10);              // LDA $10
+    OP(0x8D, W(0x2006));         // STA $2006
+    OP(0xA5, 0x20);              // LDA $20
+    OP(0x8D, W(0x2007));         // STA $2007 (CHR byte)
+    OP(0xA5, 0x10);              // LDA $10
+    OP(0x29, 0x07);              // AND #$07
+    OP(0x09, 0x20);              // ORA #$20
+    OP(0x8D, W(0x2006));         // STA $2006
+    OP(0xA5, 0x20);              // LDA $20
+    OP(0x8D, W(0x2006));         // STA $2006
+    OP(0xA5, 0x10);              // LDA $10
+    OP(0x8D, W(0x2007));         // STA $2007 (nametable byte)
+    OP(0xA9, 0x3F);              // LDA #$3F
+    OP(0x8D, W(0x2006));         // STA $2006
+    OP(0xA5, 0x10);              // LDA $10
+    OP(0x29, 0x1F);              // AND #$1F
+    OP(0x8D, W(0x2006));         // STA $2006
+    OP(0xA5, 0x10);              // LDA $10
+    OP(0x4A, 0x4A);              // LSR LSR
+    OP(0x29, 0x3F);              // AND #$3F
+    OP(0x8D, W(0x2007));         // STA $2007 (palette entry)
+    OP(0xA5, 0x10);              // LDA $10
+    OP(0x4A, 0x4A, 0x4A, 0x4A, 0x4A); // LSR x5
+    OP(0x29, 0x07);              // AND #$07
+    OP(0xAA);                    // TAX
+    OP(0xBD, W(CTRL_TABLE));     // LDA CTRL_TABLE,X
+    OP(0x8D, W(0x2000));         // STA $2000
+    OP(0xBD, W(CTRL_TABLE + 8)); // LDA CTRL_TABLE+8,X
+    OP(0x8D, W(0x2001));         // STA $2001
+    OP(0x2C, W(0x2002));         // BIT $2002
+    OP(0xA5, 0x10);              // LDA $10
+    OP(0x8D, W(0x2005));         // STA $2005
+    OP(0x4A);                    // LSR
+    OP(0x29, 0x7F);              // AND #$7F
+    OP(0x8D, W(0x2005));         // STA $2005
+    OP(0x68, 0xA8, 0x68, 0xAA, 0x68); // PLA TAY PLA TAX PLA
+    OP(0x40);                    // RTI
+
+    unsigned irq = pc;
+    OP(0x40);                    // RTI
+
+    pc = 0xFFFA;
+    OP(W(nmi), W(reset), W(irq));
+}
+
+uint8_t *nes_test_rom(size_t *size, bool chr_ram)
+{
+    static const uint8_t ctrl[16] = {
+        0x88, 0x89, 0x8A, 0xAB, 0x98, 0xB0, 0x80, 0x9B, // NMI on, nametables, pattern tables, 8x16
+        0x1E, 0x1E, 0x18, 0x1A, 0x1C, 0x0E, 0x16, 0x1E, // BG/sprites on or off, left column clipping
+    };
+    size_t length = 16 + PRG_SIZE + (chr_ram ? 0 : CHR_SIZE * CHR_BANKS);
+    uint8_t *rom = calloc(1, length);
+    uint32_t rng = 1;
+
+    if (!rom)
+        return NULL;
+
+    memcpy(rom, "NES\x1A", 4);
+    rom[4] = PRG_SIZE / 0x4000;
+    rom[5] = chr_ram ? 0 : CHR_SIZE * CHR_BANKS / 0x2000;
+    rom[6] = chr_ram ? 0x01 : 0x31; // Vertical mirroring, mapper 0 or 3
+    prg = rom + 16;
+
+    // Tiles: noise with some empty rows, so that transparency and priority matter
+    for (int i = 0; i < CHR_SIZE; ++i)
+    {
+        rng = rng * 1103515245 + 12345;
+        prg[CHR_DATA - 0x8000 + i] = (rng >> 28) < 3 ? 0 : rng >> 16;
+    }
+    for (int i = 0; i < 0x1000; ++i)
+    {
+        rng = rng * 1103515245 + 12345;
+        prg[NT_DATA - 0x8000 + i] = (i & 0x3FF) >= 0x3C0 ? rng >> 16 : (i * 7 + (i >> 5)) & 0xFF;
+    }
+    for (int i = 0; i < 256; ++i)
+    {
+        rng = rng * 1103515245 + 12345;
+        prg[PAL_DATA - 0x8000 + i] = (rng >> 16) & 0x3F;
+        prg[OAM_DATA - 0x8000 + i] = rng >> 16;
+    }
+    memcpy(prg + CTRL_TABLE - 0x8000, ctrl, sizeof(ctrl));
+    if (!chr_ram)
+    {
+        uint8_t *chr = rom + 16 + PRG_SIZE;
+        memcpy(chr, prg + CHR_DATA - 0x8000, CHR_SIZE);
+        for (int i = CHR_SIZE; i < CHR_SIZE * CHR_BANKS; ++i)
+            chr[i] = chr[i - CHR_SIZE] * 5 + (i >> 13);
+    }
+
+    assemble();
+
+    *size = length;
+    return rom;
+}
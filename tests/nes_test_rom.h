@@ -0,0 +1,10 @@
+// A synthetic cartridge for the nofrendo host tests, see nes_test_rom.c
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Returns a malloc'd iNES image. With chr_ram the cartridge has no CHR ROM and the program
+// uploads its tiles through $2007, like CHR RAM games do.
+uint8_t *nes_test_rom(size_t *size, bool chr_ram);
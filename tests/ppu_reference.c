@@ -0,0 +1,14 @@
+// nes/ppu.c as it was before the predecoded CHR cache, for test_ppu to compare the current renderer with.
+// CMake extracts it from the git history into the build directory, only the two functions the current
+// core calls are added here.
+#include "ppu_reference_base.c"
+
+// No cache to invalidate, tiles are decoded from CHR memory every time
+void ppu_invalidatechr(void)
+{
+}
+
+void ppu_invalidatelines(void)
+{
+    memset(line_checksums, 0, sizeof(line_checksums));
+}
@@ -0,0 +1,48 @@
+// The few rg_system/rg_settings functions that rg_utils.c and rg_storage.c call, for host tests.
+// Settings always return their default, logs at warning level or above go to stderr.
+#include "rg_system.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+void rg_system_log(int level, const char *context, const char *format, ...)
+{
+    if (level > RG_LOG_WARN)
+        return;
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s: ", context);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+void rg_system_panic(const char *context, const char *message)
+{
+    fprintf(stderr, "PANIC in %s: %s\n", context, message);
+    abort();
+}
+
+int64_t rg_system_timer(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void rg_task_delay(uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+double rg_settings_get_number(const char *section, const char *key, double default_value)
+{
+    return default_value;
+}
+
+void rg_settings_set_number(const char *section, const char *key, double value)
+{
+}
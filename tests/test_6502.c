@@ -0,0 +1,177 @@
+// nofrendo 6502 throughput with the per-page handler tables of mem.c, against the dispatch they replaced:
+// every operand read went through mem_getbyte and every write above $2000 through mem_putbyte, which
+// walked the handler lists for any 2KB page flagged as having handlers. The old dispatch is rebuilt here
+// by pointing all the table entries at a copy of those two functions. Both must run the same program.
+#include "nes_test_rom.h"
+
+#include <nofrendo.h>
+#include <nes/state.h>
+#include <rg_system.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HAS_READ_HANDLER  (1 << 0)
+#define HAS_WRITE_HANDLER (1 << 2)
+#define STATE_CAPACITY    (64 * 1024)
+#define ROUNDS            5
+
+static mem_t *mem;
+static uint32 flags[MEM_PAGECOUNT];
+
+static uint8 scan_getbyte(uint32 address)
+{
+    uint32 page_flags = flags[address >> MEM_PAGESHIFT];
+
+    if (page_flags & HAS_READ_HANDLER)
+    {
+        for (mem_read_handler_t *mr = mem->read_handlers; mr->handler != NULL; mr++)
+        {
+            if (address >= mr->min_range && address <= mr->max_range)
+                return mr->handler(address);
+        }
+    }
+    if (page_flags & MEM_PAGE_HAS_MEMORY)
+        return mem->pages[address >> MEM_PAGESHIFT][address];
+    return 0xFF;
+}
+
+static void scan_putbyte(uint32 address, uint8 value)
+{
+    uint32 page_flags = flags[address >> MEM_PAGESHIFT];
+
+    if (page_flags & HAS_WRITE_HANDLER)
+    {
+        for (mem_write_handler_t *mw = mem->write_handlers; mw->handler != NULL; mw++)
+        {
+            if (address >= mw->min_range && address <= mw->max_range)
+            {
+                mw->handler(address, value);
+                return;
+            }
+        }
+    }
+    if (page_flags & MEM_PAGE_HAS_MEMORY)
+        mem->pages[address >> MEM_PAGESHIFT][address] = value;
+}
+
+static void use_scan_dispatch(void)
+{
+    for (int page = 0; page < MEM_PAGECOUNT; ++page)
+        flags[page] = mem->flags[page] & MEM_PAGE_HAS_MEMORY;
+    for (mem_read_handler_t *mr = mem->read_handlers; mr->handler != NULL; mr++)
+        for (uint32 i = mr->min_range; i <= mr->max_range; i++)
+            flags[i >> MEM_PAGESHIFT] |= HAS_READ_HANDLER;
+    for (mem_write_handler_t *mw = mem->write_handlers; mw->handler != NULL; mw++)
+        for (uint32 i = mw->min_range; i <= mw->max_range; i++)
+            flags[i >> MEM_PAGESHIFT] |= HAS_WRITE_HANDLER;
+
+    for (int page = 0; page < MEM_IOPAGECOUNT; ++page)
+    {
+        mem->read_funcs[page] = scan_getbyte;
+        mem->write_funcs[page] = scan_putbyte;
+    }
+}
+
+static bool save_state_mem(void *data, size_t *size)
+{
+    FILE *fp = fmemopen(data, *size, "wb");
+    if (!fp)
+        return false;
+    setvbuf(fp, NULL, _IONBF, 0);
+    bool success = state_save_fp(fp) == 0 && !ferror(fp);
+    *size = ftell(fp);
+    fclose(fp);
+    return success;
+}
+
+// A fresh machine each time, a restored state wouldn't bring back the CPU and PPU latches
+static uint8_t *start_nes(void)
+{
+    size_t rom_size;
+    uint8_t *rom = nes_test_rom(&rom_size, false);
+    if (!rom || !nes_init(SYS_NES_NTSC, 32000, false, NULL) || nes_insertcart(rom_loadmem(rom, rom_size)) != 0)
+        exit(2);
+    mem = nes_getptr()->mem;
+    for (int i = 0; i < 10; ++i)
+        nes_emulate(false);
+    return rom;
+}
+
+// The CPU alone: a frame worth of cycles, then the NMI the PPU would have raised
+static int64_t run_frames(int frames, int64_t *cycles)
+{
+    nes_t *nes = nes_getptr();
+    int frame_cycles = nes->cycles_per_scanline * nes->scanlines_per_frame;
+    int64_t start = rg_system_timer();
+    for (int i = 0; i < frames; ++i)
+    {
+        *cycles += nes6502_execute(frame_cycles);
+        nes6502_nmi();
+    }
+    return rg_system_timer() - start;
+}
+
+int main(int argc, char **argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 600;
+    uint8_t *after_scan = malloc(STATE_CAPACITY), *after_table = malloc(STATE_CAPACITY);
+    size_t scan_size = STATE_CAPACITY, table_size = STATE_CAPACITY;
+    int64_t scan_cycles = 0, table_cycles = 0, scan_time = 0, table_time = 0;
+    int failures = 0;
+
+    if (!after_scan || !after_table)
+        return 2;
+
+    // Same program from the same starting point, both dispatches must end up in the same state.
+    // Best of a few rounds, alternating, host timings are noisy.
+    bool success = true;
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        int64_t cycles = 0, elapsed;
+        scan_size = table_size = STATE_CAPACITY;
+        uint8_t *rom = start_nes();
+        use_scan_dispatch();
+        elapsed = run_frames(frames, &cycles);
+        scan_time = round ? RG_MIN(scan_time, elapsed) : elapsed;
+        scan_cycles = cycles;
+        success = success && save_state_mem(after_scan, &scan_size);
+        nes_shutdown();
+        free(rom);
+
+        cycles = 0;
+        rom = start_nes();
+        elapsed = run_frames(frames, &cycles);
+        table_time = round ? RG_MIN(table_time, elapsed) : elapsed;
+        table_cycles = cycles;
+        success = success && save_state_mem(after_table, &table_size);
+        nes_shutdown();
+        free(rom);
+    }
+
+    if (!success)
+    {
+        printf("FAIL: snapshot failed\n");
+        failures++;
+    }
+    else if (scan_cycles != table_cycles || scan_size != table_size || memcmp(after_scan, after_table, scan_size) != 0)
+    {
+        printf("FAIL: the handler tables don't behave like the handler lists\n");
+        failures++;
+    }
+
+    if (scan_time > 0 && table_time > 0)
+    {
+        double before = scan_cycles * 1e6 / scan_time, after = table_cycles * 1e6 / table_time;
+        printf("%d frames, %lld cycles\n", frames, (long long)table_cycles);
+        printf("Handler lists:  %.1f Mcycles/s\n", before / 1e6);
+        printf("Handler tables: %.1f Mcycles/s (%.2fx)\n", after / 1e6, after / before);
+    }
+
+    free(after_scan);
+    free(after_table);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,147 @@
+// Checks the scale plan line kernels of rg_display.c against the per-pixel scaler they replaced,
+// for every pixel format, filter and the scales used by the NES, SNES and GBA cores.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RG_SCREEN_WIDTH 800
+#define RG_SCREEN_HEIGHT 480
+#define RG_SCREEN_PARTIAL_UPDATES 1
+#include "rg_display_scaler.h"
+#include "rg_utils.h"
+
+#define FLOAT_TO_INT(x) ((int)((x) + 0.1f))
+
+enum {FORMAT_PAL8, FORMAT_565LE, FORMAT_565BE};
+static const char *format_names[] = {"PAL8", "565LE", "565BE"};
+
+static int16_t map[RG_SCREEN_WIDTH + 1];
+static uint16_t palette[256];
+static uint16_t source[RG_SCREEN_WIDTH]; // PAL8 lines use it as bytes
+
+// The scaler as it was before scale plans: a table lookup per pixel, a separate filter pass and
+// rg_hash over the result for partial updates
+static uint32_t reference_line(uint16_t *dst, int width, int format, bool filter, const void *line)
+{
+    for (int xx = 0; xx < width; ++xx)
+    {
+        int x = map[xx];
+        if (format == FORMAT_PAL8)
+            dst[xx] = LCD_PIXEL_FROM_BE(palette[((const uint8_t *)line)[x]]);
+        else if (format == FORMAT_565LE)
+            dst[xx] = LCD_PIXEL_FROM_LE(((const uint16_t *)line)[x]);
+        else
+            dst[xx] = LCD_PIXEL_FROM_BE(((const uint16_t *)line)[x]);
+    }
+    if (filter)
+    {
+        for (int x = 1; x < width - 1; ++x)
+        {
+            if (map[x] == map[x - 1])
+                dst[x] = blend_pixels(dst[x - 1], dst[x + 1]);
+        }
+    }
+    return rg_hash((const char *)dst, width * 2);
+}
+
+static line_kernel_t get_kernel(int format, bool filter)
+{
+    if (format == FORMAT_PAL8)
+        return filter ? render_line_pal8_filtered : render_line_pal8;
+    if (format == FORMAT_565LE)
+        return filter ? render_line_565le_filtered : render_line_565le;
+    return filter ? render_line_565be_filtered : render_line_565be;
+}
+
+static void setup(int src_width, int width)
+{
+    float step_x = (float)src_width / width;
+    for (int x = 0; x < width; ++x)
+        map[x] = FLOAT_TO_INT(x * step_x);
+    build_scale_plan(map, width);
+}
+
+static void fill_source(unsigned seed, int smooth)
+{
+    srand(seed);
+    for (int i = 0; i < 256; ++i)
+        palette[i] = rand();
+    for (int x = 0; x < RG_SCREEN_WIDTH; ++x)
+        source[x] = (smooth && x > 0 && rand() % 4) ? source[x - 1] : rand();
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {const char *name; int width, height;} sources[] = {
+        {"NES", 256, 240}, {"SNES", 256, 224}, {"GBA", 240, 160},
+    };
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    uint16_t expected[RG_SCREEN_WIDTH], actual[RG_SCREEN_WIDTH];
+    int failures = 0;
+
+    for (size_t s = 0; s < sizeof(sources) / sizeof(sources[0]); ++s)
+    {
+        int src_width = sources[s].width, src_height = sources[s].height;
+        const int widths[] = {
+            src_width,                                                                  // OFF
+            FLOAT_TO_INT(RG_SCREEN_HEIGHT * ((float)src_width / src_height)) & ~1,      // FIT
+            RG_SCREEN_WIDTH,                                                            // FULL
+            FLOAT_TO_INT(src_width * 1.5f) & ~1, src_width * 2, src_width * 3,          // ZOOM
+        };
+        for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w)
+        {
+            int width = widths[w];
+            if (width > RG_SCREEN_WIDTH)
+                continue;
+            setup(src_width, width);
+
+            for (int format = FORMAT_PAL8; format <= FORMAT_565BE; ++format)
+            {
+                for (int filter = 0; filter < 2; ++filter)
+                {
+                    line_kernel_t kernel = get_kernel(format, filter);
+                    for (unsigned seed = 0; seed < 8; ++seed)
+                    {
+                        fill_source(seed, seed & 1);
+                        memset(actual, 0, sizeof(actual));
+                        reference_line(expected, width, format, filter, source);
+                        uint32_t checksum = kernel(actual, source, palette);
+                        if (memcmp(expected, actual, width * 2) != 0 || checksum == 0)
+                        {
+                            printf("FAIL: %s %dx%d => %d %s filter:%d seed:%u\n", sources[s].name, src_width,
+                                   src_height, width, format_names[format], filter, seed);
+                            failures++;
+                            break;
+                        }
+                    }
+
+                    double start = now();
+                    for (int i = 0; i < iterations * src_height; ++i)
+                        reference_line(expected, width, format, filter, source);
+                    double reference_time = now() - start;
+
+                    start = now();
+                    for (int i = 0; i < iterations * src_height; ++i)
+                        kernel(actual, source, palette);
+                    double kernel_time = now() - start;
+
+                    printf("%-4s %3dx%3d => %3dx%3d %-5s filter:%d spans:%3d  reference:%7.1f Mpx/s  kernel:%7.1f Mpx/s\n",
+                           sources[s].name, src_width, src_height, width, RG_SCREEN_HEIGHT, format_names[format], filter,
+                           scale_plan.num_spans, width * src_height * iterations / reference_time / 1e6,
+                           width * src_height * iterations / kernel_time / 1e6);
+                }
+            }
+        }
+    }
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+// nofrendo ppu_renderline with the predecoded CHR cache against the renderer it replaced (ppu_reference.c).
+// Both can't live in one binary, so this is built twice: test_ppu_reference records a hash of every frame
+// and its timings, test_ppu renders the same frames and compares. Both cartridges of nes_test_rom.c run:
+// CNROM switches CHR banks mid-frame, the CHR RAM one rewrites tiles every frame and reloads its state.
+#include "nes_test_rom.h"
+
+#include <nofrendo.h>
+#include <nes/state.h>
+#include <rg_system.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATE_CAPACITY (64 * 1024)
+#define STATE_RELOAD   500
+
+static const char *cartridges[] = {"CHR ROM", "CHR RAM"};
+
+static uint64_t frame_hash(const uint8_t *vidbuf)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int y = 0; y < NES_SCREEN_HEIGHT; ++y)
+    {
+        const uint8_t *line = NES_SCREEN_GETPTR(vidbuf, 0, y);
+        for (int x = 0; x < NES_SCREEN_WIDTH; ++x)
+            hash = (hash ^ line[x]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// A state reload goes through ppu_invalidatechr when the VRAM block is present
+static bool reload_state(void)
+{
+    static uint8_t buffer[STATE_CAPACITY];
+    FILE *fp = fmemopen(buffer, sizeof(buffer), "wb");
+    if (!fp)
+        return false;
+    setvbuf(fp, NULL, _IONBF, 0);
+    bool success = state_save_fp(fp) == 0 && !ferror(fp);
+    long size = ftell(fp);
+    fclose(fp);
+    if (!success || !(fp = fmemopen(buffer, size, "rb")))
+        return false;
+    success = state_load_fp(fp) == 0;
+    fclose(fp);
+    return success;
+}
+
+// Renders `frames` frames of a cartridge, returns the time spent in nes_emulate
+static int64_t render(bool chr_ram, int frames, uint64_t *hashes)
+{
+    uint8_t *vidbuf = calloc(1, NES_SCREEN_PITCH * NES_SCREEN_HEIGHT);
+    size_t rom_size;
+    uint8_t *rom = nes_test_rom(&rom_size, chr_ram);
+    int64_t elapsed = 0;
+
+    if (!vidbuf || !rom || !nes_init(SYS_NES_NTSC, 32000, false, NULL) || nes_insertcart(rom_loadmem(rom, rom_size)) != 0)
+        exit(2);
+    nes_setvidbuf(vidbuf);
+
+    for (int i = 0; i < frames; ++i)
+    {
+        if (i % STATE_RELOAD == STATE_RELOAD - 1 && !reload_state())
+            exit(2);
+        int64_t start = rg_system_timer();
+        nes_emulate(true);
+        elapsed += rg_system_timer() - start;
+        hashes[i] = frame_hash(vidbuf);
+    }
+
+    nes_shutdown();
+    free(rom);
+    free(vidbuf);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 2000;
+    const char *path = argc > 2 ? argv[2] : "ppu_frames.bin";
+    uint64_t *hashes = calloc(frames, sizeof(uint64_t)), *expected = calloc(frames, sizeof(uint64_t));
+    int failures = 0;
+
+    if (frames <= 0 || !hashes || !expected)
+        return 2;
+
+#ifdef PPU_REFERENCE
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return 2;
+    fwrite(&frames, sizeof(frames), 1, fp);
+    for (int cart = 0; cart < 2; ++cart)
+    {
+        int64_t elapsed = render(cart == 1, frames, hashes);
+        fwrite(&elapsed, sizeof(elapsed), 1, fp);
+        fwrite(hashes, sizeof(uint64_t), frames, fp);
+        printf("%s: %d frames, %dus per frame\n", cartridges[cart], frames, (int)(elapsed / frames));
+    }
+    if (fclose(fp) != 0)
+        failures++;
+#else
+    int recorded = 0;
+    FILE *fp = fopen(path, "rb");
+    if (!fp || !fread(&recorded, sizeof(recorded), 1, fp) || recorded != frames)
+    {
+        printf("FAIL: %s is missing or doesn't have %d frames, run test_ppu_reference first\n", path, frames);
+        return 1;
+    }
+    for (int cart = 0; cart < 2; ++cart)
+    {
+        int64_t reference = 0, elapsed = render(cart == 1, frames, hashes);
+        if (!fread(&reference, sizeof(reference), 1, fp) || fread(expected, sizeof(uint64_t), frames, fp) != (size_t)frames)
+        {
+            printf("FAIL: %s is truncated\n", path);
+            failures++;
+            break;
+        }
+        int mismatches = 0, first = -1;
+        for (int i = 0; i < frames; ++i)
+        {
+            if (hashes[i] != expected[i] && mismatches++ == 0)
+                first = i;
+        }
+        printf("%s: %d frames, reference %dus per frame, CHR cache %dus per frame (%.2fx)\n", cartridges[cart],
+               frames, (int)(reference / frames), (int)(elapsed / frames), elapsed > 0 ? (double)reference / elapsed : 0.);
+        if (mismatches)
+        {
+            printf("FAIL: %d frames differ from the reference, the first one is frame %d\n", mismatches, first);
+            failures++;
+        }
+    }
+    fclose(fp);
+#endif
+
+    free(hashes);
+    free(expected);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+// Rewind ring of rg_rewind.c: 600 frames of synthetic state are captured into a ring small enough to wrap.
+// Every snapshot still in the ring must come back byte-exact, and rg_rewind_restore must pick the right one.
+#include "rg_system.h"
+#include "rg_rewind.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATE_SIZE (32 * 1024)
+#define RING_SIZE  (256 * 1024)
+
+static uint8_t *current;
+static const uint8_t *loaded;
+static size_t loaded_size;
+
+static bool save_state_mem(void *data, size_t *size)
+{
+    if (*size < STATE_SIZE)
+        return false;
+    memcpy(data, current, STATE_SIZE);
+    *size = STATE_SIZE;
+    return true;
+}
+
+static bool load_state_mem(const void *data, size_t size)
+{
+    loaded = data;
+    loaded_size = size;
+    return true;
+}
+
+// A console's state from one frame to the next: counters, a few moving objects, a scrolling buffer
+// that is partly rewritten, and large areas that never change (zeroed RAM, tables).
+static void step_state(uint8_t *state, int frame)
+{
+    uint32_t rng = frame * 2654435761u + 1;
+
+    state[0] = frame;
+    state[1] = frame >> 8;
+    for (int i = 0; i < 64; ++i)
+    {
+        rng = rng * 1103515245 + 12345;
+        if ((rng >> 28) < 4)
+            state[256 + i * 4 + (rng >> 16) % 4] += 1 + (rng >> 24) % 3;
+    }
+    for (int i = 0; i < 32; ++i)
+        state[2048 + (frame * 32 + i) % 2048] = (frame + i) * 13;
+    if (frame % 97 == 0)
+    {
+        for (int i = 0; i < 1024; ++i)
+        {
+            rng = rng * 1103515245 + 12345;
+            state[8192 + i] = rng >> 16;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 600;
+    uint8_t *history = calloc(frames, STATE_SIZE);
+    uint8_t *state = calloc(1, STATE_SIZE);
+    rg_rewind_t *rewind = rg_rewind_alloc(RING_SIZE, STATE_SIZE);
+    size_t encoded = 0, captured = 0;
+    int failures = 0, wraps = 0;
+
+    if (!history || !state || !rewind)
+        return 2;
+
+    // The capacity is checked before anything goes into the ring
+    rg_rewind_t *small = rg_rewind_alloc(RING_SIZE, STATE_SIZE / 2);
+    current = state;
+    if (!small || rg_rewind_capture(small, save_state_mem, 0) || small->count != 0)
+    {
+        printf("FAIL: a snapshot larger than the capacity was accepted\n");
+        failures++;
+    }
+    rg_rewind_free(small);
+
+    for (int i = 0; i < 2048; ++i)
+        state[16384 + i] = (i * 7) & 0xFF;
+
+    int64_t start = rg_system_timer();
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        step_state(state, frame);
+        memcpy(history + (size_t)frame * STATE_SIZE, state, STATE_SIZE);
+
+        uint32_t end = rewind->count ? rg_rewind_entry(rewind, rewind->count - 1)->offset + rg_rewind_entry(rewind, rewind->count - 1)->length : 0;
+        if (!rg_rewind_capture(rewind, save_state_mem, frame))
+        {
+            printf("FAIL: frame %d not captured\n", frame);
+            failures++;
+            break;
+        }
+        const rg_rewind_entry_t *newest = rg_rewind_entry(rewind, rewind->count - 1);
+        if (newest->offset < end)
+            wraps++;
+        encoded += newest->length;
+        captured += STATE_SIZE;
+
+        // The newest snapshot must always be usable, that's the one a short rewind picks
+        if (!rg_rewind_decode(rewind, rewind->count - 1) || memcmp(rewind->state, state, STATE_SIZE) != 0)
+        {
+            printf("FAIL: frame %d not restored right after capture\n", frame);
+            failures++;
+        }
+    }
+    int64_t elapsed = rg_system_timer() - start;
+
+    // Whatever survived the wrap arounds must still be intact, overwritten entries would show up here
+    for (int i = 0; i < rewind->count; ++i)
+    {
+        const rg_rewind_entry_t *entry = rg_rewind_entry(rewind, i);
+        if (!rg_rewind_decode(rewind, i) || memcmp(rewind->state, history + (size_t)entry->tick * STATE_SIZE, STATE_SIZE) != 0)
+        {
+            printf("FAIL: frame %d corrupted in the ring\n", (int)entry->tick);
+            failures++;
+        }
+    }
+
+    float ratio = encoded ? (float)captured / encoded : 0.f;
+    printf("%d frames, %d in the ring after %d wraps, oldest is frame %d\n", frames, rewind->count, wraps,
+           rewind->count ? (int)rg_rewind_entry(rewind, 0)->tick : -1);
+    printf("Compression: %d bytes => %d bytes (%.1fx), %dus per capture and check\n", (int)captured, (int)encoded,
+           ratio, frames > 0 ? (int)(elapsed / frames) : 0);
+
+    if (frames >= 60 && (wraps == 0 || !rg_rewind_entry(rewind, 0)->keyframe))
+    {
+        printf("FAIL: the ring never wrapped or doesn't start on a keyframe\n");
+        failures++;
+    }
+    if (frames > 0 && ratio < 20.f)
+    {
+        printf("FAIL: deltas should compress at least 20x\n");
+        failures++;
+    }
+
+    // Rewinding 10 frames at a time: each restore must hand over the newest snapshot at least that old,
+    // consume it, and the next capture must start a new keyframe that decodes on its own
+    for (int step = 0, tick = frames - 1; step < 5 && rewind->count > 1; ++step, tick -= 10)
+    {
+        int expected = -1;
+        for (int i = 0; i < rewind->count; ++i)
+        {
+            if ((int)rg_rewind_entry(rewind, i)->tick <= tick - 10)
+                expected = rg_rewind_entry(rewind, i)->tick;
+        }
+        if (expected < 0)
+            expected = rg_rewind_entry(rewind, 0)->tick;
+        int count = rewind->count;
+        if (!rg_rewind_restore(rewind, tick - 10, load_state_mem) || loaded_size != STATE_SIZE ||
+            memcmp(loaded, history + (size_t)expected * STATE_SIZE, STATE_SIZE) != 0 || rewind->count >= count)
+        {
+            printf("FAIL: rewinding from frame %d didn't restore frame %d\n", tick, expected);
+            failures++;
+            break;
+        }
+        memcpy(state, loaded, STATE_SIZE);
+        state[0] ^= 0xFF;
+        if (!rg_rewind_capture(rewind, save_state_mem, expected) || !rg_rewind_entry(rewind, rewind->count - 1)->keyframe ||
+            !rg_rewind_decode(rewind, rewind->count - 1) || memcmp(rewind->state, state, STATE_SIZE) != 0)
+        {
+            printf("FAIL: the capture after a rewind isn't a usable keyframe\n");
+            failures++;
+            break;
+        }
+    }
+
+    rg_rewind_free(rewind);
+    free(history);
+    free(state);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
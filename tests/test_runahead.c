@@ -0,0 +1,116 @@
+// Run-ahead snapshot and restore cost, on nofrendo running nes_test_rom. The memory handlers are the
+// ones of main_nes.c (state_save_fp/state_load_fp on fmemopen), rg_emu_runahead_save/_load add nothing
+// but a buffer and the timing. Also checks that a restore brings back exactly what was saved.
+#include "nes_test_rom.h"
+
+#include <nofrendo.h>
+#include <nes/state.h>
+#include <rg_system.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATE_CAPACITY (64 * 1024)
+
+static bool save_state_mem(void *data, size_t *size)
+{
+    FILE *fp = fmemopen(data, *size, "wb");
+    if (!fp)
+        return false;
+    setvbuf(fp, NULL, _IONBF, 0);
+    bool success = state_save_fp(fp) == 0 && !ferror(fp);
+    *size = ftell(fp);
+    fclose(fp);
+    return success;
+}
+
+static bool load_state_mem(const void *data, size_t size)
+{
+    FILE *fp = fmemopen((void *)data, size, "rb");
+    if (!fp)
+        return false;
+    bool success = state_load_fp(fp) == 0;
+    fclose(fp);
+    return success;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 300;
+    uint8_t *snapshot = malloc(STATE_CAPACITY), *replay = malloc(STATE_CAPACITY);
+    uint8_t *vidbuf = malloc(NES_SCREEN_PITCH * NES_SCREEN_HEIGHT);
+    size_t rom_size, size = 0;
+    uint8_t *rom = nes_test_rom(&rom_size, false);
+    int failures = 0;
+
+    if (!snapshot || !replay || !vidbuf || !rom)
+        return 2;
+    if (!nes_init(SYS_NES_NTSC, 32000, false, NULL) || nes_insertcart(rom_loadmem(rom, rom_size)) != 0)
+        return 2;
+    nes_setvidbuf(vidbuf);
+    for (int i = 0; i < 60; ++i)
+        nes_emulate(true);
+
+    int64_t save_time = 0, load_time = 0, ahead_time = 0, frame_time = 0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        // The real frame
+        int64_t start = rg_system_timer();
+        nes_emulate(false);
+        frame_time += rg_system_timer() - start;
+
+        // rg_emu_runahead_save, one hidden frame, rg_emu_runahead_load
+        size = STATE_CAPACITY;
+        start = rg_system_timer();
+        bool success = save_state_mem(snapshot, &size);
+        save_time += rg_system_timer() - start;
+
+        start = rg_system_timer();
+        nes_emulate(true);
+        ahead_time += rg_system_timer() - start;
+
+        start = rg_system_timer();
+        success = success && load_state_mem(snapshot, size);
+        load_time += rg_system_timer() - start;
+
+        // Whatever the snapshot holds must come back. SNSS doesn't keep the CPU's position within the
+        // scanline, so the frames after a restore may drift by a few cycles, an exact replay isn't expected.
+        if (i % 10 == 0)
+        {
+            size_t replay_size = STATE_CAPACITY;
+            success = success && save_state_mem(replay, &replay_size);
+            if (success && (replay_size != size || memcmp(replay, snapshot, size) != 0))
+            {
+                printf("FAIL: iteration %d, restored state differs from the snapshot\n", i);
+                failures++;
+            }
+        }
+
+        if (!success)
+        {
+            printf("FAIL: iteration %d, snapshot or restore failed\n", i);
+            failures++;
+            break;
+        }
+    }
+
+    if (iterations > 0)
+    {
+        int save = save_time / iterations, load = load_time / iterations;
+        int frame = frame_time / iterations, drawn = ahead_time / iterations;
+        printf("State: %d bytes\n", (int)size);
+        printf("Snapshot: %dus, restore: %dus (runaheadCost), real frame: %dus, frame ahead: %dus\n", save, load, frame, drawn);
+        printf("Snapshot and restore are %d%% of the time run-ahead 1 adds to a frame\n",
+               (save + load + drawn) > 0 ? (save + load) * 100 / (save + load + drawn) : 0);
+    }
+
+    nes_shutdown();
+    free(rom);
+    free(snapshot);
+    free(replay);
+    free(vidbuf);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+// Save state writes: the deflate round trip, what an interrupted write leaves on disk, and how long the
+// main thread stalls now that only the snapshot happens there (the rg_savestate task deflates and writes).
+#include "rg_system.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STATE_SIZE (256 * 1024)
+
+static char state_path[RG_PATH_MAX];
+
+// Emulator states are mostly zeroed RAM, repeated tables and some noise
+static void fill_state(uint8_t *state, unsigned seed)
+{
+    uint32_t rng = seed * 2654435761u + 1;
+    memset(state, 0, STATE_SIZE);
+    for (size_t i = 0; i < STATE_SIZE; ++i)
+    {
+        rng = rng * 1103515245 + 12345;
+        if ((i / 4096) % 4 == 1)
+            state[i] = (i * 7) & 0xFF;
+        else if ((i / 4096) % 4 == 2 && (rng >> 24) < 48)
+            state[i] = rng >> 16;
+    }
+}
+
+static bool same_as_file(const uint8_t *state)
+{
+    void *data = NULL;
+    size_t data_len = 0;
+    bool same = rg_storage_is_deflated(state_path) && rg_storage_inflate_file(state_path, &data, &data_len) &&
+                data_len == STATE_SIZE && memcmp(data, state, STATE_SIZE) == 0;
+    free(data);
+    return same;
+}
+
+static bool deflate_writer(const char *path, void *arg)
+{
+    return rg_storage_deflate_file(path, arg, STATE_SIZE);
+}
+
+// Dies halfway through the new state, like a full card or a pulled card would
+static bool interrupted_writer(const char *path, void *arg)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+    fwrite(arg, STATE_SIZE / 2, 1, fp);
+    fclose(fp);
+    return false;
+}
+
+static char *sibling(const char *ext)
+{
+    static char path[RG_PATH_MAX + 8];
+    snprintf(path, sizeof(path), "%s%s", state_path, ext);
+    return path;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+    uint8_t *previous = malloc(STATE_SIZE), *next = malloc(STATE_SIZE), *staging = malloc(STATE_SIZE);
+    int failures = 0;
+
+    char dir[] = "/tmp/rg-savestate-XXXXXX";
+    if (!previous || !next || !staging || !mkdtemp(dir))
+        return 2;
+    snprintf(state_path, sizeof(state_path), "%s/game.sav", dir);
+    fill_state(previous, 1);
+    fill_state(next, 2);
+
+    // Round trip
+    if (!rg_storage_replace_file(state_path, &deflate_writer, previous) || !same_as_file(previous))
+    {
+        printf("FAIL: deflate round trip\n");
+        failures++;
+    }
+    printf("Deflate: %d bytes => %d bytes\n", STATE_SIZE, (int)rg_storage_stat(state_path).size);
+
+    // A writer that fails leaves the previous state alone, and no .new behind
+    if (rg_storage_replace_file(state_path, &interrupted_writer, next) || !same_as_file(previous) ||
+        rg_storage_exists(sibling(".new")))
+    {
+        printf("FAIL: failed write clobbered the previous state\n");
+        failures++;
+    }
+
+    // Power lost between the two renames: only the .bak and a complete .new exist
+    rg_storage_deflate_file(sibling(".new"), next, STATE_SIZE);
+    rename(state_path, sibling(".bak"));
+    if (!rg_storage_recover_file(state_path) || !same_as_file(previous) || rg_storage_exists(sibling(".bak")))
+    {
+        printf("FAIL: previous state not recovered after an interrupted rename\n");
+        failures++;
+    }
+    remove(sibling(".new"));
+
+    // The main thread only serialises into the staging buffer, the task does the rest
+    int64_t stall = 0, write = 0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        int64_t start = rg_system_timer();
+        memcpy(staging, i & 1 ? next : previous, STATE_SIZE);
+        int64_t snapshot = rg_system_timer();
+        if (!rg_storage_replace_file(state_path, &deflate_writer, staging) || !same_as_file(staging))
+        {
+            printf("FAIL: save %d\n", i);
+            failures++;
+        }
+        stall += snapshot - start;
+        write += rg_system_timer() - snapshot;
+    }
+    if (iterations > 0)
+    {
+        printf("Main thread stall: %dus per save, was %dus when the write was synchronous\n",
+               (int)(stall / iterations), (int)((stall + write) / iterations));
+        if (stall >= write)
+        {
+            printf("FAIL: the snapshot costs as much as the write\n");
+            failures++;
+        }
+    }
+
+    remove(state_path);
+    rmdir(dir);
+    free(previous);
+    free(next);
+    free(staging);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}